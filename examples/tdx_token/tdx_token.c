@@ -199,7 +199,11 @@ int main(int argc, char *argv[])
 	}
 
 	LOG("Info: Intel Trust Authority Token: %s\n", token.jwt);
-	LOG("Info: Headers returned: %s\n", headers.headers);
+	LOG("Info: Headers returned:\n");
+	for (size_t i = 0; i < headers.count; i++)
+	{
+		LOG("Info:   %s: %s\n", headers.entries[i].name, headers.entries[i].value);
+	}
 
 	result = verify_token(&token, ta_base_url, NULL, &parsed_token, retry_max, retry_wait_time);
 	if (STATUS_OK != result)
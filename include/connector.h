@@ -19,6 +19,7 @@ extern "C"
 		policies *policies;
 		const char *request_id;
 		const char *token_signing_alg;
+		long long deadline; /* time by which the request must be done (see trust_authority_deadline), 0 for none */
 	}get_token_args;
 
 	// collect_token_args structure holds user provided request paramaters used in nonce/token rest calls
@@ -26,15 +27,36 @@ extern "C"
 		policies *policies;
 		const char *request_id;
 		const char *token_signing_alg;
+		int timeout_ms; /* budget for the nonce, evidence and token calls together, 0 for none */
 	}collect_token_args;
 
 	//get_nonce_args holds the request parameters needed for getting nonce from Intel Trust Authority
 	typedef struct get_nonce_args {
 		const char *request_id;
+		long long deadline; /* time by which the request must be done (see trust_authority_deadline), 0 for none */
 	}get_nonce_args;
 
 	/**
-	 * Create a new trust authority connector client to make REST calls to Intel Trust Authority
+	 * Initialize process wide state (libcurl) used by all connectors. Should be called once
+	 * at startup before any other thread is started, and balanced with trust_authority_global_cleanup().
+	 * If never called, the state is initialized on first request and kept until process exit.
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_global_init(void);
+
+	// Release process wide state after all connectors are freed.
+	TRUST_AUTHORITY_STATUS trust_authority_global_cleanup(void);
+
+	/**
+	 * Create a new trust authority connector client to make REST calls to Intel Trust Authority.
+	 * Connectors created for the same api_url share a process wide TLS session and DNS cache,
+	 * so new connections opened from any thread resume existing TLS sessions.
+	 *
+	 * One connector can be shared by any number of threads making requests at the same time;
+	 * curl handles are taken from the connector's pool as threads need them and reused afterwards.
+	 * Every setting, including the transport and the nonce pool, can be changed while requests are
+	 * running; requests already sent finish with the settings they started with. connector_free()
+	 * must only be called once no other thread uses the connector.
 	 * @param api_key a char pointer containing Intel Trust Authority api key
 	 * @param api_url a char pointer containing Intel Trust Authority url
 	 * @param retry_max integer containing maximum number of retries
@@ -47,12 +69,234 @@ extern "C"
 			const int retry_max,
 			const int retry_wait_time);
 
+	/**
+	 * Set the hard cap on the size of responses (body and headers) accepted from Intel Trust Authority.
+	 * Response buffers grow up to this size, larger responses fail the request.
+	 * @param connector a trust_authority_connector pointer
+	 * @param max_response_size maximum response size in bytes, defaults to DEFAULT_MAX_RESPONSE_SIZE
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_max_response_size(trust_authority_connector *connector,
+			size_t max_response_size);
+
+	/**
+	 * Replace the retry policy of a connector. Retries back off exponentially from
+	 * retry_base_delay_ms up to retry_max_delay_ms and are made on 429/5xx responses
+	 * and on transient network errors. Requests already running keep the policy they started with.
+	 * @param connector connector instance
+	 * @param policy retry policy, copied into the connector
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_retry_policy(trust_authority_connector *connector,
+			const retry_config *policy);
+
+	/**
+	 * Select the response headers kept by get_nonce/get_token, other headers are dropped as they are
+	 * received. All headers are kept by default. Call before the connector is used for requests.
+	 * @param connector connector instance
+	 * @param names header names, case insensitive
+	 * @param count number of names, at most MAX_KEPT_HEADERS; 0 to keep all headers
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_response_headers(trust_authority_connector *connector,
+			const char **names,
+			int count);
+
+	/**
+	 * Make the requests of the connector through a custom transport instead of libcurl.
+	 * Hedging does not apply, and the asynchronous client does not accept such connectors.
+	 * The transport is called from every thread making requests. Call before the connector is used for requests.
+	 * @param connector connector instance
+	 * @param transport transport, must outlive the connector; NULL to go back to libcurl
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_transport(trust_authority_connector *connector,
+			const transport_adapter *transport);
+
+	/**
+	 * Send requests over a unix domain socket, e.g. to a local egress sidecar, instead of TCP.
+	 * The api_url still selects the scheme, Host header and path; use an http://localhost url
+	 * when the sidecar does not terminate TLS. Call before the connector is used for requests.
+	 * @param connector connector instance
+	 * @param path socket path of at most UNIX_SOCKET_PATH_MAX_LEN characters, NULL to use TCP again
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_unix_socket(trust_authority_connector *connector,
+			const char *path);
+
+	/**
+	 * Select the compression used by the connector. Request bodies larger than MIN_GZIP_BODY_SIZE
+	 * are gzipped with COMPRESSION_GZIP_REQUEST; if the server answers 415 the body is resent
+	 * uncompressed and request compression is turned off for the connector.
+	 * COMPRESSION_ACCEPT_ENCODING is enabled by default.
+	 * @param connector connector instance
+	 * @param flags COMPRESSION_* flags
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_compression(trust_authority_connector *connector,
+			int flags);
+
+	/**
+	 * Enable hedging of token requests: when no response arrived within delay_ms, the same
+	 * request is sent again and whichever response comes first is used, the other request is cancelled.
+	 * @param connector connector instance
+	 * @param delay_ms time to wait for a response before sending the duplicate, 0 to disable hedging
+	 * @param api_url URL of Intel Trust Authority the duplicate goes to, NULL for the connector's URL
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_hedging(trust_authority_connector *connector,
+			int delay_ms,
+			const char *api_url);
+
+	/**
+	 * Reopen the connection the token request is likely to go to on a background thread while
+	 * collect_token generates the quote, so that the request skips DNS, TCP and TLS set up after
+	 * a long quote generation. The token request does not wait for it. Disabled by default.
+	 * @param connector connector instance
+	 * @param enabled non zero to enable, 0 to disable
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_preconnect(trust_authority_connector *connector,
+			int enabled);
+
+	/**
+	 * Open pooled connections ahead of the first requests, so that they skip DNS, TCP and TLS set up.
+	 * Each connection is opened with a HEAD request to the connector's api_url, or to every endpoint
+	 * when endpoints are set; the connections are made in parallel. Nothing is done for custom transports.
+	 * @param connector connector instance
+	 * @param connections number of connections to open, 0 for DEFAULT_WARMUP_CONNECTIONS; at most DEFAULT_HTTP_POOL_SIZE
+	 * @param timeout_ms time the warm up may take, 0 for no limit
+	 * @return STATUS_WARMUP_ERROR if no connection could be opened
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_warmup(trust_authority_connector *connector,
+			int connections,
+			int timeout_ms);
+
+	/**
+	 * Spread requests over several deployments of Intel Trust Authority. Each request goes to the healthy
+	 * endpoint with the lowest average latency weighted by its error rate, and get_nonce/get_token fail over
+	 * to the next best endpoint when a request fails with a network error, 429 or 5xx. An endpoint failing
+	 * ENDPOINT_DOWN_FAILURES times in a row is left out for ENDPOINT_DOWN_MS. The connector's api_url is
+	 * only used while no endpoints are set. Each endpoint has its own circuit breaker, endpoints whose circuit is
+	 * open are skipped; hedging keeps applying to all endpoints together.
+	 * @param connector connector instance
+	 * @param api_urls URLs of the endpoints, each serving the same API
+	 * @param count number of URLs, at most MAX_ENDPOINTS; 0 to go back to the connector's api_url
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_endpoints(trust_authority_connector *connector,
+			const char **api_urls,
+			int count);
+
+	/**
+	 * Get the statistics of the endpoints set with trust_authority_connector_set_endpoints.
+	 * @param connector connector instance
+	 * @param stats receives up to MAX_ENDPOINTS entries
+	 * @param count number of entries written
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_get_endpoint_stats(trust_authority_connector *connector,
+			endpoint_stats *stats,
+			int *count);
+
+	/**
+	 * Configure the circuit breakers of the connector's endpoints. Attempts answered with 5xx or
+	 * failing with a network error count as failures; once the configured failure count or error
+	 * rate is reached, the endpoint's circuit opens until a probe succeeds. Requests refused because
+	 * the circuits of all endpoints are open fail with STATUS_CIRCUIT_OPEN_ERROR without being sent;
+	 * a request which was sent reports its own failure, even if it opened the circuit.
+	 * The breaker of the api_url, settings and state, is shared by all connectors of the process using
+	 * the same api_url: settings made with one connector apply to all of them. Changing the settings
+	 * keeps the state of the circuits, disabling a breaker closes it.
+	 * @param connector connector instance
+	 * @param config circuit breaker settings
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_circuit_breaker(trust_authority_connector *connector,
+			const circuit_breaker_config *config);
+
+	/**
+	 * Get the circuit breaker state of the connector, so callers can shed load early. With endpoints
+	 * set, this is the best state among them: the circuit is only reported open when all of them are.
+	 * @param connector connector instance
+	 * @param state current state
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_get_circuit_state(trust_authority_connector *connector,
+			circuit_state *state);
+
+	/**
+	 * Pace the requests made with the connector's API key. The limiter is shared by all connectors
+	 * of the process using the same key and also slows down after 429 responses and rate limit headers
+	 * (RateLimit-Remaining/RateLimit-Reset) from the server. Requests which cannot be sent within
+	 * max_queue_ms fail with STATUS_RATE_LIMITED_ERROR.
+	 * @param connector connector instance
+	 * @param config rate limit settings
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_rate_limit(trust_authority_connector *connector,
+			const rate_limit_config *config);
+
+	/**
+	 * Get the statistics of the rate limiter of the connector's API key.
+	 * @param connector connector instance
+	 * @param stats current statistics
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_get_rate_limit_stats(trust_authority_connector *connector,
+			rate_limit_stats *stats);
+
+	/**
+	 * Keep nonces ready for collect_token. A background thread fetches up to config->size nonces,
+	 * drops those with less than min_remaining_ms of validity left according to their iat and
+	 * refills the pool as nonces are taken. Calling again replaces the pool, once the threads taking
+	 * nonces from the previous one are done with it.
+	 * @param connector connector instance
+	 * @param config pool settings, NULL or a size of 0 to stop the pool
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_set_nonce_pool(trust_authority_connector *connector,
+			const nonce_pool_config *config);
+
+	/**
+	 * Take a prefetched nonce without waiting.
+	 * @param connector connector instance
+	 * @param nonce nonce handed over to the caller, to be freed with nonce_free
+	 * @return STATUS_NONCE_POOL_EMPTY_ERROR if the pool is disabled or has no fresh nonce
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_take_nonce(trust_authority_connector *connector,
+			nonce *nonce);
+
+	/**
+	 * Get the statistics of the nonce pool of a connector.
+	 * @param connector connector instance
+	 * @param stats current statistics, all 0 when the pool is disabled
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_connector_get_nonce_pool_stats(trust_authority_connector *connector,
+			nonce_pool_stats *stats);
+
+	/**
+	 * Compute the deadline of a request which has to be done within timeout_ms from now.
+	 * Requests running out of time fail with STATUS_DEADLINE_EXCEEDED_ERROR.
+	 * @param timeout_ms time budget in milliseconds
+	 * @return deadline in milliseconds on CLOCK_MONOTONIC, 0 (none) if timeout_ms is not positive
+	 */
+	long long trust_authority_deadline(int timeout_ms);
+
+	/**
+	 * Checks if a deadline computed with trust_authority_deadline has passed.
+	 * @param deadline deadline, 0 for none
+	 * @return non zero if the deadline has passed
+	 */
+	int trust_authority_deadline_expired(long long deadline);
+
 	/**
 	 * Get a nonce from Intel Trust Authority.
 	 * @param connector instance to connect to Intel Trust Authority
 	 * @param nonce nonce value returned by Intel Trust Authority
 	 * @param nonce_args args required to pass in nonce request
-	 * @param resp_header a char pointer containing response headers returned from Intel Trust Authority 
+	 * @param resp_header response headers returned from Intel Trust Authority, may be NULL
 	 * @return return status
 	 */
 	TRUST_AUTHORITY_STATUS get_nonce(trust_authority_connector *connector,
@@ -63,7 +307,7 @@ extern "C"
 	/**
 	 * Get a token from Intel Trust Authority by providing evidence and nonce as input
 	 * @param connector a trust_authority_connector pointer
-	 * @param resp_header a char pointer containing response headers returned from Intel Trust Authority
+	 * @param resp_header response headers returned from Intel Trust Authority, may be NULL
 	 * @param token token returned from Intel Trust Authority
 	 * @param token_args args required pass in token requrest 
 	 * @param attestation_url url to be used for attestation
@@ -100,6 +344,15 @@ extern "C"
 	// Delete/free nonce.
 	TRUST_AUTHORITY_STATUS nonce_free(nonce *nonce);
 
+	/**
+	 * Look up a response header by name.
+	 * @param headers response headers returned from Intel Trust Authority
+	 * @param name header name, case insensitive
+	 * @return value of the first header with that name, NULL if it was not received or not kept
+	 */
+	const char *response_headers_get(const response_headers *headers,
+			const char *name);
+
 	// Delete/free response_headers
 	TRUST_AUTHORITY_STATUS response_headers_free(response_headers *header);
 
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __CONNECTOR_ASYNC_H__
+#define __CONNECTOR_ASYNC_H__
+
+#include "connector.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Socket events requested through async_socket_callback
+#define ASYNC_POLL_IN 1
+#define ASYNC_POLL_OUT 2
+#define ASYNC_POLL_INOUT 3
+#define ASYNC_POLL_REMOVE 4
+
+// Socket readiness reported through trust_authority_async_socket_action
+#define ASYNC_EVENT_IN 1
+#define ASYNC_EVENT_OUT 2
+#define ASYNC_EVENT_ERR 4
+
+// fd passed to trust_authority_async_socket_action when the timer expired
+#define ASYNC_SOCKET_TIMEOUT -1
+
+#define DEFAULT_BATCH_CONCURRENCY 8 // token requests get_tokens_batch keeps in flight by default
+#define MAX_BATCH_CONCURRENCY 256
+
+	/**
+	 * Non-blocking client driving many nonce/token requests from a single thread.
+	 * An instance must only be used from one thread at a time.
+	 */
+	typedef struct trust_authority_async trust_authority_async;
+
+	/**
+	 * Called once a request completed. Results are written to the nonce/token/response_headers
+	 * passed when the request was submitted.
+	 * @param status status of the request
+	 * @param user_data user data passed when the request was submitted
+	 */
+	typedef void (*async_complete_callback)(TRUST_AUTHORITY_STATUS status,
+			void *user_data);
+
+	/**
+	 * Called when the event loop has to start, change or stop watching a socket.
+	 * @param fd socket to be watched
+	 * @param what one of ASYNC_POLL_IN, ASYNC_POLL_OUT, ASYNC_POLL_INOUT or ASYNC_POLL_REMOVE
+	 * @param loop_data event loop data passed to trust_authority_async_set_callbacks
+	 * @return 0 on success
+	 */
+	typedef int (*async_socket_callback)(int fd,
+			int what,
+			void *loop_data);
+
+	/**
+	 * Called when the event loop has to (re)arm its single timer.
+	 * @param timeout_ms milliseconds until trust_authority_async_socket_action must be called
+	 * with ASYNC_SOCKET_TIMEOUT, -1 to delete the timer
+	 * @param loop_data event loop data passed to trust_authority_async_set_callbacks
+	 * @return 0 on success
+	 */
+	typedef int (*async_timer_callback)(long timeout_ms,
+			void *loop_data);
+
+	/**
+	 * Create a non-blocking client making requests through connector.
+	 * @param async client created
+	 * @param connector connector used for the requests, must outlive the client
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_async_new(trust_authority_async **async,
+			trust_authority_connector *connector);
+
+	/**
+	 * Integrate with an event loop. Without callbacks the client is driven with trust_authority_async_perform.
+	 * @param async client
+	 * @param socket_cb callback to watch sockets
+	 * @param timer_cb callback to arm the timer
+	 * @param loop_data data passed to the callbacks
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_async_set_callbacks(trust_authority_async *async,
+			async_socket_callback socket_cb,
+			async_timer_callback timer_cb,
+			void *loop_data);
+
+	/**
+	 * Submit a request for a nonce from Intel Trust Authority.
+	 * @param async client
+	 * @param nonce nonce value returned by Intel Trust Authority, must stay valid until completion
+	 * @param nonce_args args required to pass in nonce request
+	 * @param resp_headers response headers returned by Intel Trust Authority, may be NULL
+	 * @param callback called on completion
+	 * @param user_data passed to callback
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS get_nonce_async(trust_authority_async *async,
+			nonce *nonce,
+			get_nonce_args *nonce_args,
+			response_headers *resp_headers,
+			async_complete_callback callback,
+			void *user_data);
+
+	/**
+	 * Submit a request for a token from Intel Trust Authority. The request is marshalled
+	 * before returning, token_args need not outlive this call.
+	 * @param async client
+	 * @param resp_headers response headers returned by Intel Trust Authority, may be NULL
+	 * @param token token returned by Intel Trust Authority, must stay valid until completion
+	 * @param token_args args required pass in token request
+	 * @param attestation_url url to be used for attestation
+	 * @param callback called on completion
+	 * @param user_data passed to callback
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS get_token_async(trust_authority_async *async,
+			response_headers *resp_headers,
+			token *token,
+			get_token_args *token_args,
+			char *attestation_url,
+			async_complete_callback callback,
+			void *user_data);
+
+	/**
+	 * Let the client act on a ready socket or an expired timer. Completion callbacks are called from here.
+	 * @param async client
+	 * @param fd ready socket or ASYNC_SOCKET_TIMEOUT
+	 * @param events ASYNC_EVENT_* bitmask of the socket readiness, 0 to let the client check
+	 * @param running number of requests still in flight
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_async_socket_action(trust_authority_async *async,
+			int fd,
+			int events,
+			int *running);
+
+	/**
+	 * Drive all requests without an external event loop, waiting up to timeout_ms for activity.
+	 * Completion callbacks are called from here.
+	 * @param async client
+	 * @param timeout_ms maximum time to wait for socket activity, 0 to not wait
+	 * @param running number of requests still in flight
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS trust_authority_async_perform(trust_authority_async *async,
+			int timeout_ms,
+			int *running);
+
+	/**
+	 * Get tokens for many evidences at once. Up to concurrency requests are kept in flight over the
+	 * connections of the connector, so the batch takes about count / concurrency round trips instead of count.
+	 * The connections are kept open for the next batch made with the same connector.
+	 * Connectors with a custom transport cannot be multiplexed and make the requests one after the other.
+	 * @param connector connector instance to connect to Intel Trust Authority
+	 * @param tokens count tokens, tokens[i] is filled in when statuses[i] is STATUS_OK
+	 * @param token_args count args, one per token request
+	 * @param statuses count statuses, the result of each request
+	 * @param count number of requests
+	 * @param attestation_url url to be used for attestation
+	 * @param concurrency maximum number of requests in flight, 0 for DEFAULT_BATCH_CONCURRENCY
+	 * @return STATUS_OK once every request completed whatever its own status, an error if the batch could not be run
+	 */
+	TRUST_AUTHORITY_STATUS get_tokens_batch(trust_authority_connector *connector,
+			token *tokens,
+			get_token_args *token_args,
+			TRUST_AUTHORITY_STATUS *statuses,
+			int count,
+			char *attestation_url,
+			int concurrency);
+
+	// Delete/free the client. Requests still in flight are dropped without calling their callbacks.
+	TRUST_AUTHORITY_STATUS trust_authority_async_free(trust_authority_async *async);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
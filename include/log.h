@@ -15,13 +15,17 @@ extern "C"
 {
 #endif
 
-	char* getFormattedTime(void);
+#define LOG_TIME_LEN 20
 
-#define LOG(fmt, ...) fprintf(stdout, "[LOG:%s::%s::%d] " fmt "\n", getFormattedTime(), __FILE__, __LINE__ __VA_OPT__(, ) __VA_ARGS__);
-#define ERROR(fmt, ...) fprintf(stderr, "[ERR:%s::%s::%d] " fmt "\n", getFormattedTime(), __FILE__, __LINE__ __VA_OPT__(, ) __VA_ARGS__);
+	// Formats the current local time into buf, which must hold LOG_TIME_LEN chars, and returns buf
+	char* getFormattedTime(char *buf, size_t len);
+
+// The time is formatted into a buffer of the caller so that threads can log concurrently
+#define LOG(fmt, ...) do { char _log_time[LOG_TIME_LEN]; fprintf(stdout, "[LOG:%s::%s::%d] " fmt "\n", getFormattedTime(_log_time, sizeof(_log_time)), __FILE__, __LINE__ __VA_OPT__(, ) __VA_ARGS__); } while (0);
+#define ERROR(fmt, ...) do { char _log_time[LOG_TIME_LEN]; fprintf(stderr, "[ERR:%s::%s::%d] " fmt "\n", getFormattedTime(_log_time, sizeof(_log_time)), __FILE__, __LINE__ __VA_OPT__(, ) __VA_ARGS__); } while (0);
 
 #if ENABLE_DEBUG_LOGGING
-#define DEBUG(fmt, ...) fprintf(stdout, "[DBG:%s::%s::%d] " fmt "\n", getFormattedTime(), __FILE__, __LINE__ __VA_OPT__(, ) __VA_ARGS__);
+#define DEBUG(fmt, ...) do { char _log_time[LOG_TIME_LEN]; fprintf(stdout, "[DBG:%s::%s::%d] " fmt "\n", getFormattedTime(_log_time, sizeof(_log_time)), __FILE__, __LINE__ __VA_OPT__(, ) __VA_ARGS__); } while (0);
 #else
 #define DEBUG(fmt, ...)
 #ifdef __cplusplus
@@ -7,11 +7,104 @@
 
 #include <connector.h>
 
+#define DEFAULT_TOKEN_CACHE_MARGIN_MS 30000 // cached tokens are not handed out this close to their exp
+#define DEFAULT_TOKEN_REFRESH_AHEAD_MS 60000 // tokens in use are refreshed this long before they stop being handed out
+#define DEFAULT_TOKEN_CACHE_SIZE 64
+#define TOKEN_CACHE_RETRY_MS 5000 // wait before a failed refresh is retried
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+	// Cache of tokens collected with collect_token_cached, see token_cache_new.
+	typedef struct token_cache token_cache;
+
+	typedef struct token_cache_config
+	{
+		int expiry_margin_ms;	/* tokens are not handed out within this time of their exp, 0 for DEFAULT_TOKEN_CACHE_MARGIN_MS */
+		int refresh_ahead_ms;	/* time before the margin a token read since its last refresh is refreshed, 0 for DEFAULT_TOKEN_REFRESH_AHEAD_MS */
+		int max_entries;	/* 0 for DEFAULT_TOKEN_CACHE_SIZE */
+	} token_cache_config;
+
+	typedef struct token_cache_stats
+	{
+		int entries;			/* tokens cached right now */
+		long long hits;			/* tokens handed out from the cache */
+		long long misses;		/* calls which had to collect a token */
+		long long refreshes;		/* tokens refreshed in the background */
+		long long refresh_failures;	/* failed background refreshes */
+	} token_cache_stats;
+
+	// Stages of collecting a token, in the order they run
+	typedef enum attestation_stage
+	{
+		ATTESTATION_STAGE_NONCE,	/* nonce taken from the connector's pool or requested */
+		ATTESTATION_STAGE_EVIDENCE,	/* evidence collected over the nonce */
+		ATTESTATION_STAGE_MARSHAL,	/* appraisal request marshalled */
+		ATTESTATION_STAGE_ATTEST,	/* appraisal request sent and token received */
+		ATTESTATION_STAGE_VERIFY,	/* token verified, only run with a verify callback */
+		ATTESTATION_STAGE_COUNT
+	} attestation_stage;
+
+	typedef struct stage_timing
+	{
+		long long start_us;	/* microseconds on a monotonic clock, 0 if the stage did not run */
+		long long end_us;
+	} stage_timing;
+
+	// Where the time of collecting a token went
+	typedef struct attestation_result
+	{
+		stage_timing stages[ATTESTATION_STAGE_COUNT];	/* indexed by attestation_stage */
+		int failed_stage;				/* attestation_stage which failed, -1 if none did */
+	} attestation_result;
+
+	/**
+	 * Verifies a token received from Intel Trust Authority, e.g. by calling verify_token.
+	 * @param ctx verify_ctx of the pipeline
+	 * @param token token to verify
+	 * @return STATUS_OK if the token is valid
+	 */
+	typedef int (*token_verify_callback)(void *ctx,
+			token *token);
+
+	// Platform specific parts of collecting a token
+	typedef struct attestation_pipeline
+	{
+		const char *attestation_endpoint;	/* path evidence is attested at, NULL for "/appraisal/v1/attest" */
+		evidence_callback collect_evidence;
+		void *ctx;				/* passed to collect_evidence */
+		token_verify_callback verify;		/* runs the verify stage, NULL to skip it */
+		void *verify_ctx;			/* passed to verify */
+	} attestation_pipeline;
+
+	/**
+	 * Collect a token through the stages nonce, evidence, marshal, attest and, with a verify callback,
+	 * verify, recording when each stage started and ended. collect_token, collect_token_callback and
+	 * collect_token_azure are pipelines without the verify stage.
+	 * @param connector connector instance to connect to Intel Trust Authority
+	 * @param resp_headers response headers of the attest request, may be NULL
+	 * @param token token returned from Intel Trust Authority, also handed out when its verification failed
+	 * @param token_args args required to get Token from Intel Trust Authority
+	 * @param pipeline platform specific stages
+	 * @param user_data containing user data
+	 * @param user_data_len containing length of user data
+	 * @param result timings of the stages, may be NULL
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS collect_token_pipeline(trust_authority_connector *connector,
+			response_headers *resp_headers,
+			token *token,
+			collect_token_args *token_args,
+			const attestation_pipeline *pipeline,
+			uint8_t *user_data,
+			uint32_t user_data_len,
+			attestation_result *result);
+
+	// Name of a stage for logs and metrics, e.g. "nonce".
+	const char *attestation_stage_name(attestation_stage stage);
+
 	/**
 	 * Utility function that gets nonce, evidence (provided by evidence_adapter) and gets a token from Intel Trust Authority SaaS.
 	 * @param connector connector instance to connect to Intel Trust Authority
@@ -71,6 +164,52 @@ extern "C"
 			uint8_t *user_data,
 			uint32_t user_data_len);
 
+	/**
+	 * Create a token cache. A background thread refreshes cached tokens still in use shortly
+	 * before they expire, so collect_token_cached does not wait for Intel Trust Authority on a hit.
+	 * @param cache cache created
+	 * @param config cache settings, NULL for the defaults
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS token_cache_new(token_cache **cache,
+			const token_cache_config *config);
+
+	/**
+	 * Same as collect_token, but tokens are reused until their exp minus the expiry margin. Entries are
+	 * keyed by connector, adapter, policy IDs, token signing algorithm and a hash of user_data. Tokens
+	 * without an exp claim are not cached. resp_headers is only filled in when a token was collected.
+	 * The connector and adapter are used for background refreshes and must outlive the cache.
+	 * @param cache cache to look the token up in
+	 * @param connector connector instance to connect to Intel Trust Authority
+	 * @param resp_headers response headers returned from Intel Trust Authority, may be NULL
+	 * @param token token, a copy owned by the caller
+	 * @param token_args args required to get Token from Intel Trust Authority
+	 * @param adapter sgx/tdx adapter
+	 * @param user_data containing user data
+	 * @param user_data_len containing length of user data
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS collect_token_cached(token_cache *cache,
+			trust_authority_connector *connector,
+			response_headers *resp_headers,
+			token *token,
+			collect_token_args *token_args,
+			evidence_adapter *adapter,
+			uint8_t *user_data,
+			uint32_t user_data_len);
+
+	/**
+	 * Get the statistics of a token cache.
+	 * @param cache cache instance
+	 * @param stats current statistics
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS token_cache_get_stats(token_cache *cache,
+			token_cache_stats *stats);
+
+	// Stop the background refreshes and free the cache with its tokens.
+	TRUST_AUTHORITY_STATUS token_cache_free(token_cache *cache);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __TOKEN_PROVIDER_ASYNC_H__
+#define __TOKEN_PROVIDER_ASYNC_H__
+
+#include <connector.h>
+#include <token_provider.h>
+
+#define DEFAULT_TOKEN_PROVIDER_WORKERS 4 // threads making the nonce and token requests of submitted jobs
+#define MAX_TOKEN_PROVIDER_WORKERS 64
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/**
+	 * Worker pool collecting tokens in the background through the stages of collect_token_pipeline.
+	 * Network workers run the nonce stage and the marshal, attest and verify stages while evidence
+	 * workers generate quotes, so quotes, which the quoting enclave generates one at a time, overlap
+	 * with the requests of other jobs. Jobs holding a quote are attested before further nonces
+	 * are fetched, and nonces are only fetched for as many jobs as there are evidence workers, plus
+	 * one, so that a nonce waits for at most one quote before its own. A pool may be used from several threads.
+	 */
+	typedef struct token_provider_pool token_provider_pool;
+
+	// Token collection submitted to a token_provider_pool.
+	typedef struct collect_token_job collect_token_job;
+
+	typedef struct token_provider_pool_config
+	{
+		int workers;		/* network workers, 0 for DEFAULT_TOKEN_PROVIDER_WORKERS */
+		int evidence_workers;	/* evidence workers, 0 for 1 as quotes are generated one at a time */
+	} token_provider_pool_config;
+
+	/**
+	 * Called on a worker thread once a job completed, before waiters of the job return.
+	 * @param status status of the job
+	 * @param user_data user data passed when the job was submitted
+	 */
+	typedef void (*collect_token_complete_callback)(TRUST_AUTHORITY_STATUS status,
+			void *user_data);
+
+	/**
+	 * Create a worker pool and start its threads.
+	 * @param pool pool created
+	 * @param config pool settings, NULL for the defaults
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS token_provider_pool_new(token_provider_pool **pool,
+			const token_provider_pool_config *config);
+
+	/**
+	 * Submit a collect_token job. The timeout of token_args counts from the submission, time spent queued included.
+	 * token_args is copied; the connector, adapter, policies, user data, token and resp_headers must stay valid until completion.
+	 * @param pool pool running the job
+	 * @param job handle of the job, to be freed with collect_token_job_free; NULL to only be told through callback
+	 * @param connector connector instance to connect to Intel Trust Authority
+	 * @param resp_headers response headers returned from Intel Trust Authority, may be NULL
+	 * @param token token returned from Intel Trust Authority
+	 * @param token_args args required to get Token from Intel Trust Authority
+	 * @param adapter sgx/tdx adapter
+	 * @param user_data containing user data
+	 * @param user_data_len containing length of user data
+	 * @param callback called once the job completed, may be NULL
+	 * @param callback_data passed to callback
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS collect_token_submit(token_provider_pool *pool,
+			collect_token_job **job,
+			trust_authority_connector *connector,
+			response_headers *resp_headers,
+			token *token,
+			collect_token_args *token_args,
+			evidence_adapter *adapter,
+			uint8_t *user_data,
+			uint32_t user_data_len,
+			collect_token_complete_callback callback,
+			void *callback_data);
+
+	// Same as collect_token_submit for the Azure platform, see collect_token_azure.
+	TRUST_AUTHORITY_STATUS collect_token_azure_submit(token_provider_pool *pool,
+			collect_token_job **job,
+			trust_authority_connector *connector,
+			response_headers *resp_headers,
+			token *token,
+			collect_token_args *token_args,
+			evidence_adapter *adapter,
+			uint8_t *user_data,
+			uint32_t user_data_len,
+			collect_token_complete_callback callback,
+			void *callback_data);
+
+	/**
+	 * Same as collect_token_submit for any platform, see collect_token_pipeline. The verify stage runs on a network worker.
+	 * @param pipeline platform specific stages, copied
+	 */
+	TRUST_AUTHORITY_STATUS collect_token_pipeline_submit(token_provider_pool *pool,
+			collect_token_job **job,
+			trust_authority_connector *connector,
+			response_headers *resp_headers,
+			token *token,
+			collect_token_args *token_args,
+			const attestation_pipeline *pipeline,
+			uint8_t *user_data,
+			uint32_t user_data_len,
+			collect_token_complete_callback callback,
+			void *callback_data);
+
+	/**
+	 * Check whether a job completed without waiting.
+	 * @param job job to check
+	 * @param status status of the job once it completed, may be NULL
+	 * @return 1 if the job completed
+	 */
+	int collect_token_job_poll(collect_token_job *job,
+			TRUST_AUTHORITY_STATUS *status);
+
+	/**
+	 * Wait for a job to complete.
+	 * @param job job to wait for
+	 * @param timeout_ms longest time to wait, 0 to wait until the job completed
+	 * @param status status of the job once it completed, may be NULL
+	 * @return STATUS_DEADLINE_EXCEEDED_ERROR if the job did not complete in time
+	 */
+	TRUST_AUTHORITY_STATUS collect_token_job_wait(collect_token_job *job,
+			int timeout_ms,
+			TRUST_AUTHORITY_STATUS *status);
+
+	/**
+	 * Get the stage timings of a completed job.
+	 * @param job job which completed
+	 * @param result timings of the stages
+	 * @return STATUS_INVALID_PARAMETER if the job did not complete yet
+	 */
+	TRUST_AUTHORITY_STATUS collect_token_job_result(collect_token_job *job,
+			attestation_result *result);
+
+	// Free a job handle. A job still running completes in the background and is freed then.
+	void collect_token_job_free(collect_token_job *job);
+
+	// Complete the submitted jobs, stop the threads and free the pool.
+	void token_provider_pool_free(token_provider_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
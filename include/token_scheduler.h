@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __TOKEN_SCHEDULER_H__
+#define __TOKEN_SCHEDULER_H__
+
+#include <connector.h>
+#include <token_provider.h>
+
+#define DEFAULT_TOKEN_SCHEDULER_JITTER_PERCENT 10 // share of each wait taken off at random, so that a fleet does not attest in step
+#define TOKEN_SCHEDULER_MIN_BACKOFF_MS 1000 // wait after a failed attestation, doubled on every further failure
+#define TOKEN_SCHEDULER_MAX_BACKOFF_MS 60000
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/**
+	 * Scheduler keeping a current token for each registered request. A background thread
+	 * attests again on an interval or before the token's exp, one request at a time since
+	 * quotes are generated one at a time. Reading a token takes no lock and makes no request.
+	 */
+	typedef struct token_scheduler token_scheduler;
+
+	// Request registered with a token_scheduler.
+	typedef struct scheduled_token scheduled_token;
+
+	typedef struct token_scheduler_config
+	{
+		int interval_ms;	/* longest time a token is used before attesting again, 0 to only attest again before exp */
+		int refresh_ahead_ms;	/* time before the margin a token is attested again, 0 for DEFAULT_TOKEN_REFRESH_AHEAD_MS */
+		int expiry_margin_ms;	/* tokens are not handed out within this time of their exp, 0 for DEFAULT_TOKEN_CACHE_MARGIN_MS */
+		int jitter_percent;	/* 0 for DEFAULT_TOKEN_SCHEDULER_JITTER_PERCENT, negative for no jitter */
+	} token_scheduler_config;
+
+	typedef struct token_scheduler_stats
+	{
+		int registered;			/* requests registered right now */
+		long long attestations;		/* tokens collected */
+		long long failures;		/* failed attestations */
+	} token_scheduler_stats;
+
+	/**
+	 * Create a scheduler and start its thread.
+	 * @param scheduler scheduler created
+	 * @param config scheduler settings, NULL for the defaults
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS token_scheduler_new(token_scheduler **scheduler,
+			const token_scheduler_config *config);
+
+	/**
+	 * Register a request, its first token is collected right away. token_args and user data are copied;
+	 * the connector and adapter must outlive the registration.
+	 * @param scheduler scheduler collecting the tokens
+	 * @param handle registration, to read tokens with scheduled_token_get
+	 * @param connector connector instance to connect to Intel Trust Authority
+	 * @param token_args args required to get Token from Intel Trust Authority
+	 * @param adapter sgx/tdx adapter
+	 * @param user_data containing user data
+	 * @param user_data_len containing length of user data
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS token_scheduler_register(token_scheduler *scheduler,
+			scheduled_token **handle,
+			trust_authority_connector *connector,
+			collect_token_args *token_args,
+			evidence_adapter *adapter,
+			uint8_t *user_data,
+			uint32_t user_data_len);
+
+	/**
+	 * Get a copy of the current token of a registration without locking or contacting Intel Trust Authority.
+	 * @param handle registration to read
+	 * @param token token copied, to be freed with token_free
+	 * @return STATUS_NO_TOKEN_ERROR if no token was collected yet or the last one expired
+	 */
+	TRUST_AUTHORITY_STATUS scheduled_token_get(scheduled_token *handle,
+			token *token);
+
+	// Stop collecting tokens for a registration and free it. The handle must not be read any more.
+	TRUST_AUTHORITY_STATUS token_scheduler_unregister(token_scheduler *scheduler,
+			scheduled_token *handle);
+
+	/**
+	 * Get the statistics of a scheduler.
+	 * @param scheduler scheduler instance
+	 * @param stats statistics copied
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS token_scheduler_get_stats(token_scheduler *scheduler,
+			token_scheduler_stats *stats);
+
+	// Stop the thread and free the scheduler with the registrations left.
+	TRUST_AUTHORITY_STATUS token_scheduler_free(token_scheduler *scheduler);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -11,11 +11,33 @@
 #define SHA512_LEN 64
 #define API_KEY_MAX_LEN 256
 #define API_URL_MAX_LEN 128
+#define UNIX_SOCKET_PATH_MAX_LEN 107 // sun_path holds 108 bytes including the terminator
 #define MAX_USER_DATA_LEN 1024	  // 1k
 #define MAX_EVIDENCE_LEN 8 * 1024 // 8k
 #define MAX_ATS_CERT_CHAIN_LEN 10
 #define DEFAULT_RETRY_MAX 2;
 #define DEFAULT_RETRY_WAIT_TIME 2;
+#define DEFAULT_RETRY_MAX_DELAY_MS 30000 // cap on a single backoff delay
+#define MIN_GZIP_BODY_SIZE 1024 // smaller request bodies are sent uncompressed
+#define MAX_KEPT_HEADERS 16 // response header names a connector can be asked to keep
+#define MAX_HEADER_NAME_LEN 64
+#define DEFAULT_CIRCUIT_WINDOW_MS 10000 // error rate window of the circuit breaker
+#define DEFAULT_CIRCUIT_OPEN_MS 5000 // time an open circuit waits before probing the endpoint
+#define DEFAULT_RATE_LIMIT_MAX_QUEUE_MS 30000 // longest a request waits for the rate limiter
+#define DEFAULT_RATE_LIMIT_PAUSE_MS 1000 // pause after a 429 without Retry-After
+#define MAX_NONCE_POOL_SIZE 64 // nonces a connector can keep ready
+#define DEFAULT_NONCE_MAX_AGE_MS 60000 // validity of a nonce counted from its iat
+#define DEFAULT_NONCE_MIN_REMAINING_MS 20000 // validity a pooled nonce must have left to be handed out
+#define DEFAULT_HTTP_POOL_SIZE 8 // idle keep-alive handles kept per connector
+#define MAX_ENDPOINTS 8 // Intel Trust Authority endpoints a connector can spread its requests over
+#define ENDPOINT_EWMA_WEIGHT 0.2 // weight of the latest attempt in the latency and error rate averages
+#define ENDPOINT_DOWN_FAILURES 3 // consecutive failed attempts taking an endpoint out of rotation
+#define ENDPOINT_DOWN_MS 10000 // time an endpoint stays out of rotation before it is tried again
+#define ENDPOINT_PROBE_INTERVAL 100 // every this many requests go to the least recently used endpoint
+#define DEFAULT_WARMUP_CONNECTIONS 2 // pooled connections opened by a warm up
+#define PRECONNECT_TIMEOUT_MS 10000 // budget of reopening the attest connection when the request has none
+#define DEFAULT_MAX_RESPONSE_SIZE 4 * 1024 * 1024 // 4M
+#define MIN_RESPONSE_BUFFER_SIZE 256
 #define COMMAND_LEN 1000
 #define TPM_OUTPUT_BUFFER 10000
 
@@ -28,11 +50,37 @@ typedef struct token
 	char *jwt;
 } token;
 
+typedef struct response_header
+{
+	const char *name; /* lower case */
+	const char *value;
+} response_header;
+
+/**
+ * Response headers parsed as they are received. Names and values point into headers,
+ * use response_headers_get to look a header up by name.
+ */
 typedef struct response_headers
 {
-	char *headers;
+	char *headers; /* storage of the names and values, NUL separated */
+	response_header *entries; /* headers in the order they were received */
+	size_t count;
+	unsigned int *index; /* hash table of entries by name, entry index + 1, 0 for free slots */
+	size_t index_size; /* power of two */
 } response_headers;
 
+/**
+ * Frees a quote which an adapter handed over in the buffer it was generated in.
+ * @param ctx release_ctx of the evidence
+ * @param data evidence buffer to free
+ */
+typedef void (*evidence_release_callback)(void *ctx, uint8_t *data);
+
+/**
+ * Evidence collected by an adapter. The evidence owns its buffers and evidence_free frees them;
+ * the quote is freed with release when set, so that adapters can hand over native buffers
+ * without copying them.
+ */
 typedef struct evidence
 {
 	uint32_t type;
@@ -44,6 +92,8 @@ typedef struct evidence
 	uint32_t runtime_data_len;
 	uint8_t *event_log;
 	uint32_t event_log_len;
+	evidence_release_callback release; /* frees evidence, NULL if it was allocated with malloc */
+	void *release_ctx;
 } evidence;
 
 typedef struct nonce
@@ -69,15 +119,144 @@ typedef struct policies
 
 typedef struct retry_config
 {
-	int retry_wait_time;
-	int retry_max;
+	int retry_wait_time;	 /* seconds before the first retry, used when retry_base_delay_ms is 0 */
+	int retry_max;		 /* maximum number of retries */
+	int retry_base_delay_ms; /* milliseconds before the first retry, doubled on every further retry */
+	int retry_max_delay_ms;	 /* upper bound of a single backoff delay, 0 for DEFAULT_RETRY_MAX_DELAY_MS */
+	int retry_jitter;	 /* non zero to wait a random time between 0 and the delay (full jitter) */
+	int retry_after;	 /* non zero to wait as long as a Retry-After response header asks for, uncapped */
 } retry_config;
 
+typedef enum
+{
+	CIRCUIT_CLOSED = 0, /* requests go through */
+	CIRCUIT_OPEN,	    /* the endpoint failed too often, requests fail fast */
+	CIRCUIT_HALF_OPEN   /* a few probe requests are let through to test the endpoint */
+} circuit_state;
+
+// Circuit breaker settings of an Intel Trust Authority endpoint. The breaker is disabled while both thresholds are 0.
+typedef struct circuit_breaker_config
+{
+	int failure_threshold;	/* consecutive failed attempts opening the circuit, 0 to not trip on consecutive failures */
+	int error_rate_percent;	/* percentage of failed attempts within window_ms opening the circuit, 0 to not trip on error rate */
+	int min_requests;	/* attempts needed within a window before the error rate is considered */
+	int window_ms;		/* length of the error rate window, 0 for DEFAULT_CIRCUIT_WINDOW_MS */
+	int open_ms;		/* time the circuit stays open before probing, 0 for DEFAULT_CIRCUIT_OPEN_MS */
+	int half_open_probes;	/* requests let through at a time while half-open, 0 for 1 */
+} circuit_breaker_config;
+
+// Client side rate limit of an API key, shared by all connectors of the process using the key.
+typedef struct rate_limit_config
+{
+	double requests_per_second; /* pace of the requests, 0 to only slow down when the server throttles */
+	int burst;		    /* requests which can be sent at once, 0 for 1 */
+	int max_queue_ms;	    /* longest a request waits to be sent, 0 for DEFAULT_RATE_LIMIT_MAX_QUEUE_MS */
+} rate_limit_config;
+
+// Rate limiter statistics, to size the number of workers sharing an API key.
+typedef struct rate_limit_stats
+{
+	int queue_depth;	  /* requests waiting to be sent right now */
+	long long requests;	  /* requests which went through the limiter */
+	long long waited;	  /* requests which had to wait */
+	long long total_wait_ms;  /* time spent waiting by all requests */
+	long max_wait_ms;	  /* longest wait of a request */
+	long long throttled;	  /* 429 responses received */
+	double requests_per_second; /* current pace, lowered after 429 responses; 0 when unpaced */
+} rate_limit_stats;
+
+// Nonces fetched ahead of time by a background thread of the connector.
+typedef struct nonce_pool_config
+{
+	int size;		/* nonces kept ready, 0 to disable the pool */
+	int max_age_ms;		/* validity of a nonce counted from its iat, 0 for DEFAULT_NONCE_MAX_AGE_MS */
+	int min_remaining_ms;	/* nonces with less validity left are dropped, 0 for DEFAULT_NONCE_MIN_REMAINING_MS */
+} nonce_pool_config;
+
+// Nonce pool statistics.
+typedef struct nonce_pool_stats
+{
+	int ready;		/* nonces ready to be taken right now */
+	long long fetched;	/* nonces fetched by the background thread */
+	long long taken;	/* nonces handed out */
+	long long expired;	/* nonces dropped before being used */
+	long long misses;	/* takes which found the pool empty */
+	long long failures;	/* failed fetches */
+} nonce_pool_stats;
+
+// Health of an Intel Trust Authority endpoint as seen by a connector.
+typedef struct endpoint_stats
+{
+	char api_url[API_URL_MAX_LEN + 1];
+	double latency_ms;	/* moving average of the latency of successful attempts */
+	double error_rate;	/* moving average of failed attempts, from 0 to 1 */
+	long long requests;	/* attempts sent to the endpoint, retries included */
+	long long failures;	/* attempts which failed without a response, or with 429 or 5xx */
+	int healthy;		/* 0 while the endpoint is out of rotation after consecutive failures */
+} endpoint_stats;
+
+// Compression used by a connector, see trust_authority_connector_set_compression
+#define COMPRESSION_GZIP_REQUEST 0x1	// gzip request bodies (Content-Encoding: gzip)
+#define COMPRESSION_ACCEPT_ENCODING 0x2 // accept compressed responses (Accept-Encoding)
+
+// Hedging of token requests, a duplicate request is sent when the first one is slow.
+typedef struct hedge_config
+{
+	int delay_ms;			   /* time to wait for a response before sending the duplicate, 0 to not hedge */
+	char api_url[API_URL_MAX_LEN + 1]; /* URL the duplicate goes to, empty for the connector's api_url */
+} hedge_config;
+
+// Request handed over to a transport_adapter.
+typedef struct transport_request
+{
+	const char *method;	      /* "GET" or "POST" */
+	const char *url;
+	const char *api_key;	      /* value of the x-api-key header, NULL for none */
+	const char *accept;	      /* Accept header line, NULL for none */
+	const char *request_id;	      /* request-id header value, NULL for none */
+	const char *content_type;     /* Content-Type header line, NULL for none */
+	const char *content_encoding; /* "gzip" when the body is compressed, NULL otherwise */
+	const char *body;	      /* NULL for GET requests */
+	size_t body_len;
+	long long deadline; /* trust_authority_deadline() time by which the request must be done, 0 for none */
+} transport_request;
+
+// Response filled in by a transport_adapter. Buffers are allocated with malloc and owned by the library once returned.
+typedef struct transport_response
+{
+	long status_code;
+	char *body;
+	size_t body_len;
+	char *headers; /* "Name: value\r\n" lines, NULL for none */
+	size_t headers_len;
+} transport_response;
+
+/**
+ * Performs one HTTP request. Retries, rate limiting and the circuit breaker are applied around it.
+ * @return 0 once a response was received whatever its status code, non zero if no response was received
+ */
+typedef int (*transport_callback)(void *ctx,
+		const transport_request *request,
+		transport_response *response);
+
+// Replaces libcurl for the requests of a connector, e.g. with an in-process loopback for benchmarks.
+typedef struct transport_adapter
+{
+	void *ctx;
+	transport_callback perform;
+} transport_adapter;
+
+struct http_pool;
+struct nonce_pool;
+
 typedef struct trust_authority_connector
 {
 	char api_key[API_KEY_MAX_LEN + 1]; /* character array containing API KEY use to authenticate to Intel trust Authority */
 	char api_url[API_URL_MAX_LEN + 1]; /* character array containing URL of Intel Trust Authority */
 	retry_config *retries;
+	struct http_pool *pool; /* persistent keep-alive HTTP handles reused across requests */
+	hedge_config hedging; /* hedging of token requests, disabled by default */
+	struct nonce_pool *nonce_pool; /* nonces prefetched in the background, NULL when disabled */
 } trust_authority_connector;
 
 typedef struct jwks
@@ -165,6 +344,12 @@ typedef enum
 	STATUS_POST_TOKEN_ERROR,
 	STATUS_GET_SIGNING_CERT_ERROR,
 	STATUS_GET_AZURE_TD_QUOTE_ERROR,
+	STATUS_DEADLINE_EXCEEDED_ERROR,
+	STATUS_CIRCUIT_OPEN_ERROR,
+	STATUS_RATE_LIMITED_ERROR,
+	STATUS_NONCE_POOL_EMPTY_ERROR,
+	STATUS_WARMUP_ERROR,
+	STATUS_NO_TOKEN_ERROR,
 
 	STATUS_JSON_ERROR = 0x600,
 	STATUS_JSON_ENCODING_ERROR,
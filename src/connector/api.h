@@ -5,6 +5,9 @@
 #ifndef __API_H__
 #define __API_H__
 
+#include <connector.h>
+#include "rest.h"
+
 #ifdef __cplusplus
 
 extern "C"
@@ -13,7 +16,8 @@ extern "C"
 #endif
 
 	/**
-	 * Checks if given url is correct
+	 * Checks if given url is correct. Like the other validators it allocates nothing and may be
+	 * called concurrently.
 	 * @param url  url to be verified
 	 * @return int containing status
 	*/	
@@ -34,6 +38,73 @@ extern "C"
 	TRUST_AUTHORITY_STATUS is_valid_api_key(const char *api_key);
 
 
+	/**
+	 * Validates the token request and marshals it into the appraisal request JSON sent to Intel Trust Authority.
+	 * @param args args required to get token
+	 * @param json appraisal request in JSON form, to be freed by the caller
+	 * @return return status
+	*/	
+	TRUST_AUTHORITY_STATUS marshal_token_request(get_token_args *args,
+			char **json);
+
+	// Appraisal request marshalled ahead of being sent.
+	typedef struct token_request
+	{
+		char *json; /* whole request when gzip is set, otherwise the small fields referenced by stream */
+		http_body_stream stream; /* body encoding the evidence while it is uploaded, unused when gzip is set */
+		int gzip;
+	} token_request;
+
+	/**
+	 * Marshal the appraisal request of get_token.
+	 * @param connector connector instance
+	 * @param args args required to get token, the evidence must stay valid until the request was sent
+	 * @param request request marshalled, to be freed with token_request_free
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS token_request_marshal(trust_authority_connector *connector,
+			get_token_args *args,
+			token_request *request);
+
+	/**
+	 * Send a marshalled appraisal request and unmarshal the token, as get_token does.
+	 * @param connector connector instance
+	 * @param resp_headers response headers returned from Intel Trust Authority, may be NULL
+	 * @param token token returned from Intel Trust Authority
+	 * @param args args the request was marshalled from
+	 * @param request request to send, may be sent again
+	 * @param attestation_endpoint path of the attest API
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS token_request_send(trust_authority_connector *connector,
+			response_headers *resp_headers,
+			token *token,
+			get_token_args *args,
+			token_request *request,
+			const char *attestation_endpoint);
+
+	// Free the buffers of a marshalled request, NULL is ignored.
+	void token_request_free(token_request *request);
+
+	/**
+	 * Copy the retry policy of a connector, which may be changed while other threads make requests.
+	 * @param connector connector instance
+	 * @param policy copy of the policy
+	 */
+	void connector_retry_policy(trust_authority_connector *connector,
+			retry_config *policy);
+
+	/**
+	 * Keep, or re-open, a connection to the endpoint the next token request is likely to go to while the
+	 * caller collects evidence, if enabled with trust_authority_connector_set_preconnect(). The caller
+	 * does not wait for it.
+	 * @param connector connector instance
+	 * @param deadline http_now_ms() time by which the connection must be open, 0 for PRECONNECT_TIMEOUT_MS
+	 * @return 1 if a preconnect was started
+	 */
+	int connector_preconnect(trust_authority_connector *connector,
+			long long deadline);
+
 	/**
 	 * Verifies if token signing algorithm are supported 
 	 * @param input alg to be verified
@@ -0,0 +1,905 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include <connector.h>
+#include <connector_async.h>
+#include <types.h>
+#include <log.h>
+#include "api.h"
+#include "json.h"
+#include "rest.h"
+
+#define BATCH_POLL_TIMEOUT_MS 1000 // longest a batch waits for socket activity before checking for retries
+
+typedef enum
+{
+	ASYNC_NONCE,
+	ASYNC_TOKEN
+} async_request_type;
+
+typedef struct async_transfer
+{
+	trust_authority_async *async;
+	async_request_type type;
+	CURL *curl;
+	struct curl_slist *req_headers;
+	struct write_result body;
+	struct write_headers headers;
+	char url[API_URL_MAX_LEN + 1];
+	char *request; /* appraisal request JSON, NULL for nonce requests */
+	char *gzip_request; /* gzipped request sent instead of request, NULL if not compressed */
+	size_t gzip_len;
+	const char *request_id; /* points to request_id_buf, NULL for none */
+	char request_id_buf[API_URL_MAX_LEN + 1]; /* copied as the caller's args need not outlive submission */
+	nonce *nonce;
+	token *token;
+	response_headers *resp_headers;
+	async_complete_callback callback;
+	void *user_data;
+	int retry_count;
+	long long deadline; /* http_now_ms() time by which the request must be done, 0 for none */
+	long long retry_at; /* monotonic time to restart the transfer at, 0 while it is running */
+	long long queue_until; /* time the request must have been sent by, rate limiter waits included */
+	long long queued_at; /* time the transfer started waiting for the rate limiter, 0 if not waiting */
+	struct async_transfer *next;
+} async_transfer;
+
+struct trust_authority_async
+{
+	trust_authority_connector *connector;
+	CURLM *multi;
+	async_socket_callback socket_cb;
+	async_timer_callback timer_cb;
+	void *loop_data;
+	long long curl_timeout_at; /* monotonic time curl asked to be called back at, -1 for none */
+	async_transfer *transfers; /* transfers running or waiting for a retry */
+	int count;
+	int pooled; /* multi was taken from the connector's pool and goes back to it with its connections */
+};
+
+// Arms the event loop timer for whichever comes first, curl's timeout or a pending retry.
+static void async_update_timer(trust_authority_async *async)
+{
+	long long next = async->curl_timeout_at;
+	long timeout_ms = -1;
+
+	if (NULL == async->timer_cb)
+	{
+		return;
+	}
+
+	for (async_transfer *transfer = async->transfers; NULL != transfer; transfer = transfer->next)
+	{
+		if (0 != transfer->retry_at && (next < 0 || transfer->retry_at < next))
+		{
+			next = transfer->retry_at;
+		}
+	}
+
+	if (next >= 0)
+	{
+		long long now = http_now_ms();
+		timeout_ms = (next > now) ? (long)(next - now) : 0;
+	}
+
+	async->timer_cb(timeout_ms, async->loop_data);
+}
+
+static int async_multi_socket_cb(CURL *easy,
+		curl_socket_t s,
+		int what,
+		void *userp,
+		void *socketp)
+{
+	trust_authority_async *async = (trust_authority_async *)userp;
+
+	return async->socket_cb((int)s, what, async->loop_data);
+}
+
+static int async_multi_timer_cb(CURLM *multi,
+		long timeout_ms,
+		void *userp)
+{
+	trust_authority_async *async = (trust_authority_async *)userp;
+
+	async->curl_timeout_at = (timeout_ms < 0) ? -1 : http_now_ms() + timeout_ms;
+	async_update_timer(async);
+
+	return 0;
+}
+
+// Takes a transfer waiting for the rate limiter off its queue.
+static void async_dequeue(async_transfer *transfer)
+{
+	if (0 != transfer->queued_at)
+	{
+		http_limiter_dequeue(http_pool_limiter(transfer->async->connector->pool), (long)(http_now_ms() - transfer->queued_at));
+		transfer->queued_at = 0;
+	}
+}
+
+/**
+ * Takes a rate limiter token for the next attempt of a transfer.
+ * @return milliseconds to wait before sending the request, -1 if it cannot be sent in time
+ */
+static long async_reserve(async_transfer *transfer)
+{
+	long long not_after = (0 != transfer->deadline && transfer->deadline < transfer->queue_until) ?
+		transfer->deadline : transfer->queue_until;
+	long wait = http_limiter_reserve(http_pool_limiter(transfer->async->connector->pool), not_after);
+
+	if (wait > 0)
+	{
+		transfer->queued_at = http_now_ms();
+	}
+
+	return wait;
+}
+
+static void async_transfer_free(async_transfer *transfer)
+{
+	if (NULL != transfer)
+	{
+		async_dequeue(transfer);
+		http_handle_release(transfer->async->connector->pool, transfer->curl);
+		transfer->curl = NULL;
+		if (NULL != transfer->req_headers)
+		{
+			curl_slist_free_all(transfer->req_headers);
+			transfer->req_headers = NULL;
+		}
+		http_response_free(&transfer->body, &transfer->headers);
+		if (NULL != transfer->request)
+		{
+			free(transfer->request);
+			transfer->request = NULL;
+		}
+		if (NULL != transfer->gzip_request)
+		{
+			free(transfer->gzip_request);
+			transfer->gzip_request = NULL;
+		}
+		free(transfer);
+		transfer = NULL;
+	}
+}
+
+static void async_unlink(trust_authority_async *async,
+		async_transfer *transfer)
+{
+	for (async_transfer **link = &async->transfers; NULL != *link; link = &(*link)->next)
+	{
+		if (*link == transfer)
+		{
+			*link = transfer->next;
+			async->count--;
+			break;
+		}
+	}
+}
+
+// Sets up the handle of a transfer, the gzipped request is sent if there is one.
+static void async_prepare(async_transfer *transfer)
+{
+	trust_authority_connector *connector = transfer->async->connector;
+
+	if (NULL != transfer->req_headers)
+	{
+		curl_slist_free_all(transfer->req_headers);
+		transfer->req_headers = NULL;
+	}
+
+	transfer->req_headers = http_request_prepare(transfer->curl, transfer->url, connector->api_key,
+			ACCEPT_APPLICATION_JSON, transfer->request_id,
+			(NULL != transfer->request) ? CONTENT_TYPE_APPLICATION_JSON : NULL,
+			(NULL != transfer->gzip_request) ? transfer->gzip_request : transfer->request, transfer->gzip_len,
+			(NULL != transfer->gzip_request) ? "gzip" : NULL,
+			&transfer->body, &transfer->headers, connector->pool);
+	curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+	http_apply_deadline(transfer->curl, transfer->deadline);
+}
+
+static TRUST_AUTHORITY_STATUS async_submit(trust_authority_async *async,
+		async_transfer *transfer,
+		const char *request_id)
+{
+	CURLMcode mstatus = CURLM_OK;
+	long wait = 0;
+
+	transfer->async = async;
+	if (trust_authority_deadline_expired(transfer->deadline))
+	{
+		async_transfer_free(transfer);
+		return STATUS_DEADLINE_EXCEEDED_ERROR;
+	}
+
+	if (!http_breaker_allow(http_pool_url_breaker(async->connector->pool, transfer->url)))
+	{
+		async_transfer_free(transfer);
+		return STATUS_CIRCUIT_OPEN_ERROR;
+	}
+
+	transfer->curl = http_handle_acquire(async->connector->pool);
+	if (NULL == transfer->curl)
+	{
+		async_transfer_free(transfer);
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	if (CURLE_OK != http_gzip_body(async->connector->pool, transfer->request, &transfer->gzip_request, &transfer->gzip_len))
+	{
+		async_transfer_free(transfer);
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	if (NULL != request_id)
+	{
+		strncpy(transfer->request_id_buf, request_id, API_URL_MAX_LEN);
+		transfer->request_id = transfer->request_id_buf;
+	}
+	async_prepare(transfer);
+
+	transfer->queue_until = http_now_ms() + http_limiter_max_queue_ms(http_pool_limiter(async->connector->pool));
+	wait = async_reserve(transfer);
+	if (wait < 0)
+	{
+		ERROR("Error: Request to %s not sent, rate limited\n", transfer->url);
+		async_transfer_free(transfer);
+		return STATUS_RATE_LIMITED_ERROR;
+	}
+
+	transfer->next = async->transfers;
+	async->transfers = transfer;
+	async->count++;
+
+	// Paced requests are started along with the retries once their turn comes
+	if (wait > 0)
+	{
+		transfer->retry_at = http_now_ms() + wait;
+		async_update_timer(async);
+		return STATUS_OK;
+	}
+
+	mstatus = curl_multi_add_handle(async->multi, transfer->curl);
+	if (CURLM_OK != mstatus)
+	{
+		ERROR("Error: Failed to add request to %s: %s\n", transfer->url, curl_multi_strerror(mstatus));
+		async_unlink(async, transfer);
+		async_transfer_free(transfer);
+		return STATUS_REST_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+// Unmarshals the response of a finished transfer into the caller's structures.
+static TRUST_AUTHORITY_STATUS async_complete(async_transfer *transfer,
+		CURLcode result,
+		long code)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_OK;
+	TRUST_AUTHORITY_STATUS rest_error = (ASYNC_NONCE == transfer->type) ? STATUS_GET_NONCE_ERROR : STATUS_POST_TOKEN_ERROR;
+	char *response = NULL;
+	response_headers headers = {0};
+
+	if (CURLE_OPERATION_TIMEDOUT == result && 0 != transfer->deadline)
+	{
+		ERROR("Error: Request to %s ran out of time", transfer->url);
+		return STATUS_DEADLINE_EXCEEDED_ERROR;
+	}
+
+	if (CURLE_AGAIN == result)
+	{
+		ERROR("Error: Request to %s was rate limited", transfer->url);
+		return STATUS_RATE_LIMITED_ERROR;
+	}
+
+	if (CURLE_OK != result)
+	{
+		ERROR("Error: Request to %s returned %s", transfer->url, curl_easy_strerror(result));
+		return rest_error;
+	}
+
+	if (200 != code)
+	{
+		ERROR("Error: Request to '%s' returned code %ld\n", transfer->url, code);
+		return rest_error;
+	}
+
+	if (CURLE_OK != http_response_take(&transfer->body, &transfer->headers, &response,
+				(NULL != transfer->resp_headers) ? &headers : NULL))
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	if (ASYNC_NONCE == transfer->type)
+	{
+		status = json_unmarshal_nonce(transfer->nonce, response);
+	}
+	else
+	{
+		status = json_unmarshal_token(transfer->token, response);
+	}
+
+	if (STATUS_OK == status && NULL != transfer->resp_headers)
+	{
+		*transfer->resp_headers = headers;
+		memset(&headers, 0, sizeof(headers));
+	}
+
+	free(response);
+	response = NULL;
+	response_headers_free(&headers);
+
+	return status;
+}
+
+// Restarts transfers whose retry wait time has passed.
+static void async_start_due_retries(trust_authority_async *async)
+{
+	long long now = http_now_ms();
+
+	for (async_transfer *transfer = async->transfers; NULL != transfer; transfer = transfer->next)
+	{
+		if (0 != transfer->retry_at && transfer->retry_at <= now)
+		{
+			transfer->retry_at = 0;
+			async_dequeue(transfer);
+			// A retry started late still goes through curl so that it completes like any other timeout
+			if (CURLE_OK != http_apply_deadline(transfer->curl, transfer->deadline))
+			{
+				curl_easy_setopt(transfer->curl, CURLOPT_TIMEOUT_MS, 1L);
+			}
+			curl_multi_add_handle(async->multi, transfer->curl);
+		}
+	}
+}
+
+// Handles finished transfers: schedules retries or completes them and calls their callbacks.
+static void async_process_done(trust_authority_async *async)
+{
+	CURLMsg *msg = NULL;
+	int left = 0;
+	int scheduled = 0;
+
+	while (NULL != (msg = curl_multi_info_read(async->multi, &left)))
+	{
+		if (CURLMSG_DONE != msg->msg)
+		{
+			continue;
+		}
+
+		// msg does not survive removing the handle
+		CURL *curl = msg->easy_handle;
+		CURLcode result = msg->data.result;
+		async_transfer *transfer = NULL;
+		retry_config policy = {0};
+		retry_config *retries = &policy;
+		long code = 0;
+
+		connector_retry_policy(async->connector, &policy);
+		curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&transfer);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		curl_multi_remove_handle(async->multi, curl);
+
+		http_breaker *breaker = http_pool_url_breaker(async->connector->pool, transfer->url);
+		int retry = http_is_retryable(result, code) &&
+				NULL != retries && transfer->retry_count < retries->retry_max;
+		long delay_ms = 0;
+
+		curl_off_t elapsed_us = 0;
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &elapsed_us);
+		http_endpoints_record(http_pool_endpoints(async->connector->pool), transfer->url, (long)(elapsed_us / 1000),
+				CURLE_OK != result || http_is_retryable(result, code));
+
+		http_breaker_record(breaker, http_breaker_outcome(result, code));
+		http_limiter_record(http_pool_limiter(async->connector->pool), code, http_retry_after_ms(curl), &transfer->headers);
+
+		// The server does not take gzip bodies, resend uncompressed right away
+		if (HTTP_UNSUPPORTED_MEDIA_TYPE == code && NULL != transfer->gzip_request)
+		{
+			http_pool_gzip_rejected(async->connector->pool);
+			free(transfer->gzip_request);
+			transfer->gzip_request = NULL;
+			transfer->gzip_len = 0;
+			async_prepare(transfer);
+			http_response_reset(&transfer->body, &transfer->headers);
+			transfer->retry_at = http_now_ms() + 1;
+			scheduled = 1;
+			continue;
+		}
+		if (retry && CIRCUIT_OPEN == http_breaker_state(breaker))
+		{
+			ERROR("%s (status: %ld, %s): not retried, the circuit is open", transfer->url, code, curl_easy_strerror(result));
+			retry = 0;
+		}
+
+		// Throttled requests queue for the rate limiter instead of using up retries
+		int throttled = (HTTP_TOO_MANY_REQUESTS == code && NULL != http_pool_limiter(async->connector->pool) &&
+				CIRCUIT_OPEN != http_breaker_state(breaker));
+		if (retry || throttled)
+		{
+			long wait = async_reserve(transfer);
+			if (wait < 0)
+			{
+				ERROR("%s (status: %ld, %s): not retried, rate limited", transfer->url, code, curl_easy_strerror(result));
+				result = (0 != transfer->deadline && transfer->deadline <= transfer->queue_until) ?
+					CURLE_OPERATION_TIMEDOUT : CURLE_AGAIN;
+				retry = 0;
+				throttled = 0;
+			}
+			else if (throttled)
+			{
+				DEBUG("%s throttled, queueing for %ldms\n", transfer->url, wait);
+				http_response_reset(&transfer->body, &transfer->headers);
+				transfer->retry_at = http_now_ms() + wait + 1;
+				scheduled = 1;
+				continue;
+			}
+			else
+			{
+				delay_ms = wait;
+			}
+		}
+
+		if (retry)
+		{
+			long backoff_ms = http_retry_delay_ms(retries, transfer->retry_count, http_retry_after_ms(curl));
+			if (backoff_ms > delay_ms)
+			{
+				delay_ms = backoff_ms;
+			}
+			if (0 != transfer->deadline && http_now_ms() + delay_ms + 1 >= transfer->deadline)
+			{
+				ERROR("%s (status: %ld, %s): no time left for a retry", transfer->url, code, curl_easy_strerror(result));
+				result = CURLE_OPERATION_TIMEDOUT;
+				retry = 0;
+			}
+		}
+
+		if (retry)
+		{
+			transfer->retry_count++;
+			ERROR("%s (status: %ld, %s): retrying in %ldms(%d left)", transfer->url, code, curl_easy_strerror(result),
+					delay_ms, (retries->retry_max - transfer->retry_count));
+			http_response_reset(&transfer->body, &transfer->headers);
+			// Zero would mean running, wait at least a millisecond
+			transfer->retry_at = http_now_ms() + delay_ms + 1;
+			scheduled = 1;
+			continue;
+		}
+
+		TRUST_AUTHORITY_STATUS status = async_complete(transfer, result, code);
+		async_complete_callback callback = transfer->callback;
+		void *user_data = transfer->user_data;
+
+		async_unlink(async, transfer);
+		async_transfer_free(transfer);
+
+		if (NULL != callback)
+		{
+			callback(status, user_data);
+		}
+	}
+
+	if (scheduled)
+	{
+		async_update_timer(async);
+	}
+}
+
+// Create a client, on a multi handle of the connector's pool when pooled so its connections outlive the client
+static TRUST_AUTHORITY_STATUS async_new(trust_authority_async **async,
+		trust_authority_connector *connector,
+		int pooled)
+{
+	if (NULL == async)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	// Requests are multiplexed on a curl multi handle, custom transports cannot take part
+	if (NULL != http_pool_transport(connector->pool))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (CURLE_OK != http_ensure_global_init())
+	{
+		return STATUS_INTERNAL_ERROR;
+	}
+
+	*async = (trust_authority_async *)calloc(1, sizeof(trust_authority_async));
+	if (NULL == *async)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	(*async)->multi = pooled ? http_pool_acquire_multi(connector->pool) : curl_multi_init();
+	if (NULL == (*async)->multi)
+	{
+		free(*async);
+		*async = NULL;
+		return STATUS_ALLOCATION_ERROR;
+	}
+	(*async)->connector = connector;
+	(*async)->curl_timeout_at = -1;
+	(*async)->pooled = pooled;
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_async_new(trust_authority_async **async,
+		trust_authority_connector *connector)
+{
+	// Event loops set their own socket callbacks on the multi handle, which pooled handles must not keep
+	return async_new(async, connector, 0);
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_async_set_callbacks(trust_authority_async *async,
+		async_socket_callback socket_cb,
+		async_timer_callback timer_cb,
+		void *loop_data)
+{
+	if (NULL == async)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL == socket_cb || NULL == timer_cb)
+	{
+		return STATUS_NULL_CALLBACK;
+	}
+
+	async->socket_cb = socket_cb;
+	async->timer_cb = timer_cb;
+	async->loop_data = loop_data;
+
+	curl_multi_setopt(async->multi, CURLMOPT_SOCKETFUNCTION, async_multi_socket_cb);
+	curl_multi_setopt(async->multi, CURLMOPT_SOCKETDATA, async);
+	curl_multi_setopt(async->multi, CURLMOPT_TIMERFUNCTION, async_multi_timer_cb);
+	curl_multi_setopt(async->multi, CURLMOPT_TIMERDATA, async);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS get_nonce_async(trust_authority_async *async,
+		nonce *nonce,
+		get_nonce_args *args,
+		response_headers *resp_headers,
+		async_complete_callback callback,
+		void *user_data)
+{
+	async_transfer *transfer = NULL;
+
+	if (NULL == async)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL == nonce)
+	{
+		return STATUS_NULL_NONCE;
+	}
+
+	if (NULL == args)
+	{
+		return STATUS_NULL_ARGS;
+	}
+
+	transfer = (async_transfer *)calloc(1, sizeof(async_transfer));
+	if (NULL == transfer)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	transfer->type = ASYNC_NONCE;
+	transfer->deadline = args->deadline;
+	transfer->nonce = nonce;
+	transfer->resp_headers = resp_headers;
+	transfer->headers.discard = (NULL == resp_headers);
+	transfer->callback = callback;
+	transfer->user_data = user_data;
+	// Requests made on the loop are not failed over, they only go to the best endpoint
+	if (http_endpoints_pick(http_pool_endpoints(async->connector->pool), 0, transfer->url) < 0)
+	{
+		strncat(transfer->url, async->connector->api_url, API_URL_MAX_LEN);
+	}
+	strncat(transfer->url, "/appraisal/v1/nonce", API_URL_MAX_LEN - strlen(transfer->url));
+	DEBUG("Nonce url: %s\n", transfer->url);
+
+	return async_submit(async, transfer, args->request_id);
+}
+
+TRUST_AUTHORITY_STATUS get_token_async(trust_authority_async *async,
+		response_headers *resp_headers,
+		token *token,
+		get_token_args *args,
+		char *attestation_endpoint,
+		async_complete_callback callback,
+		void *user_data)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_OK;
+	async_transfer *transfer = NULL;
+
+	if (NULL == async)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL == token)
+	{
+		return STATUS_NULL_TOKEN;
+	}
+
+	if (NULL == attestation_endpoint)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	transfer = (async_transfer *)calloc(1, sizeof(async_transfer));
+	if (NULL == transfer)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	status = marshal_token_request(args, &transfer->request);
+	if (STATUS_OK != status)
+	{
+		free(transfer);
+		transfer = NULL;
+		return status;
+	}
+
+	transfer->type = ASYNC_TOKEN;
+	transfer->deadline = args->deadline;
+	transfer->token = token;
+	transfer->resp_headers = resp_headers;
+	transfer->headers.discard = (NULL == resp_headers);
+	transfer->callback = callback;
+	transfer->user_data = user_data;
+	// Requests made on the loop are not failed over, they only go to the best endpoint
+	if (http_endpoints_pick(http_pool_endpoints(async->connector->pool), 0, transfer->url) < 0)
+	{
+		strncat(transfer->url, async->connector->api_url, API_URL_MAX_LEN);
+	}
+	strncat(transfer->url, attestation_endpoint, API_URL_MAX_LEN - strlen(transfer->url));
+	DEBUG("Token url: %s\n", transfer->url);
+
+	return async_submit(async, transfer, args->request_id);
+}
+
+// Request of a batch, tells the batch it completed
+typedef struct batch_slot
+{
+	int *in_flight;
+	TRUST_AUTHORITY_STATUS *status;
+} batch_slot;
+
+static void batch_request_done(TRUST_AUTHORITY_STATUS status,
+		void *user_data)
+{
+	batch_slot *slot = (batch_slot *)user_data;
+
+	*slot->status = status;
+	(*slot->in_flight)--;
+}
+
+TRUST_AUTHORITY_STATUS get_tokens_batch(trust_authority_connector *connector,
+		token *tokens,
+		get_token_args *args,
+		TRUST_AUTHORITY_STATUS *statuses,
+		int count,
+		char *attestation_endpoint,
+		int concurrency)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_OK;
+	trust_authority_async *async = NULL;
+	batch_slot *slots = NULL;
+	int in_flight = 0;
+	int next = 0;
+
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == tokens)
+	{
+		return STATUS_NULL_TOKEN;
+	}
+
+	if (NULL == args)
+	{
+		return STATUS_NULL_ARGS;
+	}
+
+	if (NULL == statuses || count < 0 || concurrency < 0 || concurrency > MAX_BATCH_CONCURRENCY || NULL == attestation_endpoint)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	// Requests never sent, e.g. when driving the batch fails, report the failure
+	for (int i = 0; i < count; i++)
+	{
+		statuses[i] = STATUS_REST_ERROR;
+	}
+
+	// Custom transports are called synchronously, there is nothing to overlap
+	if (NULL != http_pool_transport(connector->pool))
+	{
+		for (int i = 0; i < count; i++)
+		{
+			statuses[i] = get_token(connector, NULL, &tokens[i], &args[i], attestation_endpoint);
+		}
+		return STATUS_OK;
+	}
+
+	slots = (batch_slot *)calloc(count > 0 ? count : 1, sizeof(batch_slot));
+	if (NULL == slots)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	// Connections opened by a batch are kept in the pooled multi handle for the next batch
+	status = async_new(&async, connector, 1);
+	if (STATUS_OK != status)
+	{
+		goto ERROR;
+	}
+
+	concurrency = (0 != concurrency) ? concurrency : DEFAULT_BATCH_CONCURRENCY;
+	while (next < count || in_flight > 0)
+	{
+		// Requests are marshalled as slots free up, only those in flight are held in memory
+		while (next < count && in_flight < concurrency)
+		{
+			slots[next].in_flight = &in_flight;
+			slots[next].status = &statuses[next];
+			in_flight++;
+			status = get_token_async(async, NULL, &tokens[next], &args[next], attestation_endpoint, batch_request_done, &slots[next]);
+			if (STATUS_OK != status)
+			{
+				statuses[next] = status;
+				in_flight--;
+			}
+			next++;
+		}
+
+		status = trust_authority_async_perform(async, BATCH_POLL_TIMEOUT_MS, NULL);
+		if (STATUS_OK != status)
+		{
+			ERROR("Error: Batch of token requests stopped with %d requests in flight\n", in_flight);
+			goto ERROR;
+		}
+	}
+
+ERROR:
+	trust_authority_async_free(async);
+	free(slots);
+	slots = NULL;
+	return status;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_async_socket_action(trust_authority_async *async,
+		int fd,
+		int events,
+		int *running)
+{
+	CURLMcode mstatus = CURLM_OK;
+	int still_running = 0;
+
+	if (NULL == async)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (ASYNC_SOCKET_TIMEOUT == fd)
+	{
+		// curl re-arms its timeout from within the action if it still needs one
+		async->curl_timeout_at = -1;
+		async_start_due_retries(async);
+	}
+
+	mstatus = curl_multi_socket_action(async->multi, (curl_socket_t)fd, events, &still_running);
+	async_process_done(async);
+
+	if (ASYNC_SOCKET_TIMEOUT == fd)
+	{
+		async_update_timer(async);
+	}
+
+	if (NULL != running)
+	{
+		*running = async->count;
+	}
+
+	return (CURLM_OK == mstatus) ? STATUS_OK : STATUS_REST_ERROR;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_async_perform(trust_authority_async *async,
+		int timeout_ms,
+		int *running)
+{
+	CURLMcode mstatus = CURLM_OK;
+	int still_running = 0;
+
+	if (NULL == async)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	async_start_due_retries(async);
+	mstatus = curl_multi_perform(async->multi, &still_running);
+	async_process_done(async);
+
+	if (CURLM_OK == mstatus && async->count > 0 && timeout_ms > 0)
+	{
+		long long wait_until = http_now_ms() + timeout_ms;
+
+		// Wake up in time for the earliest pending retry
+		for (async_transfer *transfer = async->transfers; NULL != transfer; transfer = transfer->next)
+		{
+			if (0 != transfer->retry_at && transfer->retry_at < wait_until)
+			{
+				wait_until = transfer->retry_at;
+			}
+		}
+
+		long long now = http_now_ms();
+		mstatus = curl_multi_poll(async->multi, NULL, 0, (wait_until > now) ? (int)(wait_until - now) : 0, NULL);
+		if (CURLM_OK == mstatus)
+		{
+			async_start_due_retries(async);
+			mstatus = curl_multi_perform(async->multi, &still_running);
+			async_process_done(async);
+		}
+	}
+
+	if (NULL != running)
+	{
+		*running = async->count;
+	}
+
+	return (CURLM_OK == mstatus) ? STATUS_OK : STATUS_REST_ERROR;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_async_free(trust_authority_async *async)
+{
+	if (NULL != async)
+	{
+		while (NULL != async->transfers)
+		{
+			async_transfer *transfer = async->transfers;
+
+			async->transfers = transfer->next;
+			if (0 == transfer->retry_at)
+			{
+				curl_multi_remove_handle(async->multi, transfer->curl);
+			}
+			async_transfer_free(transfer);
+		}
+
+		if (async->pooled)
+		{
+			http_pool_release_multi(async->connector->pool, async->multi);
+		}
+		else if (NULL != async->multi)
+		{
+			curl_multi_cleanup(async->multi);
+		}
+		async->multi = NULL;
+		free(async);
+		async = NULL;
+	}
+	return STATUS_OK;
+}
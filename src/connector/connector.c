@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <openssl/sha.h>
 #include <openssl/pem.h>
 #include <connector.h>
@@ -13,10 +15,27 @@
 #include "api.h"
 #include "appraisal_request.h"
 #include "rest.h"
+#include "nonce_pool.h"
 #include <log.h>
 #include "base64.h"
 #include <jwt.h>
-#include <regex.h>
+
+#define UUID_STRING_LEN 36 // 8-4-4-4-12 hex digits
+
+TRUST_AUTHORITY_STATUS trust_authority_global_init(void)
+{
+	if (CURLE_OK != http_global_init())
+	{
+		return STATUS_INTERNAL_ERROR;
+	}
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_global_cleanup(void)
+{
+	http_global_cleanup();
+	return STATUS_OK;
+}
 
 TRUST_AUTHORITY_STATUS trust_authority_connector_new(trust_authority_connector **connector,
 		const char *api_key,
@@ -27,6 +46,7 @@ TRUST_AUTHORITY_STATUS trust_authority_connector_new(trust_authority_connector *
 	size_t base64_input_length = 0, output_length = 0;
 	unsigned char *buf = NULL;
 	TRUST_AUTHORITY_STATUS status = STATUS_OK;
+	CURLcode curl_status = CURLE_OK;
 
 	if (NULL == connector)
 	{
@@ -68,27 +88,649 @@ TRUST_AUTHORITY_STATUS trust_authority_connector_new(trust_authority_connector *
 	*connector = (trust_authority_connector *)calloc(1, sizeof(trust_authority_connector));
 	if (NULL == *connector)
 	{
-		return STATUS_ALLOCATION_ERROR;
+		return STATUS_ALLOCATION_ERROR;
+	}
+	(*connector)->retries = (retry_config *)calloc(1, sizeof(retry_config));
+	if (NULL == (*connector)->retries)
+	{
+		status = STATUS_ALLOCATION_ERROR;
+		goto ERROR;
+	}
+
+	strncpy((*connector)->api_key, api_key, API_KEY_MAX_LEN);
+	strncpy((*connector)->api_url, api_url, API_URL_MAX_LEN);
+
+	// Connectors for the same api_url resume each other's TLS sessions and reuse DNS results
+	curl_status = http_pool_new(&(*connector)->pool, DEFAULT_HTTP_POOL_SIZE, (*connector)->api_url);
+	if (CURLE_OK != curl_status)
+	{
+		goto ERROR;
+	}
+	(*connector)->pool->compression = COMPRESSION_ACCEPT_ENCODING;
+
+	// Connectors using the same api_key are paced by the same rate limiter
+	curl_status = http_limiter_acquire(&(*connector)->pool->limiter, (*connector)->api_key);
+	if (CURLE_OK != curl_status)
+	{
+		goto ERROR;
+	}
+
+	if (retry_max != 0)
+	{
+		(*connector)->retries->retry_max = retry_max;
+	}
+	if (retry_wait_time != 0)
+	{
+		(*connector)->retries->retry_wait_time = retry_wait_time;
+	}
+	(*connector)->retries->retry_jitter = 1;
+	(*connector)->retries->retry_after = 1;
+
+	return STATUS_OK;
+
+ERROR:
+	if (CURLE_OK != curl_status)
+	{
+		status = (CURLE_OUT_OF_MEMORY == curl_status) ? STATUS_ALLOCATION_ERROR : STATUS_INTERNAL_ERROR;
+	}
+	// Releases whatever part of the pool, share and limiter was set up
+	connector_free(*connector);
+	*connector = NULL;
+	return status;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_retry_policy(trust_authority_connector *connector,
+		const retry_config *policy)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->retries || NULL == connector->pool || NULL == policy)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (policy->retry_max < 0 || policy->retry_wait_time < 0 ||
+			policy->retry_base_delay_ms < 0 || policy->retry_max_delay_ms < 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	// Requests running on other threads copy the policy under the same lock
+	pthread_mutex_lock(&connector->pool->lock);
+	*connector->retries = *policy;
+	pthread_mutex_unlock(&connector->pool->lock);
+
+	return STATUS_OK;
+}
+
+void connector_retry_policy(trust_authority_connector *connector,
+		retry_config *policy)
+{
+	memset(policy, 0, sizeof(*policy));
+	if (NULL == connector->retries)
+	{
+		return;
+	}
+
+	if (NULL == connector->pool)
+	{
+		*policy = *connector->retries;
+		return;
+	}
+
+	pthread_mutex_lock(&connector->pool->lock);
+	*policy = *connector->retries;
+	pthread_mutex_unlock(&connector->pool->lock);
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_max_response_size(trust_authority_connector *connector,
+		size_t max_response_size)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool || 0 == max_response_size)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&connector->pool->lock);
+	connector->pool->max_response_size = max_response_size;
+	pthread_mutex_unlock(&connector->pool->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_response_headers(trust_authority_connector *connector,
+		const char **names,
+		int count)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool || count < 0 || count > MAX_KEPT_HEADERS || (count > 0 && NULL == names))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (NULL == names[i] || '\0' == names[i][0] || strlen(names[i]) > MAX_HEADER_NAME_LEN)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	// Responses being received read the selection under the same lock
+	pthread_mutex_lock(&connector->pool->lock);
+	for (int i = 0; i < count; i++)
+	{
+		size_t len = strlen(names[i]);
+		for (size_t j = 0; j <= len; j++)
+		{
+			connector->pool->keep_headers[i][j] = tolower((unsigned char)names[i][j]);
+		}
+	}
+	connector->pool->keep_count = count;
+	pthread_mutex_unlock(&connector->pool->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_transport(trust_authority_connector *connector,
+		const transport_adapter *transport)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool || (NULL != transport && NULL == transport->perform))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&connector->pool->lock);
+	connector->pool->transport = transport;
+	pthread_mutex_unlock(&connector->pool->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_unix_socket(trust_authority_connector *connector,
+		const char *path)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool || (NULL != path && (strnlen(path, UNIX_SOCKET_PATH_MAX_LEN + 1) > UNIX_SOCKET_PATH_MAX_LEN)))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&connector->pool->lock);
+	if (NULL == path)
+	{
+		connector->pool->unix_socket[0] = '\0';
+	}
+	else
+	{
+		strncpy(connector->pool->unix_socket, path, UNIX_SOCKET_PATH_MAX_LEN);
+		connector->pool->unix_socket[UNIX_SOCKET_PATH_MAX_LEN] = '\0';
+	}
+	pthread_mutex_unlock(&connector->pool->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_compression(trust_authority_connector *connector,
+		int flags)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool || 0 != (flags & ~(COMPRESSION_GZIP_REQUEST | COMPRESSION_ACCEPT_ENCODING)))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&connector->pool->lock);
+	connector->pool->compression = flags;
+	pthread_mutex_unlock(&connector->pool->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_hedging(trust_authority_connector *connector,
+		int delay_ms,
+		const char *api_url)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool || delay_ms < 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL != api_url && (strnlen(api_url, API_URL_MAX_LEN + 1) > API_URL_MAX_LEN || 0 != is_valid_url(api_url)))
+	{
+		return STATUS_INVALID_API_URL;
+	}
+
+	pthread_mutex_lock(&connector->pool->lock);
+	memset(&connector->hedging, 0, sizeof(connector->hedging));
+	connector->hedging.delay_ms = delay_ms;
+	if (NULL != api_url)
+	{
+		strncpy(connector->hedging.api_url, api_url, API_URL_MAX_LEN);
+	}
+	pthread_mutex_unlock(&connector->pool->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_preconnect(trust_authority_connector *connector,
+		int enabled)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&connector->pool->lock);
+	connector->pool->preconnect = (0 != enabled);
+	pthread_mutex_unlock(&connector->pool->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_warmup(trust_authority_connector *connector,
+		int connections,
+		int timeout_ms)
+{
+	endpoint_stats endpoints[MAX_ENDPOINTS];
+	const char *urls[MAX_ENDPOINTS] = {0};
+	int url_count = 0;
+
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool || connections < 0 || connections > DEFAULT_HTTP_POOL_SIZE || timeout_ms < 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL != http_pool_transport(connector->pool))
+	{
+		return STATUS_OK;
+	}
+
+	url_count = http_endpoints_get_stats(&connector->pool->endpoints, endpoints);
+	for (int i = 0; i < url_count; i++)
+	{
+		urls[i] = endpoints[i].api_url;
+	}
+	if (0 == url_count)
+	{
+		urls[url_count++] = connector->api_url;
+	}
+
+	if (0 == http_pool_warmup(connector->pool, urls, url_count, (0 != connections) ? connections : DEFAULT_WARMUP_CONNECTIONS,
+				trust_authority_deadline(timeout_ms)))
+	{
+		ERROR("Error: Failed to open any connection to %s\n", urls[0]);
+		return STATUS_WARMUP_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_endpoints(trust_authority_connector *connector,
+		const char **api_urls,
+		int count)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == connector->pool || count < 0 || count > MAX_ENDPOINTS || (count > 0 && NULL == api_urls))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (NULL == api_urls[i] || strnlen(api_urls[i], API_URL_MAX_LEN + 1) > API_URL_MAX_LEN || 0 != is_valid_url(api_urls[i]))
+		{
+			return STATUS_INVALID_API_URL;
+		}
+	}
+
+	http_endpoints_set(&connector->pool->endpoints, api_urls, count);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_get_endpoint_stats(trust_authority_connector *connector,
+		endpoint_stats *stats,
+		int *count)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == stats || NULL == count)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	*count = (NULL != connector->pool) ? http_endpoints_get_stats(&connector->pool->endpoints, stats) : 0;
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_circuit_breaker(trust_authority_connector *connector,
+		const circuit_breaker_config *config)
+{
+	http_breaker *breaker = NULL;
+
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	breaker = http_pool_breaker(connector->pool);
+	if (NULL == breaker || NULL == config)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (config->failure_threshold < 0 || config->error_rate_percent < 0 || config->error_rate_percent > 100 ||
+			config->min_requests < 0 || config->window_ms < 0 || config->open_ms < 0 || config->half_open_probes < 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	http_pool_configure_breakers(connector->pool, config);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_get_circuit_state(trust_authority_connector *connector,
+		circuit_state *state)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == state)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	*state = http_pool_circuit_state(connector->pool);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_rate_limit(trust_authority_connector *connector,
+		const rate_limit_config *config)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == config || NULL == connector->pool || NULL == connector->pool->limiter)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (config->requests_per_second < 0 || config->burst < 0 || config->max_queue_ms < 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	http_limiter_configure(connector->pool->limiter, config);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_get_rate_limit_stats(trust_authority_connector *connector,
+		rate_limit_stats *stats)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == stats)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	http_limiter_get_stats((NULL != connector->pool) ? connector->pool->limiter : NULL, stats);
+
+	return STATUS_OK;
+}
+
+// Lock the nonce pool of a connector against being replaced, for reading while it is used
+static void nonce_pool_lock(trust_authority_connector *connector,
+		int write)
+{
+	if (NULL != connector->pool)
+	{
+		if (write)
+		{
+			pthread_rwlock_wrlock(&connector->pool->nonce_pool_lock);
+		}
+		else
+		{
+			pthread_rwlock_rdlock(&connector->pool->nonce_pool_lock);
+		}
+	}
+}
+
+static void nonce_pool_unlock(trust_authority_connector *connector)
+{
+	if (NULL != connector->pool)
+	{
+		pthread_rwlock_unlock(&connector->pool->nonce_pool_lock);
+	}
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_set_nonce_pool(trust_authority_connector *connector,
+		const nonce_pool_config *config)
+{
+	TRUST_AUTHORITY_STATUS result = STATUS_OK;
+	nonce_pool_config settings = {0};
+	nonce_pool *replacement = NULL;
+	nonce_pool *previous = NULL;
+
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL != config)
+	{
+		settings = *config;
+		if (settings.size < 0 || settings.size > MAX_NONCE_POOL_SIZE || settings.max_age_ms < 0 || settings.min_remaining_ms < 0)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+		settings.max_age_ms = (0 != settings.max_age_ms) ? settings.max_age_ms : DEFAULT_NONCE_MAX_AGE_MS;
+		settings.min_remaining_ms = (0 != settings.min_remaining_ms) ? settings.min_remaining_ms : DEFAULT_NONCE_MIN_REMAINING_MS;
+		// A nonce must be usable for a while after it was fetched
+		if (settings.min_remaining_ms >= settings.max_age_ms)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	if (settings.size > 0)
+	{
+		result = nonce_pool_new(&replacement, connector, &settings);
+		if (STATUS_OK != result)
+		{
+			return result;
+		}
+	}
+
+	// Once the lock is held for writing no thread uses the old pool, nor can find it afterwards
+	nonce_pool_lock(connector, 1);
+	previous = connector->nonce_pool;
+	connector->nonce_pool = replacement;
+	nonce_pool_unlock(connector);
+	nonce_pool_free(previous);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_take_nonce(trust_authority_connector *connector,
+		nonce *nonce)
+{
+	TRUST_AUTHORITY_STATUS result = STATUS_OK;
+
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == nonce)
+	{
+		return STATUS_NULL_NONCE;
+	}
+
+	nonce_pool_lock(connector, 0);
+	result = (NULL != connector->nonce_pool) ? nonce_pool_take(connector->nonce_pool, nonce) : STATUS_NONCE_POOL_EMPTY_ERROR;
+	nonce_pool_unlock(connector);
+
+	return result;
+}
+
+TRUST_AUTHORITY_STATUS trust_authority_connector_get_nonce_pool_stats(trust_authority_connector *connector,
+		nonce_pool_stats *stats)
+{
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == stats)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	nonce_pool_lock(connector, 0);
+	if (NULL != connector->nonce_pool)
+	{
+		nonce_pool_get_stats(connector->nonce_pool, stats);
+	}
+	nonce_pool_unlock(connector);
+
+	return STATUS_OK;
+}
+
+long long trust_authority_deadline(int timeout_ms)
+{
+	return (timeout_ms > 0) ? http_now_ms() + timeout_ms : 0;
+}
+
+int trust_authority_deadline_expired(long long deadline)
+{
+	return (0 != deadline && http_now_ms() >= deadline);
+}
+
+// Picks the base url of a request, the connector's api_url unless it has endpoints
+static int connector_pick_endpoint(trust_authority_connector *connector,
+		char *base)
+{
+	int endpoint = (NULL != connector->pool) ? http_endpoints_pick(&connector->pool->endpoints, 0, base) : -1;
+
+	if (endpoint < 0)
+	{
+		strncpy(base, connector->api_url, API_URL_MAX_LEN);
+		base[API_URL_MAX_LEN] = '\0';
+	}
+
+	return endpoint;
+}
+
+/**
+ * Moves a failed request on to the next best endpoint which was not tried yet.
+ * Requests which failed for reasons another endpoint would not change are not failed over.
+ * @return 1 if the request is to be sent again to base
+ */
+static int connector_fail_over(trust_authority_connector *connector,
+		int *endpoint,
+		unsigned int *tried,
+		char *base,
+		CURLcode status,
+		long long deadline)
+{
+	char next[API_URL_MAX_LEN + 1] = {0};
+	int picked = -1;
+
+	if (*endpoint < 0 || CURLE_AGAIN == status || trust_authority_deadline_expired(deadline) ||
+			!http_endpoints_failing(&connector->pool->endpoints, *endpoint))
+	{
+		return 0;
 	}
-	(*connector)->retries = (retry_config *)calloc(1, sizeof(retry_config));
-	if (NULL == (*connector)->retries)
+
+	*tried |= 1u << *endpoint;
+	picked = http_endpoints_pick(&connector->pool->endpoints, *tried, next);
+	if (picked < 0)
 	{
-		return STATUS_ALLOCATION_ERROR;
+		return 0;
 	}
 
-	strncpy((*connector)->api_key, api_key, API_KEY_MAX_LEN);
-	strncpy((*connector)->api_url, api_url, API_URL_MAX_LEN);
+	ERROR("Error: Request to %s failed, failing over to %s", base, next);
+	*endpoint = picked;
+	memcpy(base, next, sizeof(next));
 
-	if (retry_max != 0)
-	{
-		(*connector)->retries->retry_max = retry_max;
-	}
-	if (retry_wait_time != 0)
+	return 1;
+}
+
+int connector_preconnect(trust_authority_connector *connector,
+		long long deadline)
+{
+	char base[API_URL_MAX_LEN + 1] = {0};
+
+	if (NULL == connector || NULL == connector->pool || NULL != http_pool_transport(connector->pool))
 	{
-		(*connector)->retries->retry_wait_time = retry_wait_time;
+		return 0;
 	}
 
-	return STATUS_OK;
+	// Only a guess, get_token picks again with the outcome of the requests made meanwhile
+	connector_pick_endpoint(connector, base);
+
+	return http_preconnect_start(connector->pool, base, (0 != deadline) ? deadline : http_now_ms() + PRECONNECT_TIMEOUT_MS);
 }
 
 TRUST_AUTHORITY_STATUS get_nonce(trust_authority_connector *connector,
@@ -98,8 +740,12 @@ TRUST_AUTHORITY_STATUS get_nonce(trust_authority_connector *connector,
 {
 	int result = STATUS_OK;
 	char *json = NULL;
-	char *headers = NULL;
+	response_headers headers = {0};
 	char url[API_URL_MAX_LEN + 1] = {0};
+	char base[API_URL_MAX_LEN + 1] = {0};
+	int endpoint = -1;
+	unsigned int tried = 0;
+	retry_config retries = {0};
 	CURLcode status = CURLE_OK;
 
 	if (NULL == connector)
@@ -111,14 +757,39 @@ TRUST_AUTHORITY_STATUS get_nonce(trust_authority_connector *connector,
 	{
 		return STATUS_NULL_NONCE;
 	}
+	connector_retry_policy(connector, &retries);
+	endpoint = connector_pick_endpoint(connector, base);
+
+	do
+	{
+		free(json);
+		json = NULL;
+		response_headers_free(&headers);
 
-	strncat(url, connector->api_url, API_URL_MAX_LEN);
-	strncat(url, "/appraisal/v1/nonce", API_URL_MAX_LEN);
-	DEBUG("Nonce url: %s\n", url);
+		url[0] = '\0';
+		strncat(url, base, API_URL_MAX_LEN);
+		strncat(url, "/appraisal/v1/nonce", API_URL_MAX_LEN - strlen(url));
+		DEBUG("Nonce url: %s\n", url);
 
-	//Get nonce from Intel Trust Authority
-	status = get_request(url, connector->api_key, ACCEPT_APPLICATION_JSON, 
-			args->request_id, NULL, &json ,&headers, connector->retries);
+		//Get nonce from Intel Trust Authority
+		status = get_request(url, connector->api_key, ACCEPT_APPLICATION_JSON,
+				args->request_id, NULL, &json, (NULL != resp_headers) ? &headers : NULL, &retries, connector->pool, args->deadline);
+	} while ((CURLE_OK != status || NULL == json) && connector_fail_over(connector, &endpoint, &tried, base, status, args->deadline));
+	if (CURLE_OPERATION_TIMEDOUT == status && 0 != args->deadline)
+	{
+		ERROR("Error: GET request to %s ran out of time", url);
+		return STATUS_DEADLINE_EXCEEDED_ERROR;
+	}
+	if (CURLE_AGAIN == status)
+	{
+		ERROR("Error: GET request to %s was rate limited", url);
+		return STATUS_RATE_LIMITED_ERROR;
+	}
+	if (HTTP_CIRCUIT_OPEN == status)
+	{
+		ERROR("Error: GET request to %s failed fast, the circuit is open", url);
+		return STATUS_CIRCUIT_OPEN_ERROR;
+	}
 	if (NULL == json || CURLE_OK != status)
 	{
 		ERROR("Error: GET request to %s failed", url);
@@ -130,49 +801,31 @@ TRUST_AUTHORITY_STATUS get_nonce(trust_authority_connector *connector,
 	if (STATUS_OK != result)
 	{
 		ERROR("Error: Unmarshalling Nonce - %d\n", result);
-		return result;
+		goto ERROR;
 	}
 
-	//Fetch all the headers recieved.
-	size_t size = strlen(headers);
-	resp_headers->headers = (char *)calloc(size + 1, sizeof(char));
-	if (NULL == resp_headers->headers)
+	//Hand over the headers recieved, they are owned by the caller from here on.
+	if (NULL != resp_headers)
 	{
-		return STATUS_ALLOCATION_ERROR;
+		*resp_headers = headers;
+		memset(&headers, 0, sizeof(headers));
 	}
-	memcpy(resp_headers->headers, headers, size);
 
+ERROR:
 	if (json)
 	{
 		free(json);
 		json = NULL;
 	}
+	response_headers_free(&headers);
 
 	return result;
 }
 
-TRUST_AUTHORITY_STATUS get_token(trust_authority_connector *connector,
-		response_headers *resp_headers,
-		token *token,
-		get_token_args *args,
-		char *attestation_endpoint)
+// Validates the token request and fills the appraisal request referencing the evidence of args.
+static TRUST_AUTHORITY_STATUS token_appraisal_request(get_token_args *args,
+		appraisal_request *request)
 {
-	int result = STATUS_OK;
-	appraisal_request request = {0};
-	char *json = NULL;
-	char url[API_URL_MAX_LEN + 1] = {0};
-	char *response = NULL;
-	char *headers = NULL;
-	CURLcode status = CURLE_OK;
-
-	if (NULL == connector)
-	{
-		return STATUS_NULL_CONNECTOR;
-	}
-	if (NULL == token)
-	{
-		return STATUS_NULL_TOKEN;
-	}
 	if (NULL == args)
 	{
 		return STATUS_NULL_ARGS;
@@ -198,31 +851,203 @@ TRUST_AUTHORITY_STATUS get_token(trust_authority_connector *connector,
 		return STATUS_NULL_NONCE;
 	}
 
-	strncat(url, connector->api_url, API_URL_MAX_LEN);
-	strncat(url, attestation_endpoint, API_URL_MAX_LEN);
-	DEBUG("Token url: %s\n", url);
-	
-	request.quote_len = args->evidence->evidence_len;
-	request.quote = args->evidence->evidence;
-	request.verifier_nonce = args->nonce;
-	request.runtime_data_len = args->evidence->runtime_data_len;
-	request.runtime_data = args->evidence->runtime_data;
-	request.user_data_len = args->evidence->user_data_len;
-	request.user_data = args->evidence->user_data;
-	request.policy_ids = args->policies;
-	request.event_log_len = args->evidence->event_log_len;
-	request.event_log = args->evidence->event_log;
-	request.token_signing_alg = args->token_signing_alg;
-	//Marshal the request in JSON form to be sent to Intel Trust Authority
-	result = json_marshal_appraisal_request(&request, &json);
+	request->quote_len = args->evidence->evidence_len;
+	request->quote = args->evidence->evidence;
+	request->verifier_nonce = args->nonce;
+	request->runtime_data_len = args->evidence->runtime_data_len;
+	request->runtime_data = args->evidence->runtime_data;
+	request->user_data_len = args->evidence->user_data_len;
+	request->user_data = args->evidence->user_data;
+	request->policy_ids = args->policies;
+	request->event_log_len = args->evidence->event_log_len;
+	request->event_log = args->evidence->event_log;
+	request->token_signing_alg = args->token_signing_alg;
+
+	return STATUS_OK;
+}
+
+/**
+ * Lays out the appraisal request as a body streamed while it is uploaded. The quote and event log
+ * are base64 encoded straight from args->evidence, only the small fields are marshalled up front.
+ * @param args args required to get token, must stay valid until the request is done
+ * @param fields marshalled small fields referenced by stream, to be freed by the caller
+ * @param stream body to be sent
+ * @return return status
+ */
+static TRUST_AUTHORITY_STATUS stream_token_request(get_token_args *args,
+		char **fields,
+		http_body_stream *stream)
+{
+	int result = STATUS_OK;
+	appraisal_request request = {0};
+	static const char quote_start[] = "{\"quote\":\"";
+	static const char event_log_start[] = "\"event_log\":\"";
+	static const char string_end[] = "\",";
+
+	result = token_appraisal_request(args, &request);
+	if (STATUS_OK != result)
+	{
+		return result;
+	}
+
+	result = json_marshal_appraisal_request_fields(&request, fields);
 	if (STATUS_OK != result)
 	{
 		ERROR("Error: Failed to marshal appraisal request\n");
-		goto ERROR;
+		return result;
+	}
+
+	// The marshalled fields always hold the nonce, they are appended without their opening brace
+	memset(stream, 0, sizeof(*stream));
+	http_body_stream_add(stream, quote_start, strlen(quote_start), 0);
+	http_body_stream_add(stream, request.quote, request.quote_len, 1);
+	http_body_stream_add(stream, string_end, strlen(string_end), 0);
+	if (request.event_log_len > 0)
+	{
+		http_body_stream_add(stream, event_log_start, strlen(event_log_start), 0);
+		http_body_stream_add(stream, request.event_log, request.event_log_len, 1);
+		http_body_stream_add(stream, string_end, strlen(string_end), 0);
+	}
+	http_body_stream_add(stream, *fields + 1, strlen(*fields + 1), 0);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS marshal_token_request(get_token_args *args,
+		char **json)
+{
+	int result = STATUS_OK;
+	char *fields = NULL;
+	http_body_stream stream;
+
+	// The quote and event log are base64 encoded once, straight into the body
+	result = stream_token_request(args, &fields, &stream);
+	if (STATUS_OK != result)
+	{
+		return result;
+	}
+
+	*json = http_body_stream_dump(&stream);
+	free(fields);
+	if (NULL == *json)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+	DEBUG("Appraisal Request: %s", *json);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS token_request_marshal(trust_authority_connector *connector,
+		get_token_args *args,
+		token_request *request)
+{
+	int result = STATUS_OK;
+
+	memset(request, 0, sizeof(*request));
+
+	//Marshal the request in JSON form to be sent to Intel Trust Authority. Unless it is
+	//gzipped, the evidence is encoded while the body is uploaded instead of being copied.
+	request->gzip = http_pool_compression(connector->pool) & COMPRESSION_GZIP_REQUEST;
+	result = request->gzip ? marshal_token_request(args, &request->json) : stream_token_request(args, &request->json, &request->stream);
+	if (STATUS_OK != result)
+	{
+		token_request_free(request);
+	}
+
+	return result;
+}
+
+void token_request_free(token_request *request)
+{
+	if (NULL != request)
+	{
+		free(request->json);
+		request->json = NULL;
+	}
+}
+
+TRUST_AUTHORITY_STATUS token_request_send(trust_authority_connector *connector,
+		response_headers *resp_headers,
+		token *token,
+		get_token_args *args,
+		token_request *request,
+		const char *attestation_endpoint)
+{
+	int result = STATUS_OK;
+	char url[API_URL_MAX_LEN + 1] = {0};
+	char base[API_URL_MAX_LEN + 1] = {0};
+	int endpoint = -1;
+	unsigned int tried = 0;
+	char hedge_url[API_URL_MAX_LEN + 1] = {0};
+	hedge_config hedging = {0};
+	http_hedge hedge = {hedge_url, 0};
+	retry_config retries = {0};
+	char *response = NULL;
+	response_headers headers = {0};
+	CURLcode status = CURLE_OK;
+
+	// Settings which may be changed by other threads while the request runs are copied
+	connector_retry_policy(connector, &retries);
+	if (NULL != connector->pool)
+	{
+		pthread_mutex_lock(&connector->pool->lock);
+		hedging = connector->hedging;
+		pthread_mutex_unlock(&connector->pool->lock);
 	}
+	hedge.delay_ms = hedging.delay_ms;
 
-	//Get token from Intel Trust Authority
-	status = post_request(url, connector->api_key, ACCEPT_APPLICATION_JSON, args->request_id, CONTENT_TYPE_APPLICATION_JSON, json, &response, &headers, connector->retries);
+	endpoint = connector_pick_endpoint(connector, base);
+	do
+	{
+		free(response);
+		response = NULL;
+		response_headers_free(&headers);
+
+		url[0] = '\0';
+		strncat(url, base, API_URL_MAX_LEN);
+		strncat(url, attestation_endpoint, API_URL_MAX_LEN - strlen(url));
+		DEBUG("Token url: %s\n", url);
+
+		if (hedge.delay_ms > 0)
+		{
+			hedge_url[0] = '\0';
+			strncat(hedge_url, ('\0' != hedging.api_url[0]) ? hedging.api_url : base, API_URL_MAX_LEN);
+			strncat(hedge_url, attestation_endpoint, API_URL_MAX_LEN - strlen(hedge_url));
+		}
+
+		//Get token from Intel Trust Authority
+		if (request->gzip)
+		{
+			status = post_request(url, connector->api_key, ACCEPT_APPLICATION_JSON, args->request_id, CONTENT_TYPE_APPLICATION_JSON, request->json, &response,
+					(NULL != resp_headers) ? &headers : NULL, &retries, connector->pool, args->deadline,
+					(hedge.delay_ms > 0) ? &hedge : NULL);
+		}
+		else
+		{
+			status = post_request_stream(url, connector->api_key, ACCEPT_APPLICATION_JSON, args->request_id, CONTENT_TYPE_APPLICATION_JSON, &request->stream,
+					&response, (NULL != resp_headers) ? &headers : NULL, &retries, connector->pool, args->deadline,
+					(hedge.delay_ms > 0) ? &hedge : NULL);
+		}
+	} while ((CURLE_OK != status || NULL == response) && connector_fail_over(connector, &endpoint, &tried, base, status, args->deadline));
+	if (CURLE_OPERATION_TIMEDOUT == status && 0 != args->deadline)
+	{
+		ERROR("Error: POST request to %s ran out of time", url);
+		result = STATUS_DEADLINE_EXCEEDED_ERROR;
+		goto ERROR;
+	}
+	if (CURLE_AGAIN == status)
+	{
+		ERROR("Error: POST request to %s was rate limited", url);
+		result = STATUS_RATE_LIMITED_ERROR;
+		goto ERROR;
+	}
+	if (HTTP_CIRCUIT_OPEN == status)
+	{
+		ERROR("Error: POST request to %s failed fast, the circuit is open", url);
+		result = STATUS_CIRCUIT_OPEN_ERROR;
+		goto ERROR;
+	}
 	if (NULL == response || CURLE_OK != status)
 	{
 		ERROR("Error: POST request to %s failed", url);
@@ -238,71 +1063,195 @@ TRUST_AUTHORITY_STATUS get_token(trust_authority_connector *connector,
 		goto ERROR;
 	}
 
-	//Fetch all the headers
-	size_t size = strlen(headers);
-	resp_headers->headers = (char *)calloc(size + 1, sizeof(char));
-	if (NULL == resp_headers->headers)
+	//Hand over the headers recieved, they are owned by the caller from here on.
+	if (NULL != resp_headers)
 	{
-		return STATUS_ALLOCATION_ERROR;
+		*resp_headers = headers;
+		memset(&headers, 0, sizeof(headers));
 	}
-	memcpy(resp_headers->headers, headers, size);
 
 ERROR:
 
-	if (json)
+	if (response)
 	{
-		free(json);
-		json = NULL;
+		free(response);
+		response = NULL;
+	}
+	response_headers_free(&headers);
+	return result;
+}
+
+TRUST_AUTHORITY_STATUS get_token(trust_authority_connector *connector,
+		response_headers *resp_headers,
+		token *token,
+		get_token_args *args,
+		char *attestation_endpoint)
+{
+	int result = STATUS_OK;
+	token_request request = {0};
+
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+	if (NULL == token)
+	{
+		return STATUS_NULL_TOKEN;
+	}
+
+	result = token_request_marshal(connector, args, &request);
+	if (STATUS_OK != result)
+	{
+		return result;
 	}
+
+	result = token_request_send(connector, resp_headers, token, args, &request, attestation_endpoint);
+	token_request_free(&request);
+
 	return result;
 }
 
-// This method detects malformed URLs
+// Length of the run of characters at s accepted by pred
+static size_t span(const char *s,
+		int (*pred)(int))
+{
+	size_t n = 0;
+
+	while ('\0' != s[n] && pred((unsigned char)s[n]))
+	{
+		n++;
+	}
+
+	return n;
+}
+
+static int is_host_char(int c)
+{
+	return isalnum(c) || '.' == c || '-' == c;
+}
+
+static int is_port_char(int c)
+{
+	return isdigit(c);
+}
+
+static int is_loopback_char(int c)
+{
+	return isdigit(c) || '.' == c;
+}
+
+static int is_path_char(int c)
+{
+	return !isspace(c) && !iscntrl(c) && '%' != c && '\\' != c;
+}
+
+// This method detects malformed URLs. Plain http is only accepted for local hops, e.g. an egress sidecar.
+// It is a hand-written scanner rather than a regex, so it allocates nothing and is safe to call concurrently.
 int is_valid_url(const char *url)
 {
-	int ret;
-	regex_t regex;
-	ret = regcomp(&regex, "^(https)://[a-zA-Z0-9.-]+(:[0-9]+)?(/[^\\s%]*)*$", REG_EXTENDED);
-	if (ret)
+	const char *p = url;
+	size_t n = 0;
+
+	if (NULL == p)
+	{
+		goto INVALID;
+	}
+
+	// scheme and host: https://[a-zA-Z0-9.-]+ or http://(localhost|127\.[0-9.]+|\[::1\])
+	if (0 == strncmp(p, "https://", 8))
 	{
-		ERROR("Error: Could not compile regex\n");
-		return ret;
+		p += 8;
+		n = span(p, is_host_char);
+		if (0 == n)
+		{
+			goto INVALID;
+		}
+		p += n;
+	}
+	else if (0 == strncmp(p, "http://", 7))
+	{
+		p += 7;
+		if (0 == strncmp(p, "localhost", 9))
+		{
+			p += 9;
+		}
+		else if (0 == strncmp(p, "[::1]", 5))
+		{
+			p += 5;
+		}
+		else if (0 == strncmp(p, "127.", 4))
+		{
+			p += 4;
+			n = span(p, is_loopback_char);
+			if (0 == n)
+			{
+				goto INVALID;
+			}
+			p += n;
+		}
+		else
+		{
+			goto INVALID;
+		}
 	}
-	ret = regexec(&regex, url, 0, NULL, 0);
-	regfree(&regex);
-	if (ret)
+	else
 	{
-		ERROR("Error: Invalid URL\n");
-		return ret;
+		goto INVALID;
 	}
 
-	return ret;
+	// optional port
+	if (':' == *p)
+	{
+		p++;
+		n = span(p, is_port_char);
+		if (0 == n)
+		{
+			goto INVALID;
+		}
+		p += n;
+	}
+
+	// optional path without whitespace or escapes
+	if ('/' == *p)
+	{
+		p += span(p, is_path_char);
+	}
+
+	if ('\0' == *p)
+	{
+		return 0;
+	}
+
+INVALID:
+	ERROR("Error: Invalid URL\n");
+	return 1;
 }
 
+// Checks the 8-4-4-4-12 hex digit UUID format without a regex
 int is_valid_uuid(const char *uuid_str)
 {
-	// Regular expression pattern for UUID format
-	const char *pattern = "^[0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{12}$";
-
-	regex_t regex;
-	int ret;
+	if (NULL == uuid_str)
+	{
+		return 1;
+	}
 
-	ret = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
-	if (ret)
+	for (int i = 0; i < UUID_STRING_LEN; i++)
 	{
-		ERROR("Error: Could not compile regex.\n");
-		return ret;
+		int dash = (8 == i || 13 == i || 18 == i || 23 == i);
+		if (dash ? ('-' != uuid_str[i]) : !isxdigit((unsigned char)uuid_str[i]))
+		{
+			ERROR("Error: Malformed UUID, expected %s at position %d\n", dash ? "'-'" : "a hex digit", i);
+			return 1;
+		}
 	}
 
-	ret = regexec(&regex, uuid_str, 0, NULL, 0);
-	regfree(&regex);
-	if (ret)
+	if ('\0' != uuid_str[UUID_STRING_LEN])
 	{
-		ERROR("Error: Regex match failed or No match found.\n");
-		return ret;
+		ERROR("Error: Malformed UUID, longer than %d characters\n", UUID_STRING_LEN);
+		return 1;
 	}
 
-	return ret;
+	return 0;
 }
 TRUST_AUTHORITY_STATUS is_valid_token_sigining_alg(const char *input)
 {
@@ -316,28 +1265,31 @@ TRUST_AUTHORITY_STATUS is_valid_token_sigining_alg(const char *input)
 	return STATUS_OK;
 }
 
-// Validate format of api_key
+// Validate format of api_key: base64, standard or url safe alphabet, with at most two padding characters
+// at its end. The key is scanned in place instead of being decoded into a buffer.
 TRUST_AUTHORITY_STATUS is_valid_api_key(const char *api_key)
 {
-	size_t base64_input_length = 0, output_length = 0;
-	unsigned char *buf = NULL;
+	size_t len = 0;
+	size_t padding = 0;
 
-	base64_input_length = strlen(api_key);
-	output_length = (base64_input_length / 4) * 3; // Estimate the output length
-	buf = (unsigned char *)calloc(output_length + 1, sizeof(unsigned char));
-	if (NULL == buf)
+	for (; '\0' != api_key[len]; len++)
 	{
-		return STATUS_ALLOCATION_ERROR;
+		unsigned char c = (unsigned char)api_key[len];
+
+		if ('=' == c)
+		{
+			padding++;
+		}
+		else if (padding > 0 || !(isalnum(c) || '+' == c || '/' == c || '-' == c || '_' == c))
+		{
+			return STATUS_INVALID_API_KEY;
+		}
 	}
-	if (BASE64_SUCCESS != base64_decode(api_key, base64_input_length, buf, &output_length))
+
+	if (0 != len % 4 || padding > 2)
 	{
-		free(buf);
-		buf = NULL;
 		return STATUS_INVALID_API_KEY;
 	}
-	// freeing buffer upon success
-	free(buf);
-	buf = NULL;
 
 	return STATUS_OK;
 }
@@ -353,7 +1305,6 @@ TRUST_AUTHORITY_STATUS get_token_signing_certificate(const char *jwks_url,
 		return STATUS_INVALID_PARAMETER;
 	}
 	CURLcode status = CURLE_OK;
-	char *header = NULL;
 	TRUST_AUTHORITY_STATUS ret = STATUS_OK;
 
 	retry_config *retries = NULL;
@@ -371,7 +1322,9 @@ TRUST_AUTHORITY_STATUS get_token_signing_certificate(const char *jwks_url,
 	{
 		retries->retry_wait_time = retry_wait_time;
 	}
-	status = get_request(jwks_url, NULL, ACCEPT_APPLICATION_JSON, NULL, NULL, jwks, &header, retries);
+	retries->retry_jitter = 1;
+	retries->retry_after = 1;
+	status = get_request(jwks_url, NULL, ACCEPT_APPLICATION_JSON, NULL, NULL, jwks, NULL, retries, NULL, 0);
 	if (CURLE_OK != status || *jwks == NULL)
 	{
 		ret = STATUS_GET_SIGNING_CERT_ERROR;
@@ -393,11 +1346,22 @@ TRUST_AUTHORITY_STATUS connector_free(trust_authority_connector *connector)
 {
 	if (NULL != connector)
 	{
+		// The background thread uses the connector, stop it first
+		if (NULL != connector->nonce_pool)
+		{
+			nonce_pool_free(connector->nonce_pool);
+			connector->nonce_pool = NULL;
+		}
 		if (NULL != connector->retries)
 		{
 			free(connector->retries);
 			connector->retries = NULL;
 		}
+		if (NULL != connector->pool)
+		{
+			http_pool_free(connector->pool);
+			connector->pool = NULL;
+		}
 		free(connector);
 		connector = NULL;
 	}
@@ -446,10 +1410,22 @@ TRUST_AUTHORITY_STATUS evidence_free(evidence *evidence)
 {
 	if (NULL != evidence)
 	{
-		if (NULL != evidence->evidence)
+		if (NULL != evidence->evidence && NULL != evidence->release)
+		{
+			evidence->release(evidence->release_ctx, evidence->evidence);
+		}
+		else if (NULL != evidence->evidence)
 		{
 			free(evidence->evidence);
-			evidence->evidence = NULL;
+		}
+		evidence->evidence = NULL;
+		evidence->release = NULL;
+		evidence->release_ctx = NULL;
+
+		if (NULL != evidence->runtime_data)
+		{
+			free(evidence->runtime_data);
+			evidence->runtime_data = NULL;
 		}
 
 		if (NULL != evidence->user_data)
@@ -476,10 +1452,45 @@ TRUST_AUTHORITY_STATUS response_headers_free(response_headers *header)
 			free(header->headers);
 			header->headers = NULL;
 		}
+		// The index is allocated along with the entries
+		if(NULL != header->entries)
+		{
+			free(header->entries);
+			header->entries = NULL;
+		}
+		header->index = NULL;
+		header->count = 0;
+		header->index_size = 0;
 	}
 	return STATUS_OK;
 }
 
+const char *response_headers_get(const response_headers *headers,
+		const char *name)
+{
+	size_t mask = 0;
+	size_t slot = 0;
+
+	if (NULL == headers || NULL == name || 0 == headers->index_size)
+	{
+		return NULL;
+	}
+
+	mask = headers->index_size - 1;
+	slot = http_header_hash(name, strlen(name)) & mask;
+	while (0 != headers->index[slot])
+	{
+		const response_header *entry = &headers->entries[headers->index[slot] - 1];
+		if (0 == strcasecmp(entry->name, name))
+		{
+			return entry->value;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
 TRUST_AUTHORITY_STATUS jwks_free(jwk_set *key_set)
 {
 	if (NULL != key_set)
@@ -601,8 +601,10 @@ TRUST_AUTHORITY_STATUS json_unmarshal_token_signing_cert(jwk_set **key_sets,
  *	},
  *	"runtime_data": ""
  * }
+ * The quote and event log are left out unless with_evidence is set.
  */
-TRUST_AUTHORITY_STATUS json_marshal_appraisal_request(appraisal_request *request,
+static TRUST_AUTHORITY_STATUS marshal_appraisal_request(appraisal_request *request,
+		int with_evidence,
 		char **json)
 {
 	int result = STATUS_OK;
@@ -625,23 +627,26 @@ TRUST_AUTHORITY_STATUS json_marshal_appraisal_request(appraisal_request *request
 
 	jansson_request = json_object();
 	// quote
-	input_length = request->quote_len;
-	output_length = ((input_length + 2) / 3) * 4 + 1;
-	b64 = (char *)calloc(1, output_length * sizeof(char));
-	if (b64 == NULL)
+	if (with_evidence)
 	{
-		return STATUS_ALLOCATION_ERROR;
-	}
-	result = base64_encode(request->quote, input_length, b64, output_length, false);
-	if (BASE64_SUCCESS != result)
-	{
-		status = STATUS_JSON_ENCODING_ERROR;
-		goto ERROR;
-	}
+		input_length = request->quote_len;
+		output_length = ((input_length + 2) / 3) * 4 + 1;
+		b64 = (char *)calloc(1, output_length * sizeof(char));
+		if (b64 == NULL)
+		{
+			return STATUS_ALLOCATION_ERROR;
+		}
+		result = base64_encode(request->quote, input_length, b64, output_length, false);
+		if (BASE64_SUCCESS != result)
+		{
+			status = STATUS_JSON_ENCODING_ERROR;
+			goto ERROR;
+		}
 
-	json_object_set(jansson_request, "quote", json_string(b64));
-	free(b64);
-	b64 = NULL;
+		json_object_set(jansson_request, "quote", json_string(b64));
+		free(b64);
+		b64 = NULL;
+	}
 
 	// signed_nonce
 	result = get_jansson_nonce(request->verifier_nonce, &jansson_nonce);
@@ -700,15 +705,15 @@ TRUST_AUTHORITY_STATUS json_marshal_appraisal_request(appraisal_request *request
 		json_object_set(jansson_request, "token_signing_alg", json_string(request->token_signing_alg));
 	}
 
-	// policy_ids
+	// policy_ids, empty when none are given
 	policies = json_array();
 	json_object_set_new(jansson_request, "policy_ids", policies);
-	for (int i = 0; i < request->policy_ids->count; i++)
+	for (int i = 0; NULL != request->policy_ids && i < request->policy_ids->count; i++)
 	{
 		json_array_append(policies, json_string(request->policy_ids->ids[i]));
 	}
 	// eventlog
-	if (request->event_log_len > 0)
+	if (with_evidence && request->event_log_len > 0)
 	{
 		input_length = request->event_log_len;
 		output_length = ((input_length + 2) / 3) * 4 + 1;
@@ -743,3 +748,15 @@ ERROR:
 
 	return status;
 }
+
+TRUST_AUTHORITY_STATUS json_marshal_appraisal_request(appraisal_request *request,
+		char **json)
+{
+	return marshal_appraisal_request(request, 1, json);
+}
+
+TRUST_AUTHORITY_STATUS json_marshal_appraisal_request_fields(appraisal_request *request,
+		char **json)
+{
+	return marshal_appraisal_request(request, 0, json);
+}
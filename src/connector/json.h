@@ -72,6 +72,16 @@ extern "C"
 	TRUST_AUTHORITY_STATUS json_marshal_appraisal_request(appraisal_request *request,
 			char **json);
 
+	/**
+	 * Performs marshaling of the request sent to Intel Trust Authority without the quote and
+	 * event log, which are streamed into the request body by the caller.
+	 * @param request request to be marshalled
+	 * @param json marshalled fields, to be freed by the caller
+	 * @return int containing status
+	 */
+	TRUST_AUTHORITY_STATUS json_marshal_appraisal_request_fields(appraisal_request *request,
+			char **json);
+
 	/**
 	 * Performs umnmarshalling of token signing certificate
 	 * @param cert  certificate to be unmarshalled from json format to jwks type
@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <connector.h>
+#include <types.h>
+#include <log.h>
+#include "nonce_pool.h"
+#include "rest.h"
+
+// Nonce ready to be handed out.
+typedef struct pooled_nonce
+{
+	nonce nonce;
+	long long expires_at; /* http_now_ms() time the nonce stops being valid */
+} pooled_nonce;
+
+struct nonce_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* wakes the background thread when a nonce is taken or the pool stops */
+	pthread_t thread;
+	trust_authority_connector *connector;
+	nonce_pool_config config; /* defaults applied */
+	pooled_nonce *entries; /* oldest first */
+	int count;
+	int stop;
+	nonce_pool_stats stats;
+};
+
+long long nonce_issued_at_ms(const nonce *nonce)
+{
+	char iat[64] = {0};
+	struct tm tm = {0};
+	time_t issued = 0;
+	int consumed = 0;
+	long long ms = 0;
+
+	if (NULL == nonce || NULL == nonce->iat || 0 == nonce->iat_len || nonce->iat_len >= sizeof(iat))
+	{
+		return -1;
+	}
+	memcpy(iat, nonce->iat, nonce->iat_len);
+
+	// The zone is always UTC and ignored
+	if (6 != sscanf(iat, "%4d-%2d-%2d %2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed))
+	{
+		return -1;
+	}
+	if ('.' == iat[consumed])
+	{
+		for (int i = 1, scale = 100; i <= 3 && iat[consumed + i] >= '0' && iat[consumed + i] <= '9'; i++, scale /= 10)
+		{
+			ms += (iat[consumed + i] - '0') * scale;
+		}
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	issued = timegm(&tm);
+	if ((time_t)-1 == issued)
+	{
+		return -1;
+	}
+
+	return (long long)issued * 1000 + ms;
+}
+
+static long long wall_now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Drops the nonces which do not have enough validity left, the pool must be locked
+static void nonce_pool_drop_stale(nonce_pool *pool,
+		long long now)
+{
+	int stale = 0;
+
+	while (stale < pool->count && pool->entries[stale].expires_at - now < pool->config.min_remaining_ms)
+	{
+		nonce_free(&pool->entries[stale].nonce);
+		stale++;
+	}
+
+	if (stale > 0)
+	{
+		pool->count -= stale;
+		memmove(pool->entries, pool->entries + stale, pool->count * sizeof(pooled_nonce));
+		pool->stats.expired += stale;
+		DEBUG("Dropped %d stale nonces\n", stale);
+	}
+}
+
+// Fetches one nonce and works out when it expires, called without the pool lock
+static TRUST_AUTHORITY_STATUS nonce_pool_fetch(nonce_pool *pool,
+		pooled_nonce *entry)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_OK;
+	get_nonce_args args = {0};
+	long long issued_at = 0;
+	long long age = 0;
+
+	args.deadline = trust_authority_deadline(NONCE_POOL_FETCH_TIMEOUT_MS);
+	memset(entry, 0, sizeof(*entry));
+	status = get_nonce(pool->connector, &entry->nonce, &args, NULL);
+	if (STATUS_OK != status)
+	{
+		return status;
+	}
+
+	// Nonces are valid from their iat on, the time they took to arrive is already used up
+	issued_at = nonce_issued_at_ms(&entry->nonce);
+	if (issued_at > 0)
+	{
+		age = wall_now_ms() - issued_at;
+		age = (age > 0) ? age : 0;
+	}
+	entry->expires_at = http_now_ms() + pool->config.max_age_ms - age;
+
+	return STATUS_OK;
+}
+
+// Sleeps on the pool's condition until wake_at (http_now_ms() time), 0 to sleep until signalled
+static void nonce_pool_wait(nonce_pool *pool,
+		long long wake_at)
+{
+	struct timespec until;
+
+	if (0 == wake_at)
+	{
+		pthread_cond_wait(&pool->cond, &pool->lock);
+		return;
+	}
+
+	until.tv_sec = wake_at / 1000;
+	until.tv_nsec = (wake_at % 1000) * 1000000;
+	pthread_cond_timedwait(&pool->cond, &pool->lock, &until);
+}
+
+static void *nonce_pool_run(void *arg)
+{
+	nonce_pool *pool = (nonce_pool *)arg;
+	long backoff_ms = 0;
+	long long retry_at = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop)
+	{
+		long long now = http_now_ms();
+		long long wake_at = 0;
+		pooled_nonce entry;
+		TRUST_AUTHORITY_STATUS status = STATUS_OK;
+
+		nonce_pool_drop_stale(pool, now);
+
+		if (pool->count < pool->config.size && now >= retry_at)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			status = nonce_pool_fetch(pool, &entry);
+			pthread_mutex_lock(&pool->lock);
+
+			// Fetching again right away would not help when nonces arrive stale, e.g. with a skewed clock
+			if (STATUS_OK == status && entry.expires_at - http_now_ms() < pool->config.min_remaining_ms)
+			{
+				ERROR("Error: Prefetched nonce has less than %dms of validity left\n", pool->config.min_remaining_ms);
+				nonce_free(&entry.nonce);
+				pool->stats.expired++;
+				status = STATUS_NONCE_POOL_EMPTY_ERROR;
+			}
+			if (STATUS_OK != status)
+			{
+				pool->stats.failures++;
+				backoff_ms = (0 == backoff_ms) ? NONCE_POOL_MIN_BACKOFF_MS : backoff_ms * 2;
+				backoff_ms = (backoff_ms < NONCE_POOL_MAX_BACKOFF_MS) ? backoff_ms : NONCE_POOL_MAX_BACKOFF_MS;
+				retry_at = http_now_ms() + backoff_ms;
+				ERROR("Error: Failed to prefetch nonce 0x%04x, retrying in %ldms\n", status, backoff_ms);
+				continue;
+			}
+
+			backoff_ms = 0;
+			pool->stats.fetched++;
+			if (pool->stop || pool->count >= pool->config.size)
+			{
+				nonce_free(&entry.nonce);
+				continue;
+			}
+			pool->entries[pool->count++] = entry;
+			continue;
+		}
+
+		// Sleep until the oldest nonce turns stale, a failed fetch is retried or a nonce is taken
+		if (pool->count > 0)
+		{
+			wake_at = pool->entries[0].expires_at - pool->config.min_remaining_ms;
+		}
+		if (pool->count < pool->config.size && (0 == wake_at || retry_at < wake_at))
+		{
+			wake_at = retry_at;
+		}
+		nonce_pool_wait(pool, (wake_at > 0) ? wake_at : 0);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+TRUST_AUTHORITY_STATUS nonce_pool_new(nonce_pool **pool,
+		trust_authority_connector *connector,
+		const nonce_pool_config *config)
+{
+	nonce_pool *p = NULL;
+	pthread_condattr_t attr;
+
+	if (NULL == pool || NULL == connector || NULL == config || config->size <= 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	p = (nonce_pool *)calloc(1, sizeof(nonce_pool));
+	if (NULL == p)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+	p->entries = (pooled_nonce *)calloc(config->size, sizeof(pooled_nonce));
+	if (NULL == p->entries)
+	{
+		free(p);
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	p->connector = connector;
+	p->config = *config;
+	if (0 == p->config.max_age_ms)
+	{
+		p->config.max_age_ms = DEFAULT_NONCE_MAX_AGE_MS;
+	}
+	if (0 == p->config.min_remaining_ms)
+	{
+		p->config.min_remaining_ms = DEFAULT_NONCE_MIN_REMAINING_MS;
+	}
+
+	// Wake up times are computed with http_now_ms()
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (0 != pthread_create(&p->thread, NULL, nonce_pool_run, p))
+	{
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+		free(p->entries);
+		free(p);
+		return STATUS_INTERNAL_ERROR;
+	}
+
+	*pool = p;
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS nonce_pool_take(nonce_pool *pool,
+		nonce *nonce)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_NONCE_POOL_EMPTY_ERROR;
+
+	pthread_mutex_lock(&pool->lock);
+	nonce_pool_drop_stale(pool, http_now_ms());
+	if (pool->count > 0)
+	{
+		*nonce = pool->entries[0].nonce;
+		pool->count--;
+		memmove(pool->entries, pool->entries + 1, pool->count * sizeof(pooled_nonce));
+		pool->stats.taken++;
+		status = STATUS_OK;
+	}
+	else
+	{
+		pool->stats.misses++;
+	}
+	// Refill right away
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return status;
+}
+
+void nonce_pool_get_stats(nonce_pool *pool,
+		nonce_pool_stats *stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	stats->ready = pool->count;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void nonce_pool_free(nonce_pool *pool)
+{
+	if (NULL == pool)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_join(pool->thread, NULL);
+
+	for (int i = 0; i < pool->count; i++)
+	{
+		nonce_free(&pool->entries[i].nonce);
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->entries);
+	free(pool);
+}
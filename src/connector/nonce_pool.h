@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __NONCE_POOL_H__
+#define __NONCE_POOL_H__
+
+#include <connector.h>
+
+#define NONCE_POOL_FETCH_TIMEOUT_MS 10000 // budget of a background nonce request, bounds how long stopping takes
+#define NONCE_POOL_MIN_BACKOFF_MS 500 // wait after a failed fetch, doubled on every further failure
+#define NONCE_POOL_MAX_BACKOFF_MS 30000
+
+#ifdef __cplusplus
+
+extern "C"
+{
+
+#endif
+
+	typedef struct nonce_pool nonce_pool;
+
+	/**
+	 * Create a nonce pool and start its background thread.
+	 * @param pool pool created
+	 * @param connector connector the nonces are fetched with, must outlive the pool
+	 * @param config pool settings, size must be positive
+	 * @return return status
+	 */
+	TRUST_AUTHORITY_STATUS nonce_pool_new(nonce_pool **pool,
+			trust_authority_connector *connector,
+			const nonce_pool_config *config);
+
+	/**
+	 * Take the oldest nonce which still has enough validity left.
+	 * @param pool pool to take from
+	 * @param nonce nonce handed over to the caller
+	 * @return STATUS_NONCE_POOL_EMPTY_ERROR if no fresh nonce is ready
+	 */
+	TRUST_AUTHORITY_STATUS nonce_pool_take(nonce_pool *pool,
+			nonce *nonce);
+
+	// Copy the statistics of pool
+	void nonce_pool_get_stats(nonce_pool *pool,
+			nonce_pool_stats *stats);
+
+	/**
+	 * Time a nonce was issued at according to its iat, e.g. "2022-08-24 12:36:32.929722075 +0000 UTC".
+	 * @param nonce nonce to look at
+	 * @return milliseconds since the epoch, -1 if the iat cannot be parsed
+	 */
+	long long nonce_issued_at_ms(const nonce *nonce);
+
+	// Stop the background thread and free the pool with the nonces left
+	void nonce_pool_free(nonce_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -3,17 +3,89 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
 #include <curl/curl.h>
+#include <zlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <types.h>
 #include <log.h>
 #include "rest.h"
+#include "base64.h"
 
-#define BUFFER_SIZE (16 * 1024) /* 16 KB */
 #define API_KEY_HEADER "x-api-key: "
 #define USER_AGENT "User-Agent: Intel Trust Authority API Client"
 #define REQUEST_ID_HEADER "request-id: "
+#define CONTENT_ENCODING_HEADER "Content-Encoding: "
+
+// Grows *buf so that it can hold needed bytes. hint is the expected total size, 0 if unknown.
+static int buffer_reserve(char **buf,
+		size_t *size,
+		size_t needed,
+		size_t max,
+		size_t hint)
+{
+	size_t new_size = 0;
+	char *tmp = NULL;
+
+	if (0 == max)
+	{
+		max = DEFAULT_MAX_RESPONSE_SIZE;
+	}
+
+	if (needed > max)
+	{
+		ERROR("Error: Response exceeds maximum size of %zu bytes\n", max);
+		return -1;
+	}
+
+	if (needed <= *size)
+	{
+		return 0;
+	}
+
+	if (hint >= needed && hint <= max)
+	{
+		new_size = hint;
+	}
+	else
+	{
+		new_size = (*size > 0) ? *size * 2 : MIN_RESPONSE_BUFFER_SIZE;
+		if (new_size < needed)
+		{
+			new_size = needed;
+		}
+		if (new_size > max)
+		{
+			new_size = max;
+		}
+	}
+
+	tmp = (char *)realloc(*buf, new_size);
+	if (NULL == tmp)
+	{
+		ERROR("Error: Failed to grow response buffer to %zu bytes\n", new_size);
+		return -1;
+	}
+	*buf = tmp;
+	*size = new_size;
+
+	return 0;
+}
+
+// Releases the unused tail of a buffer before it is handed over to the caller.
+static char *buffer_shrink(char *buf,
+		size_t used)
+{
+	char *tmp = (char *)realloc(buf, used);
+
+	return (NULL != tmp) ? tmp : buf;
+}
 
 size_t write_response(void *ptr,
 		size_t size,
@@ -21,17 +93,124 @@ size_t write_response(void *ptr,
 		void *stream)
 {
 	struct write_result *result = (struct write_result *)stream;
+	size_t len = size * nmemb;
+	curl_off_t content_length = -1;
+	size_t hint = 0;
+
+	if (NULL != result->curl && 0 == result->pos &&
+			CURLE_OK == curl_easy_getinfo(result->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length) &&
+			content_length > 0)
+	{
+		hint = (size_t)content_length + 1;
+	}
 
-	if (result->pos + size * nmemb >= BUFFER_SIZE - 1)
+	if (0 != buffer_reserve(&result->data, &result->size, result->pos + len + 1, result->max, hint))
 	{
-		ERROR("Error: Too small buffer\n");
 		return 0;
 	}
 
-	memcpy(result->data + result->pos, ptr, size * nmemb);
-	result->pos += size * nmemb;
+	memcpy(result->data + result->pos, ptr, len);
+	result->pos += len;
+	result->data[result->pos] = '\0';
 
-	return size * nmemb;
+	return len;
+}
+
+unsigned int http_header_hash(const char *name,
+		size_t len)
+{
+	unsigned int hash = 2166136261u;
+
+	// FNV-1a over the lower case name
+	for (size_t i = 0; i < len; i++)
+	{
+		char c = name[i];
+		if (c >= 'A' && c <= 'Z')
+		{
+			c += 'a' - 'A';
+		}
+		hash = (hash ^ (unsigned char)c) * 16777619u;
+	}
+
+	return hash;
+}
+
+// Checks if a header was selected with trust_authority_connector_set_response_headers.
+static int http_pool_keeps_header(http_pool *pool,
+		const char *name,
+		size_t len)
+{
+	int keep = 0;
+
+	if (NULL == pool)
+	{
+		return 1;
+	}
+
+	// The selection may be changed while responses are received
+	pthread_mutex_lock(&pool->lock);
+	keep = (0 == pool->keep_count);
+	for (int i = 0; i < pool->keep_count && !keep; i++)
+	{
+		keep = (0 == strncasecmp(pool->keep_headers[i], name, len) && '\0' == pool->keep_headers[i][len]);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return keep;
+}
+
+// Reads the headers pacing requests: draft IETF RateLimit-*, the common X-RateLimit-* forms and Retry-After in seconds.
+static void http_read_rate_limit(struct write_headers *result,
+		const char *name,
+		size_t name_len,
+		const char *value,
+		size_t value_len)
+{
+	char number[32] = {0};
+	long long parsed = 0;
+	char *end = NULL;
+
+	if (name_len > 2 && 0 == strncasecmp(name, "x-", 2))
+	{
+		name += 2;
+		name_len -= 2;
+	}
+
+	if (!(name_len == sizeof("ratelimit-remaining") - 1 && 0 == strncasecmp(name, "ratelimit-remaining", name_len)) &&
+			!(name_len == sizeof("ratelimit-reset") - 1 && 0 == strncasecmp(name, "ratelimit-reset", name_len)) &&
+			!(name_len == sizeof("retry-after") - 1 && 0 == strncasecmp(name, "retry-after", name_len)))
+	{
+		return;
+	}
+
+	memcpy(number, value, (value_len < sizeof(number) - 1) ? value_len : sizeof(number) - 1);
+	errno = 0;
+	parsed = strtoll(number, &end, 10);
+	if (end == number || 0 != errno || parsed < 0)
+	{
+		return;
+	}
+
+	if (name_len == sizeof("ratelimit-remaining") - 1)
+	{
+		result->ratelimit_remaining = (parsed > LONG_MAX) ? LONG_MAX : (long)parsed;
+	}
+	else if (name_len == sizeof("retry-after") - 1)
+	{
+		result->retry_after_ms = (parsed > 24 * 3600) ? 24 * 3600 * 1000L : (long)parsed * 1000;
+	}
+	else
+	{
+		// Some servers send the reset as a Unix time instead of seconds from now
+		if (parsed > 1000000000LL)
+		{
+			parsed -= (long long)time(NULL);
+		}
+		if (parsed > 0 && parsed <= 24 * 3600)
+		{
+			result->ratelimit_reset_ms = (long)parsed * 1000;
+		}
+	}
 }
 
 size_t write_response_headers(char *ptr,
@@ -40,17 +219,69 @@ size_t write_response_headers(char *ptr,
 		void *userdata)
 {
 	struct write_headers *result = (struct write_headers *)userdata;
+	size_t len = size * nmemb;
+	const char *colon = NULL;
+	const char *value = NULL;
+	size_t name_len = 0;
+	size_t value_len = 0;
+	char *out = NULL;
+
+	// A status line starts the headers of a new response, e.g. after 100 Continue
+	if (len >= 5 && 0 == strncmp(ptr, "HTTP/", 5))
+	{
+		result->pos = 0;
+		result->count = 0;
+		result->ratelimit_remaining = -1;
+		result->ratelimit_reset_ms = 0;
+		result->retry_after_ms = 0;
+		return len;
+	}
+
+	// The blank line ending the headers and folded lines are skipped
+	colon = (const char *)memchr(ptr, ':', len);
+	if (NULL == colon || colon == ptr || ' ' == ptr[0] || '\t' == ptr[0])
+	{
+		return len;
+	}
+
+	name_len = colon - ptr;
+	value = colon + 1;
+	value_len = len - name_len - 1;
+	while (value_len > 0 && (' ' == *value || '\t' == *value))
+	{
+		value++;
+		value_len--;
+	}
+	while (value_len > 0 && ('\r' == value[value_len - 1] || '\n' == value[value_len - 1] ||
+				' ' == value[value_len - 1] || '\t' == value[value_len - 1]))
+	{
+		value_len--;
+	}
+
+	http_read_rate_limit(result, ptr, name_len, value, value_len);
+	if (result->discard || !http_pool_keeps_header(result->pool, ptr, name_len))
+	{
+		return len;
+	}
 
-	if (result->pos + size * nmemb >= BUFFER_SIZE - 1)
+	if (0 != buffer_reserve(&result->headers, &result->size, result->pos + name_len + value_len + 2, result->max, 0))
 	{
-		ERROR("Error: Too small buffer\n");
 		return 0;
 	}
 
-	memcpy(result->headers + result->pos, ptr, size * nmemb);
-	result->pos += size * nmemb;
+	out = result->headers + result->pos;
+	for (size_t i = 0; i < name_len; i++)
+	{
+		char c = ptr[i];
+		out[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+	}
+	out[name_len] = '\0';
+	memcpy(out + name_len + 1, value, value_len);
+	out[name_len + 1 + value_len] = '\0';
+	result->pos += name_len + value_len + 2;
+	result->count++;
 
-	return nmemb * size;
+	return len;
 }
 
 struct curl_slist *build_headers(struct curl_slist *headers,
@@ -88,182 +319,2602 @@ struct curl_slist *build_headers(struct curl_slist *headers,
 	return headers;
 }
 
-CURLcode make_http_request(const char *url,
-		const char *api_key,
-		const char *accept,
-		const char *request_id,
-		const char *content_type,
-		const char *body,
-		char **response,
-		char **response_headers,
-		retry_config *retries)
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static int global_refs = 0;
+static pthread_once_t implicit_init_once = PTHREAD_ONCE_INIT;
+static CURLcode implicit_init_status = CURLE_OK;
+
+CURLcode http_global_init(void)
 {
-	CURL *curl = NULL;
 	CURLcode status = CURLE_OK;
-	struct curl_slist *req_headers = NULL;
-	char *resp_headers = NULL;
-	char *data = NULL;
-	char *req_type = NULL;
-	long code;
-	int res = 0;
 
-	if (NULL == url)
+	pthread_mutex_lock(&global_lock);
+	if (0 == global_refs)
 	{
-		return CURLE_URL_MALFORMAT;
+		status = curl_global_init(CURL_GLOBAL_ALL);
 	}
-
-	curl_global_init(CURL_GLOBAL_ALL);
-	curl = curl_easy_init();
-	if (!curl)
+	if (CURLE_OK == status)
 	{
-		status = CURLE_OUT_OF_MEMORY;
-		goto ERROR;
+		global_refs++;
 	}
+	pthread_mutex_unlock(&global_lock);
+
+	return status;
+}
 
-	data = (char *)calloc(BUFFER_SIZE, sizeof(char));
-	if (!data)
+void http_global_cleanup(void)
+{
+	pthread_mutex_lock(&global_lock);
+	if (global_refs > 0)
 	{
-		status = CURLE_OUT_OF_MEMORY;
-		goto ERROR;
+		global_refs--;
+		if (0 == global_refs)
+		{
+			curl_global_cleanup();
+		}
 	}
+	pthread_mutex_unlock(&global_lock);
+}
+
+// Applications that never call trust_authority_global_init() take a reference
+// on first use which is held for the lifetime of the process.
+static void implicit_global_init(void)
+{
+	implicit_init_status = http_global_init();
+}
 
-	resp_headers = (char *)calloc(BUFFER_SIZE, sizeof(char));
-	if (!resp_headers)
+static pthread_mutex_t shares_lock = PTHREAD_MUTEX_INITIALIZER;
+static http_share *shares = NULL;
+
+static void share_lock(CURL *handle,
+		curl_lock_data data,
+		curl_lock_access access,
+		void *userptr)
+{
+	http_share *share = (http_share *)userptr;
+
+	if (CURL_LOCK_ACCESS_SHARED == access)
 	{
-		status = CURLE_OUT_OF_MEMORY;
-		goto ERROR;
+		pthread_rwlock_rdlock(&share->locks[data]);
 	}
+	else
+	{
+		pthread_rwlock_wrlock(&share->locks[data]);
+	}
+}
 
-	struct write_result write_result = {
-		.data = data,
-		.pos = 0};
-
-	struct write_headers write_headers = {
-		.headers = resp_headers,
-		.pos = 0};
+static void share_unlock(CURL *handle,
+		curl_lock_data data,
+		void *userptr)
+{
+	http_share *share = (http_share *)userptr;
 
-	curl_easy_setopt(curl, CURLOPT_URL, url);
+	pthread_rwlock_unlock(&share->locks[data]);
+}
 
-	req_headers = build_headers(req_headers, api_key, accept, request_id, content_type);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req_headers);
+static void share_free(http_share *share)
+{
+	if (NULL != share)
+	{
+		if (NULL != share->share)
+		{
+			curl_share_cleanup(share->share);
+			share->share = NULL;
+		}
+		for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		{
+			pthread_rwlock_destroy(&share->locks[i]);
+		}
+		pthread_mutex_destroy(&share->breaker.lock);
+		free(share);
+		share = NULL;
+	}
+}
 
-	if (NULL != body)
+static CURLcode share_new(http_share **share,
+		const char *key)
+{
+	*share = (http_share *)calloc(1, sizeof(http_share));
+	if (NULL == *share)
 	{
-		req_type = "POST";
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)strlen(body));
+		return CURLE_OUT_OF_MEMORY;
 	}
-	else
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
 	{
-		req_type = "GET";
+		pthread_rwlock_init(&(*share)->locks[i], NULL);
 	}
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_result);
+	pthread_mutex_init(&(*share)->breaker.lock, NULL);
+	strncpy((*share)->key, key, API_URL_MAX_LEN);
 
-	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_response_headers);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &write_headers);
+	(*share)->share = curl_share_init();
+	if (NULL == (*share)->share)
+	{
+		share_free(*share);
+		*share = NULL;
+		return CURLE_OUT_OF_MEMORY;
+	}
 
-	int retry_count = 0;
-	status = curl_easy_perform(curl);
-	while (status == 0)
+	curl_share_setopt((*share)->share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt((*share)->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt((*share)->share, CURLSHOPT_USERDATA, *share);
+	curl_share_setopt((*share)->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt((*share)->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	return CURLE_OK;
+}
+
+CURLcode http_share_acquire(http_share **share,
+		const char *key)
+{
+	CURLcode status = CURLE_OK;
+	http_share *entry = NULL;
+
+	if (NULL == share || NULL == key)
+	{
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+	}
+
+	pthread_mutex_lock(&shares_lock);
+	for (entry = shares; NULL != entry; entry = entry->next)
 	{
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-		if (code == 500 || code == 503 || code == 504) 
+		if (0 == strncmp(entry->key, key, API_URL_MAX_LEN))
 		{
-			ERROR("%s %s (status: %ld): retrying in %ds(%d left)", req_type, url, code, retries->retry_wait_time, (retries->retry_max- retry_count));
-			if (retry_count >= retries->retry_max) 
-			{
-				ERROR("Request to %s failed: %s %s giving up after %d attempts:%ld.\n", url, req_type, url, (retries->retry_max + 1), code);
-				goto ERROR;
-			}
+			break;
+		}
+	}
 
-			//TODO: Try to increase sleep time exponentially.
-			const int sleep_secs = retries->retry_wait_time;
-			sleep(sleep_secs);
+	if (NULL == entry)
+	{
+		status = share_new(&entry, key);
+		if (CURLE_OK == status)
+		{
+			entry->next = shares;
+			shares = entry;
 		}
-		else
+	}
+
+	if (CURLE_OK == status)
+	{
+		entry->refs++;
+		*share = entry;
+	}
+	pthread_mutex_unlock(&shares_lock);
+
+	return status;
+}
+
+void http_share_release(http_share *share)
+{
+	http_share **link = NULL;
+
+	if (NULL == share)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&shares_lock);
+	share->refs--;
+	if (share->refs > 0)
+	{
+		share = NULL;
+	}
+	else
+	{
+		for (link = &shares; NULL != *link; link = &(*link)->next)
 		{
-			if (200 != code) 
+			if (*link == share)
 			{
-				ERROR("%s request to '%s' returned code %ld\n", req_type, url, code);
-				goto ERROR;
+				*link = share->next;
+				break;
 			}
-			break;
 		}
+	}
+	pthread_mutex_unlock(&shares_lock);
 
-		status = curl_easy_perform(curl);
-		retry_count++;
+	share_free(share);
+}
+
+CURLcode http_pool_new(http_pool **pool,
+		size_t capacity,
+		const char *share_key)
+{
+	CURLcode status = CURLE_OK;
+
+	if (NULL == pool)
+	{
+		return CURLE_BAD_FUNCTION_ARGUMENT;
 	}
 
-	if (0 != status)
+	*pool = (http_pool *)calloc(1, sizeof(http_pool));
+	if (NULL == *pool)
 	{
-		ERROR("%s request to %s returned %s", req_type, url, curl_easy_strerror(status));
-		goto ERROR;
+		return CURLE_OUT_OF_MEMORY;
 	}
 
-	*response = (char *)calloc(strlen(data) + 1, sizeof(char));
-	if (NULL == *response)
+	(*pool)->handles = (CURL **)calloc(capacity, sizeof(CURL *));
+	(*pool)->multis = (CURLM **)calloc(capacity, sizeof(CURLM *));
+	if (capacity > 0 && (NULL == (*pool)->handles || NULL == (*pool)->multis))
 	{
-		status = CURLE_OUT_OF_MEMORY;
-		goto ERROR;
+		free((*pool)->handles);
+		free((*pool)->multis);
+		free(*pool);
+		*pool = NULL;
+		return CURLE_OUT_OF_MEMORY;
+	}
+	(*pool)->capacity = capacity;
+	(*pool)->max_response_size = DEFAULT_MAX_RESPONSE_SIZE;
+	pthread_mutex_init(&(*pool)->lock, NULL);
+	pthread_mutex_init(&(*pool)->endpoints.lock, NULL);
+	pthread_cond_init(&(*pool)->preconnects_done, NULL);
+	pthread_rwlock_init(&(*pool)->nonce_pool_lock, NULL);
+	for (int i = 0; i < MAX_ENDPOINTS; i++)
+	{
+		pthread_mutex_init(&(*pool)->endpoints.list[i].breaker.lock, NULL);
 	}
-	memcpy(*response, data, strlen(data));
 
-	*response_headers = (char *)calloc(strlen(resp_headers) + 1, sizeof(char));
-	if (NULL == *response_headers)
+	if (NULL != share_key)
 	{
-		status = CURLE_OUT_OF_MEMORY;
-		goto ERROR;
+		status = http_share_acquire(&(*pool)->share, share_key);
+		if (CURLE_OK != status)
+		{
+			http_pool_free(*pool);
+			*pool = NULL;
+			return status;
+		}
 	}
-	memcpy(*response_headers, resp_headers, strlen(resp_headers));
 
-	curl_easy_cleanup(curl);
-	curl_slist_free_all(req_headers);
-	curl_global_cleanup();
+	return CURLE_OK;
+}
 
-	return status;
+CURL *http_pool_acquire(http_pool *pool)
+{
+	CURL *curl = NULL;
 
-ERROR:
-	if (data)
+	pthread_mutex_lock(&pool->lock);
+	if (pool->count > 0)
 	{
-		free(data);
-		data = NULL;
+		curl = pool->handles[--pool->count];
+		pool->handles[pool->count] = NULL;
 	}
-	if (*response_headers)
+	pthread_mutex_unlock(&pool->lock);
+
+	// Pooled handles keep the share object through curl_easy_reset(), only new ones are attached
+	if (NULL == curl)
 	{
-		free(*response_headers);
-		*response_headers = NULL;
+		curl = curl_easy_init();
+		if (NULL != curl && NULL != pool->share)
+		{
+			curl_easy_setopt(curl, CURLOPT_SHARE, pool->share->share);
+		}
 	}
-	if (*response)
+
+	return curl;
+}
+
+void http_pool_release(http_pool *pool,
+		CURL *curl)
+{
+	if (NULL == curl)
 	{
-		free(*response);
-		*response = NULL;
+		return;
 	}
 
-	return status;
+	// Drops all options set by the previous request, the connection cache is kept.
+	curl_easy_reset(curl);
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->count < pool->capacity)
+	{
+		pool->handles[pool->count++] = curl;
+		curl = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (NULL != curl)
+	{
+		curl_easy_cleanup(curl);
+	}
 }
 
-CURLcode get_request(const char *url,
-		const char *api_key,
-		const char *accept,
-		const char *request_id,
-		const char *content_type,
-		char **response,
-		char **response_headers,
-		retry_config *retries)
+// Connections opened ahead of requests on one pooled handle
+typedef struct http_warmup
+{
+	http_pool *pool;
+	CURL *curl;
+	const char **urls;
+	int url_count;
+	long long deadline;
+	int warmed; /* urls a connection was opened to, or found alive */
+	int started; /* thread is running */
+	pthread_t thread;
+} http_warmup;
+
+// Connection opened on a detached thread ahead of a request
+typedef struct http_preconnect
+{
+	http_warmup warmup;
+	char url[API_URL_MAX_LEN + 1];
+	const char *urls[1];
+} http_preconnect;
+
+static size_t http_warmup_discard(char *ptr,
+		size_t size,
+		size_t nmemb,
+		void *userdata)
 {
-	return make_http_request(url, api_key, accept, request_id, content_type, NULL, response, response_headers, retries);
+	return size * nmemb;
 }
 
-CURLcode post_request(const char *url,
-		const char *api_key,
-		const char *accept,
-		const char *request_id,
-		const char *content_type,
-		const char *body,
-		char **response,
-		char **response_headers,
-		retry_config *retries)
+// Aborts a warm up request once the pool is being freed
+static int http_warmup_progress(void *clientp,
+		curl_off_t dltotal,
+		curl_off_t dlnow,
+		curl_off_t ultotal,
+		curl_off_t ulnow)
+{
+	http_pool *pool = (http_pool *)clientp;
+	int closing = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	closing = pool->closing;
+	pthread_mutex_unlock(&pool->lock);
+
+	return closing;
+}
+
+// Sends a HEAD request to each url, the connections are left in the handle's cache
+static void *http_warmup_run(void *arg)
 {
-	return make_http_request(url, api_key, accept, request_id, content_type, body, response, response_headers, retries);
+	http_warmup *warmup = (http_warmup *)arg;
+	long long queue_until = http_now_ms() + http_limiter_max_queue_ms(warmup->pool->limiter);
+	long long not_after = (0 != warmup->deadline && warmup->deadline < queue_until) ? warmup->deadline : queue_until;
+	char unix_socket[UNIX_SOCKET_PATH_MAX_LEN + 1];
+
+	curl_easy_setopt(warmup->curl, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(warmup->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(warmup->curl, CURLOPT_WRITEFUNCTION, http_warmup_discard);
+	curl_easy_setopt(warmup->curl, CURLOPT_XFERINFOFUNCTION, http_warmup_progress);
+	curl_easy_setopt(warmup->curl, CURLOPT_XFERINFODATA, warmup->pool);
+	curl_easy_setopt(warmup->curl, CURLOPT_NOPROGRESS, 0L);
+	http_pool_unix_socket(warmup->pool, unix_socket);
+	if ('\0' != unix_socket[0])
+	{
+		curl_easy_setopt(warmup->curl, CURLOPT_UNIX_SOCKET_PATH, unix_socket);
+	}
+
+	for (int i = 0; i < warmup->url_count; i++)
+	{
+		http_breaker *breaker = http_pool_url_breaker(warmup->pool, warmup->urls[i]);
+		CURLcode status = http_apply_deadline(warmup->curl, warmup->deadline);
+		struct write_headers headers = {0}; /* the headers of a HEAD response are not read */
+		long code = 0;
+
+		if (CURLE_OK != status)
+		{
+			break;
+		}
+		// The HEAD request is a request like any other to the server
+		if (CURLE_OK != http_limiter_wait(warmup->pool->limiter, not_after))
+		{
+			DEBUG("Warming up connection to %s skipped, rate limited\n", warmup->urls[i]);
+			break;
+		}
+		if (!http_breaker_allow(breaker))
+		{
+			DEBUG("Warming up connection to %s skipped, the circuit is open\n", warmup->urls[i]);
+			continue;
+		}
+		curl_easy_setopt(warmup->curl, CURLOPT_URL, warmup->urls[i]);
+		// Any response leaves a warm connection behind
+		status = curl_easy_perform(warmup->curl);
+		if (CURLE_OK == status)
+		{
+			curl_easy_getinfo(warmup->curl, CURLINFO_RESPONSE_CODE, &code);
+		}
+		// A request aborted by the pool going away tells nothing about the endpoint
+		http_breaker_record(breaker, (CURLE_ABORTED_BY_CALLBACK == status) ? -1 : http_breaker_outcome(status, code));
+		headers.ratelimit_remaining = -1;
+		http_limiter_record(warmup->pool->limiter, code, http_retry_after_ms(warmup->curl), &headers);
+		if (CURLE_OK != status)
+		{
+			DEBUG("Warming up connection to %s failed: %s\n", warmup->urls[i], curl_easy_strerror(status));
+			continue;
+		}
+		warmup->warmed++;
+	}
+
+	return NULL;
+}
+
+static int http_warmup_start(http_warmup *warmup,
+		http_pool *pool,
+		const char **urls,
+		int url_count,
+		long long deadline)
+{
+	memset(warmup, 0, sizeof(*warmup));
+	warmup->pool = pool;
+	warmup->urls = urls;
+	warmup->url_count = url_count;
+	warmup->deadline = deadline;
+	warmup->curl = http_pool_acquire(pool);
+	if (NULL == warmup->curl)
+	{
+		return 0;
+	}
+	warmup->started = (0 == pthread_create(&warmup->thread, NULL, http_warmup_run, warmup));
+
+	return 1;
+}
+
+// Waits for a warm up to end and hands its handle back to the pool
+static void http_warmup_finish(http_warmup *warmup)
+{
+	if (NULL == warmup->curl)
+	{
+		return;
+	}
+
+	if (warmup->started)
+	{
+		pthread_join(warmup->thread, NULL);
+	}
+	else
+	{
+		http_warmup_run(warmup);
+	}
+	http_pool_release(warmup->pool, warmup->curl);
+	warmup->curl = NULL;
+}
+
+int http_pool_warmup(http_pool *pool,
+		const char **urls,
+		int url_count,
+		int count,
+		long long deadline)
+{
+	http_warmup *warmups = NULL;
+	int warmed = 0;
+
+	if (NULL == pool || NULL != http_pool_transport(pool) || NULL == urls || url_count <= 0 || count <= 0)
+	{
+		return 0;
+	}
+
+	if (CURLE_OK != http_ensure_global_init())
+	{
+		return 0;
+	}
+
+	// Handles beyond the capacity would not be kept
+	count = ((size_t)count < pool->capacity) ? count : (int)pool->capacity;
+	warmups = (http_warmup *)calloc(count, sizeof(http_warmup));
+	if (NULL == warmups)
+	{
+		return 0;
+	}
+
+	// All handles are taken before any is returned, so that each one opens its own connections
+	for (int i = 0; i < count; i++)
+	{
+		http_warmup_start(&warmups[i], pool, urls, url_count, deadline);
+	}
+	for (int i = 0; i < count; i++)
+	{
+		http_warmup_finish(&warmups[i]);
+		warmed += warmups[i].warmed;
+	}
+	free(warmups);
+
+	return warmed;
+}
+
+// Takes a preconnect off the pool's count, the pool may be freed right after
+static void http_preconnect_end(http_preconnect *preconnect)
+{
+	http_pool *pool = preconnect->warmup.pool;
+
+	if (NULL != preconnect->warmup.curl)
+	{
+		http_pool_release(pool, preconnect->warmup.curl);
+	}
+	free(preconnect);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->preconnects--;
+	pthread_cond_broadcast(&pool->preconnects_done);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *http_preconnect_run(void *arg)
+{
+	http_preconnect *preconnect = (http_preconnect *)arg;
+
+	http_warmup_run(&preconnect->warmup);
+	http_preconnect_end(preconnect);
+
+	return NULL;
+}
+
+int http_preconnect_start(http_pool *pool,
+		const char *url,
+		long long deadline)
+{
+	http_preconnect *preconnect = NULL;
+	pthread_attr_t attr;
+	int started = 0;
+
+	if (NULL == pool || NULL != http_pool_transport(pool) || NULL == url)
+	{
+		return 0;
+	}
+
+	if (CURLE_OK != http_ensure_global_init())
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	started = (pool->preconnect && !pool->closing);
+	if (started)
+	{
+		pool->preconnects++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (!started)
+	{
+		return 0;
+	}
+
+	preconnect = (http_preconnect *)calloc(1, sizeof(http_preconnect));
+	if (NULL == preconnect)
+	{
+		pthread_mutex_lock(&pool->lock);
+		pool->preconnects--;
+		pthread_cond_broadcast(&pool->preconnects_done);
+		pthread_mutex_unlock(&pool->lock);
+		return 0;
+	}
+	strncpy(preconnect->url, url, API_URL_MAX_LEN);
+	preconnect->urls[0] = preconnect->url;
+	preconnect->warmup.pool = pool;
+	preconnect->warmup.urls = preconnect->urls;
+	preconnect->warmup.url_count = 1;
+	preconnect->warmup.deadline = deadline;
+	preconnect->warmup.curl = http_pool_acquire(pool);
+
+	// Nobody waits for the thread, without one the connection is left to the request
+	started = (NULL != preconnect->warmup.curl && 0 == pthread_attr_init(&attr));
+	if (started)
+	{
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		started = (0 == pthread_create(&preconnect->warmup.thread, &attr, http_preconnect_run, preconnect));
+		pthread_attr_destroy(&attr);
+	}
+	if (!started)
+	{
+		http_preconnect_end(preconnect);
+		return 0;
+	}
+
+	return 1;
+}
+
+CURLM *http_pool_acquire_multi(http_pool *pool)
+{
+	CURLM *multi = NULL;
+
+	if (NULL != pool)
+	{
+		pthread_mutex_lock(&pool->lock);
+		if (pool->multi_count > 0)
+		{
+			multi = pool->multis[--pool->multi_count];
+			pool->multis[pool->multi_count] = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return (NULL != multi) ? multi : curl_multi_init();
+}
+
+void http_pool_release_multi(http_pool *pool,
+		CURLM *multi)
+{
+	if (NULL == multi)
+	{
+		return;
+	}
+
+	if (NULL != pool)
+	{
+		pthread_mutex_lock(&pool->lock);
+		if (pool->multi_count < pool->capacity)
+		{
+			pool->multis[pool->multi_count++] = multi;
+			multi = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (NULL != multi)
+	{
+		curl_multi_cleanup(multi);
+	}
+}
+
+void http_pool_free(http_pool *pool)
+{
+	if (NULL != pool)
+	{
+		// Preconnect threads use the pool until they end, they abort their request once closing is set
+		pthread_mutex_lock(&pool->lock);
+		pool->closing = 1;
+		while (pool->preconnects > 0)
+		{
+			pthread_cond_wait(&pool->preconnects_done, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		for (size_t i = 0; i < pool->count; i++)
+		{
+			curl_easy_cleanup(pool->handles[i]);
+			pool->handles[i] = NULL;
+		}
+		free(pool->handles);
+		pool->handles = NULL;
+		for (size_t i = 0; i < pool->multi_count; i++)
+		{
+			curl_multi_cleanup(pool->multis[i]);
+			pool->multis[i] = NULL;
+		}
+		free(pool->multis);
+		pool->multis = NULL;
+		// Handles using the share object must be gone before it can be released
+		if (NULL != pool->share)
+		{
+			http_share_release(pool->share);
+			pool->share = NULL;
+		}
+		if (NULL != pool->limiter)
+		{
+			http_limiter_release(pool->limiter);
+			pool->limiter = NULL;
+		}
+		pthread_mutex_destroy(&pool->lock);
+		pthread_mutex_destroy(&pool->endpoints.lock);
+		pthread_cond_destroy(&pool->preconnects_done);
+		pthread_rwlock_destroy(&pool->nonce_pool_lock);
+		for (int i = 0; i < MAX_ENDPOINTS; i++)
+		{
+			pthread_mutex_destroy(&pool->endpoints.list[i].breaker.lock);
+		}
+		free(pool);
+		pool = NULL;
+	}
+}
+
+int http_pool_compression(http_pool *pool)
+{
+	int compression = 0;
+
+	if (NULL != pool)
+	{
+		pthread_mutex_lock(&pool->lock);
+		compression = pool->compression;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return compression;
+}
+
+void http_pool_gzip_rejected(http_pool *pool)
+{
+	if (NULL != pool)
+	{
+		pthread_mutex_lock(&pool->lock);
+		pool->compression &= ~COMPRESSION_GZIP_REQUEST;
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+CURLcode http_gzip_body(http_pool *pool,
+		const char *body,
+		char **gzip_body,
+		size_t *gzip_len)
+{
+	z_stream stream = {0};
+	size_t len = 0;
+	size_t bound = 0;
+	char *buf = NULL;
+
+	*gzip_body = NULL;
+	*gzip_len = 0;
+
+	if (NULL == body || !(http_pool_compression(pool) & COMPRESSION_GZIP_REQUEST))
+	{
+		return CURLE_OK;
+	}
+
+	len = strlen(body);
+	if (len < MIN_GZIP_BODY_SIZE)
+	{
+		return CURLE_OK;
+	}
+
+	// 16 added to the window bits selects the gzip wrapper
+	if (Z_OK != deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY))
+	{
+		return CURLE_OUT_OF_MEMORY;
+	}
+
+	bound = deflateBound(&stream, len);
+	buf = (char *)malloc(bound);
+	if (NULL == buf)
+	{
+		deflateEnd(&stream);
+		return CURLE_OUT_OF_MEMORY;
+	}
+
+	stream.next_in = (Bytef *)body;
+	stream.avail_in = (uInt)len;
+	stream.next_out = (Bytef *)buf;
+	stream.avail_out = (uInt)bound;
+	if (Z_STREAM_END != deflate(&stream, Z_FINISH) || stream.total_out >= len)
+	{
+		// Not compressible, send the body as it is
+		deflateEnd(&stream);
+		free(buf);
+		return CURLE_OK;
+	}
+
+	*gzip_len = stream.total_out;
+	*gzip_body = buf;
+	deflateEnd(&stream);
+	DEBUG("Request body gzipped from %zu to %zu bytes\n", len, *gzip_len);
+
+	return CURLE_OK;
+}
+
+CURLcode http_body_stream_add(http_body_stream *stream,
+		const void *data,
+		size_t len,
+		int base64)
+{
+	if (stream->count >= HTTP_BODY_MAX_PARTS)
+	{
+		return CURLE_OUT_OF_MEMORY;
+	}
+
+	stream->parts[stream->count].data = (const unsigned char *)data;
+	stream->parts[stream->count].len = len;
+	stream->parts[stream->count].base64 = base64;
+	stream->count++;
+
+	return CURLE_OK;
+}
+
+size_t http_body_stream_length(const http_body_stream *stream)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < stream->count; i++)
+	{
+		len += stream->parts[i].base64 ? ((stream->parts[i].len + 2) / 3) * 4 : stream->parts[i].len;
+	}
+
+	return len;
+}
+
+char *http_body_stream_dump(const http_body_stream *stream)
+{
+	http_body_reader reader;
+	size_t len = http_body_stream_length(stream);
+	char *body = (char *)malloc(len + 1);
+
+	if (NULL == body)
+	{
+		return NULL;
+	}
+
+	http_body_reader_init(&reader, stream);
+	body[http_body_read(body, 1, len, &reader)] = '\0';
+
+	return body;
+}
+
+void http_body_reader_init(http_body_reader *reader,
+		const http_body_stream *stream)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->stream = stream;
+}
+
+size_t http_body_read(char *buffer,
+		size_t size,
+		size_t nitems,
+		void *userdata)
+{
+	http_body_reader *reader = (http_body_reader *)userdata;
+	size_t avail = size * nitems;
+	size_t written = 0;
+	// Room for a single group and base64_encode()'s terminator
+	char group[5];
+
+	while (written < avail)
+	{
+		const http_body_part *part = NULL;
+		size_t left = 0;
+		size_t n = 0;
+
+		// Flush characters of a group which did not fit last time
+		if (reader->pending_pos < reader->pending_len)
+		{
+			n = reader->pending_len - reader->pending_pos;
+			n = (n < avail - written) ? n : avail - written;
+			memcpy(buffer + written, reader->pending + reader->pending_pos, n);
+			reader->pending_pos += n;
+			written += n;
+			continue;
+		}
+
+		if (reader->part >= reader->stream->count)
+		{
+			break;
+		}
+
+		part = &reader->stream->parts[reader->part];
+		left = part->len - reader->offset;
+		if (0 == left)
+		{
+			reader->part++;
+			reader->offset = 0;
+			continue;
+		}
+
+		if (!part->base64)
+		{
+			n = (left < avail - written) ? left : avail - written;
+			memcpy(buffer + written, part->data + reader->offset, n);
+			reader->offset += n;
+			written += n;
+			continue;
+		}
+
+		// Whole groups are encoded straight into the buffer, keeping one byte for the terminator
+		n = (avail - written > 4) ? ((avail - written - 1) / 4) * 3 : 0;
+		n = (n < (left / 3) * 3) ? n : (left / 3) * 3;
+		if (n > 0)
+		{
+			base64_encode(part->data + reader->offset, n, buffer + written, (n / 3) * 4 + 1, false);
+			reader->offset += n;
+			written += (n / 3) * 4;
+			continue;
+		}
+
+		// The final partial group, or a buffer too small for a group, goes through pending
+		n = (left < 3) ? left : 3;
+		base64_encode(part->data + reader->offset, n, group, sizeof(group), false);
+		memcpy(reader->pending, group, 4);
+		reader->pending_len = 4;
+		reader->pending_pos = 0;
+		reader->offset += n;
+	}
+
+	return written;
+}
+
+// Transfers are rewound when libcurl resends the body, e.g. on a reused connection that was closed
+static int http_body_seek(void *userdata,
+		curl_off_t offset,
+		int origin)
+{
+	http_body_reader *reader = (http_body_reader *)userdata;
+
+	if (SEEK_SET != origin || 0 != offset)
+	{
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	http_body_reader_init(reader, reader->stream);
+
+	return CURL_SEEKFUNC_OK;
+}
+
+void http_request_set_stream(CURL *curl,
+		http_body_reader *reader,
+		const http_body_stream *stream)
+{
+	http_body_reader_init(reader, stream);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, http_body_read);
+	curl_easy_setopt(curl, CURLOPT_READDATA, reader);
+	curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, http_body_seek);
+	curl_easy_setopt(curl, CURLOPT_SEEKDATA, reader);
+	// The length is known up front, the body goes out with Content-Length rather than chunked
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)http_body_stream_length(stream));
+}
+
+http_breaker *http_pool_breaker(http_pool *pool)
+{
+	return (NULL != pool && NULL != pool->share) ? &pool->share->breaker : NULL;
+}
+
+const transport_adapter *http_pool_transport(http_pool *pool)
+{
+	const transport_adapter *transport = NULL;
+
+	if (NULL != pool)
+	{
+		pthread_mutex_lock(&pool->lock);
+		transport = pool->transport;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return transport;
+}
+
+size_t http_pool_max_response_size(http_pool *pool)
+{
+	size_t max = DEFAULT_MAX_RESPONSE_SIZE;
+
+	if (NULL != pool)
+	{
+		pthread_mutex_lock(&pool->lock);
+		max = pool->max_response_size;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return max;
+}
+
+void http_pool_unix_socket(http_pool *pool,
+		char *path)
+{
+	path[0] = '\0';
+	if (NULL != pool)
+	{
+		pthread_mutex_lock(&pool->lock);
+		memcpy(path, pool->unix_socket, sizeof(pool->unix_socket));
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+http_limiter *http_pool_limiter(http_pool *pool)
+{
+	return (NULL != pool) ? pool->limiter : NULL;
+}
+
+http_endpoints *http_pool_endpoints(http_pool *pool)
+{
+	return (NULL != pool) ? &pool->endpoints : NULL;
+}
+
+static int breaker_enabled(const circuit_breaker_config *config)
+{
+	return (config->failure_threshold > 0 || config->error_rate_percent > 0);
+}
+
+static long breaker_open_ms(const circuit_breaker_config *config)
+{
+	return (config->open_ms > 0) ? config->open_ms : DEFAULT_CIRCUIT_OPEN_MS;
+}
+
+// Must be called with the breaker locked.
+static void breaker_set_state(http_breaker *breaker,
+		circuit_state state,
+		long long now)
+{
+	breaker->state = state;
+	breaker->changed_at = now;
+	breaker->probes = 0;
+	breaker->consecutive_failures = 0;
+	breaker->window_requests = 0;
+	breaker->window_failures = 0;
+	breaker->window_start = now;
+}
+
+void http_breaker_configure(http_breaker *breaker,
+		const circuit_breaker_config *config)
+{
+	pthread_mutex_lock(&breaker->lock);
+	breaker->config = *config;
+	// Failures counted before it was disabled must not open the circuit once it is enabled again
+	if (!breaker_enabled(config))
+	{
+		breaker_set_state(breaker, CIRCUIT_CLOSED, http_now_ms());
+	}
+	pthread_mutex_unlock(&breaker->lock);
+}
+
+// Close a breaker again, keeping its settings.
+static void breaker_reset(http_breaker *breaker)
+{
+	pthread_mutex_lock(&breaker->lock);
+	breaker_set_state(breaker, CIRCUIT_CLOSED, http_now_ms());
+	pthread_mutex_unlock(&breaker->lock);
+}
+
+int http_breaker_allow(http_breaker *breaker)
+{
+	int allowed = 1;
+
+	if (NULL == breaker)
+	{
+		return 1;
+	}
+
+	pthread_mutex_lock(&breaker->lock);
+	if (breaker_enabled(&breaker->config) && CIRCUIT_CLOSED != breaker->state)
+	{
+		long long now = http_now_ms();
+		long open_ms = breaker_open_ms(&breaker->config);
+		int max_probes = (breaker->config.half_open_probes > 0) ? breaker->config.half_open_probes : 1;
+
+		// Also hands out new probes when the previous ones never reported back
+		if (now - breaker->changed_at >= open_ms)
+		{
+			breaker_set_state(breaker, CIRCUIT_HALF_OPEN, now);
+		}
+
+		allowed = (CIRCUIT_HALF_OPEN == breaker->state && breaker->probes < max_probes);
+		if (allowed)
+		{
+			breaker->probes++;
+		}
+	}
+	pthread_mutex_unlock(&breaker->lock);
+
+	return allowed;
+}
+
+void http_breaker_record(http_breaker *breaker,
+		int failed)
+{
+	long long now = 0;
+	long window_ms = 0;
+
+	if (NULL == breaker)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&breaker->lock);
+	if (!breaker_enabled(&breaker->config))
+	{
+		goto UNLOCK;
+	}
+
+	if (failed < 0)
+	{
+		if (CIRCUIT_HALF_OPEN == breaker->state && breaker->probes > 0)
+		{
+			breaker->probes--;
+		}
+		goto UNLOCK;
+	}
+
+	now = http_now_ms();
+	if (CIRCUIT_HALF_OPEN == breaker->state)
+	{
+		// A single probe decides
+		breaker_set_state(breaker, failed ? CIRCUIT_OPEN : CIRCUIT_CLOSED, now);
+		goto UNLOCK;
+	}
+
+	// Outcomes of attempts started before the circuit opened do not count
+	if (CIRCUIT_OPEN == breaker->state)
+	{
+		goto UNLOCK;
+	}
+
+	window_ms = (breaker->config.window_ms > 0) ? breaker->config.window_ms : DEFAULT_CIRCUIT_WINDOW_MS;
+	if (now - breaker->window_start >= window_ms)
+	{
+		breaker->window_start = now;
+		breaker->window_requests = 0;
+		breaker->window_failures = 0;
+	}
+
+	breaker->window_requests++;
+	if (failed)
+	{
+		breaker->window_failures++;
+		breaker->consecutive_failures++;
+	}
+	else
+	{
+		breaker->consecutive_failures = 0;
+	}
+
+	if ((breaker->config.failure_threshold > 0 && breaker->consecutive_failures >= breaker->config.failure_threshold) ||
+			(breaker->config.error_rate_percent > 0 && breaker->window_requests >= breaker->config.min_requests &&
+			 breaker->window_failures * 100 >= breaker->config.error_rate_percent * breaker->window_requests))
+	{
+		ERROR("Circuit opened after %d failures in %d attempts\n", breaker->window_failures, breaker->window_requests);
+		breaker_set_state(breaker, CIRCUIT_OPEN, now);
+	}
+
+UNLOCK:
+	pthread_mutex_unlock(&breaker->lock);
+}
+
+int http_breaker_outcome(CURLcode result,
+		long code)
+{
+	if (CURLE_OK == result && HTTP_TOO_MANY_REQUESTS == code)
+	{
+		return -1;
+	}
+
+	return (CURLE_OK != result || code >= 500);
+}
+
+circuit_state http_breaker_state(http_breaker *breaker)
+{
+	circuit_state state = CIRCUIT_CLOSED;
+
+	if (NULL == breaker)
+	{
+		return CIRCUIT_CLOSED;
+	}
+
+	pthread_mutex_lock(&breaker->lock);
+	if (breaker_enabled(&breaker->config))
+	{
+		state = breaker->state;
+		// The next request will be let through as a probe
+		if (CIRCUIT_OPEN == state && http_now_ms() - breaker->changed_at >= breaker_open_ms(&breaker->config))
+		{
+			state = CIRCUIT_HALF_OPEN;
+		}
+	}
+	pthread_mutex_unlock(&breaker->lock);
+
+	return state;
+}
+
+// Whether url is base, or base followed by a path
+static int http_url_under(const char *url,
+		const char *base,
+		size_t base_len)
+{
+	return 0 == strncmp(url, base, base_len) && ('\0' == url[base_len] || '/' == url[base_len]);
+}
+
+http_breaker *http_pool_url_breaker(http_pool *pool,
+		const char *url)
+{
+	http_breaker *breaker = NULL;
+
+	if (NULL == pool || NULL == url)
+	{
+		return http_pool_breaker(pool);
+	}
+
+	// The list never moves, the breaker outlives a change of the endpoints
+	pthread_mutex_lock(&pool->endpoints.lock);
+	for (int i = 0; i < pool->endpoints.count; i++)
+	{
+		http_endpoint *endpoint = &pool->endpoints.list[i];
+
+		if (http_url_under(url, endpoint->url, endpoint->url_len))
+		{
+			breaker = &endpoint->breaker;
+			break;
+		}
+	}
+	// Other hosts, e.g. the one requests are hedged to, have no breaker of their own
+	if (NULL == breaker && 0 == pool->endpoints.count && NULL != pool->share &&
+			http_url_under(url, pool->share->key, strlen(pool->share->key)))
+	{
+		breaker = http_pool_breaker(pool);
+	}
+	pthread_mutex_unlock(&pool->endpoints.lock);
+
+	return breaker;
+}
+
+void http_pool_configure_breakers(http_pool *pool,
+		const circuit_breaker_config *config)
+{
+	if (NULL != pool->share)
+	{
+		http_breaker_configure(&pool->share->breaker, config);
+	}
+	// Unused endpoints are configured too, endpoints set later start with the same settings
+	for (int i = 0; i < MAX_ENDPOINTS; i++)
+	{
+		http_breaker_configure(&pool->endpoints.list[i].breaker, config);
+	}
+}
+
+circuit_state http_pool_circuit_state(http_pool *pool)
+{
+	circuit_state state = CIRCUIT_OPEN;
+
+	if (NULL == pool)
+	{
+		return CIRCUIT_CLOSED;
+	}
+
+	pthread_mutex_lock(&pool->endpoints.lock);
+	if (0 == pool->endpoints.count)
+	{
+		state = http_breaker_state(http_pool_breaker(pool));
+	}
+	for (int i = 0; i < pool->endpoints.count && CIRCUIT_CLOSED != state; i++)
+	{
+		circuit_state endpoint_state = http_breaker_state(&pool->endpoints.list[i].breaker);
+
+		if (CIRCUIT_OPEN != endpoint_state)
+		{
+			state = endpoint_state;
+		}
+	}
+	pthread_mutex_unlock(&pool->endpoints.lock);
+
+	return state;
+}
+
+static pthread_mutex_t limiters_lock = PTHREAD_MUTEX_INITIALIZER;
+static http_limiter *limiters = NULL;
+
+CURLcode http_limiter_acquire(http_limiter **limiter,
+		const char *api_key)
+{
+	http_limiter *entry = NULL;
+
+	if (NULL == limiter || NULL == api_key)
+	{
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+	}
+
+	pthread_mutex_lock(&limiters_lock);
+	for (entry = limiters; NULL != entry; entry = entry->next)
+	{
+		if (0 == strncmp(entry->key, api_key, API_KEY_MAX_LEN))
+		{
+			break;
+		}
+	}
+
+	if (NULL == entry)
+	{
+		entry = (http_limiter *)calloc(1, sizeof(http_limiter));
+		if (NULL == entry)
+		{
+			pthread_mutex_unlock(&limiters_lock);
+			return CURLE_OUT_OF_MEMORY;
+		}
+		pthread_mutex_init(&entry->lock, NULL);
+		strncpy(entry->key, api_key, API_KEY_MAX_LEN);
+		entry->next = limiters;
+		limiters = entry;
+	}
+
+	entry->refs++;
+	*limiter = entry;
+	pthread_mutex_unlock(&limiters_lock);
+
+	return CURLE_OK;
+}
+
+void http_limiter_release(http_limiter *limiter)
+{
+	if (NULL == limiter)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&limiters_lock);
+	limiter->refs--;
+	if (limiter->refs > 0)
+	{
+		limiter = NULL;
+	}
+	else
+	{
+		for (http_limiter **link = &limiters; NULL != *link; link = &(*link)->next)
+		{
+			if (*link == limiter)
+			{
+				*link = limiter->next;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&limiters_lock);
+
+	if (NULL != limiter)
+	{
+		pthread_mutex_destroy(&limiter->lock);
+		free(limiter);
+		limiter = NULL;
+	}
+}
+
+static double limiter_burst(const rate_limit_config *config)
+{
+	return (config->burst > 0) ? config->burst : 1;
+}
+
+void http_limiter_configure(http_limiter *limiter,
+		const rate_limit_config *config)
+{
+	pthread_mutex_lock(&limiter->lock);
+	limiter->config = *config;
+	limiter->rate = config->requests_per_second;
+	limiter->tokens = limiter_burst(config);
+	limiter->refilled_at = http_now_ms();
+	limiter->stats.requests_per_second = limiter->rate;
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+long http_limiter_max_queue_ms(http_limiter *limiter)
+{
+	long max_queue_ms = 0;
+
+	if (NULL != limiter)
+	{
+		pthread_mutex_lock(&limiter->lock);
+		max_queue_ms = limiter->config.max_queue_ms;
+		pthread_mutex_unlock(&limiter->lock);
+	}
+
+	return (max_queue_ms > 0) ? max_queue_ms : DEFAULT_RATE_LIMIT_MAX_QUEUE_MS;
+}
+
+// Must be called with the limiter locked.
+static void limiter_refill(http_limiter *limiter,
+		long long now)
+{
+	if (limiter->rate > 0)
+	{
+		limiter->tokens += (now - limiter->refilled_at) * limiter->rate / 1000.0;
+		if (limiter->tokens > limiter_burst(&limiter->config))
+		{
+			limiter->tokens = limiter_burst(&limiter->config);
+		}
+	}
+	limiter->refilled_at = now;
+}
+
+long http_limiter_reserve(http_limiter *limiter,
+		long long not_after)
+{
+	long long now = 0;
+	long long wait = 0;
+
+	if (NULL == limiter)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&limiter->lock);
+	now = http_now_ms();
+	limiter_refill(limiter, now);
+
+	// Tokens are taken ahead of time so waiting requests are sent in the order they came in
+	if (limiter->rate > 0 && limiter->tokens < 1)
+	{
+		wait = (long long)((1 - limiter->tokens) * 1000.0 / limiter->rate) + 1;
+	}
+	if (limiter->paused_until > now + wait)
+	{
+		wait = limiter->paused_until - now;
+	}
+
+	if (0 != not_after && now + wait > not_after)
+	{
+		pthread_mutex_unlock(&limiter->lock);
+		return -1;
+	}
+
+	if (limiter->rate > 0)
+	{
+		limiter->tokens -= 1;
+	}
+	limiter->stats.requests++;
+	if (wait > 0)
+	{
+		limiter->stats.queue_depth++;
+	}
+	pthread_mutex_unlock(&limiter->lock);
+
+	return (long)wait;
+}
+
+void http_limiter_dequeue(http_limiter *limiter,
+		long waited_ms)
+{
+	if (NULL == limiter)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&limiter->lock);
+	limiter->stats.queue_depth--;
+	limiter->stats.waited++;
+	limiter->stats.total_wait_ms += waited_ms;
+	if (waited_ms > limiter->stats.max_wait_ms)
+	{
+		limiter->stats.max_wait_ms = waited_ms;
+	}
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+void http_limiter_record(http_limiter *limiter,
+		long code,
+		long retry_after_ms,
+		const struct write_headers *headers)
+{
+	long long now = 0;
+
+	if (NULL == limiter || 0 == code)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&limiter->lock);
+	now = http_now_ms();
+	limiter_refill(limiter, now);
+	if (HTTP_TOO_MANY_REQUESTS == code)
+	{
+		long pause_ms = (retry_after_ms > 0) ? retry_after_ms :
+			(headers->ratelimit_reset_ms > 0) ? headers->ratelimit_reset_ms : DEFAULT_RATE_LIMIT_PAUSE_MS;
+
+		limiter->stats.throttled++;
+		if (now + pause_ms > limiter->paused_until)
+		{
+			limiter->paused_until = now + pause_ms;
+		}
+		// Multiplicative decrease, recovered additively by successful responses
+		if (limiter->rate > 0)
+		{
+			limiter->rate /= 2;
+			if (limiter->rate < limiter->config.requests_per_second / 16)
+			{
+				limiter->rate = limiter->config.requests_per_second / 16;
+			}
+			if (limiter->tokens > 0)
+			{
+				limiter->tokens = 0;
+			}
+		}
+	}
+	else if (code >= 200 && code < 300 && limiter->rate < limiter->config.requests_per_second)
+	{
+		limiter->rate += limiter->config.requests_per_second / 10;
+		if (limiter->rate > limiter->config.requests_per_second)
+		{
+			limiter->rate = limiter->config.requests_per_second;
+		}
+	}
+
+	// The server's own quota wins over the local bucket
+	if (0 == headers->ratelimit_remaining && headers->ratelimit_reset_ms > 0 &&
+			now + headers->ratelimit_reset_ms > limiter->paused_until)
+	{
+		limiter->paused_until = now + headers->ratelimit_reset_ms;
+	}
+	else if (headers->ratelimit_remaining > 0 && limiter->rate > 0 && limiter->tokens > headers->ratelimit_remaining)
+	{
+		limiter->tokens = headers->ratelimit_remaining;
+	}
+	limiter->stats.requests_per_second = limiter->rate;
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+void http_limiter_get_stats(http_limiter *limiter,
+		rate_limit_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (NULL != limiter)
+	{
+		pthread_mutex_lock(&limiter->lock);
+		*stats = limiter->stats;
+		pthread_mutex_unlock(&limiter->lock);
+	}
+}
+
+void http_endpoints_set(http_endpoints *endpoints,
+		const char **urls,
+		int count)
+{
+	pthread_mutex_lock(&endpoints->lock);
+	endpoints->count = 0;
+	endpoints->picks = 0;
+	for (int i = 0; i < MAX_ENDPOINTS; i++)
+	{
+		http_endpoint *endpoint = &endpoints->list[i];
+
+		// The breaker is reset in place, requests still running may hold on to it
+		memset(endpoint->url, 0, sizeof(endpoint->url));
+		endpoint->url_len = 0;
+		endpoint->latency_ms = 0;
+		endpoint->error_rate = 0;
+		endpoint->consecutive_failures = 0;
+		endpoint->down_until = 0;
+		endpoint->last_used = 0;
+		endpoint->requests = 0;
+		endpoint->failures = 0;
+		breaker_reset(&endpoint->breaker);
+		if (i < count)
+		{
+			strncpy(endpoint->url, urls[i], API_URL_MAX_LEN);
+			endpoint->url_len = strlen(endpoint->url);
+			endpoints->count++;
+		}
+	}
+	pthread_mutex_unlock(&endpoints->lock);
+}
+
+// Lower is better, endpoints never measured come first so that they get measured
+static double endpoint_score(const http_endpoint *endpoint)
+{
+	return endpoint->latency_ms * (1 + 4 * endpoint->error_rate);
+}
+
+int http_endpoints_pick(http_endpoints *endpoints,
+		unsigned int tried,
+		char *url)
+{
+	long long now = http_now_ms();
+	int best = -1;
+	int probe = 0;
+
+	if (NULL == endpoints)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&endpoints->lock);
+	probe = (0 == ++endpoints->picks % ENDPOINT_PROBE_INTERVAL);
+	for (int i = 0; i < endpoints->count; i++)
+	{
+		const http_endpoint *endpoint = &endpoints->list[i];
+
+		if ((tried & (1u << i)) || endpoint->down_until > now || CIRCUIT_OPEN == http_breaker_state(&endpoints->list[i].breaker))
+		{
+			continue;
+		}
+		if (best < 0 ||
+				(probe && endpoint->last_used < endpoints->list[best].last_used) ||
+				(!probe && endpoint_score(endpoint) < endpoint_score(&endpoints->list[best])))
+		{
+			best = i;
+		}
+	}
+
+	// Every endpoint is out of rotation, try one whose circuit lets it through, then the one whose time is up first
+	if (best < 0)
+	{
+		int best_open = 0;
+
+		for (int i = 0; i < endpoints->count; i++)
+		{
+			int open = (CIRCUIT_OPEN == http_breaker_state(&endpoints->list[i].breaker));
+
+			if (!(tried & (1u << i)) && (best < 0 || open < best_open ||
+						(open == best_open && endpoints->list[i].down_until < endpoints->list[best].down_until)))
+			{
+				best = i;
+				best_open = open;
+			}
+		}
+	}
+
+	if (best >= 0)
+	{
+		endpoints->list[best].last_used = now;
+		strncpy(url, endpoints->list[best].url, API_URL_MAX_LEN);
+		url[API_URL_MAX_LEN] = '\0';
+	}
+	pthread_mutex_unlock(&endpoints->lock);
+
+	return best;
+}
+
+void http_endpoints_record(http_endpoints *endpoints,
+		const char *url,
+		long latency_ms,
+		int failed)
+{
+	if (NULL == endpoints || NULL == url)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&endpoints->lock);
+	for (int i = 0; i < endpoints->count; i++)
+	{
+		http_endpoint *endpoint = &endpoints->list[i];
+
+		// The url is the endpoint's followed by a path
+		if (!http_url_under(url, endpoint->url, endpoint->url_len))
+		{
+			continue;
+		}
+
+		endpoint->requests++;
+		endpoint->error_rate += ENDPOINT_EWMA_WEIGHT * ((failed ? 1.0 : 0.0) - endpoint->error_rate);
+		if (failed)
+		{
+			endpoint->failures++;
+			if (++endpoint->consecutive_failures >= ENDPOINT_DOWN_FAILURES)
+			{
+				endpoint->down_until = http_now_ms() + ENDPOINT_DOWN_MS;
+			}
+		}
+		else
+		{
+			endpoint->latency_ms = (0 == endpoint->latency_ms) ? latency_ms :
+				endpoint->latency_ms + ENDPOINT_EWMA_WEIGHT * (latency_ms - endpoint->latency_ms);
+			// Never measured as 0 again, which would put it ahead of all endpoints
+			endpoint->latency_ms = (endpoint->latency_ms > 0) ? endpoint->latency_ms : 0.1;
+			endpoint->consecutive_failures = 0;
+			endpoint->down_until = 0;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&endpoints->lock);
+}
+
+int http_endpoints_failing(http_endpoints *endpoints,
+		int index)
+{
+	int failing = 0;
+
+	pthread_mutex_lock(&endpoints->lock);
+	if (index >= 0 && index < endpoints->count)
+	{
+		failing = (endpoints->list[index].consecutive_failures > 0 ||
+				CIRCUIT_OPEN == http_breaker_state(&endpoints->list[index].breaker));
+	}
+	pthread_mutex_unlock(&endpoints->lock);
+
+	return failing;
+}
+
+int http_endpoints_get_stats(http_endpoints *endpoints,
+		endpoint_stats *stats)
+{
+	long long now = http_now_ms();
+	int count = 0;
+
+	pthread_mutex_lock(&endpoints->lock);
+	for (int i = 0; i < endpoints->count; i++)
+	{
+		const http_endpoint *endpoint = &endpoints->list[i];
+
+		memset(&stats[i], 0, sizeof(stats[i]));
+		strncpy(stats[i].api_url, endpoint->url, API_URL_MAX_LEN);
+		stats[i].latency_ms = endpoint->latency_ms;
+		stats[i].error_rate = endpoint->error_rate;
+		stats[i].requests = endpoint->requests;
+		stats[i].failures = endpoint->failures;
+		stats[i].healthy = (endpoint->down_until <= now);
+	}
+	count = endpoints->count;
+	pthread_mutex_unlock(&endpoints->lock);
+
+	return count;
+}
+
+long long http_now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+CURLcode http_ensure_global_init(void)
+{
+	pthread_once(&implicit_init_once, implicit_global_init);
+	return implicit_init_status;
+}
+
+CURL *http_handle_acquire(http_pool *pool)
+{
+	return (NULL != pool) ? http_pool_acquire(pool) : curl_easy_init();
+}
+
+void http_handle_release(http_pool *pool,
+		CURL *curl)
+{
+	if (NULL == curl)
+	{
+		return;
+	}
+
+	if (NULL != pool)
+	{
+		http_pool_release(pool, curl);
+	}
+	else
+	{
+		curl_easy_cleanup(curl);
+	}
+}
+
+struct curl_slist *http_request_prepare(CURL *curl,
+		const char *url,
+		const char *api_key,
+		const char *accept,
+		const char *request_id,
+		const char *content_type,
+		const char *body,
+		size_t body_len,
+		const char *content_encoding,
+		struct write_result *write_result,
+		struct write_headers *write_headers,
+		http_pool *pool)
+{
+	struct curl_slist *req_headers = NULL;
+	char unix_socket[UNIX_SOCKET_PATH_MAX_LEN + 1];
+
+	write_result->curl = curl;
+	write_result->max = http_pool_max_response_size(pool);
+	write_headers->max = write_result->max;
+	write_headers->pool = pool;
+	write_headers->ratelimit_remaining = -1;
+	write_headers->ratelimit_reset_ms = 0;
+	write_headers->retry_after_ms = 0;
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	// Keep idle pooled connections alive between attestation requests
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	// A local sidecar is reached without TCP, the url still gives the scheme, Host header and path
+	http_pool_unix_socket(pool, unix_socket);
+	if ('\0' != unix_socket[0])
+	{
+		curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, unix_socket);
+	}
+
+	req_headers = build_headers(req_headers, api_key, accept, request_id, content_type);
+	if (NULL != content_encoding)
+	{
+		char encoding_header[sizeof(CONTENT_ENCODING_HEADER) + 16];
+		snprintf(encoding_header, sizeof(encoding_header), "%s%s", CONTENT_ENCODING_HEADER, content_encoding);
+		req_headers = curl_slist_append(req_headers, encoding_header);
+	}
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req_headers);
+
+	if (NULL != body)
+	{
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)((0 != body_len) ? body_len : strlen(body)));
+	}
+
+	// An empty string offers every encoding libcurl can decode
+	if (http_pool_compression(pool) & COMPRESSION_ACCEPT_ENCODING)
+	{
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	}
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, write_result);
+
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_response_headers);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, write_headers);
+
+	return req_headers;
+}
+
+int http_is_retryable(CURLcode result,
+		long code)
+{
+	switch (result)
+	{
+	case CURLE_OK:
+		return (code == 429 || code == 500 || code == 502 || code == 503 || code == 504);
+	// The connection failed or broke off, another attempt may well succeed
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+long http_retry_after_ms(CURL *curl)
+{
+	curl_off_t retry_after = 0;
+
+	// Parses both the delay-seconds and the HTTP-date form of the header
+	if (CURLE_OK != curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after) || retry_after <= 0)
+	{
+		return 0;
+	}
+
+	// Same bound as headers received through a transport, retry delays are added to deadlines
+	return (retry_after > 24 * 3600) ? 24 * 3600 * 1000L : (long)retry_after * 1000;
+}
+
+long http_retry_delay_ms(const retry_config *retries,
+		int retry_count,
+		long retry_after_ms)
+{
+	// Seeded per thread so that concurrent requests do not retry in lockstep
+	static __thread unsigned int jitter_seed = 0;
+	long base = (retries->retry_base_delay_ms > 0) ? retries->retry_base_delay_ms : (long)retries->retry_wait_time * 1000;
+	long cap = (retries->retry_max_delay_ms > 0) ? retries->retry_max_delay_ms : DEFAULT_RETRY_MAX_DELAY_MS;
+	long delay = (base < cap) ? base : cap;
+
+	for (int i = 0; i < retry_count && delay < cap; i++)
+	{
+		delay = (delay > cap / 2) ? cap : delay * 2;
+	}
+
+	if (retries->retry_jitter && delay > 0)
+	{
+		if (0 == jitter_seed)
+		{
+			jitter_seed = (unsigned int)(http_now_ms() ^ (uintptr_t)&jitter_seed);
+		}
+		delay = (long)(rand_r(&jitter_seed) % ((unsigned long)delay + 1));
+	}
+
+	// The server knows best when it can take the request again, retrying earlier would be refused;
+	// callers give up instead when the delay goes past their deadline
+	if (retries->retry_after && retry_after_ms > delay)
+	{
+		delay = retry_after_ms;
+	}
+
+	return delay;
+}
+
+CURLcode http_apply_deadline(CURL *curl,
+		long long deadline)
+{
+	long long remaining = 0;
+
+	if (0 == deadline)
+	{
+		return CURLE_OK;
+	}
+
+	remaining = deadline - http_now_ms();
+	if (remaining <= 0)
+	{
+		return CURLE_OPERATION_TIMEDOUT;
+	}
+
+	// Custom transports get the deadline along with the request
+	if (NULL == curl)
+	{
+		return CURLE_OK;
+	}
+
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)remaining);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)remaining);
+
+	return CURLE_OK;
+}
+
+static void http_sleep_ms(long ms)
+{
+	struct timespec delay = {ms / 1000, (ms % 1000) * 1000000};
+
+	while (0 != nanosleep(&delay, &delay) && EINTR == errno)
+	{
+	}
+}
+
+CURLcode http_limiter_wait(http_limiter *limiter,
+		long long not_after)
+{
+	long wait = http_limiter_reserve(limiter, not_after);
+
+	if (wait < 0)
+	{
+		return CURLE_AGAIN;
+	}
+
+	if (wait > 0)
+	{
+		long long start = http_now_ms();
+
+		http_sleep_ms(wait);
+		http_limiter_dequeue(limiter, (long)(http_now_ms() - start));
+	}
+
+	return CURLE_OK;
+}
+
+void http_response_reset(struct write_result *write_result,
+		struct write_headers *write_headers)
+{
+	write_result->pos = 0;
+	write_headers->pos = 0;
+	write_headers->count = 0;
+}
+
+// Index the headers received by name and hand them over along with their storage.
+static CURLcode http_headers_take(struct write_headers *write_headers,
+		response_headers *resp_headers)
+{
+	size_t index_size = 4;
+	size_t mask = 0;
+	char *p = NULL;
+	void *block = NULL;
+
+	memset(resp_headers, 0, sizeof(*resp_headers));
+	if (0 == write_headers->count)
+	{
+		return CURLE_OK;
+	}
+
+	// Keep the table at most half full so probe sequences stay short
+	while (index_size < 2 * write_headers->count)
+	{
+		index_size *= 2;
+	}
+	mask = index_size - 1;
+
+	block = calloc(1, write_headers->count * sizeof(response_header) + index_size * sizeof(unsigned int));
+	if (NULL == block)
+	{
+		return CURLE_OUT_OF_MEMORY;
+	}
+
+	resp_headers->headers = buffer_shrink(write_headers->headers, write_headers->pos);
+	write_headers->headers = NULL;
+	write_headers->size = 0;
+	resp_headers->entries = (response_header *)block;
+	resp_headers->index = (unsigned int *)(resp_headers->entries + write_headers->count);
+	resp_headers->index_size = index_size;
+	resp_headers->count = write_headers->count;
+
+	p = resp_headers->headers;
+	for (size_t i = 0; i < resp_headers->count; i++)
+	{
+		size_t name_len = strlen(p);
+		size_t slot = http_header_hash(p, name_len) & mask;
+
+		resp_headers->entries[i].name = p;
+		p += name_len + 1;
+		resp_headers->entries[i].value = p;
+		p += strlen(p) + 1;
+
+		while (0 != resp_headers->index[slot])
+		{
+			slot = (slot + 1) & mask;
+		}
+		resp_headers->index[slot] = (unsigned int)i + 1;
+	}
+
+	return CURLE_OK;
+}
+
+CURLcode http_response_take(struct write_result *write_result,
+		struct write_headers *write_headers,
+		char **response,
+		response_headers *resp_headers)
+{
+	// An empty body is still returned as an empty string
+	if (0 != buffer_reserve(&write_result->data, &write_result->size, write_result->pos + 1, write_result->max, 0))
+	{
+		return CURLE_OUT_OF_MEMORY;
+	}
+	write_result->data[write_result->pos] = '\0';
+
+	if (NULL != resp_headers && CURLE_OK != http_headers_take(write_headers, resp_headers))
+	{
+		return CURLE_OUT_OF_MEMORY;
+	}
+
+	// The body is handed over to the caller as it is, no copy is made
+	*response = buffer_shrink(write_result->data, write_result->pos + 1);
+	write_result->data = NULL;
+	write_result->size = 0;
+
+	return CURLE_OK;
+}
+
+void http_response_free(struct write_result *write_result,
+		struct write_headers *write_headers)
+{
+	if (write_result->data)
+	{
+		free(write_result->data);
+		write_result->data = NULL;
+	}
+	if (write_headers->headers)
+	{
+		free(write_headers->headers);
+		write_headers->headers = NULL;
+	}
+	write_result->size = 0;
+	write_headers->size = 0;
+	write_headers->pos = 0;
+	write_headers->count = 0;
+}
+
+// Swap the responses received by two transfers, each buffer keeps pointing to its own transfer.
+static void http_response_swap(struct write_result *a_result,
+		struct write_headers *a_headers,
+		struct write_result *b_result,
+		struct write_headers *b_headers)
+{
+	CURL *a_curl = a_result->curl;
+	CURL *b_curl = b_result->curl;
+	struct write_result result = *a_result;
+	struct write_headers headers = *a_headers;
+
+	*a_result = *b_result;
+	*a_headers = *b_headers;
+	*b_result = result;
+	*b_headers = headers;
+	a_result->curl = a_curl;
+	b_result->curl = b_curl;
+}
+
+/**
+ * Performs one attempt of a request prepared on curl for url. When no response arrived after
+ * hedge->delay_ms a duplicate goes to hedge->url, unless its circuit is open; the first usable
+ * response wins and ends up in write_result/write_headers, the other transfer is cancelled.
+ * The outcome of each transfer is recorded with the circuit breaker and endpoint of its own url,
+ * a cancelled transfer hands back the probe it may have been let through as.
+ */
+static CURLcode http_perform_hedged(CURL *curl,
+		const char *url,
+		http_breaker *breaker,
+		struct write_result *write_result,
+		struct write_headers *write_headers,
+		const http_hedge *hedge,
+		const char *api_key,
+		const char *accept,
+		const char *request_id,
+		const char *content_type,
+		const char *body,
+		size_t body_len,
+		const char *content_encoding,
+		const http_body_stream *stream,
+		http_pool *pool,
+		long long deadline,
+		long *code)
+{
+	CURLM *multi = NULL;
+	CURL *second = NULL;
+	http_body_reader second_reader;
+	struct curl_slist *second_headers = NULL;
+	struct write_result second_result = {0};
+	struct write_headers second_write_headers = {0};
+	CURLcode status = CURLE_OK;
+	CURLcode first_status = CURLE_OK;
+	CURLcode second_status = CURLE_OK;
+	long first_code = 0;
+	long second_code = 0;
+	int done = 0;
+	int second_done = 0;
+	int running = 0;
+	long long start = http_now_ms();
+	long long now = start;
+	long long hedge_at = start + hedge->delay_ms;
+	long long second_start = 0;
+	http_breaker *second_breaker = http_pool_url_breaker(pool, hedge->url);
+	http_endpoints *endpoints = (NULL != pool) ? &pool->endpoints : NULL;
+
+	second_write_headers.discard = write_headers->discard;
+	multi = http_pool_acquire_multi(pool);
+	if (NULL == multi)
+	{
+		http_breaker_record(breaker, -1);
+		return CURLE_OUT_OF_MEMORY;
+	}
+	curl_multi_add_handle(multi, curl);
+
+	for (;;)
+	{
+		CURLMsg *msg = NULL;
+		int left = 0;
+
+		curl_multi_perform(multi, &running);
+		while (NULL != (msg = curl_multi_info_read(multi, &left)))
+		{
+			if (CURLMSG_DONE != msg->msg)
+			{
+				continue;
+			}
+			if (msg->easy_handle == curl)
+			{
+				done = 1;
+				first_status = msg->data.result;
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &first_code);
+				status = first_status;
+				*code = first_code;
+			}
+			else
+			{
+				second_done = 1;
+				second_status = msg->data.result;
+				curl_easy_getinfo(second, CURLINFO_RESPONSE_CODE, &second_code);
+			}
+		}
+
+		if (second_done && !http_is_retryable(second_status, second_code))
+		{
+			DEBUG("Hedged request to %s answered first\n", hedge->url);
+			http_response_swap(write_result, write_headers, &second_result, &second_write_headers);
+			status = second_status;
+			*code = second_code;
+			break;
+		}
+		// A failed transfer is only reported once the other one cannot do better
+		if (done && (!http_is_retryable(status, *code) || NULL == second || second_done))
+		{
+			break;
+		}
+
+		now = http_now_ms();
+		if (NULL == second && !done && now >= hedge_at && !http_breaker_allow(second_breaker))
+		{
+			DEBUG("Not hedging to %s, the circuit is open\n", hedge->url);
+			hedge_at = LLONG_MAX;
+		}
+		if (NULL == second && !done && now >= hedge_at)
+		{
+			second = http_handle_acquire(pool);
+			if (NULL != second)
+			{
+				second_headers = http_request_prepare(second, hedge->url, api_key, accept, request_id, content_type, body,
+						body_len, content_encoding, &second_result, &second_write_headers, pool);
+				if (NULL != stream)
+				{
+					http_request_set_stream(second, &second_reader, stream);
+				}
+				http_apply_deadline(second, deadline);
+				curl_multi_add_handle(multi, second);
+				second_start = now;
+				DEBUG("No response after %ldms, hedging to %s\n", hedge->delay_ms, hedge->url);
+				continue;
+			}
+			http_breaker_record(second_breaker, -1);
+			hedge_at = LLONG_MAX;
+		}
+
+		// Wake up in time to send the duplicate, curl shortens the wait for its own timeouts
+		curl_multi_poll(multi, NULL, 0, (NULL == second && !done && hedge_at - now < 1000) ? (int)(hedge_at - now) : 1000, NULL);
+	}
+
+	now = http_now_ms();
+	if (done)
+	{
+		http_breaker_record(breaker, http_breaker_outcome(first_status, first_code));
+		http_endpoints_record(endpoints, url, (long)(now - start), CURLE_OK != first_status || http_is_retryable(first_status, first_code));
+	}
+	else
+	{
+		http_breaker_record(breaker, -1);
+	}
+	if (second_done)
+	{
+		http_breaker_record(second_breaker, http_breaker_outcome(second_status, second_code));
+		http_endpoints_record(endpoints, hedge->url, (long)(now - second_start),
+				CURLE_OK != second_status || http_is_retryable(second_status, second_code));
+	}
+	else if (NULL != second)
+	{
+		http_breaker_record(second_breaker, -1);
+	}
+
+	// Removing a transfer still running cancels it
+	curl_multi_remove_handle(multi, curl);
+	if (NULL != second)
+	{
+		curl_multi_remove_handle(multi, second);
+		http_handle_release(pool, second);
+		second = NULL;
+	}
+	if (NULL != second_headers)
+	{
+		curl_slist_free_all(second_headers);
+		second_headers = NULL;
+	}
+	http_response_free(&second_result, &second_write_headers);
+	http_pool_release_multi(pool, multi);
+
+	return status;
+}
+
+/**
+ * Make a request through a custom transport. The response is handed over to write_result
+ * and write_headers as if it had been received by curl.
+ */
+static CURLcode http_perform_transport(const transport_adapter *transport,
+		const char *url,
+		const char *api_key,
+		const char *accept,
+		const char *request_id,
+		const char *content_type,
+		const char *body,
+		size_t body_len,
+		const char *content_encoding,
+		long long deadline,
+		struct write_result *write_result,
+		struct write_headers *write_headers,
+		long *code)
+{
+	CURLcode status = CURLE_OK;
+	transport_request request = {0};
+	transport_response response = {0};
+	const char *line = NULL;
+	const char *end = NULL;
+
+	request.method = (NULL != body) ? "POST" : "GET";
+	request.url = url;
+	request.api_key = api_key;
+	request.accept = accept;
+	request.request_id = request_id;
+	request.content_type = content_type;
+	request.content_encoding = content_encoding;
+	request.body = body;
+	request.body_len = (NULL == body) ? 0 : (0 != body_len) ? body_len : strlen(body);
+	request.deadline = deadline;
+
+	if (0 != transport->perform(transport->ctx, &request, &response))
+	{
+		status = CURLE_COULDNT_CONNECT;
+		goto ERROR;
+	}
+	*code = response.status_code;
+
+	// Header lines go through the same parser as the ones received by curl
+	write_headers->pos = 0;
+	write_headers->count = 0;
+	line = response.headers;
+	end = response.headers + response.headers_len;
+	while (NULL != line && line < end)
+	{
+		const char *next = (const char *)memchr(line, '\n', end - line);
+		size_t len = (NULL != next) ? (size_t)(next - line) + 1 : (size_t)(end - line);
+
+		if (len != write_response_headers((char *)line, 1, len, write_headers))
+		{
+			status = CURLE_WRITE_ERROR;
+			goto ERROR;
+		}
+		line += len;
+	}
+
+	// The body is adopted as it is, only room for the terminating NUL may be added
+	if (NULL != response.body)
+	{
+		free(write_result->data);
+		write_result->data = response.body;
+		write_result->size = response.body_len;
+		write_result->pos = response.body_len;
+		response.body = NULL;
+		if (0 != buffer_reserve(&write_result->data, &write_result->size, write_result->pos + 1, write_result->max, 0))
+		{
+			status = CURLE_WRITE_ERROR;
+			goto ERROR;
+		}
+		write_result->data[write_result->pos] = '\0';
+	}
+
+ERROR:
+	if (NULL != response.body)
+	{
+		free(response.body);
+		response.body = NULL;
+	}
+	if (NULL != response.headers)
+	{
+		free(response.headers);
+		response.headers = NULL;
+	}
+
+	return status;
+}
+
+CURLcode make_http_request(const char *url,
+		const char *api_key,
+		const char *accept,
+		const char *request_id,
+		const char *content_type,
+		const char *body,
+		const http_body_stream *stream,
+		char **response,
+		response_headers *resp_headers,
+		retry_config *retries,
+		http_pool *pool,
+		long long deadline,
+		const http_hedge *hedge)
+{
+	CURL *curl = NULL;
+	CURLcode status = CURLE_OK;
+	struct curl_slist *req_headers = NULL;
+	struct write_result write_result = {0};
+	struct write_headers write_headers = {0};
+	http_body_reader reader;
+	char *stream_body = NULL;
+	const char *req_type = (NULL != body || NULL != stream) ? "POST" : "GET";
+	http_breaker *breaker = http_pool_url_breaker(pool, url);
+	http_limiter *limiter = (NULL != pool) ? pool->limiter : NULL;
+	const transport_adapter *transport = http_pool_transport(pool);
+	char *gzip_body = NULL;
+	size_t gzip_len = 0;
+	long code;
+
+	if (NULL == url)
+	{
+		return CURLE_URL_MALFORMAT;
+	}
+
+	// Transports take the body in one piece
+	if (NULL != stream && NULL != transport)
+	{
+		stream_body = http_body_stream_dump(stream);
+		if (NULL == stream_body)
+		{
+			return CURLE_OUT_OF_MEMORY;
+		}
+		body = stream_body;
+		stream = NULL;
+	}
+
+	status = http_gzip_body(pool, body, &gzip_body, &gzip_len);
+	if (CURLE_OK != status)
+	{
+		goto ERROR;
+	}
+
+	write_headers.discard = (NULL == resp_headers);
+	if (NULL != transport)
+	{
+		write_result.max = http_pool_max_response_size(pool);
+		write_headers.max = write_result.max;
+		write_headers.pool = pool;
+		write_headers.ratelimit_remaining = -1;
+	}
+	else
+	{
+		status = http_ensure_global_init();
+		if (CURLE_OK != status)
+		{
+			goto ERROR;
+		}
+
+		curl = http_handle_acquire(pool);
+		if (!curl)
+		{
+			status = CURLE_OUT_OF_MEMORY;
+			goto ERROR;
+		}
+
+		req_headers = http_request_prepare(curl, url, api_key, accept, request_id, content_type,
+				(NULL != gzip_body) ? gzip_body : body, gzip_len, (NULL != gzip_body) ? "gzip" : NULL,
+				&write_result, &write_headers, pool);
+		if (NULL != stream)
+		{
+			http_request_set_stream(curl, &reader, stream);
+		}
+	}
+
+	int retry_count = 0;
+	// Requests queue for the rate limiter at most this long, throttled retries included
+	long long queue_until = http_now_ms() + http_limiter_max_queue_ms(limiter);
+	long long not_after = (0 != deadline && deadline < queue_until) ? deadline : queue_until;
+	for (;;)
+	{
+		code = 0;
+		if (CURLE_OK != http_limiter_wait(limiter, not_after))
+		{
+			ERROR("%s request to %s not sent, rate limited\n", req_type, url);
+			status = (not_after == deadline) ? CURLE_OPERATION_TIMEDOUT : CURLE_AGAIN;
+			break;
+		}
+
+		status = http_apply_deadline(curl, deadline);
+		if (CURLE_OK != status)
+		{
+			break;
+		}
+
+		if (!http_breaker_allow(breaker))
+		{
+			ERROR("%s request to %s refused, the circuit is open\n", req_type, url);
+			status = HTTP_CIRCUIT_OPEN;
+			break;
+		}
+
+		// Every attempt uploads the streamed body from its start
+		if (NULL != stream)
+		{
+			http_body_reader_init(&reader, stream);
+		}
+
+		long long attempt_start = http_now_ms();
+		int recorded = 0;
+		if (NULL != transport)
+		{
+			status = http_perform_transport(transport, url, api_key, accept, request_id, content_type,
+					(NULL != gzip_body) ? gzip_body : body, gzip_len, (NULL != gzip_body) ? "gzip" : NULL,
+					deadline, &write_result, &write_headers, &code);
+		}
+		else if (NULL != hedge && hedge->delay_ms > 0)
+		{
+			status = http_perform_hedged(curl, url, breaker, &write_result, &write_headers, hedge, api_key, accept, request_id,
+					content_type, (NULL != gzip_body) ? gzip_body : body, gzip_len, (NULL != gzip_body) ? "gzip" : NULL,
+					stream, pool, deadline, &code);
+			recorded = 1;
+		}
+		else
+		{
+			status = curl_easy_perform(curl);
+			if (CURLE_OK == status)
+			{
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+			}
+		}
+
+		long retry_after_ms = (NULL != curl) ? http_retry_after_ms(curl) : write_headers.retry_after_ms;
+
+		http_limiter_record(limiter, code, retry_after_ms, &write_headers);
+		// Hedged attempts record each transfer against its own url
+		if (!recorded)
+		{
+			http_breaker_record(breaker, http_breaker_outcome(status, code));
+			http_endpoints_record((NULL != pool) ? &pool->endpoints : NULL, url, (long)(http_now_ms() - attempt_start),
+					CURLE_OK != status || http_is_retryable(status, code));
+		}
+
+		// The server does not take gzip bodies, resend uncompressed right away
+		if (HTTP_UNSUPPORTED_MEDIA_TYPE == code && NULL != gzip_body)
+		{
+			DEBUG("%s %s does not accept gzip request bodies\n", req_type, url);
+			http_pool_gzip_rejected(pool);
+			free(gzip_body);
+			gzip_body = NULL;
+			gzip_len = 0;
+			if (NULL != curl)
+			{
+				curl_slist_free_all(req_headers);
+				req_headers = http_request_prepare(curl, url, api_key, accept, request_id, content_type, body, 0, NULL,
+						&write_result, &write_headers, pool);
+			}
+			http_response_reset(&write_result, &write_headers);
+			continue;
+		}
+
+		if (!http_is_retryable(status, code))
+		{
+			break;
+		}
+
+		// The attempt was made, its own failure is returned
+		if (CIRCUIT_OPEN == http_breaker_state(breaker))
+		{
+			ERROR("Request to %s failed: %s %s not retried, the circuit is open:%ld.\n", url, req_type, url, code);
+			break;
+		}
+
+		// Throttled requests queue for the limiter instead of using up retries
+		if (HTTP_TOO_MANY_REQUESTS == code && NULL != limiter)
+		{
+			DEBUG("%s %s throttled, queueing for the rate limiter\n", req_type, url);
+			http_response_reset(&write_result, &write_headers);
+			continue;
+		}
+
+		if (NULL == retries || retry_count >= retries->retry_max)
+		{
+			ERROR("Request to %s failed: %s %s giving up after %d attempts:%ld.\n", url, req_type, url, (retry_count + 1), code);
+			break;
+		}
+
+		long delay_ms = http_retry_delay_ms(retries, retry_count, retry_after_ms);
+		if (0 != deadline && http_now_ms() + delay_ms >= deadline)
+		{
+			ERROR("Request to %s failed: %s %s no time left for a retry:%ld.\n", url, req_type, url, code);
+			status = CURLE_OPERATION_TIMEDOUT;
+			break;
+		}
+
+		ERROR("%s %s (status: %ld, %s): retrying in %ldms(%d left)", req_type, url, code, curl_easy_strerror(status),
+				delay_ms, (retries->retry_max - retry_count));
+		http_sleep_ms(delay_ms);
+
+		// Drop the failed response, the buffers are reused for the next attempt
+		http_response_reset(&write_result, &write_headers);
+		retry_count++;
+	}
+
+	if (0 != status)
+	{
+		ERROR("%s request to %s returned %s", req_type, url, curl_easy_strerror(status));
+		goto ERROR;
+	}
+
+	if (200 != code)
+	{
+		ERROR("%s request to '%s' returned code %ld\n", req_type, url, code);
+		goto ERROR;
+	}
+
+	status = http_response_take(&write_result, &write_headers, response, resp_headers);
+
+ERROR:
+	http_handle_release(pool, curl);
+	curl = NULL;
+	if (gzip_body)
+	{
+		free(gzip_body);
+		gzip_body = NULL;
+	}
+	if (stream_body)
+	{
+		free(stream_body);
+		stream_body = NULL;
+	}
+	if (req_headers)
+	{
+		curl_slist_free_all(req_headers);
+		req_headers = NULL;
+	}
+	http_response_free(&write_result, &write_headers);
+
+	return status;
+}
+
+CURLcode get_request(const char *url,
+		const char *api_key,
+		const char *accept,
+		const char *request_id,
+		const char *content_type,
+		char **response,
+		response_headers *resp_headers,
+		retry_config *retries,
+		http_pool *pool,
+		long long deadline)
+{
+	return make_http_request(url, api_key, accept, request_id, content_type, NULL, NULL, response, resp_headers, retries, pool, deadline, NULL);
+}
+
+CURLcode post_request(const char *url,
+		const char *api_key,
+		const char *accept,
+		const char *request_id,
+		const char *content_type,
+		const char *body,
+		char **response,
+		response_headers *resp_headers,
+		retry_config *retries,
+		http_pool *pool,
+		long long deadline,
+		const http_hedge *hedge)
+{
+	return make_http_request(url, api_key, accept, request_id, content_type, body, NULL, response, resp_headers, retries, pool, deadline, hedge);
+}
+
+CURLcode post_request_stream(const char *url,
+		const char *api_key,
+		const char *accept,
+		const char *request_id,
+		const char *content_type,
+		const http_body_stream *stream,
+		char **response,
+		response_headers *resp_headers,
+		retry_config *retries,
+		http_pool *pool,
+		long long deadline,
+		const http_hedge *hedge)
+{
+	if (NULL == stream)
+	{
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+	}
+
+	return make_http_request(url, api_key, accept, request_id, content_type, NULL, stream, response, resp_headers, retries, pool, deadline, hedge);
 }
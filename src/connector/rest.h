@@ -6,20 +6,181 @@
 #define __TRUST_AUTHORITY_REST_H__
 
 #include <curl/curl.h>
+#include <pthread.h>
 #include <types.h>
 
+/**
+ * Growable response body buffer. The buffer is sized from Content-Length when the
+ * server sends one, and is handed over to the caller as the response without copying.
+ */
 struct write_result
 {
 	char *data;
-	int pos;
+	size_t pos; /* number of bytes written, data is kept NUL terminated */
+	size_t size; /* number of bytes allocated */
+	size_t max; /* hard cap on the response size, 0 for DEFAULT_MAX_RESPONSE_SIZE */
+	CURL *curl; /* transfer the body belongs to, used to look up Content-Length */
 };
 
+/**
+ * Response headers parsed as they are received. Kept headers are stored as
+ * "name\0value\0" pairs with lower case names, dropped headers are not copied at all.
+ */
 struct write_headers
 {
 	char *headers;
-	size_t pos;
+	size_t pos; /* number of bytes written */
+	size_t size; /* number of bytes allocated */
+	size_t max; /* hard cap on the headers size, 0 for DEFAULT_MAX_RESPONSE_SIZE */
+	size_t count; /* number of headers kept */
+	int discard; /* non zero when the caller does not want any header */
+	struct http_pool *pool; /* pool selecting the headers to keep, NULL keeps all */
+	long ratelimit_remaining; /* RateLimit-Remaining sent by the server, -1 if none; read even if the header is not kept */
+	long ratelimit_reset_ms; /* time until RateLimit-Reset sent by the server, 0 if none */
+	long retry_after_ms; /* Retry-After in seconds sent by the server, 0 if none; curl also reads the HTTP-date form */
 };
 
+/**
+ * Circuit breaker of an endpoint, counting failed attempts and refusing requests while open.
+ */
+typedef struct http_breaker
+{
+	pthread_mutex_t lock;
+	circuit_breaker_config config;
+	circuit_state state;
+	int consecutive_failures;
+	int window_requests; /* attempts made in the current error rate window */
+	int window_failures; /* failed attempts in the current error rate window */
+	long long window_start;
+	long long changed_at; /* time of the last state change */
+	int probes; /* requests let through since the circuit became half-open */
+} http_breaker;
+
+/**
+ * Token bucket pacing the requests made with an API key. It is shared by all connectors
+ * of the process using the key, and slows down after 429 responses and rate limit headers.
+ */
+typedef struct http_limiter
+{
+	char key[API_KEY_MAX_LEN + 1]; /* api key the limiter is registered for */
+	int refs; /* number of pools using the limiter */
+	pthread_mutex_t lock;
+	rate_limit_config config;
+	double rate; /* current requests per second, 0 when unpaced */
+	double tokens; /* may go negative, requests reserve tokens ahead of time */
+	long long refilled_at;
+	long long paused_until; /* no request is sent before, after a 429 or an exhausted quota */
+	rate_limit_stats stats;
+	struct http_limiter *next;
+} http_limiter;
+
+/**
+ * Process wide curl share object caching TLS sessions and DNS results. Connectors
+ * talking to the same Intel Trust Authority URL use the same share object.
+ */
+typedef struct http_share
+{
+	char key[API_URL_MAX_LEN + 1]; /* url the share object is registered for */
+	CURLSH *share;
+	pthread_rwlock_t locks[CURL_LOCK_DATA_LAST]; /* one lock per type of shared data */
+	int refs; /* number of pools using the share object */
+	http_breaker breaker; /* circuit breaker of the endpoint, used while the connector has no endpoints set */
+	struct http_share *next;
+} http_share;
+
+// Intel Trust Authority endpoint requests can be sent to.
+typedef struct http_endpoint
+{
+	char url[API_URL_MAX_LEN + 1];
+	size_t url_len;
+	double latency_ms; /* moving average of successful attempts, 0 until one succeeded */
+	double error_rate; /* moving average of failed attempts */
+	int consecutive_failures;
+	long long down_until; /* http_now_ms() time the endpoint is back in rotation, 0 if it is in rotation */
+	long long last_used; /* http_now_ms() time the endpoint was last picked */
+	long long requests;
+	long long failures;
+	http_breaker breaker; /* circuit breaker of the endpoint, its lock lives as long as the pool */
+} http_endpoint;
+
+/**
+ * Endpoints of a connector. Requests go to the healthy endpoint with the lowest latency,
+ * weighted by its error rate, and fail over to the next one.
+ */
+typedef struct http_endpoints
+{
+	pthread_mutex_t lock;
+	http_endpoint list[MAX_ENDPOINTS];
+	int count; /* 0 when the connector only uses its api_url */
+	long long picks;
+} http_endpoints;
+
+/**
+ * Pool of curl easy handles owned by a connector. Handles released back to the
+ * pool keep their connection cache, so later requests reuse warm TCP/TLS connections.
+ */
+typedef struct http_pool
+{
+	pthread_mutex_t lock;
+	CURL **handles; /* idle handles ready to be reused */
+	size_t count; /* number of idle handles */
+	size_t capacity; /* maximum number of idle handles kept */
+	size_t max_response_size; /* hard cap on response body and headers size, guarded by lock */
+	int compression; /* COMPRESSION_* flags, guarded by lock as the server may turn off gzip requests */
+	CURLM **multis; /* idle multi handles for hedged requests and token batches, they keep their own connection cache */
+	size_t multi_count; /* number of idle multi handles */
+	char keep_headers[MAX_KEPT_HEADERS][MAX_HEADER_NAME_LEN + 1]; /* response headers to keep, lower case, guarded by lock */
+	int keep_count; /* 0 keeps all response headers, guarded by lock */
+	http_share *share; /* TLS session and DNS cache shared with other connectors, may be NULL */
+	http_limiter *limiter; /* rate limiter of the api key, may be NULL */
+	const transport_adapter *transport; /* performs the requests instead of libcurl, NULL for libcurl; guarded by lock */
+	char unix_socket[UNIX_SOCKET_PATH_MAX_LEN + 1]; /* requests are sent over this unix domain socket, empty for TCP; guarded by lock */
+	http_endpoints endpoints; /* endpoints the requests are spread over, guarded by their own lock */
+	int preconnect; /* reopen the attest connection while evidence is collected, guarded by lock; off by default */
+	int preconnects; /* preconnect threads running, guarded by lock */
+	int closing; /* the pool is being freed, running preconnects give up; guarded by lock */
+	pthread_cond_t preconnects_done; /* signalled when a preconnect thread ends */
+	pthread_rwlock_t nonce_pool_lock; /* held for reading while the connector's nonce pool is used, for writing to replace it */
+} http_pool;
+
+// Hedging of a request: a duplicate goes to url when no response arrived within delay_ms.
+typedef struct http_hedge
+{
+	const char *url; /* url of the duplicate request */
+	long delay_ms;
+} http_hedge;
+
+#define HTTP_BODY_MAX_PARTS 8
+
+// Piece of a streamed request body, referenced and not copied.
+typedef struct http_body_part
+{
+	const unsigned char *data;
+	size_t len;
+	int base64; /* data is base64 encoded while it is sent */
+} http_body_part;
+
+/**
+ * Request body produced while it is uploaded. Large binary fields are base64 encoded chunk by
+ * chunk into libcurl's upload buffer, so no copy of the whole body is ever held in memory.
+ */
+typedef struct http_body_stream
+{
+	http_body_part parts[HTTP_BODY_MAX_PARTS];
+	int count;
+} http_body_stream;
+
+// Position of one transfer in a http_body_stream, each transfer of a stream has its own.
+typedef struct http_body_reader
+{
+	const http_body_stream *stream;
+	int part; /* part being sent */
+	size_t offset; /* bytes of the part consumed */
+	char pending[4]; /* encoded characters which did not fit into the last read */
+	size_t pending_len;
+	size_t pending_pos;
+} http_body_reader;
+
 #ifdef __cplusplus
 
 extern "C"
@@ -31,6 +192,472 @@ extern "C"
 #define CONTENT_TYPE_APPLICATION_JWT "Content-Type: application/jwt"
 #define ACCEPT_APPLICATION_JSON "Accept: application/json"
 #define ACCEPT_APPLICATION_JWT "Accept: application/jwt"
+#define HTTP_UNSUPPORTED_MEDIA_TYPE 415
+#define HTTP_TOO_MANY_REQUESTS 429
+#define HTTP_CIRCUIT_OPEN ((CURLcode)(CURL_LAST + 1)) // returned instead of a curl result when the circuit breaker refused the request, nothing was sent
+
+	/**
+	 * Performs the process wide curl initialization. Calls are reference counted
+	 * and must be balanced with http_global_cleanup().
+	 * @return enum containing status from CURL command
+	 */
+	CURLcode http_global_init(void);
+
+	// Releases the process wide curl state once the last reference is dropped.
+	void http_global_cleanup(void);
+
+	/**
+	 * Get the share object registered for key, creating it on first use.
+	 * @param share share object returned, reference counted
+	 * @param key url identifying the share object
+	 * @return enum containing status from CURL command
+	 */
+	CURLcode http_share_acquire(http_share **share,
+			const char *key);
+
+	// Drop a reference to the share object, freeing it with the last reference.
+	void http_share_release(http_share *share);
+
+	/**
+	 * Create a pool of reusable curl easy handles.
+	 * @param pool pool created
+	 * @param capacity maximum number of idle handles kept in the pool
+	 * @param share_key url whose TLS session and DNS cache the pool handles share, NULL to not share
+	 * @return enum containing status from CURL command
+	 */
+	CURLcode http_pool_new(http_pool **pool,
+			size_t capacity,
+			const char *share_key);
+
+	/**
+	 * Take an easy handle out of the pool, creating a new one if none is idle.
+	 * @param pool pool to take the handle from
+	 * @return curl easy handle or NULL on allocation failure
+	 */
+	CURL *http_pool_acquire(http_pool *pool);
+
+	/**
+	 * Return an easy handle to the pool. Options are reset but live connections
+	 * are kept. The handle is cleaned up if the pool is already full.
+	 * @param pool pool the handle was taken from
+	 * @param curl handle to be returned
+	 */
+	void http_pool_release(http_pool *pool,
+			CURL *curl);
+
+	/**
+	 * Open connections ahead of the first requests: count idle handles of the pool each send a HEAD request
+	 * to every url in parallel and keep the connection in their cache. The requests wait for the rate limiter
+	 * and go through the circuit breaker of their url, they are not retried or accounted to the endpoints.
+	 * Nothing is done for custom transports.
+	 * @param pool pool to warm up
+	 * @param urls urls to connect to
+	 * @param url_count number of urls
+	 * @param count number of handles to warm up, at most the capacity of the pool
+	 * @param deadline http_now_ms() time by which the warm up must be done, 0 for none
+	 * @return number of connections opened
+	 */
+	int http_pool_warmup(http_pool *pool,
+			const char **urls,
+			int url_count,
+			int count,
+			long long deadline);
+
+	/**
+	 * Keep, or re-open, a pooled connection to url on a detached thread while the caller is busy, e.g.
+	 * generating a quote. The handle goes back to the pool once its HEAD request is done, where the next
+	 * request picks it up; a request made before then takes another handle. Nothing is done unless
+	 * preconnects are enabled on the pool. http_pool_free() waits for the running preconnects.
+	 * @param pool pool to take the handle from
+	 * @param url url to connect to
+	 * @param deadline http_now_ms() time by which the connection must be open, 0 for none
+	 * @return 1 if a preconnect was started
+	 */
+	int http_preconnect_start(http_pool *pool,
+			const char *url,
+			long long deadline);
+
+	/**
+	 * Take a multi handle out of the pool, or create a one-shot multi handle when pool is NULL.
+	 * @param pool pool to take the handle from, may be NULL
+	 * @return curl multi handle or NULL on allocation failure
+	 */
+	CURLM *http_pool_acquire_multi(http_pool *pool);
+
+	// Return a multi handle taken with http_pool_acquire_multi(), all easy handles must be removed from it.
+	void http_pool_release_multi(http_pool *pool,
+			CURLM *multi);
+
+	// Delete/free http_pool along with all idle handles.
+	void http_pool_free(http_pool *pool);
+
+	// COMPRESSION_* flags in use by a pool, 0 when pool is NULL.
+	int http_pool_compression(http_pool *pool);
+
+	// Turn off gzip request bodies for a pool after the server refused one.
+	void http_pool_gzip_rejected(http_pool *pool);
+
+	/**
+	 * Gzip a request body if the pool asks for it and it is worth it.
+	 * @param pool pool the request is made with, may be NULL
+	 * @param body request body
+	 * @param gzip_body compressed body, NULL if the body is to be sent as is; to be freed by the caller
+	 * @param gzip_len length of the compressed body
+	 * @return enum containing status from CURL command
+	 */
+	CURLcode http_gzip_body(http_pool *pool,
+			const char *body,
+			char **gzip_body,
+			size_t *gzip_len);
+
+	/**
+	 * Append a part to a streamed request body.
+	 * @param stream body to append to
+	 * @param data bytes of the part, must stay valid until the request is done
+	 * @param len length of data
+	 * @param base64 non-zero to base64 encode data while it is sent
+	 * @return CURLE_OK, CURLE_OUT_OF_MEMORY if the stream has no room left
+	 */
+	CURLcode http_body_stream_add(http_body_stream *stream,
+			const void *data,
+			size_t len,
+			int base64);
+
+	// Number of bytes the stream sends, base64 encoding included
+	size_t http_body_stream_length(const http_body_stream *stream);
+
+	/**
+	 * Copy a streamed body into a string, for transports which take the body in one piece.
+	 * @param stream body to copy
+	 * @return NUL terminated body to be freed by the caller, NULL if out of memory
+	 */
+	char *http_body_stream_dump(const http_body_stream *stream);
+
+	// Rewind reader to the start of stream
+	void http_body_reader_init(http_body_reader *reader,
+			const http_body_stream *stream);
+
+	// CURLOPT_READFUNCTION filling the upload buffer from a http_body_reader
+	size_t http_body_read(char *buffer,
+			size_t size,
+			size_t nitems,
+			void *userdata);
+
+	/**
+	 * Upload a streamed body with a prepared handle, replacing any body given to http_request_prepare().
+	 * @param curl handle to set up
+	 * @param reader position in the stream used by this handle, must stay valid until the transfer is done
+	 * @param stream body to upload
+	 */
+	void http_request_set_stream(CURL *curl,
+			http_body_reader *reader,
+			const http_body_stream *stream);
+
+	// Circuit breaker of the api_url a pool talks to, NULL if it has none.
+	http_breaker *http_pool_breaker(http_pool *pool);
+
+	/**
+	 * Circuit breaker requests to url go through: the breaker of the endpoint url starts with,
+	 * or the one of the api_url when the pool has no endpoints set.
+	 * @param pool pool the request is made with, may be NULL
+	 * @param url url of the request
+	 * @return circuit breaker, NULL if there is none
+	 */
+	http_breaker *http_pool_url_breaker(http_pool *pool,
+			const char *url);
+
+	/**
+	 * Apply circuit breaker settings to the api_url and all endpoints of a pool, their state is kept.
+	 * @param pool pool of a connector
+	 * @param config new settings
+	 */
+	void http_pool_configure_breakers(http_pool *pool,
+			const circuit_breaker_config *config);
+
+	/**
+	 * State of the circuits of a pool taken together: the state of the api_url's breaker, or with
+	 * endpoints set the best state among them, so that it is only open when every endpoint is.
+	 * @param pool pool of a connector, may be NULL
+	 * @return CIRCUIT_CLOSED if the pool has no breaker
+	 */
+	circuit_state http_pool_circuit_state(http_pool *pool);
+
+	// Transport performing the requests of a pool, NULL for libcurl or without a pool.
+	const transport_adapter *http_pool_transport(http_pool *pool);
+
+	// Hard cap on the response size of a pool, DEFAULT_MAX_RESPONSE_SIZE without a pool.
+	size_t http_pool_max_response_size(http_pool *pool);
+
+	/**
+	 * Copy the unix domain socket requests of a pool are sent over.
+	 * @param pool pool of a connector, may be NULL
+	 * @param path receives the path, UNIX_SOCKET_PATH_MAX_LEN + 1 chars; empty for TCP
+	 */
+	void http_pool_unix_socket(http_pool *pool,
+			char *path);
+
+	// Rate limiter pacing a pool, NULL if it has none.
+	http_limiter *http_pool_limiter(http_pool *pool);
+
+	// Endpoints requests of a pool are spread over, NULL without a pool.
+	http_endpoints *http_pool_endpoints(http_pool *pool);
+
+	/**
+	 * Replace the settings of a circuit breaker. Its state is kept, so that connectors sharing the breaker
+	 * do not see an open circuit close because another one reconfigured it; a disabled breaker is closed.
+	 * @param breaker circuit breaker
+	 * @param config new settings
+	 */
+	void http_breaker_configure(http_breaker *breaker,
+			const circuit_breaker_config *config);
+
+	/**
+	 * Checks if an attempt may be made. An open circuit becomes half-open after its open time
+	 * and then lets a limited number of probes through.
+	 * @param breaker circuit breaker, may be NULL
+	 * @return non zero if the attempt may be made
+	 */
+	int http_breaker_allow(http_breaker *breaker);
+
+	/**
+	 * Record the outcome of an attempt.
+	 * @param breaker circuit breaker, may be NULL
+	 * @param failed non zero if the attempt failed, negative if it tells nothing about the endpoint
+	 * such as a throttled request; a half-open probe is then handed back
+	 */
+	void http_breaker_record(http_breaker *breaker,
+			int failed);
+
+	/**
+	 * Classify an attempt for a circuit breaker. Any transport error and 5xx responses are failures,
+	 * whether or not they are worth retrying; 429 only says the client sends too much.
+	 * @param result curl result of the attempt
+	 * @param code http status received
+	 * @return 1 if the attempt failed, 0 if it succeeded, -1 if it does not count
+	 */
+	int http_breaker_outcome(CURLcode result,
+			long code);
+
+	// Current state of a circuit breaker, CIRCUIT_CLOSED when breaker is NULL.
+	circuit_state http_breaker_state(http_breaker *breaker);
+
+	/**
+	 * Get the rate limiter registered for an API key, creating it on first use.
+	 * @param limiter limiter, to be released with http_limiter_release()
+	 * @param api_key api key the requests are made with
+	 * @return enum containing status from CURL command
+	 */
+	CURLcode http_limiter_acquire(http_limiter **limiter,
+			const char *api_key);
+
+	// Drop a reference on a rate limiter, it is freed with the last one.
+	void http_limiter_release(http_limiter *limiter);
+
+	// Apply new settings to a rate limiter, the bucket starts full.
+	void http_limiter_configure(http_limiter *limiter,
+			const rate_limit_config *config);
+
+	// Longest a request waits for the limiter, DEFAULT_RATE_LIMIT_MAX_QUEUE_MS when limiter is NULL.
+	long http_limiter_max_queue_ms(http_limiter *limiter);
+
+	/**
+	 * Take a token for the next request. A request which has to wait is counted as queued until
+	 * http_limiter_dequeue() is called.
+	 * @param limiter limiter, NULL for no limit
+	 * @param not_after http_now_ms() time the request must have been sent by, 0 for none
+	 * @return milliseconds to wait before sending the request, -1 if that is past not_after
+	 */
+	long http_limiter_reserve(http_limiter *limiter,
+			long long not_after);
+
+	// Take a request waited for waited_ms off the queue.
+	void http_limiter_dequeue(http_limiter *limiter,
+			long waited_ms);
+
+	/**
+	 * Block until the next request may be sent.
+	 * @param limiter limiter, NULL for no limit
+	 * @param not_after http_now_ms() time the request must have been sent by, 0 for none
+	 * @return CURLE_OK, CURLE_AGAIN if the request cannot be sent in time
+	 */
+	CURLcode http_limiter_wait(http_limiter *limiter,
+			long long not_after);
+
+	/**
+	 * Adapt the pace to a response: 429 pauses all requests and halves the rate, successful
+	 * responses recover it, and an exhausted RateLimit-Remaining pauses until the quota resets.
+	 * @param limiter limiter, NULL for no limit
+	 * @param code HTTP status code, 0 if no response was received
+	 * @param retry_after_ms Retry-After of the response, 0 if none
+	 * @param headers rate limit headers of the response
+	 */
+	void http_limiter_record(http_limiter *limiter,
+			long code,
+			long retry_after_ms,
+			const struct write_headers *headers);
+
+	// Copy the statistics of a limiter, zeroed when limiter is NULL.
+	void http_limiter_get_stats(http_limiter *limiter,
+			rate_limit_stats *stats);
+
+	/**
+	 * Replace the endpoints requests are spread over. Their statistics start afresh.
+	 * @param endpoints endpoints of a pool
+	 * @param urls endpoint urls, validated by the caller
+	 * @param count number of urls, at most MAX_ENDPOINTS; 0 to only use the connector's api_url
+	 */
+	void http_endpoints_set(http_endpoints *endpoints,
+			const char **urls,
+			int count);
+
+	/**
+	 * Pick the endpoint for a request: the healthy endpoint with the lowest latency weighted by its error rate.
+	 * Endpoints without a successful attempt yet are tried first, and every ENDPOINT_PROBE_INTERVAL requests go
+	 * to the endpoint left unused the longest so that its averages stay current. Endpoints whose circuit is open
+	 * are left out. When all endpoints are out of rotation, one whose circuit is not open is preferred, then the
+	 * one coming back first.
+	 * @param endpoints endpoints of a pool
+	 * @param tried bitmask of the endpoints which already failed the request
+	 * @param url receives the url of the endpoint, API_URL_MAX_LEN + 1 chars
+	 * @return index of the endpoint, -1 if there are no endpoints or all were tried
+	 */
+	int http_endpoints_pick(http_endpoints *endpoints,
+			unsigned int tried,
+			char *url);
+
+	/**
+	 * Account an attempt to the endpoint url starts with.
+	 * @param endpoints endpoints of a pool, may be NULL
+	 * @param url url the attempt was made to
+	 * @param latency_ms time the attempt took
+	 * @param failed the attempt failed without a response, or with 429 or 5xx
+	 */
+	void http_endpoints_record(http_endpoints *endpoints,
+			const char *url,
+			long latency_ms,
+			int failed);
+
+	// Whether the last attempt made to endpoint index failed or its circuit is open, in which case requests fail over.
+	int http_endpoints_failing(http_endpoints *endpoints,
+			int index);
+
+	/**
+	 * Copy the statistics of the endpoints.
+	 * @param endpoints endpoints of a pool
+	 * @param stats receives up to MAX_ENDPOINTS entries
+	 * @return number of endpoints
+	 */
+	int http_endpoints_get_stats(http_endpoints *endpoints,
+			endpoint_stats *stats);
+
+	// Milliseconds on a monotonic clock, used for retry and timeout bookkeeping.
+	long long http_now_ms(void);
+
+	/**
+	 * Initializes libcurl on first use for applications that never called http_global_init().
+	 * @return enum containing status from CURL command
+	 */
+	CURLcode http_ensure_global_init(void);
+
+	/**
+	 * Take a handle from pool, or create a one-shot handle when pool is NULL.
+	 * @param pool pool to take the handle from, may be NULL
+	 * @return curl easy handle or NULL on allocation failure
+	 */
+	CURL *http_handle_acquire(http_pool *pool);
+
+	// Return a handle taken with http_handle_acquire().
+	void http_handle_release(http_pool *pool,
+			CURL *curl);
+
+	/**
+	 * Set up a handle for a request to Intel Trust Authority. A POST is made when body is not NULL.
+	 * @param curl handle to set up
+	 * @param url containing url of Intel Trust Authority
+	 * @param api_key  a char pointer containing Intel Trust Authority api key
+	 * @param accept accept header
+	 * @param request_id id to uniquely identify the request
+	 * @param content_type content type header
+	 * @param body request body, must stay valid until the transfer is done
+	 * @param body_len length of body, 0 if body is a string
+	 * @param content_encoding encoding of body, NULL if it is not encoded
+	 * @param write_result buffer receiving the response body
+	 * @param write_headers buffer receiving the response headers
+	 * @param pool pool the handle was taken from, may be NULL
+	 * @return request header list to be freed with curl_slist_free_all() after the transfer
+	 */
+	struct curl_slist *http_request_prepare(CURL *curl,
+			const char *url,
+			const char *api_key,
+			const char *accept,
+			const char *request_id,
+			const char *content_type,
+			const char *body,
+			size_t body_len,
+			const char *content_encoding,
+			struct write_result *write_result,
+			struct write_headers *write_headers,
+			http_pool *pool);
+
+	/**
+	 * Limit the next attempt on a handle to the time left until deadline, covering connect and transfer.
+	 * @param curl handle to set up
+	 * @param deadline http_now_ms() time by which the request must be done, 0 for none
+	 * @return CURLE_OPERATION_TIMEDOUT if the deadline has passed, CURLE_OK otherwise
+	 */
+	CURLcode http_apply_deadline(CURL *curl,
+			long long deadline);
+
+	/**
+	 * Checks if a request should be retried. Transient network errors and 429/5xx answers are retried.
+	 * @param result CURL result of the attempt
+	 * @param code HTTP status code, only used when result is CURLE_OK
+	 * @return non zero if the request should be retried
+	 */
+	int http_is_retryable(CURLcode result,
+			long code);
+
+	// Milliseconds the server asked to wait through a Retry-After header, 0 if it did not.
+	long http_retry_after_ms(CURL *curl);
+
+	/**
+	 * Computes how long to wait before a retry: exponential backoff with optional full jitter,
+	 * extended to the Retry-After delay when retries->retry_after is set. The Retry-After delay
+	 * is not capped by retries->retry_max_delay_ms. Safe to call from any thread.
+	 * @param retries retry policy
+	 * @param retry_count number of retries made so far
+	 * @param retry_after_ms delay asked for by the server, 0 if none
+	 * @return delay in milliseconds
+	 */
+	long http_retry_delay_ms(const retry_config *retries,
+			int retry_count,
+			long retry_after_ms);
+
+	// Drop a received response so the buffers can be reused by another attempt.
+	void http_response_reset(struct write_result *write_result,
+			struct write_headers *write_headers);
+
+	/**
+	 * Hand over the received response body and headers to the caller without copying them.
+	 * The headers are indexed by name on the way.
+	 * @param write_result buffer holding the response body
+	 * @param write_headers buffer holding the response headers
+	 * @param response response body, to be freed by the caller
+	 * @param resp_headers response headers, to be freed with response_headers_free(); may be NULL
+	 * @return enum containing status from CURL command
+	 */
+	CURLcode http_response_take(struct write_result *write_result,
+			struct write_headers *write_headers,
+			char **response,
+			response_headers *resp_headers);
+
+	// Case insensitive hash of a header name, used to index response headers.
+	unsigned int http_header_hash(const char *name,
+			size_t len);
+
+	// Free response buffers which were not handed over.
+	void http_response_free(struct write_result *write_result,
+			struct write_headers *write_headers);
 
 	/**
 	 * Performs GET operation to Intel Trust Authority to get nonce/token
@@ -40,9 +667,11 @@ extern "C"
 	 * @param request_id id to uniquely identify the request
 	 * @param content_type content type header
 	 * @param response containing response recieved from Intel Trust Authority
-	 * @param response_headers response headers recieved from Intel Trust Authority
+	 * @param resp_headers response headers recieved from Intel Trust Authority, NULL to drop them
 	 * @param retries struct containing retry information
-	 * @return enum containing status from CURL command
+	 * @param pool pool of handles to reuse connections from, NULL for a one-shot handle
+	 * @param deadline http_now_ms() time by which the request must be done, 0 for none
+	 * @return enum containing status from CURL command, CURLE_OPERATION_TIMEDOUT once the deadline is hit
 	 */	
 	CURLcode get_request(const char *url,
 			const char *api_key,
@@ -50,8 +679,10 @@ extern "C"
 			const char *request_id,
 			const char *content_type,
 			char **response,
-			char **response_headers,
-			retry_config *retries);
+			response_headers *resp_headers,
+			retry_config *retries,
+			http_pool *pool,
+			long long deadline);
 
 	/**
 	 * Performs POST operation to Intel Trust Authority to get token
@@ -61,9 +692,12 @@ extern "C"
 	 * @param request_id id to uniquely identify the request
 	 * @param content_type content type header
 	 * @param response containing response recieved from Intel Trust Authority
-	 * @param response_headers response headers recieved from Intel Trust Authority
+	 * @param resp_headers response headers recieved from Intel Trust Authority, NULL to drop them
 	 * @param retries struct containing retry information
-	 * @return enum containing status from CURL command
+	 * @param pool pool of handles to reuse connections from, NULL for a one-shot handle
+	 * @param deadline http_now_ms() time by which the request must be done, 0 for none
+	 * @param hedge send a duplicate request if the response is slow, NULL to not hedge
+	 * @return enum containing status from CURL command, CURLE_OPERATION_TIMEDOUT once the deadline is hit
 	*/	
 	CURLcode post_request(const char *url,
 			const char *api_key,
@@ -72,8 +706,31 @@ extern "C"
 			const char *content_type,
 			const char *body,
 			char **response,
-			char **response_headers,
-			retry_config *retries);
+			response_headers *resp_headers,
+			retry_config *retries,
+			http_pool *pool,
+			long long deadline,
+			const http_hedge *hedge);
+
+	/**
+	 * Performs POST operation to Intel Trust Authority with a body streamed while it is uploaded,
+	 * see post_request() for the other parameters. The stream and the data it references must
+	 * stay valid until the call returns. Streamed bodies are not gzipped.
+	 * @param stream request body
+	 * @return enum containing status from CURL command, CURLE_OPERATION_TIMEDOUT once the deadline is hit
+	 */
+	CURLcode post_request_stream(const char *url,
+			const char *api_key,
+			const char *accept,
+			const char *request_id,
+			const char *content_type,
+			const http_body_stream *stream,
+			char **response,
+			response_headers *resp_headers,
+			retry_config *retries,
+			http_pool *pool,
+			long long deadline,
+			const http_hedge *hedge);
 
 #ifdef __cplusplus
 }
@@ -4,19 +4,19 @@
  */
 
 #include <time.h>
+#include <log.h>
 
-// Returns the local date/time formatted as 2023-11-27 11:11:52
-char* getFormattedTime(void) {
+// Writes the local date/time formatted as 2023-11-27 11:11:52 to buf, safe to call from any thread
+char* getFormattedTime(char *buf, size_t len) {
 
     time_t rawtime;
-    struct tm* timeinfo;
+    struct tm timeinfo;
 
     time(&rawtime);
-    timeinfo = localtime(&rawtime);
+    if (NULL == localtime_r(&rawtime, &timeinfo) || 0 == strftime(buf, len, "%Y-%m-%d %H:%M:%S", &timeinfo))
+    {
+        buf[0] = '\0';
+    }
 
-    // Must be static, otherwise won't work
-    static char _retval[20];
-    strftime(_retval, sizeof(_retval), "%Y-%m-%d %H:%M:%S", timeinfo);
-
-    return _retval;
+    return buf;
 }
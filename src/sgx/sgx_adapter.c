@@ -158,15 +158,12 @@ int sgx_collect_evidence(void *ctx,
 
 	evidence->type = EVIDENCE_TYPE_SGX;
 
-	// Populating Evidence with SQXQuote
-	evidence->evidence = (uint8_t *)calloc(quote_size + 1, sizeof(uint8_t));
-	if (NULL == evidence->evidence)
-	{
-		status = STATUS_SGX_ERROR_BASE | STATUS_ALLOCATION_ERROR; 
-		goto ERROR;
-	}
-	memcpy(evidence->evidence, p_quote_buffer, quote_size);
+	// Populating Evidence with SQXQuote, the quote buffer is handed over
+	evidence->evidence = p_quote_buffer;
 	evidence->evidence_len = quote_size;
+	evidence->release = NULL;
+	evidence->release_ctx = NULL;
+	p_quote_buffer = NULL;
 
 	// Populating Evidence with UserData
 	evidence->runtime_data = (uint8_t *)calloc(user_data_len, sizeof(uint8_t));
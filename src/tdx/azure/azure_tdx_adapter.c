@@ -216,15 +216,12 @@ int tdx_collect_evidence_azure(void *ctx,
 
 	evidence->type = EVIDENCE_TYPE_TDX;
 
-	// Populating Evidence with TDQuote
-	evidence->evidence = (uint8_t *)calloc(quote_size, sizeof(uint8_t));
-	if (NULL == evidence->evidence)
-	{
-		status = STATUS_TDX_ERROR_BASE | STATUS_ALLOCATION_ERROR;
-		goto ERROR;
-	}
-	memcpy(evidence->evidence, td_quote, quote_size);
+	// Populating Evidence with TDQuote, the decoded quote is handed over
+	evidence->evidence = td_quote;
 	evidence->evidence_len = quote_size;
+	evidence->release = NULL;
+	evidence->release_ctx = NULL;
+	td_quote = NULL;
 
 	// Populating Evidence with UserData
 	evidence->user_data = (uint8_t *)calloc(user_data_len, sizeof(uint8_t));
@@ -238,18 +235,9 @@ int tdx_collect_evidence_azure(void *ctx,
 	memcpy(evidence->user_data, user_data, user_data_len);
 	evidence->user_data_len = user_data_len;
 
-	evidence->runtime_data = (uint8_t *)calloc(runtime_data_len, sizeof(uint8_t));
-	if (NULL == evidence->runtime_data)
-	{
-		free(evidence->user_data);
-		free(evidence->evidence);
-		evidence->user_data = NULL;
-		evidence->evidence = NULL;
-		status = STATUS_ALLOCATION_ERROR;
-		goto ERROR;
-	}
-	memcpy(evidence->runtime_data, runtime_data, runtime_data_len);
+	evidence->runtime_data = runtime_data;
 	evidence->runtime_data_len = runtime_data_len;
+	runtime_data = NULL;
 	evidence->event_log = NULL;
 	evidence->event_log_len = 0;
 
@@ -383,14 +371,24 @@ int get_td_report(uint8_t *report_data, uint8_t **tpm_report)
 		DEBUG("Created NV Index: 0x%x\n", pub_templ.nvPublic.nvIndex);
 	}
 
-	// Get a random number to be appended to the end of file name to make it random
-	int rand_num = rand();
-	char filename[50];
-	// Create file name
-	sprintf(filename, "/tmp/report_azure_%d.txt", rand_num);
-	FILE *tmpFile = fopen(filename, "w");
-	fwrite(report_data, 1, TDX_REPORT_DATA_SIZE, tmpFile);
-	fclose(tmpFile);
+	// mkstemp picks a unique name without the shared state of rand(), so adapters can run on many threads
+	char filename[] = "/tmp/report_azure_XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd < 0)
+	{
+		ERROR("Unable to create report data file");
+		status = STATUS_TPM_NV_WRITE_FAILED_ERROR;
+		goto ERROR;
+	}
+	if (TDX_REPORT_DATA_SIZE != write(fd, report_data, TDX_REPORT_DATA_SIZE))
+	{
+		close(fd);
+		remove(filename);
+		ERROR("Unable to write report data file");
+		status = STATUS_TPM_NV_WRITE_FAILED_ERROR;
+		goto ERROR;
+	}
+	close(fd);
 
 	/*Write report data to nv Index 0x01400002*/
 	char tpm_write_command[100];
@@ -399,6 +397,7 @@ int get_td_report(uint8_t *report_data, uint8_t **tpm_report)
 	output = popen(tpm_write_command, "r");
 	if (output == NULL || pclose(output) == -1)
 	{
+		remove(filename);
 		ERROR("Unable to write to index 0x01400002");
 		status = STATUS_TPM_NV_WRITE_FAILED_ERROR;
 		goto ERROR;
@@ -484,7 +483,6 @@ ERROR:
 int get_td_quote(uint8_t *td_report, uint8_t **td_quote, uint16_t *quote_size)
 {
 	char *response = NULL;
-	char *headers = NULL;
 	const char azure_tdquote_url[API_URL_MAX_LEN + 1] = "http://169.254.169.254/acc/tdquote";
 	char *json_request;
 	retry_config retryConfig = {0};
@@ -520,7 +518,7 @@ int get_td_quote(uint8_t *td_report, uint8_t **td_quote, uint16_t *quote_size)
 	retryConfig.retry_max = 0;
 	retryConfig.retry_wait_time = 0;
 
-	status = post_request(azure_tdquote_url, NULL, ACCEPT_APPLICATION_JSON, NULL, CONTENT_TYPE_APPLICATION_JSON, json_request, &response, &headers, &retryConfig);
+	status = post_request(azure_tdquote_url, NULL, ACCEPT_APPLICATION_JSON, NULL, CONTENT_TYPE_APPLICATION_JSON, json_request, &response, NULL, &retryConfig, NULL, 0, NULL);
 	if (NULL == response || CURLE_OK != status)
 	{
 		ERROR("Error: POST request to %s failed", azure_tdquote_url);
@@ -563,12 +561,6 @@ ERROR:
 		response = NULL;
 	}
 
-	if (headers)
-	{
-		free(headers);
-		headers = NULL;
-	}
-
 	if (json_request)
 	{
 		free(json_request);
@@ -22,6 +22,13 @@ typedef tdx_attest_error_t (*tdx_get_quote_fx)(const tdx_report_data_t *p_tdx_re
 		uint32_t *p_quote_size,
 		uint32_t flags);
 
+// Quotes are handed over in the buffer of libtdx_attest, which must free them
+static void tdx_release_quote(void *ctx,
+		uint8_t *data)
+{
+	tdx_att_free_quote(data);
+}
+
 int tdx_adapter_new(evidence_adapter **adapter)
 {
 	tdx_adapter_context *ctx = NULL;
@@ -148,23 +155,19 @@ int tdx_collect_evidence(void *ctx,
 	}
 
 	evidence->type = EVIDENCE_TYPE_TDX;
-	// Populating Evidence with TDQuote
-	evidence->evidence = (uint8_t *)calloc(quote_size, sizeof(uint8_t));
-	if (NULL == evidence->evidence)
-	{
-		status = STATUS_TDX_ERROR_BASE | STATUS_ALLOCATION_ERROR;
-		goto ERROR;
-	}
-	memcpy(evidence->evidence, p_quote_buf, quote_size);
+	// Populating Evidence with TDQuote, the buffer of libtdx_attest is handed over
+	evidence->evidence = p_quote_buf;
 	evidence->evidence_len = quote_size;
-	tdx_att_free_quote(p_quote_buf);
+	evidence->release = tdx_release_quote;
+	evidence->release_ctx = NULL;
 
 	// Populating Evidence with UserData
 	evidence->runtime_data = (uint8_t *)calloc(user_data_len, sizeof(uint8_t));
 	if (NULL == evidence->runtime_data)
 	{
-		free(evidence->evidence);
+		tdx_release_quote(NULL, evidence->evidence);
 		evidence->evidence = NULL;
+		evidence->release = NULL;
 		status = STATUS_ALLOCATION_ERROR;
 		goto ERROR;
 	}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <connector.h>
+#include <token_provider.h>
+#include <api.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	// One token collection going through the stages of a pipeline, possibly on different threads.
+	typedef struct attestation_run
+	{
+		trust_authority_connector *connector;
+		response_headers *resp_headers;
+		token *token;
+		collect_token_args args;
+		attestation_pipeline pipeline;
+		uint8_t *user_data;
+		uint32_t user_data_len;
+		long long deadline; /* http_now_ms() time by which the token must be collected, 0 for none */
+		nonce nonce;
+		evidence evidence;
+		get_token_args token_args; /* points to nonce and evidence once marshalled */
+		token_request request;
+		attestation_result result;
+	} attestation_run;
+
+	/**
+	 * Validate the arguments of a collection and start its budget.
+	 * @param run run to set up, must not move once the marshal stage ran
+	 * @return return status, nothing to free unless STATUS_OK
+	 */
+	TRUST_AUTHORITY_STATUS attestation_run_init(attestation_run *run,
+			trust_authority_connector *connector,
+			response_headers *resp_headers,
+			token *token,
+			collect_token_args *token_args,
+			const attestation_pipeline *pipeline,
+			uint8_t *user_data,
+			uint32_t user_data_len);
+
+	/**
+	 * Run the stages first to last in order, recording their timings in run->result.
+	 * @return status of the first stage which failed, STATUS_OK if none did
+	 */
+	TRUST_AUTHORITY_STATUS attestation_run_stages(attestation_run *run,
+			attestation_stage first,
+			attestation_stage last);
+
+	// Free the nonce, evidence and request of a run.
+	void attestation_run_free(attestation_run *run);
+
+	// Copy of a collect_token request, so that the token can be collected again after the caller's args are gone.
+	typedef struct collect_token_request
+	{
+		trust_authority_connector *connector;
+		evidence_adapter adapter;
+		policies policies;
+		char *token_signing_alg;
+		int timeout_ms;
+		uint8_t *user_data;
+		uint32_t user_data_len;
+	} collect_token_request;
+
+	/**
+	 * Copy the args of a collect_token request. The connector and adapter context are not copied.
+	 * @param request copy made
+	 * @return return status, nothing to free unless STATUS_OK
+	 */
+	TRUST_AUTHORITY_STATUS collect_token_request_copy(collect_token_request *request,
+			trust_authority_connector *connector,
+			collect_token_args *token_args,
+			evidence_adapter *adapter,
+			uint8_t *user_data,
+			uint32_t user_data_len);
+
+	// Collect a token with a copied request.
+	TRUST_AUTHORITY_STATUS collect_token_request_run(collect_token_request *request,
+			token *token);
+
+	void collect_token_request_free(collect_token_request *request);
+
+	// Read the exp claim of a JWT without verifying it, -1 if there is none.
+	long long token_exp(const char *jwt);
+
+	// Monotonic time in milliseconds, as http_now_ms(), at which the exp of a JWT is reached, -1 if it has none.
+	long long token_expires_at_ms(const char *jwt);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
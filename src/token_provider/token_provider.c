@@ -3,9 +3,18 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <jansson.h>
 #include <connector.h>
 #include <token_provider.h>
 #include <log.h>
+#include <base64.h>
+#include <api.h>
+#include <rest.h>
+#include "pipeline.h"
 
 TRUST_AUTHORITY_STATUS collect_token(trust_authority_connector *connector,
 		response_headers *resp_headers,
@@ -25,23 +34,132 @@ TRUST_AUTHORITY_STATUS collect_token(trust_authority_connector *connector,
 			user_data_len);
 }
 
-TRUST_AUTHORITY_STATUS collect_token_callback(trust_authority_connector *connector,
+static long long pipeline_now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static TRUST_AUTHORITY_STATUS stage_nonce(attestation_run *run)
+{
+	TRUST_AUTHORITY_STATUS result = STATUS_OK;
+	get_nonce_args nonce_args = {0};
+
+	// A prefetched nonce saves a round trip, otherwise fetch one now
+	result = trust_authority_connector_take_nonce(run->connector, &run->nonce);
+	if (STATUS_OK != result)
+	{
+		nonce_args.request_id = run->args.request_id;
+		nonce_args.deadline = run->deadline;
+		result = get_nonce(run->connector, &run->nonce, &nonce_args, NULL);
+	}
+	if (STATUS_OK != result)
+	{
+		ERROR("Error: Failed to get Trust Authority nonce 0x%04x\n", result);
+	}
+
+	return result;
+}
+
+static TRUST_AUTHORITY_STATUS stage_evidence(attestation_run *run)
+{
+	TRUST_AUTHORITY_STATUS result = STATUS_OK;
+
+	// No time would be left to attest a quote generated now
+	if (trust_authority_deadline_expired(run->deadline))
+	{
+		ERROR("Error: No time left to collect evidence\n");
+		return STATUS_DEADLINE_EXCEEDED_ERROR;
+	}
+
+	// The attest connection may be closed by the time the quote is ready, keep it open meanwhile
+	connector_preconnect(run->connector, run->deadline);
+	result = run->pipeline.collect_evidence(run->pipeline.ctx, &run->evidence, &run->nonce, run->user_data, run->user_data_len);
+	if (STATUS_OK != result)
+	{
+		ERROR("Error: Failed to collect evidence from adapter 0x%04x\n", result);
+		return result;
+	}
+
+	// Quote generation is not interruptible, give up before attesting once it used up the budget
+	if (trust_authority_deadline_expired(run->deadline))
+	{
+		ERROR("Error: No time left to get Trust Authority token\n");
+		return STATUS_DEADLINE_EXCEEDED_ERROR;
+	}
+
+	DEBUG("Evidence[%d] @%p", run->evidence.evidence_len, run->evidence.evidence);
+
+	return STATUS_OK;
+}
+
+static TRUST_AUTHORITY_STATUS stage_marshal(attestation_run *run)
+{
+	run->token_args.evidence = &run->evidence;
+	run->token_args.nonce = &run->nonce;
+	run->token_args.token_signing_alg = run->args.token_signing_alg;
+	run->token_args.request_id = run->args.request_id;
+	run->token_args.policies = run->args.policies;
+	run->token_args.deadline = run->deadline;
+
+	return token_request_marshal(run->connector, &run->token_args, &run->request);
+}
+
+static TRUST_AUTHORITY_STATUS stage_attest(attestation_run *run)
+{
+	TRUST_AUTHORITY_STATUS result = STATUS_OK;
+
+	result = token_request_send(run->connector, run->resp_headers, run->token, &run->token_args, &run->request,
+			run->pipeline.attestation_endpoint);
+	if (STATUS_OK != result)
+	{
+		ERROR("Error: Failed to get Trust Authority token 0x%04x\n", result);
+	}
+
+	return result;
+}
+
+static TRUST_AUTHORITY_STATUS stage_verify(attestation_run *run)
+{
+	TRUST_AUTHORITY_STATUS result = STATUS_OK;
+
+	result = run->pipeline.verify(run->pipeline.verify_ctx, run->token);
+	if (STATUS_OK != result)
+	{
+		ERROR("Error: Failed to verify Trust Authority token 0x%04x\n", result);
+	}
+
+	return result;
+}
+
+static const struct
+{
+	const char *name;
+	TRUST_AUTHORITY_STATUS (*run)(attestation_run *run);
+} pipeline_stages[ATTESTATION_STAGE_COUNT] = {
+	{"nonce", stage_nonce},
+	{"evidence", stage_evidence},
+	{"marshal", stage_marshal},
+	{"attest", stage_attest},
+	{"verify", stage_verify},
+};
+
+const char *attestation_stage_name(attestation_stage stage)
+{
+	return (stage >= 0 && stage < ATTESTATION_STAGE_COUNT) ? pipeline_stages[stage].name : "unknown";
+}
+
+TRUST_AUTHORITY_STATUS attestation_run_init(attestation_run *run,
+		trust_authority_connector *connector,
 		response_headers *resp_headers,
 		token *token,
-		collect_token_args *collect_token_args,
-		evidence_callback callback,
-		void *ctx,
+		collect_token_args *token_args,
+		const attestation_pipeline *pipeline,
 		uint8_t *user_data,
 		uint32_t user_data_len)
 {
-	int result;
-	nonce nonce = {0};
-	response_headers nonce_headers = {0};
-	evidence evidence = {0};
-	uint8_t hash[SHA512_LEN] = {0};
-	get_nonce_args nonce_args = {0};
-	get_token_args token_args = {0};
-
 	if (NULL == connector)
 	{
 		return STATUS_NULL_CONNECTOR;
@@ -52,66 +170,581 @@ TRUST_AUTHORITY_STATUS collect_token_callback(trust_authority_connector *connect
 		return STATUS_NULL_TOKEN;
 	}
 
-	if (NULL == ctx)
+	if (NULL == token_args || NULL == pipeline || NULL == pipeline->collect_evidence || NULL == pipeline->ctx)
 	{
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	nonce_args.request_id = collect_token_args->request_id;
-	result = get_nonce(connector, &nonce, &nonce_args, &nonce_headers);
-	if (result != STATUS_OK)
+	memset(run, 0, sizeof(*run));
+	run->connector = connector;
+	run->resp_headers = resp_headers;
+	run->token = token;
+	run->args = *token_args;
+	run->pipeline = *pipeline;
+	if (NULL == run->pipeline.attestation_endpoint)
 	{
-		ERROR("Error: Failed to get Trust Authority nonce 0x%04x\n", result);
-		goto ERROR;
+		run->pipeline.attestation_endpoint = "/appraisal/v1/attest";
 	}
+	run->user_data = user_data;
+	run->user_data_len = user_data_len;
+	run->result.failed_stage = -1;
+	// One budget covers all stages
+	run->deadline = trust_authority_deadline(token_args->timeout_ms);
 
-	//This calls sgx_collect_evidence/tdx_collect_evidence to get the quote.
-	result = callback(ctx, &evidence, &nonce, user_data, user_data_len);
-	if (result != STATUS_OK)
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS attestation_run_stages(attestation_run *run,
+		attestation_stage first,
+		attestation_stage last)
+{
+	TRUST_AUTHORITY_STATUS result = STATUS_OK;
+
+	for (int stage = first; stage <= last && stage < ATTESTATION_STAGE_COUNT; stage++)
 	{
-		ERROR("Error: Failed to collect evidence from adapter 0x%04x\n", result);
-		goto ERROR;
+		stage_timing *timing = &run->result.stages[stage];
+
+		if (ATTESTATION_STAGE_VERIFY == stage && NULL == run->pipeline.verify)
+		{
+			continue;
+		}
+
+		timing->start_us = pipeline_now_us();
+		result = pipeline_stages[stage].run(run);
+		timing->end_us = pipeline_now_us();
+		DEBUG("Stage %s took %lldus\n", pipeline_stages[stage].name, timing->end_us - timing->start_us);
+		if (STATUS_OK != result)
+		{
+			run->result.failed_stage = stage;
+			return result;
+		}
 	}
 
-	DEBUG("Evidence[%d] @%p", evidence.evidence_len, evidence.evidence);
+	return STATUS_OK;
+}
 
-	token_args.token_signing_alg = collect_token_args->token_signing_alg;
-	token_args.request_id = collect_token_args->request_id;
-	token_args.policies = collect_token_args->policies;
-	token_args.evidence = &evidence;
-	token_args.nonce = &nonce;
+void attestation_run_free(attestation_run *run)
+{
+	token_request_free(&run->request);
+	nonce_free(&run->nonce);
+	evidence_free(&run->evidence);
+}
 
-	result = get_token(connector, resp_headers, token, &token_args, "/appraisal/v1/attest");
-	if (STATUS_OK != result)
+TRUST_AUTHORITY_STATUS collect_token_pipeline(trust_authority_connector *connector,
+		response_headers *resp_headers,
+		token *token,
+		collect_token_args *token_args,
+		const attestation_pipeline *pipeline,
+		uint8_t *user_data,
+		uint32_t user_data_len,
+		attestation_result *result)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_OK;
+	attestation_run run;
+
+	status = attestation_run_init(&run, connector, resp_headers, token, token_args, pipeline, user_data, user_data_len);
+	if (STATUS_OK != status)
+	{
+		return status;
+	}
+
+	status = attestation_run_stages(&run, ATTESTATION_STAGE_NONCE, ATTESTATION_STAGE_VERIFY);
+	if (NULL != result)
+	{
+		*result = run.result;
+	}
+	attestation_run_free(&run);
+
+	return status;
+}
+
+TRUST_AUTHORITY_STATUS collect_token_callback(trust_authority_connector *connector,
+		response_headers *resp_headers,
+		token *token,
+		collect_token_args *collect_token_args,
+		evidence_callback callback,
+		void *ctx,
+		uint8_t *user_data,
+		uint32_t user_data_len)
+{
+	attestation_pipeline pipeline = {0};
+
+	//This calls sgx_collect_evidence/tdx_collect_evidence to get the quote.
+	pipeline.collect_evidence = callback;
+	pipeline.ctx = ctx;
+
+	return collect_token_pipeline(connector, resp_headers, token, collect_token_args, &pipeline, user_data, user_data_len, NULL);
+}
+
+TRUST_AUTHORITY_STATUS collect_token_azure(trust_authority_connector *connector,
+		response_headers *resp_headers,
+		token *token,
+		collect_token_args *collect_token_args,
+		evidence_adapter *adapter,
+		uint8_t *user_data,
+		uint32_t user_data_len)
+{
+	attestation_pipeline pipeline = {0};
+
+	//This calls tdx_collect_evidence_azure to get the quote.
+	pipeline.attestation_endpoint = "/appraisal/v1/attest/azure/tdxvm";
+	pipeline.collect_evidence = (NULL != adapter) ? adapter->collect_evidence : NULL;
+	pipeline.ctx = (NULL != adapter) ? adapter->ctx : NULL;
+
+	return collect_token_pipeline(connector, resp_headers, token, collect_token_args, &pipeline, user_data, user_data_len, NULL);
+}
+
+// Cached token with what is needed to collect it again.
+typedef struct token_cache_entry
+{
+	uint8_t key[SHA512_LEN];
+	char *jwt;
+	long long expires_at; /* monotonic time after which the token is not handed out */
+	int used; /* read since it was collected, only tokens in use are refreshed */
+	int refreshing;
+	long long retry_at; /* monotonic time a failed refresh is retried, 0 if none failed */
+	collect_token_request request;
+} token_cache_entry;
+
+struct token_cache
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* wakes the refresh thread when entries change or the cache stops */
+	pthread_t thread;
+	token_cache_config config; /* defaults applied */
+	token_cache_entry **entries;
+	int count;
+	int stop;
+	token_cache_stats stats;
+};
+
+static long long monotonic_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long long realtime_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long token_exp(const char *jwt)
+{
+	const char *payload = NULL;
+	const char *end = NULL;
+	char *b64 = NULL;
+	unsigned char *buf = NULL;
+	size_t len = 0, padded = 0, output_length = 0;
+	json_t *claims = NULL;
+	json_t *exp = NULL;
+	long long result = -1;
+
+	payload = (NULL != jwt) ? strchr(jwt, '.') : NULL;
+	end = (NULL != payload) ? strchr(payload + 1, '.') : NULL;
+	if (NULL == end)
+	{
+		return -1;
+	}
+	payload++;
+	len = end - payload;
+	padded = (len + 3) / 4 * 4;
+
+	b64 = (char *)calloc(1, padded + 1);
+	output_length = padded / 4 * 3;
+	buf = (unsigned char *)calloc(1, output_length + 1);
+	if (NULL == b64 || NULL == buf)
+	{
+		goto ERROR;
+	}
+	memcpy(b64, payload, len);
+	memset(b64 + len, '=', padded - len);
+	if (BASE64_SUCCESS != base64_decode(b64, padded, buf, &output_length))
 	{
-		ERROR("Error: Failed to get Trust Authority token 0x%04x\n", result);
 		goto ERROR;
 	}
 
-	result = STATUS_OK;
+	claims = json_loads((const char *)buf, 0, NULL);
+	exp = (NULL != claims) ? json_object_get(claims, "exp") : NULL;
+	if (NULL != exp && json_is_integer(exp))
+	{
+		result = (long long)json_integer_value(exp);
+	}
 
 ERROR:
-	nonce_free(&nonce);
-	response_headers_free(&nonce_headers);
-	evidence_free(&evidence);
+	if (NULL != claims)
+	{
+		json_decref(claims);
+	}
+	free(b64);
+	free(buf);
 	return result;
 }
 
-TRUST_AUTHORITY_STATUS collect_token_azure(trust_authority_connector *connector,
+long long token_expires_at_ms(const char *jwt)
+{
+	long long exp = token_exp(jwt);
+
+	if (exp < 0)
+	{
+		return -1;
+	}
+
+	return monotonic_ms() + (exp * 1000 - realtime_ms());
+}
+
+// Digest identifying the token a request collects
+static TRUST_AUTHORITY_STATUS token_cache_key(uint8_t *key,
+		trust_authority_connector *connector,
+		evidence_adapter *adapter,
+		collect_token_args *token_args,
+		uint8_t *user_data,
+		uint32_t user_data_len)
+{
+	const char *alg = (NULL != token_args->token_signing_alg) ? token_args->token_signing_alg : "";
+	unsigned int md_len = 0;
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+
+	if (NULL == mdctx)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	EVP_DigestInit_ex(mdctx, EVP_sha512(), NULL);
+	EVP_DigestUpdate(mdctx, &connector, sizeof(connector));
+	EVP_DigestUpdate(mdctx, &adapter->collect_evidence, sizeof(adapter->collect_evidence));
+	EVP_DigestUpdate(mdctx, &adapter->ctx, sizeof(adapter->ctx));
+	EVP_DigestUpdate(mdctx, alg, strlen(alg) + 1);
+	if (NULL != token_args->policies)
+	{
+		for (uint32_t i = 0; i < token_args->policies->count; i++)
+		{
+			EVP_DigestUpdate(mdctx, token_args->policies->ids[i], strlen(token_args->policies->ids[i]) + 1);
+		}
+	}
+	// Length first so that policy ids and user data cannot run into each other
+	EVP_DigestUpdate(mdctx, &user_data_len, sizeof(user_data_len));
+	if (user_data_len > 0)
+	{
+		EVP_DigestUpdate(mdctx, user_data, user_data_len);
+	}
+	EVP_DigestFinal_ex(mdctx, key, &md_len);
+	EVP_MD_CTX_free(mdctx);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS collect_token_request_copy(collect_token_request *request,
+		trust_authority_connector *connector,
+		collect_token_args *token_args,
+		evidence_adapter *adapter,
+		uint8_t *user_data,
+		uint32_t user_data_len)
+{
+	memset(request, 0, sizeof(*request));
+	request->connector = connector;
+	request->adapter = *adapter;
+	request->timeout_ms = token_args->timeout_ms;
+	if (NULL != token_args->policies && token_args->policies->count > 0)
+	{
+		request->policies.ids = (char **)calloc(token_args->policies->count, sizeof(char *));
+		if (NULL == request->policies.ids)
+		{
+			goto ERROR;
+		}
+		for (uint32_t i = 0; i < token_args->policies->count; i++)
+		{
+			request->policies.ids[i] = strdup(token_args->policies->ids[i]);
+			if (NULL == request->policies.ids[i])
+			{
+				goto ERROR;
+			}
+			request->policies.count++;
+		}
+	}
+	if (NULL != token_args->token_signing_alg)
+	{
+		request->token_signing_alg = strdup(token_args->token_signing_alg);
+		if (NULL == request->token_signing_alg)
+		{
+			goto ERROR;
+		}
+	}
+	if (user_data_len > 0)
+	{
+		request->user_data = (uint8_t *)malloc(user_data_len);
+		if (NULL == request->user_data)
+		{
+			goto ERROR;
+		}
+		memcpy(request->user_data, user_data, user_data_len);
+		request->user_data_len = user_data_len;
+	}
+
+	return STATUS_OK;
+
+ERROR:
+	collect_token_request_free(request);
+	return STATUS_ALLOCATION_ERROR;
+}
+
+TRUST_AUTHORITY_STATUS collect_token_request_run(collect_token_request *request,
+		token *token)
+{
+	collect_token_args args = {0};
+
+	args.policies = &request->policies;
+	args.token_signing_alg = request->token_signing_alg;
+	args.timeout_ms = request->timeout_ms;
+
+	return collect_token(request->connector, NULL, token, &args, &request->adapter, request->user_data, request->user_data_len);
+}
+
+void collect_token_request_free(collect_token_request *request)
+{
+	for (uint32_t i = 0; i < request->policies.count; i++)
+	{
+		free(request->policies.ids[i]);
+	}
+	free(request->policies.ids);
+	free(request->token_signing_alg);
+	free(request->user_data);
+	memset(request, 0, sizeof(*request));
+}
+
+static void token_cache_entry_free(token_cache_entry *entry)
+{
+	if (NULL == entry)
+	{
+		return;
+	}
+	collect_token_request_free(&entry->request);
+	free(entry->jwt);
+	free(entry);
+}
+
+static token_cache_entry *token_cache_entry_new(const uint8_t *key,
+		trust_authority_connector *connector,
+		evidence_adapter *adapter,
+		collect_token_args *token_args,
+		uint8_t *user_data,
+		uint32_t user_data_len)
+{
+	token_cache_entry *entry = (token_cache_entry *)calloc(1, sizeof(token_cache_entry));
+
+	if (NULL == entry)
+	{
+		return NULL;
+	}
+
+	memcpy(entry->key, key, SHA512_LEN);
+	if (STATUS_OK != collect_token_request_copy(&entry->request, connector, token_args, adapter, user_data, user_data_len))
+	{
+		free(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+// Time a token stops being handed out, -1 if it has no exp and must not be cached
+static long long token_cache_expiry(token_cache *cache,
+		const char *jwt)
+{
+	long long expires_at = token_expires_at_ms(jwt);
+
+	return (expires_at < 0) ? -1 : expires_at - cache->config.expiry_margin_ms;
+}
+
+static token_cache_entry *token_cache_find(token_cache *cache,
+		const uint8_t *key)
+{
+	for (int i = 0; i < cache->count; i++)
+	{
+		if (0 == memcmp(cache->entries[i]->key, key, SHA512_LEN))
+		{
+			return cache->entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void token_cache_remove(token_cache *cache,
+		int index)
+{
+	token_cache_entry_free(cache->entries[index]);
+	cache->entries[index] = cache->entries[--cache->count];
+}
+
+static void *token_cache_run(void *arg)
+{
+	token_cache *cache = (token_cache *)arg;
+
+	pthread_mutex_lock(&cache->lock);
+	while (!cache->stop)
+	{
+		long long now = monotonic_ms();
+		long long wake_at = 0;
+		token_cache_entry *due = NULL;
+
+		for (int i = 0; i < cache->count;)
+		{
+			token_cache_entry *entry = cache->entries[i];
+			long long refresh_at = (0 != entry->retry_at) ? entry->retry_at : entry->expires_at - cache->config.refresh_ahead_ms;
+
+			// Expired tokens nobody asked for lately are dropped
+			if (!entry->refreshing && now >= entry->expires_at)
+			{
+				token_cache_remove(cache, i);
+				continue;
+			}
+			if (!entry->refreshing && entry->used && now >= refresh_at && NULL == due)
+			{
+				due = entry;
+			}
+			if (!entry->refreshing && entry->used && (0 == wake_at || refresh_at < wake_at))
+			{
+				wake_at = refresh_at;
+			}
+			if (!entry->refreshing && (0 == wake_at || entry->expires_at < wake_at))
+			{
+				wake_at = entry->expires_at;
+			}
+			i++;
+		}
+
+		if (NULL != due)
+		{
+			token token = {0};
+			TRUST_AUTHORITY_STATUS status = STATUS_OK;
+			long long expires_at = -1;
+
+			// The entry is not removed while refreshing, readers keep getting the current token
+			due->refreshing = 1;
+			pthread_mutex_unlock(&cache->lock);
+			status = collect_token_request_run(&due->request, &token);
+			expires_at = (STATUS_OK == status) ? token_cache_expiry(cache, token.jwt) : -1;
+			pthread_mutex_lock(&cache->lock);
+
+			due->refreshing = 0;
+			if (expires_at > monotonic_ms())
+			{
+				free(due->jwt);
+				due->jwt = token.jwt;
+				token.jwt = NULL;
+				due->expires_at = expires_at;
+				due->used = 0;
+				due->retry_at = 0;
+				cache->stats.refreshes++;
+			}
+			else
+			{
+				ERROR("Error: Failed to refresh cached token 0x%04x\n", status);
+				due->retry_at = monotonic_ms() + TOKEN_CACHE_RETRY_MS;
+				cache->stats.refresh_failures++;
+			}
+			token_free(&token);
+			continue;
+		}
+
+		if (0 == wake_at)
+		{
+			pthread_cond_wait(&cache->cond, &cache->lock);
+		}
+		else
+		{
+			struct timespec until;
+			until.tv_sec = wake_at / 1000;
+			until.tv_nsec = (wake_at % 1000) * 1000000;
+			pthread_cond_timedwait(&cache->cond, &cache->lock, &until);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return NULL;
+}
+
+TRUST_AUTHORITY_STATUS token_cache_new(token_cache **cache,
+		const token_cache_config *config)
+{
+	token_cache *c = NULL;
+	pthread_condattr_t attr;
+
+	if (NULL == cache)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL != config && (config->expiry_margin_ms < 0 || config->refresh_ahead_ms < 0 || config->max_entries < 0))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	c = (token_cache *)calloc(1, sizeof(token_cache));
+	if (NULL == c)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+	if (NULL != config)
+	{
+		c->config = *config;
+	}
+	c->config.expiry_margin_ms = (0 != c->config.expiry_margin_ms) ? c->config.expiry_margin_ms : DEFAULT_TOKEN_CACHE_MARGIN_MS;
+	c->config.refresh_ahead_ms = (0 != c->config.refresh_ahead_ms) ? c->config.refresh_ahead_ms : DEFAULT_TOKEN_REFRESH_AHEAD_MS;
+	c->config.max_entries = (0 != c->config.max_entries) ? c->config.max_entries : DEFAULT_TOKEN_CACHE_SIZE;
+
+	c->entries = (token_cache_entry **)calloc(c->config.max_entries, sizeof(token_cache_entry *));
+	if (NULL == c->entries)
+	{
+		free(c);
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&c->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (0 != pthread_create(&c->thread, NULL, token_cache_run, c))
+	{
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->lock);
+		free(c->entries);
+		free(c);
+		return STATUS_INTERNAL_ERROR;
+	}
+
+	*cache = c;
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS collect_token_cached(token_cache *cache,
+		trust_authority_connector *connector,
 		response_headers *resp_headers,
 		token *token,
-		collect_token_args *collect_token_args,
+		collect_token_args *token_args,
 		evidence_adapter *adapter,
 		uint8_t *user_data,
 		uint32_t user_data_len)
 {
-	int result;
-	nonce nonce = {0};
-	response_headers nonce_headers = {0};
-	evidence evidence = {0};
-	uint8_t hash[SHA512_LEN] = {0};
-	get_nonce_args nonce_args = {0};
-	get_token_args token_args = {0};
+	TRUST_AUTHORITY_STATUS result = STATUS_OK;
+	uint8_t key[SHA512_LEN];
+	token_cache_entry *entry = NULL;
+	token_cache_entry *added = NULL;
+	long long expires_at = -1;
+
+	if (NULL == cache)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
 
 	if (NULL == connector)
 	{
@@ -123,46 +756,141 @@ TRUST_AUTHORITY_STATUS collect_token_azure(trust_authority_connector *connector,
 		return STATUS_NULL_TOKEN;
 	}
 
-	if (NULL == adapter->ctx)
+	if (NULL == token_args || NULL == adapter)
 	{
 		return STATUS_INVALID_PARAMETER;
 	}
 
-	nonce_args.request_id = collect_token_args->request_id;
-	result = get_nonce(connector, &nonce, &nonce_args, &nonce_headers);
-	if (result != STATUS_OK)
+	result = token_cache_key(key, connector, adapter, token_args, user_data, user_data_len);
+	if (STATUS_OK != result)
 	{
-		ERROR("Error: Failed to get Trust Authority nonce 0x%04x\n", result);
-		goto ERROR;
+		return result;
 	}
 
-	//This calls tdx_collect_evidence_azure to get the quote.
-	result = adapter->collect_evidence(adapter->ctx, &evidence, &nonce, user_data, user_data_len);
-	if (result != STATUS_OK)
+	pthread_mutex_lock(&cache->lock);
+	entry = token_cache_find(cache, key);
+	if (NULL != entry && monotonic_ms() < entry->expires_at)
 	{
-		ERROR("Error: Failed to collect evidence from adapter 0x%04x\n", result);
-		goto ERROR;
+		token->jwt = strdup(entry->jwt);
+		cache->stats.hits++;
+		if (!entry->used)
+		{
+			// The refresh thread may be waiting for the token to expire rather than to be refreshed
+			entry->used = 1;
+			pthread_cond_signal(&cache->cond);
+		}
+		pthread_mutex_unlock(&cache->lock);
+		return (NULL != token->jwt) ? STATUS_OK : STATUS_ALLOCATION_ERROR;
 	}
+	cache->stats.misses++;
+	pthread_mutex_unlock(&cache->lock);
 
-	DEBUG("Evidence[%d] @%p", evidence.evidence_len, evidence.evidence);
-	token_args.evidence = &evidence;
-	token_args.nonce = &nonce;
-	token_args.token_signing_alg = collect_token_args->token_signing_alg;
-	token_args.request_id = collect_token_args->request_id;
-	token_args.policies = collect_token_args->policies;
-
-	result = get_token(connector, resp_headers, token, &token_args, "/appraisal/v1/attest/azure/tdxvm");
+	result = collect_token(connector, resp_headers, token, token_args, adapter, user_data, user_data_len);
 	if (STATUS_OK != result)
 	{
-		ERROR("Error: Failed to get Trust Authority token 0x%04x\n", result);
-		goto ERROR;
+		return result;
+	}
+
+	expires_at = token_cache_expiry(cache, token->jwt);
+	if (expires_at <= monotonic_ms())
+	{
+		DEBUG("Token has no exp or expires within the margin, not cached\n");
+		return STATUS_OK;
 	}
 
-	result = STATUS_OK;
+	added = token_cache_entry_new(key, connector, adapter, token_args, user_data, user_data_len);
+	if (NULL == added || NULL == (added->jwt = strdup(token->jwt)))
+	{
+		// The token was collected, caching it is best effort
+		token_cache_entry_free(added);
+		return STATUS_OK;
+	}
+	added->expires_at = expires_at;
 
-ERROR:
-	nonce_free(&nonce);
-	response_headers_free(&nonce_headers);
-	evidence_free(&evidence);
-	return result;
+	pthread_mutex_lock(&cache->lock);
+	entry = token_cache_find(cache, key);
+	if (NULL != entry)
+	{
+		// Raced with another miss or a refresh, keep the token lasting longer
+		if (expires_at > entry->expires_at)
+		{
+			free(entry->jwt);
+			entry->jwt = added->jwt;
+			added->jwt = NULL;
+			entry->expires_at = expires_at;
+			entry->retry_at = 0;
+		}
+		token_cache_entry_free(added);
+		added = NULL;
+	}
+	else
+	{
+		// Make room by dropping the token expiring first, unless it is being refreshed
+		if (cache->count >= cache->config.max_entries)
+		{
+			int oldest = -1;
+			for (int i = 0; i < cache->count; i++)
+			{
+				if (!cache->entries[i]->refreshing && (oldest < 0 || cache->entries[i]->expires_at < cache->entries[oldest]->expires_at))
+				{
+					oldest = i;
+				}
+			}
+			if (oldest >= 0)
+			{
+				token_cache_remove(cache, oldest);
+			}
+		}
+		if (cache->count < cache->config.max_entries)
+		{
+			cache->entries[cache->count++] = added;
+			added = NULL;
+		}
+	}
+	pthread_cond_signal(&cache->cond);
+	pthread_mutex_unlock(&cache->lock);
+	token_cache_entry_free(added);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS token_cache_get_stats(token_cache *cache,
+		token_cache_stats *stats)
+{
+	if (NULL == cache || NULL == stats)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	stats->entries = cache->count;
+	pthread_mutex_unlock(&cache->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS token_cache_free(token_cache *cache)
+{
+	if (NULL == cache)
+	{
+		return STATUS_OK;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	cache->stop = 1;
+	pthread_cond_signal(&cache->cond);
+	pthread_mutex_unlock(&cache->lock);
+	pthread_join(cache->thread, NULL);
+
+	for (int i = 0; i < cache->count; i++)
+	{
+		token_cache_entry_free(cache->entries[i]);
+	}
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->entries);
+	free(cache);
+
+	return STATUS_OK;
 }
@@ -0,0 +1,531 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <connector.h>
+#include <token_provider.h>
+#include <token_provider_async.h>
+#include <log.h>
+#include <api.h>
+#include <rest.h>
+#include "pipeline.h"
+
+#define NONCE_LOOKAHEAD 1 // nonces fetched ahead of the evidence workers, so a worker finishing a quote finds the next job ready
+
+typedef enum job_stage
+{
+	JOB_NONCE,	/* waiting for a network worker to get a nonce */
+	JOB_EVIDENCE,	/* waiting for an evidence worker to collect evidence */
+	JOB_TOKEN	/* waiting for a network worker to get the token */
+} job_stage;
+
+struct collect_token_job
+{
+	token_provider_pool *pool;
+	job_stage stage;
+	attestation_run run;
+	collect_token_complete_callback callback;
+	void *callback_data;
+	TRUST_AUTHORITY_STATUS status;
+	int done;
+	int detached; /* the handle was freed, the job frees itself once it completed */
+	struct collect_token_job *next;
+};
+
+// Jobs waiting for a stage, oldest first
+typedef struct job_queue
+{
+	collect_token_job *head;
+	collect_token_job *tail;
+	pthread_cond_t cond; /* signalled when a job is queued or the pool stops */
+} job_queue;
+
+struct token_provider_pool
+{
+	pthread_mutex_t lock;
+	job_queue network;
+	job_queue evidence;
+	pthread_cond_t done_cond; /* broadcast when a job completed */
+	int pending; /* jobs submitted and not completed yet */
+	int nonced; /* jobs past the nonce stage, or fetching a nonce, that were not quoted yet */
+	int nonce_limit; /* nonced is kept below evidence workers plus NONCE_LOOKAHEAD */
+	int stop;
+	pthread_t *threads;
+	int thread_count;
+};
+
+static void job_queue_push(job_queue *queue,
+		collect_token_job *job,
+		int front)
+{
+	job->next = NULL;
+	if (NULL == queue->head)
+	{
+		queue->head = job;
+		queue->tail = job;
+	}
+	else if (front)
+	{
+		job->next = queue->head;
+		queue->head = job;
+	}
+	else
+	{
+		queue->tail->next = job;
+		queue->tail = job;
+	}
+	pthread_cond_signal(&queue->cond);
+}
+
+// Whether the head of queue can be taken; a nonce is only fetched once an evidence worker will soon quote it
+static int job_queue_ready(token_provider_pool *pool,
+		job_queue *queue)
+{
+	if (NULL == queue->head)
+	{
+		return 0;
+	}
+
+	// Quoted jobs are queued ahead of the nonce stages, so the head is a nonce stage only when none is waiting
+	return JOB_NONCE != queue->head->stage || pool->nonced < pool->nonce_limit;
+}
+
+// Takes the next job of queue, waiting for one; NULL once the pool stopped and all jobs completed
+static collect_token_job *job_queue_take(token_provider_pool *pool,
+		job_queue *queue)
+{
+	collect_token_job *job = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!job_queue_ready(pool, queue) && !(pool->stop && 0 == pool->pending))
+	{
+		pthread_cond_wait(&queue->cond, &pool->lock);
+	}
+	job = queue->head;
+	if (NULL != job)
+	{
+		queue->head = job->next;
+		if (NULL == queue->head)
+		{
+			queue->tail = NULL;
+		}
+		job->next = NULL;
+		if (JOB_NONCE == job->stage)
+		{
+			pool->nonced++;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return job;
+}
+
+// Moves a job on to its next stage
+static void job_advance(collect_token_job *job,
+		job_stage stage)
+{
+	token_provider_pool *pool = job->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	job->stage = stage;
+	if (JOB_EVIDENCE == stage)
+	{
+		job_queue_push(&pool->evidence, job, 0);
+	}
+	else
+	{
+		// Quoted jobs go first, their nonce is ageing, and a further nonce may be fetched
+		pool->nonced--;
+		job_queue_push(&pool->network, job, 1);
+		pthread_cond_broadcast(&pool->network.cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void job_complete(collect_token_job *job,
+		TRUST_AUTHORITY_STATUS status)
+{
+	token_provider_pool *pool = job->pool;
+	int detached = 0;
+
+	attestation_run_free(&job->run);
+	job->status = status;
+
+	if (NULL != job->callback)
+	{
+		job->callback(status, job->callback_data);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (JOB_TOKEN != job->stage)
+	{
+		// Failed before it was quoted, a further nonce may be fetched
+		pool->nonced--;
+		pthread_cond_broadcast(&pool->network.cond);
+	}
+	job->done = 1;
+	detached = job->detached;
+	pool->pending--;
+	pthread_cond_broadcast(&pool->done_cond);
+	if (pool->stop && 0 == pool->pending)
+	{
+		pthread_cond_broadcast(&pool->network.cond);
+		pthread_cond_broadcast(&pool->evidence.cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (detached)
+	{
+		free(job);
+	}
+}
+
+static void *network_worker_run(void *arg)
+{
+	token_provider_pool *pool = (token_provider_pool *)arg;
+	collect_token_job *job = NULL;
+
+	while (NULL != (job = job_queue_take(pool, &pool->network)))
+	{
+		TRUST_AUTHORITY_STATUS result = STATUS_OK;
+
+		if (JOB_NONCE == job->stage)
+		{
+			result = attestation_run_stages(&job->run, ATTESTATION_STAGE_NONCE, ATTESTATION_STAGE_NONCE);
+			if (STATUS_OK == result)
+			{
+				job_advance(job, JOB_EVIDENCE);
+				continue;
+			}
+		}
+		else
+		{
+			result = attestation_run_stages(&job->run, ATTESTATION_STAGE_MARSHAL, ATTESTATION_STAGE_VERIFY);
+		}
+		job_complete(job, result);
+	}
+
+	return NULL;
+}
+
+static void *evidence_worker_run(void *arg)
+{
+	token_provider_pool *pool = (token_provider_pool *)arg;
+	collect_token_job *job = NULL;
+
+	while (NULL != (job = job_queue_take(pool, &pool->evidence)))
+	{
+		TRUST_AUTHORITY_STATUS result = attestation_run_stages(&job->run, ATTESTATION_STAGE_EVIDENCE, ATTESTATION_STAGE_EVIDENCE);
+
+		if (STATUS_OK == result)
+		{
+			job_advance(job, JOB_TOKEN);
+			continue;
+		}
+		job_complete(job, result);
+	}
+
+	return NULL;
+}
+
+// Stops the threads started so far, they complete the jobs left first
+static void token_provider_pool_stop(token_provider_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->network.cond);
+	pthread_cond_broadcast(&pool->evidence.cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->thread_count; i++)
+	{
+		pthread_join(pool->threads[i], NULL);
+	}
+	pool->thread_count = 0;
+}
+
+static void token_provider_pool_destroy(token_provider_pool *pool)
+{
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->evidence.cond);
+	pthread_cond_destroy(&pool->network.cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+TRUST_AUTHORITY_STATUS token_provider_pool_new(token_provider_pool **pool,
+		const token_provider_pool_config *config)
+{
+	token_provider_pool *p = NULL;
+	pthread_condattr_t attr;
+	int workers = DEFAULT_TOKEN_PROVIDER_WORKERS;
+	int evidence_workers = 1;
+
+	if (NULL == pool)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL != config)
+	{
+		if (config->workers < 0 || config->workers > MAX_TOKEN_PROVIDER_WORKERS ||
+				config->evidence_workers < 0 || config->evidence_workers > MAX_TOKEN_PROVIDER_WORKERS)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+		workers = (0 != config->workers) ? config->workers : workers;
+		evidence_workers = (0 != config->evidence_workers) ? config->evidence_workers : evidence_workers;
+	}
+
+	p = (token_provider_pool *)calloc(1, sizeof(token_provider_pool));
+	if (NULL == p)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+	p->threads = (pthread_t *)calloc(workers + evidence_workers, sizeof(pthread_t));
+	if (NULL == p->threads)
+	{
+		free(p);
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	p->nonce_limit = evidence_workers + NONCE_LOOKAHEAD;
+
+	// Waits for jobs are timed with http_now_ms()
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->network.cond, NULL);
+	pthread_cond_init(&p->evidence.cond, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->done_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (int i = 0; i < workers + evidence_workers; i++)
+	{
+		if (0 != pthread_create(&p->threads[i], NULL, (i < workers) ? network_worker_run : evidence_worker_run, p))
+		{
+			token_provider_pool_stop(p);
+			token_provider_pool_destroy(p);
+			return STATUS_INTERNAL_ERROR;
+		}
+		p->thread_count++;
+	}
+
+	*pool = p;
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS collect_token_pipeline_submit(token_provider_pool *pool,
+		collect_token_job **job,
+		trust_authority_connector *connector,
+		response_headers *resp_headers,
+		token *token,
+		collect_token_args *token_args,
+		const attestation_pipeline *pipeline,
+		uint8_t *user_data,
+		uint32_t user_data_len,
+		collect_token_complete_callback callback,
+		void *callback_data)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_OK;
+	collect_token_job *j = NULL;
+
+	if (NULL == pool)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	j = (collect_token_job *)calloc(1, sizeof(collect_token_job));
+	if (NULL == j)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+
+	// The budget starts now, time spent queued included
+	status = attestation_run_init(&j->run, connector, resp_headers, token, token_args, pipeline, user_data, user_data_len);
+	if (STATUS_OK != status)
+	{
+		free(j);
+		return status;
+	}
+
+	j->pool = pool;
+	j->stage = JOB_NONCE;
+	j->callback = callback;
+	j->callback_data = callback_data;
+	j->detached = (NULL == job);
+
+	if (NULL != job)
+	{
+		*job = j;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->pending++;
+	job_queue_push(&pool->network, j, 0);
+	pthread_mutex_unlock(&pool->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS collect_token_submit(token_provider_pool *pool,
+		collect_token_job **job,
+		trust_authority_connector *connector,
+		response_headers *resp_headers,
+		token *token,
+		collect_token_args *token_args,
+		evidence_adapter *adapter,
+		uint8_t *user_data,
+		uint32_t user_data_len,
+		collect_token_complete_callback callback,
+		void *callback_data)
+{
+	attestation_pipeline pipeline = {0};
+
+	pipeline.collect_evidence = (NULL != adapter) ? adapter->collect_evidence : NULL;
+	pipeline.ctx = (NULL != adapter) ? adapter->ctx : NULL;
+
+	return collect_token_pipeline_submit(pool, job, connector, resp_headers, token, token_args, &pipeline,
+			user_data, user_data_len, callback, callback_data);
+}
+
+TRUST_AUTHORITY_STATUS collect_token_azure_submit(token_provider_pool *pool,
+		collect_token_job **job,
+		trust_authority_connector *connector,
+		response_headers *resp_headers,
+		token *token,
+		collect_token_args *token_args,
+		evidence_adapter *adapter,
+		uint8_t *user_data,
+		uint32_t user_data_len,
+		collect_token_complete_callback callback,
+		void *callback_data)
+{
+	attestation_pipeline pipeline = {0};
+
+	pipeline.attestation_endpoint = "/appraisal/v1/attest/azure/tdxvm";
+	pipeline.collect_evidence = (NULL != adapter) ? adapter->collect_evidence : NULL;
+	pipeline.ctx = (NULL != adapter) ? adapter->ctx : NULL;
+
+	return collect_token_pipeline_submit(pool, job, connector, resp_headers, token, token_args, &pipeline,
+			user_data, user_data_len, callback, callback_data);
+}
+
+int collect_token_job_poll(collect_token_job *job,
+		TRUST_AUTHORITY_STATUS *status)
+{
+	int done = 0;
+
+	if (NULL == job)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&job->pool->lock);
+	done = job->done;
+	pthread_mutex_unlock(&job->pool->lock);
+
+	if (done && NULL != status)
+	{
+		*status = job->status;
+	}
+
+	return done;
+}
+
+TRUST_AUTHORITY_STATUS collect_token_job_result(collect_token_job *job,
+		attestation_result *result)
+{
+	if (NULL == job || NULL == result || !collect_token_job_poll(job, NULL))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	*result = job->run.result;
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS collect_token_job_wait(collect_token_job *job,
+		int timeout_ms,
+		TRUST_AUTHORITY_STATUS *status)
+{
+	token_provider_pool *pool = NULL;
+	long long deadline = 0;
+	int done = 0;
+
+	if (NULL == job || timeout_ms < 0)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pool = job->pool;
+	deadline = trust_authority_deadline(timeout_ms);
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done && !trust_authority_deadline_expired(deadline))
+	{
+		if (0 == deadline)
+		{
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		}
+		else
+		{
+			struct timespec until;
+
+			until.tv_sec = deadline / 1000;
+			until.tv_nsec = (deadline % 1000) * 1000000;
+			pthread_cond_timedwait(&pool->done_cond, &pool->lock, &until);
+		}
+	}
+	done = job->done;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!done)
+	{
+		return STATUS_DEADLINE_EXCEEDED_ERROR;
+	}
+
+	if (NULL != status)
+	{
+		*status = job->status;
+	}
+
+	return STATUS_OK;
+}
+
+void collect_token_job_free(collect_token_job *job)
+{
+	int done = 0;
+
+	if (NULL == job)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&job->pool->lock);
+	done = job->done;
+	job->detached = !done;
+	pthread_mutex_unlock(&job->pool->lock);
+
+	if (done)
+	{
+		free(job);
+	}
+}
+
+void token_provider_pool_free(token_provider_pool *pool)
+{
+	if (NULL == pool)
+	{
+		return;
+	}
+
+	token_provider_pool_stop(pool);
+	token_provider_pool_destroy(pool);
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <connector.h>
+#include <token_provider.h>
+#include <token_scheduler.h>
+#include <log.h>
+#include <api.h>
+#include <rest.h>
+#include "pipeline.h"
+
+// Token published to readers, not changed once published
+typedef struct token_snapshot
+{
+	char *jwt;
+	long long expires_at; /* http_now_ms() time after which the token is not handed out */
+	struct token_snapshot *next; /* retired snapshots waiting for their readers */
+} token_snapshot;
+
+struct scheduled_token
+{
+	collect_token_request request;
+	_Atomic(token_snapshot *) current; /* NULL until the first token was collected */
+	atomic_int readers; /* readers which may still use a snapshot they loaded */
+	token_snapshot *retired; /* replaced snapshots, freed once no reader is left */
+	long long due_at; /* http_now_ms() time of the next attestation */
+	long backoff_ms;
+	int attesting;
+	int removed; /* unregistered while attesting, freed by the scheduler thread */
+	scheduled_token *next;
+};
+
+struct token_scheduler
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* wakes the thread when registrations change or the scheduler stops */
+	pthread_t thread;
+	token_scheduler_config config; /* defaults applied */
+	scheduled_token *entries;
+	int stop;
+	unsigned int seed; /* jitter, only used by the thread */
+	token_scheduler_stats stats;
+};
+
+static void token_snapshot_free(token_snapshot *snapshot)
+{
+	while (NULL != snapshot)
+	{
+		token_snapshot *next = snapshot->next;
+		free(snapshot->jwt);
+		free(snapshot);
+		snapshot = next;
+	}
+}
+
+// Frees the retired snapshots of entry if no reader can still hold one
+static void scheduled_token_reclaim(scheduled_token *entry)
+{
+	// Readers count themselves before loading the snapshot, those arriving now load the current one
+	if (NULL != entry->retired && 0 == atomic_load(&entry->readers))
+	{
+		token_snapshot_free(entry->retired);
+		entry->retired = NULL;
+	}
+}
+
+static void scheduled_token_free(scheduled_token *entry)
+{
+	token_snapshot_free(atomic_load(&entry->current));
+	token_snapshot_free(entry->retired);
+	collect_token_request_free(&entry->request);
+	free(entry);
+}
+
+// Shortens a wait by a random share of it, the scheduler must be locked
+static long long token_scheduler_jitter(token_scheduler *scheduler,
+		long long delay)
+{
+	long long range = delay * scheduler->config.jitter_percent / 100;
+
+	if (range <= 0)
+	{
+		return delay;
+	}
+
+	return delay - (long long)(rand_r(&scheduler->seed) % ((unsigned long long)range + 1));
+}
+
+// Publishes a new token or schedules a retry, the scheduler must be locked
+static void token_scheduler_complete(token_scheduler *scheduler,
+		scheduled_token *entry,
+		TRUST_AUTHORITY_STATUS status,
+		token *token)
+{
+	long long now = http_now_ms();
+	long long expires_at = -1;
+	long long delay = 0;
+	token_snapshot *snapshot = NULL;
+
+	if (STATUS_OK == status)
+	{
+		expires_at = token_expires_at_ms(token->jwt);
+		expires_at = (expires_at < 0) ? -1 : expires_at - scheduler->config.expiry_margin_ms;
+		if (expires_at <= now)
+		{
+			ERROR("Error: Scheduled token has no exp or expires within the margin\n");
+			status = STATUS_TOKEN_INVALID_ERROR;
+		}
+	}
+	if (STATUS_OK == status)
+	{
+		snapshot = (token_snapshot *)calloc(1, sizeof(token_snapshot));
+		status = (NULL != snapshot) ? STATUS_OK : STATUS_ALLOCATION_ERROR;
+	}
+
+	if (STATUS_OK != status)
+	{
+		// The current token stays readable until it expires
+		ERROR("Error: Failed to collect scheduled token 0x%04x\n", status);
+		entry->backoff_ms = (0 == entry->backoff_ms) ? TOKEN_SCHEDULER_MIN_BACKOFF_MS : entry->backoff_ms * 2;
+		entry->backoff_ms = (entry->backoff_ms < TOKEN_SCHEDULER_MAX_BACKOFF_MS) ? entry->backoff_ms : TOKEN_SCHEDULER_MAX_BACKOFF_MS;
+		entry->due_at = now + token_scheduler_jitter(scheduler, entry->backoff_ms);
+		scheduler->stats.failures++;
+		return;
+	}
+
+	snapshot->jwt = token->jwt;
+	token->jwt = NULL;
+	snapshot->expires_at = expires_at;
+	snapshot->next = atomic_exchange(&entry->current, snapshot);
+	if (NULL != snapshot->next)
+	{
+		snapshot->next->next = entry->retired;
+		entry->retired = snapshot->next;
+		snapshot->next = NULL;
+	}
+	scheduled_token_reclaim(entry);
+
+	// Tokens living shorter than refresh_ahead_ms are attested again half way through
+	delay = expires_at - scheduler->config.refresh_ahead_ms - now;
+	if (delay < (expires_at - now) / 2)
+	{
+		delay = (expires_at - now) / 2;
+	}
+	if (scheduler->config.interval_ms > 0 && scheduler->config.interval_ms < delay)
+	{
+		delay = scheduler->config.interval_ms;
+	}
+	entry->due_at = now + token_scheduler_jitter(scheduler, delay);
+	entry->backoff_ms = 0;
+	scheduler->stats.attestations++;
+}
+
+static void *token_scheduler_run(void *arg)
+{
+	token_scheduler *scheduler = (token_scheduler *)arg;
+
+	pthread_mutex_lock(&scheduler->lock);
+	while (!scheduler->stop)
+	{
+		long long now = http_now_ms();
+		long long wake_at = 0;
+		scheduled_token *due = NULL;
+
+		for (scheduled_token *entry = scheduler->entries; NULL != entry; entry = entry->next)
+		{
+			scheduled_token_reclaim(entry);
+			if (NULL == due && now >= entry->due_at)
+			{
+				due = entry;
+			}
+			else if (0 == wake_at || entry->due_at < wake_at)
+			{
+				wake_at = entry->due_at;
+			}
+		}
+
+		if (NULL != due)
+		{
+			token token = {0};
+			TRUST_AUTHORITY_STATUS status = STATUS_OK;
+
+			due->attesting = 1;
+			pthread_mutex_unlock(&scheduler->lock);
+			status = collect_token_request_run(&due->request, &token);
+			pthread_mutex_lock(&scheduler->lock);
+			due->attesting = 0;
+
+			if (due->removed)
+			{
+				scheduled_token_free(due);
+			}
+			else
+			{
+				token_scheduler_complete(scheduler, due, status, &token);
+			}
+			token_free(&token);
+			continue;
+		}
+
+		if (0 == wake_at)
+		{
+			pthread_cond_wait(&scheduler->cond, &scheduler->lock);
+		}
+		else
+		{
+			struct timespec until;
+			until.tv_sec = wake_at / 1000;
+			until.tv_nsec = (wake_at % 1000) * 1000000;
+			pthread_cond_timedwait(&scheduler->cond, &scheduler->lock, &until);
+		}
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return NULL;
+}
+
+TRUST_AUTHORITY_STATUS token_scheduler_new(token_scheduler **scheduler,
+		const token_scheduler_config *config)
+{
+	token_scheduler *s = NULL;
+	pthread_condattr_t attr;
+
+	if (NULL == scheduler)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL != config && (config->interval_ms < 0 || config->refresh_ahead_ms < 0 || config->expiry_margin_ms < 0 || config->jitter_percent > 100))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	s = (token_scheduler *)calloc(1, sizeof(token_scheduler));
+	if (NULL == s)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+	if (NULL != config)
+	{
+		s->config = *config;
+	}
+	s->config.refresh_ahead_ms = (0 != s->config.refresh_ahead_ms) ? s->config.refresh_ahead_ms : DEFAULT_TOKEN_REFRESH_AHEAD_MS;
+	s->config.expiry_margin_ms = (0 != s->config.expiry_margin_ms) ? s->config.expiry_margin_ms : DEFAULT_TOKEN_CACHE_MARGIN_MS;
+	s->config.jitter_percent = (0 != s->config.jitter_percent) ? s->config.jitter_percent : DEFAULT_TOKEN_SCHEDULER_JITTER_PERCENT;
+	s->seed = (unsigned int)(http_now_ms() ^ (uintptr_t)s);
+
+	// Wake up times are computed with http_now_ms()
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (0 != pthread_create(&s->thread, NULL, token_scheduler_run, s))
+	{
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return STATUS_INTERNAL_ERROR;
+	}
+
+	*scheduler = s;
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS token_scheduler_register(token_scheduler *scheduler,
+		scheduled_token **handle,
+		trust_authority_connector *connector,
+		collect_token_args *token_args,
+		evidence_adapter *adapter,
+		uint8_t *user_data,
+		uint32_t user_data_len)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_OK;
+	scheduled_token *entry = NULL;
+
+	if (NULL == scheduler || NULL == handle)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL == connector)
+	{
+		return STATUS_NULL_CONNECTOR;
+	}
+
+	if (NULL == token_args || NULL == adapter)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	entry = (scheduled_token *)calloc(1, sizeof(scheduled_token));
+	if (NULL == entry)
+	{
+		return STATUS_ALLOCATION_ERROR;
+	}
+	status = collect_token_request_copy(&entry->request, connector, token_args, adapter, user_data, user_data_len);
+	if (STATUS_OK != status)
+	{
+		free(entry);
+		return status;
+	}
+	atomic_init(&entry->current, NULL);
+	atomic_init(&entry->readers, 0);
+
+	pthread_mutex_lock(&scheduler->lock);
+	entry->next = scheduler->entries;
+	scheduler->entries = entry;
+	scheduler->stats.registered++;
+	pthread_cond_signal(&scheduler->cond);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	*handle = entry;
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS scheduled_token_get(scheduled_token *handle,
+		token *token)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_NO_TOKEN_ERROR;
+	token_snapshot *snapshot = NULL;
+
+	if (NULL == handle)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (NULL == token)
+	{
+		return STATUS_NULL_TOKEN;
+	}
+
+	atomic_fetch_add(&handle->readers, 1);
+	snapshot = atomic_load(&handle->current);
+	if (NULL != snapshot && http_now_ms() < snapshot->expires_at)
+	{
+		token->jwt = strdup(snapshot->jwt);
+		status = (NULL != token->jwt) ? STATUS_OK : STATUS_ALLOCATION_ERROR;
+	}
+	atomic_fetch_sub(&handle->readers, 1);
+
+	return status;
+}
+
+TRUST_AUTHORITY_STATUS token_scheduler_unregister(token_scheduler *scheduler,
+		scheduled_token *handle)
+{
+	scheduled_token **link = NULL;
+
+	if (NULL == scheduler || NULL == handle)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&scheduler->lock);
+	for (link = &scheduler->entries; NULL != *link && handle != *link; link = &(*link)->next)
+	{
+	}
+	if (NULL == *link)
+	{
+		pthread_mutex_unlock(&scheduler->lock);
+		return STATUS_INVALID_PARAMETER;
+	}
+	*link = handle->next;
+	scheduler->stats.registered--;
+	if (handle->attesting)
+	{
+		handle->removed = 1;
+		handle = NULL;
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+
+	if (NULL != handle)
+	{
+		scheduled_token_free(handle);
+	}
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS token_scheduler_get_stats(token_scheduler *scheduler,
+		token_scheduler_stats *stats)
+{
+	if (NULL == scheduler || NULL == stats)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pthread_mutex_lock(&scheduler->lock);
+	*stats = scheduler->stats;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return STATUS_OK;
+}
+
+TRUST_AUTHORITY_STATUS token_scheduler_free(token_scheduler *scheduler)
+{
+	if (NULL == scheduler)
+	{
+		return STATUS_OK;
+	}
+
+	// An attestation in progress completes before the thread stops
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->stop = 1;
+	pthread_cond_signal(&scheduler->cond);
+	pthread_mutex_unlock(&scheduler->lock);
+	pthread_join(scheduler->thread, NULL);
+
+	while (NULL != scheduler->entries)
+	{
+		scheduled_token *next = scheduler->entries->next;
+		scheduled_token_free(scheduler->entries);
+		scheduler->entries = next;
+	}
+	pthread_cond_destroy(&scheduler->cond);
+	pthread_mutex_destroy(&scheduler->lock);
+	free(scheduler);
+
+	return STATUS_OK;
+}
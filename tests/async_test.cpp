@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <connector.h>
+#include <connector_async.h>
+#include <types.h>
+#include "mock_server.h"
+
+struct async_result
+{
+	int calls;
+	TRUST_AUTHORITY_STATUS status;
+};
+
+static void on_complete(TRUST_AUTHORITY_STATUS status, void *user_data)
+{
+	async_result *result = (async_result *)user_data;
+
+	result->calls++;
+	result->status = status;
+}
+
+static int on_socket(int fd, int what, void *loop_data)
+{
+	return 0;
+}
+
+static int on_timer(long timeout_ms, void *loop_data)
+{
+	return 0;
+}
+
+TEST(AsyncTest, NewNullArgs)
+{
+	trust_authority_async *async = NULL;
+	trust_authority_connector api = {0};
+
+	ASSERT_EQ(trust_authority_async_new(NULL, &api), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(trust_authority_async_new(&async, NULL), STATUS_NULL_CONNECTOR);
+}
+
+TEST(AsyncTest, SetCallbacksNullCallback)
+{
+	trust_authority_async *async = NULL;
+	trust_authority_connector api = {0};
+
+	ASSERT_EQ(trust_authority_async_new(&async, &api), STATUS_OK);
+	ASSERT_EQ(trust_authority_async_set_callbacks(async, NULL, on_timer, NULL), STATUS_NULL_CALLBACK);
+	ASSERT_EQ(trust_authority_async_set_callbacks(async, on_socket, on_timer, NULL), STATUS_OK);
+	trust_authority_async_free(async);
+}
+
+TEST(AsyncTest, SubmitNullArgs)
+{
+	trust_authority_async *async = NULL;
+	trust_authority_connector api = {0};
+	nonce nonce = {0};
+	token token = {0};
+	get_nonce_args nonce_args = {0};
+
+	ASSERT_EQ(trust_authority_async_new(&async, &api), STATUS_OK);
+	ASSERT_EQ(get_nonce_async(async, NULL, &nonce_args, NULL, on_complete, NULL), STATUS_NULL_NONCE);
+	ASSERT_EQ(get_nonce_async(async, &nonce, NULL, NULL, on_complete, NULL), STATUS_NULL_ARGS);
+	ASSERT_EQ(get_token_async(async, NULL, NULL, NULL, (char *)"/appraisal/v1/attest", on_complete, NULL), STATUS_NULL_TOKEN);
+	ASSERT_EQ(get_token_async(async, NULL, &token, NULL, (char *)"/appraisal/v1/attest", on_complete, NULL), STATUS_NULL_ARGS);
+	trust_authority_async_free(async);
+}
+
+// A connector set up without trust_authority_connector_new has no pool, requests still complete
+TEST(AsyncTest, ConnectorWithoutPool)
+{
+	trust_authority_async *async = NULL;
+	trust_authority_connector api = {0};
+	nonce nonce = {0};
+	get_nonce_args nonce_args = {0};
+	async_result result = {0};
+	int running = 0;
+
+	strncpy(api.api_url, "http://localhost:1", API_URL_MAX_LEN);
+	ASSERT_EQ(trust_authority_async_new(&async, &api), STATUS_OK);
+	ASSERT_EQ(get_nonce_async(async, &nonce, &nonce_args, NULL, on_complete, &result), STATUS_OK);
+	do
+	{
+		ASSERT_EQ(trust_authority_async_perform(async, 100, &running), STATUS_OK);
+	} while (running > 0);
+
+	ASSERT_EQ(result.calls, 1);
+	ASSERT_NE(result.status, STATUS_OK);
+	trust_authority_async_free(async);
+}
+
+// Several nonce requests complete on a single thread
+TEST(AsyncTest, GetNonceConcurrent)
+{
+	MockServer
+		mockServer
+		("{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"SGVsbG8sIFdvcmxkIW==\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}");
+	mockServer.start();
+
+	const int count = 4;
+	trust_authority_connector *api = NULL;
+	trust_authority_async *async = NULL;
+	nonce nonces[count] = {0};
+	async_result results[count] = {0};
+	get_nonce_args nonce_args = {0};
+	int running = 0;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:8080", 0, 0), STATUS_OK);
+	strncpy(api->api_url, "http://localhost:8080", API_URL_MAX_LEN);
+	ASSERT_EQ(trust_authority_async_new(&async, api), STATUS_OK);
+
+	nonce_args.request_id = "1234";
+	for (int i = 0; i < count; i++)
+	{
+		ASSERT_EQ(get_nonce_async(async, &nonces[i], &nonce_args, NULL, on_complete, &results[i]), STATUS_OK);
+	}
+
+	do
+	{
+		ASSERT_EQ(trust_authority_async_perform(async, 100, &running), STATUS_OK);
+	} while (running > 0);
+
+	for (int i = 0; i < count; i++)
+	{
+		ASSERT_EQ(results[i].calls, 1);
+		ASSERT_EQ(results[i].status, STATUS_OK);
+		ASSERT_NE(nonces[i].val, nullptr);
+		ASSERT_GT(nonces[i].val_len, 0);
+		nonce_free(&nonces[i]);
+	}
+
+	trust_authority_async_free(async);
+	connector_free(api);
+	mockServer.stop();
+}
+
+TEST(AsyncTest, BatchNullArgs)
+{
+	trust_authority_connector api = {0};
+	token tokens[1] = {0};
+	get_token_args token_args[1] = {0};
+	TRUST_AUTHORITY_STATUS statuses[1];
+
+	ASSERT_EQ(get_tokens_batch(NULL, tokens, token_args, statuses, 1, (char *)"/appraisal/v1/attest", 0), STATUS_NULL_CONNECTOR);
+	ASSERT_EQ(get_tokens_batch(&api, NULL, token_args, statuses, 1, (char *)"/appraisal/v1/attest", 0), STATUS_NULL_TOKEN);
+	ASSERT_EQ(get_tokens_batch(&api, tokens, NULL, statuses, 1, (char *)"/appraisal/v1/attest", 0), STATUS_NULL_ARGS);
+	ASSERT_EQ(get_tokens_batch(&api, tokens, token_args, NULL, 1, (char *)"/appraisal/v1/attest", 0), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(get_tokens_batch(&api, tokens, token_args, statuses, 1, (char *)"/appraisal/v1/attest", -1), STATUS_INVALID_PARAMETER);
+}
+
+// More token requests than the concurrency limit all complete, each with its own status
+TEST(AsyncTest, GetTokensBatch)
+{
+	MockServer mockServer("");
+	mockServer.start();
+
+	const int count = 5;
+	trust_authority_connector *api = NULL;
+	token tokens[count] = {0};
+	get_token_args token_args[count] = {0};
+	TRUST_AUTHORITY_STATUS statuses[count];
+	evidence evidenceObj = {0};
+	nonce nonceObj = {0};
+	policies policiesObj = {0};
+	uint8_t quote[] = "quote";
+	uint8_t val[] = "nonce1";
+	uint8_t iat[] = "iatda";
+	uint8_t signature[] = "sign1";
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "http://localhost:8080", 0, 0), STATUS_OK);
+
+	evidenceObj.evidence = quote;
+	evidenceObj.evidence_len = 5;
+	nonceObj.val = val;
+	nonceObj.val_len = 6;
+	nonceObj.iat = iat;
+	nonceObj.iat_len = 5;
+	nonceObj.signature = signature;
+	nonceObj.signature_len = 5;
+	for (int i = 0; i < count; i++)
+	{
+		token_args[i].policies = &policiesObj;
+		token_args[i].nonce = &nonceObj;
+		token_args[i].evidence = &evidenceObj;
+	}
+	// Fails to marshal without affecting the other requests
+	token_args[2].evidence = NULL;
+
+	// The second batch runs over the connections the first one left open
+	for (int batch = 0; batch < 2; batch++)
+	{
+		ASSERT_EQ(get_tokens_batch(api, tokens, token_args, statuses, count, (char *)"/appraisal/v1/attest", 2), STATUS_OK);
+
+		for (int i = 0; i < count; i++)
+		{
+			if (2 == i)
+			{
+				EXPECT_EQ(statuses[i], STATUS_NULL_EVIDENCE);
+				continue;
+			}
+			EXPECT_EQ(statuses[i], STATUS_OK);
+			EXPECT_NE(tokens[i].jwt, nullptr);
+			token_free(&tokens[i]);
+		}
+	}
+
+	connector_free(api);
+	mockServer.stop();
+}
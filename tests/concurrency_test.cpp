@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2023 Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <connector.h>
+#include <types.h>
+#include <log.h>
+#include "mock_server.h"
+
+// Stress tests for a connector shared by many threads, build with -DENABLE_TSAN=ON to have them checked for races
+
+static int shared_transport(void *ctx, const transport_request *request, transport_response *response)
+{
+	const char *nonce = "{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"SGVsbG8sIFdvcmxkIW==\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}";
+	const char *token = "{\"token\":\"eyJhbGciOiJub25lIn0.e30.c2lnbg\"}";
+	const char *body = (0 == strcmp(request->method, "GET")) ? nonce : token;
+
+	(*(std::atomic<int> *)ctx)++;
+	response->status_code = 200;
+	response->body = strdup(body);
+	response->body_len = strlen(body);
+
+	return 0;
+}
+
+// Requests of many threads go through one connector while its settings are changed
+TEST(ConcurrencyTest, SharedConnector)
+{
+	const int threads = 8;
+	const int iterations = 200;
+	trust_authority_connector *api = NULL;
+	std::atomic<int> calls(0);
+	std::atomic<int> failures(0);
+	std::atomic<bool> done(false);
+	transport_adapter transport = {&calls, shared_transport};
+	std::vector<std::thread> workers;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:1", 0, 0), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_set_transport(api, &transport), STATUS_OK);
+
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&]() {
+			uint8_t quote[] = "quote";
+			evidence evidenceObj = {0};
+			policies policiesObj = {0};
+
+			evidenceObj.evidence = quote;
+			evidenceObj.evidence_len = 5;
+			for (int i = 0; i < iterations; i++)
+			{
+				nonce nonceObj = {0};
+				token tokenObj = {0};
+				get_nonce_args nonce_args = {0};
+				get_token_args token_args = {0};
+
+				if (STATUS_OK != get_nonce(api, &nonceObj, &nonce_args, NULL))
+				{
+					failures++;
+					continue;
+				}
+				token_args.nonce = &nonceObj;
+				token_args.evidence = &evidenceObj;
+				token_args.policies = &policiesObj;
+				if (STATUS_OK != get_token(api, NULL, &tokenObj, &token_args, (char *)"/appraisal/v1/attest"))
+				{
+					failures++;
+				}
+				token_free(&tokenObj);
+				nonce_free(&nonceObj);
+			}
+		});
+	}
+
+	// Settings documented as changeable at any time
+	std::thread configurer([&]() {
+		for (int i = 0; !done; i++)
+		{
+			retry_config policy = {0};
+			policy.retry_max = i % 3;
+			policy.retry_wait_time = 1;
+			trust_authority_connector_set_retry_policy(api, &policy);
+			trust_authority_connector_set_compression(api, (i % 2) ? COMPRESSION_GZIP_REQUEST : COMPRESSION_ACCEPT_ENCODING);
+			trust_authority_connector_set_hedging(api, i % 2, (i % 2) ? "https://secondary.example.com" : NULL);
+			std::this_thread::yield();
+		}
+	});
+
+	for (auto &worker : workers)
+	{
+		worker.join();
+	}
+	done = true;
+	configurer.join();
+
+	EXPECT_EQ(failures, 0);
+	EXPECT_EQ(calls, threads * iterations * 2);
+	connector_free(api);
+}
+
+// Requests of many threads go over the real curl path of one connector, sharing its connection pool
+TEST(ConcurrencyTest, SharedConnectorOverHttp)
+{
+	MockServer
+		mockServer
+		("{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"SGVsbG8sIFdvcmxkIW==\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}");
+	mockServer.start();
+
+	const int threads = 8;
+	const int iterations = 25;
+	trust_authority_connector *api = NULL;
+	std::atomic<int> failures(0);
+	std::vector<std::thread> workers;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "http://localhost:8080", 0, 0), STATUS_OK);
+
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&]() {
+			uint8_t quote[] = "quote";
+			evidence evidenceObj = {0};
+			policies policiesObj = {0};
+
+			evidenceObj.evidence = quote;
+			evidenceObj.evidence_len = 5;
+			for (int i = 0; i < iterations; i++)
+			{
+				nonce nonceObj = {0};
+				token tokenObj = {0};
+				get_nonce_args nonce_args = {0};
+				get_token_args token_args = {0};
+
+				if (STATUS_OK != get_nonce(api, &nonceObj, &nonce_args, NULL))
+				{
+					failures++;
+					continue;
+				}
+				token_args.nonce = &nonceObj;
+				token_args.evidence = &evidenceObj;
+				token_args.policies = &policiesObj;
+				if (STATUS_OK != get_token(api, NULL, &tokenObj, &token_args, (char *)"/appraisal/v1/attest") || NULL == tokenObj.jwt)
+				{
+					failures++;
+				}
+				token_free(&tokenObj);
+				nonce_free(&nonceObj);
+			}
+		});
+	}
+
+	for (auto &worker : workers)
+	{
+		worker.join();
+	}
+
+	EXPECT_EQ(failures, 0);
+	connector_free(api);
+	mockServer.stop();
+}
+
+// Settings read while requests are made, and the nonce pool, are replaced while threads use them
+TEST(ConcurrencyTest, SettingsChangedOverHttp)
+{
+	MockServer
+		mockServer
+		("{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"SGVsbG8sIFdvcmxkIW==\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}");
+	mockServer.start();
+
+	const int threads = 4;
+	const int iterations = 25;
+	trust_authority_connector *api = NULL;
+	std::atomic<int> calls(0);
+	std::atomic<int> failures(0);
+	std::atomic<bool> done(false);
+	std::vector<std::thread> workers;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "http://localhost:8080", 0, 0), STATUS_OK);
+
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&]() {
+			for (int i = 0; i < iterations; i++)
+			{
+				nonce nonceObj = {0};
+				get_nonce_args nonce_args = {0};
+				TRUST_AUTHORITY_STATUS status = STATUS_OK;
+
+				if (STATUS_OK != get_nonce(api, &nonceObj, &nonce_args, NULL))
+				{
+					failures++;
+				}
+				nonce_free(&nonceObj);
+
+				status = trust_authority_connector_take_nonce(api, &nonceObj);
+				if (STATUS_OK != status && STATUS_NONCE_POOL_EMPTY_ERROR != status)
+				{
+					failures++;
+				}
+				nonce_free(&nonceObj);
+			}
+		});
+	}
+
+	std::thread configurer([&]() {
+		const char *keep[] = { "request-id", "retry-after" };
+		transport_adapter transport = {&calls, shared_transport};
+		nonce_pool_config pool = {0};
+		nonce_pool_stats stats = {0};
+
+		pool.size = 2;
+		for (int i = 0; !done; i++)
+		{
+			EXPECT_EQ(trust_authority_connector_set_max_response_size(api, (0 == i % 2) ? 1024 * 1024 : 2 * 1024 * 1024), STATUS_OK);
+			EXPECT_EQ(trust_authority_connector_set_response_headers(api, keep, 1 + i % 2), STATUS_OK);
+			EXPECT_EQ(trust_authority_connector_set_unix_socket(api, NULL), STATUS_OK);
+			EXPECT_EQ(trust_authority_connector_set_transport(api, (0 == i % 3) ? &transport : NULL), STATUS_OK);
+			EXPECT_EQ(trust_authority_connector_set_nonce_pool(api, (0 == i % 2) ? &pool : NULL), STATUS_OK);
+			EXPECT_EQ(trust_authority_connector_get_nonce_pool_stats(api, &stats), STATUS_OK);
+			std::this_thread::yield();
+		}
+	});
+
+	for (auto &worker : workers)
+	{
+		worker.join();
+	}
+	done = true;
+	configurer.join();
+
+	EXPECT_EQ(failures, 0);
+	connector_free(api);
+	mockServer.stop();
+}
+
+// Log lines of different threads get their own time buffer
+TEST(ConcurrencyTest, FormattedTime)
+{
+	std::vector<std::thread> workers;
+	std::atomic<int> malformed(0);
+
+	for (int t = 0; t < 8; t++)
+	{
+		workers.emplace_back([&]() {
+			for (int i = 0; i < 1000; i++)
+			{
+				char buf[LOG_TIME_LEN];
+				if (LOG_TIME_LEN - 1 != strlen(getFormattedTime(buf, sizeof(buf))))
+				{
+					malformed++;
+				}
+			}
+		});
+	}
+	for (auto &worker : workers)
+	{
+		worker.join();
+	}
+
+	EXPECT_EQ(malformed, 0);
+}
@@ -3,11 +3,14 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 #include <gtest/gtest.h>
+#include <chrono>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <openssl/sha.h>
 #include <connector.h>
+#include <connector_async.h>
 #include <types.h>
 #include <json.h>
 #include <appraisal_request.h>
@@ -18,6 +21,7 @@
 #include <jwt.h>
 #include <regex.h>
 #include <curl/curl.h>
+#include <zlib.h>
 #include "mock_server.cpp"
 #include <openssl/evp.h>
 #include <openssl/pem.h>
@@ -41,6 +45,10 @@ TEST(TANewTest, CreateApiSuccess)
 	// Verify that the api_key and api_url have been set correctly
 	ASSERT_STREQ(api->api_key, apiKey);
 	ASSERT_STREQ(api->api_url, apiUrl);
+
+	// Verify that the connector owns a pool of reusable HTTP handles
+	ASSERT_NE(api->pool, nullptr);
+	connector_free(api);
 }
 
 // Test case for null api parameter
@@ -126,6 +134,33 @@ TEST(TANewTest, InvalidClusterUrlParameter)
 	ASSERT_EQ(status, STATUS_INVALID_API_URL);
 }
 
+TEST(TANewTest, SetRetryPolicy)
+{
+	trust_authority_connector *api = nullptr;
+	retry_config policy = {0};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://example.com", 2, 2), STATUS_OK);
+
+	// Connectors back off with jitter and honour Retry-After by default
+	EXPECT_EQ(api->retries->retry_jitter, 1);
+	EXPECT_EQ(api->retries->retry_after, 1);
+
+	policy.retry_max = 5;
+	policy.retry_base_delay_ms = 50;
+	policy.retry_max_delay_ms = 2000;
+	ASSERT_EQ(trust_authority_connector_set_retry_policy(api, &policy), STATUS_OK);
+	EXPECT_EQ(api->retries->retry_max, 5);
+	EXPECT_EQ(api->retries->retry_base_delay_ms, 50);
+	EXPECT_EQ(api->retries->retry_max_delay_ms, 2000);
+
+	policy.retry_base_delay_ms = -1;
+	EXPECT_EQ(trust_authority_connector_set_retry_policy(api, &policy), STATUS_INVALID_PARAMETER);
+	EXPECT_EQ(trust_authority_connector_set_retry_policy(api, nullptr), STATUS_INVALID_PARAMETER);
+	EXPECT_EQ(trust_authority_connector_set_retry_policy(nullptr, &policy), STATUS_NULL_CONNECTOR);
+
+	connector_free(api);
+}
+
 // Test case for get_nonce function
 TEST(ApiTest, GetNonce)
 {
@@ -171,6 +206,446 @@ TEST(ApiTest, GetNonce)
 	mockServer.stop();
 }
 
+// Takes a nonce once the background thread has fetched one, waiting up to timeout_ms
+static TRUST_AUTHORITY_STATUS take_nonce_within(trust_authority_connector *api, nonce *nonce, int timeout_ms)
+{
+	TRUST_AUTHORITY_STATUS status = STATUS_NONCE_POOL_EMPTY_ERROR;
+
+	for (int waited = 0; waited < timeout_ms; waited += 10)
+	{
+		status = trust_authority_connector_take_nonce(api, nonce);
+		if (STATUS_OK == status)
+		{
+			break;
+		}
+		usleep(10000);
+	}
+	return status;
+}
+
+TEST(NoncePoolTest, PrefetchesNonces)
+{
+	MockServer
+		mockServer
+		("{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"SGVsbG8sIFdvcmxkIW==\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}");
+	mockServer.start();
+
+	trust_authority_connector *api = nullptr;
+	nonce_pool_config config = {0};
+	nonce_pool_stats stats = {0};
+	nonce nonce = {0};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "http://localhost:8080", 0, 0), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_take_nonce(api, &nonce), STATUS_NONCE_POOL_EMPTY_ERROR);
+	config.size = MAX_NONCE_POOL_SIZE + 1;
+	ASSERT_EQ(trust_authority_connector_set_nonce_pool(api, &config), STATUS_INVALID_PARAMETER);
+	config.size = 2;
+	config.max_age_ms = 1000;
+	config.min_remaining_ms = 1000;
+	ASSERT_EQ(trust_authority_connector_set_nonce_pool(api, &config), STATUS_INVALID_PARAMETER);
+	config.max_age_ms = 0;
+	config.min_remaining_ms = 0;
+	ASSERT_EQ(trust_authority_connector_set_nonce_pool(api, &config), STATUS_OK);
+
+	ASSERT_EQ(take_nonce_within(api, &nonce, 2000), STATUS_OK);
+	EXPECT_EQ(nonce.val_len, 13);
+	nonce_free(&nonce);
+	ASSERT_EQ(take_nonce_within(api, &nonce, 2000), STATUS_OK);
+	nonce_free(&nonce);
+
+	ASSERT_EQ(trust_authority_connector_get_nonce_pool_stats(api, &stats), STATUS_OK);
+	EXPECT_EQ(stats.taken, 2);
+	EXPECT_GE(stats.fetched, 2);
+
+	ASSERT_EQ(trust_authority_connector_set_nonce_pool(api, NULL), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_take_nonce(api, &nonce), STATUS_NONCE_POOL_EMPTY_ERROR);
+	connector_free(api);
+	mockServer.stop();
+}
+
+// Nonces issued too long ago according to their iat are never handed out
+TEST(NoncePoolTest, DropsStaleNonces)
+{
+	MockServer
+		mockServer
+		("{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"MjAyMC0wMS0wMSAwMDowMDowMCArMDAwMCBVVEM=\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}");
+	mockServer.start();
+
+	trust_authority_connector *api = nullptr;
+	nonce_pool_config config = {0};
+	nonce_pool_stats stats = {0};
+	nonce nonce = {0};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "http://localhost:8080", 0, 0), STATUS_OK);
+	config.size = 1;
+	ASSERT_EQ(trust_authority_connector_set_nonce_pool(api, &config), STATUS_OK);
+
+	ASSERT_EQ(take_nonce_within(api, &nonce, 300), STATUS_NONCE_POOL_EMPTY_ERROR);
+	ASSERT_EQ(trust_authority_connector_get_nonce_pool_stats(api, &stats), STATUS_OK);
+	EXPECT_GE(stats.expired, 1);
+	EXPECT_EQ(stats.ready, 0);
+
+	connector_free(api);
+	mockServer.stop();
+}
+
+// Only the response headers selected on the connector are kept
+TEST(ApiTest, GetNonceSelectedHeaders)
+{
+	MockServer
+		mockServer
+		("{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"SGVsbG8sIFdvcmxkIW==\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}");
+	mockServer.start();
+
+	trust_authority_connector *api = NULL;
+	nonce nonce = { 0 };
+	get_nonce_args nonce_args = {0};
+	response_headers headers = { 0 };
+	const char *keep[] = { "Content-Type" };
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:8080", 0, 0), STATUS_OK);
+	strncpy(api->api_url, "http://localhost:8080", API_URL_MAX_LEN);
+	ASSERT_EQ(trust_authority_connector_set_response_headers(NULL, keep, 1), STATUS_NULL_CONNECTOR);
+	ASSERT_EQ(trust_authority_connector_set_response_headers(api, NULL, 1), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(trust_authority_connector_set_response_headers(api, keep, MAX_KEPT_HEADERS + 1), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(trust_authority_connector_set_response_headers(api, keep, 1), STATUS_OK);
+
+	ASSERT_EQ(get_nonce(api, &nonce, &nonce_args, &headers), STATUS_OK);
+	ASSERT_EQ(headers.count, 1);
+	ASSERT_NE(response_headers_get(&headers, "content-type"), nullptr);
+	ASSERT_EQ(response_headers_get(&headers, "content-length"), nullptr);
+
+	nonce_free(&nonce);
+	response_headers_free(&headers);
+	connector_free(api);
+	mockServer.stop();
+}
+
+TEST(TANewTest, RateLimit)
+{
+	trust_authority_connector *api = NULL;
+	rate_limit_config config = {0};
+	rate_limit_stats stats = {0};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:8080", 0, 0), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_set_rate_limit(NULL, &config), STATUS_NULL_CONNECTOR);
+	ASSERT_EQ(trust_authority_connector_set_rate_limit(api, NULL), STATUS_INVALID_PARAMETER);
+	config.requests_per_second = -1;
+	ASSERT_EQ(trust_authority_connector_set_rate_limit(api, &config), STATUS_INVALID_PARAMETER);
+	config.requests_per_second = 20;
+	config.burst = 5;
+	ASSERT_EQ(trust_authority_connector_set_rate_limit(api, &config), STATUS_OK);
+
+	ASSERT_EQ(trust_authority_connector_get_rate_limit_stats(api, NULL), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(trust_authority_connector_get_rate_limit_stats(api, &stats), STATUS_OK);
+	EXPECT_EQ(stats.queue_depth, 0);
+	EXPECT_DOUBLE_EQ(stats.requests_per_second, 20);
+
+	// Other tests use the same api key
+	config = {0};
+	ASSERT_EQ(trust_authority_connector_set_rate_limit(api, &config), STATUS_OK);
+	connector_free(api);
+}
+
+TEST(TANewTest, SetUnixSocket)
+{
+	trust_authority_connector *api = NULL;
+	char path[UNIX_SOCKET_PATH_MAX_LEN + 2] = {0};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "http://localhost", 0, 0), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_set_unix_socket(NULL, "/run/ita.sock"), STATUS_NULL_CONNECTOR);
+	memset(path, 'a', UNIX_SOCKET_PATH_MAX_LEN + 1);
+	ASSERT_EQ(trust_authority_connector_set_unix_socket(api, path), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(trust_authority_connector_set_unix_socket(api, "/run/ita.sock"), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_set_unix_socket(api, NULL), STATUS_OK);
+	connector_free(api);
+}
+
+static int nonce_transport(void *ctx, const transport_request *request, transport_response *response)
+{
+	const char *nonce = "{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"SGVsbG8sIFdvcmxkIW==\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}";
+
+	(*(int *)ctx)++;
+	response->status_code = (0 == strcmp(request->method, "GET")) ? 200 : 405;
+	response->body = strdup(nonce);
+	response->body_len = strlen(nonce);
+
+	return 0;
+}
+
+// Requests go through a custom transport without touching the network
+TEST(ApiTest, GetNonceCustomTransport)
+{
+	trust_authority_connector *api = NULL;
+	trust_authority_async *async = NULL;
+	nonce nonce = { 0 };
+	get_nonce_args nonce_args = {0};
+	int calls = 0;
+	transport_adapter transport = {&calls, nonce_transport};
+	transport_adapter invalid = {&calls, NULL};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:1", 0, 0), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_set_transport(NULL, &transport), STATUS_NULL_CONNECTOR);
+	ASSERT_EQ(trust_authority_connector_set_transport(api, &invalid), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(trust_authority_connector_set_transport(api, &transport), STATUS_OK);
+
+	ASSERT_EQ(get_nonce(api, &nonce, &nonce_args, NULL), STATUS_OK);
+	ASSERT_EQ(calls, 1);
+	ASSERT_NE(nonce.val, nullptr);
+	ASSERT_EQ(trust_authority_async_new(&async, api), STATUS_INVALID_PARAMETER);
+
+	nonce_free(&nonce);
+	connector_free(api);
+}
+
+// Answers 503 for down.example.com, nonces for every other endpoint
+static int endpoint_transport(void *ctx, const transport_request *request, transport_response *response)
+{
+	const char *down = "https://down.example.com/";
+
+	if (0 == strncmp(request->url, down, strlen(down)))
+	{
+		(*(int *)ctx)++;
+		response->status_code = 503;
+		return 0;
+	}
+	return nonce_transport(ctx, request, response);
+}
+
+TEST(ApiTest, GetNonceFailsOverEndpoints)
+{
+	trust_authority_connector *api = NULL;
+	nonce nonce = { 0 };
+	get_nonce_args nonce_args = {0};
+	int calls = 0;
+	transport_adapter transport = {&calls, endpoint_transport};
+	const char *urls[] = {"https://down.example.com", "https://up.example.com"};
+	const char *invalid[] = {"https://up.example.com", "123456"};
+	endpoint_stats stats[MAX_ENDPOINTS];
+	int count = 0;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://endpoints.example.com", 0, 0), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_set_transport(api, &transport), STATUS_OK);
+	EXPECT_EQ(trust_authority_connector_set_endpoints(api, invalid, 2), STATUS_INVALID_API_URL);
+	EXPECT_EQ(trust_authority_connector_set_endpoints(api, urls, MAX_ENDPOINTS + 1), STATUS_INVALID_PARAMETER);
+	EXPECT_EQ(trust_authority_connector_set_endpoints(nullptr, urls, 2), STATUS_NULL_CONNECTOR);
+	ASSERT_EQ(trust_authority_connector_set_endpoints(api, urls, 2), STATUS_OK);
+
+	// The unmeasured endpoint is tried first until it is taken out of rotation
+	for (int i = 0; i < ENDPOINT_DOWN_FAILURES; i++)
+	{
+		ASSERT_EQ(get_nonce(api, &nonce, &nonce_args, NULL), STATUS_OK);
+		nonce_free(&nonce);
+	}
+	EXPECT_EQ(calls, 2 * ENDPOINT_DOWN_FAILURES);
+
+	ASSERT_EQ(get_nonce(api, &nonce, &nonce_args, NULL), STATUS_OK);
+	nonce_free(&nonce);
+	EXPECT_EQ(calls, 2 * ENDPOINT_DOWN_FAILURES + 1);
+
+	ASSERT_EQ(trust_authority_connector_get_endpoint_stats(api, stats, &count), STATUS_OK);
+	ASSERT_EQ(count, 2);
+	EXPECT_STREQ(stats[0].api_url, "https://down.example.com");
+	EXPECT_EQ(stats[0].failures, ENDPOINT_DOWN_FAILURES);
+	EXPECT_GT(stats[0].error_rate, 0);
+	EXPECT_FALSE(stats[0].healthy);
+	EXPECT_EQ(stats[1].requests, ENDPOINT_DOWN_FAILURES + 1);
+	EXPECT_EQ(stats[1].failures, 0);
+	EXPECT_TRUE(stats[1].healthy);
+
+	// Without endpoints requests go to the connector's URL again
+	ASSERT_EQ(trust_authority_connector_set_endpoints(api, NULL, 0), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_get_endpoint_stats(api, stats, &count), STATUS_OK);
+	EXPECT_EQ(count, 0);
+
+	connector_free(api);
+}
+
+// The circuit of a failing endpoint opens on its own, requests go on to the other endpoint
+TEST(ApiTest, CircuitOpensPerEndpoint)
+{
+	trust_authority_connector *api = NULL;
+	nonce nonce = { 0 };
+	get_nonce_args nonce_args = {0};
+	int calls = 0;
+	transport_adapter transport = {&calls, endpoint_transport};
+	const char *urls[] = {"https://down.example.com", "https://up.example.com"};
+	circuit_breaker_config config = {0};
+	circuit_state state = CIRCUIT_OPEN;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://endpoints.example.com", 0, 0), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_set_transport(api, &transport), STATUS_OK);
+	config.failure_threshold = 1;
+	ASSERT_EQ(trust_authority_connector_set_circuit_breaker(api, &config), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_set_endpoints(api, urls, 2), STATUS_OK);
+
+	// The first endpoint fails and opens its circuit, the request succeeds on the second
+	ASSERT_EQ(get_nonce(api, &nonce, &nonce_args, NULL), STATUS_OK);
+	nonce_free(&nonce);
+	EXPECT_EQ(calls, 2);
+	ASSERT_EQ(trust_authority_connector_get_circuit_state(api, &state), STATUS_OK);
+	EXPECT_EQ(state, CIRCUIT_CLOSED);
+
+	// The open endpoint is skipped before it is out of rotation
+	ASSERT_EQ(get_nonce(api, &nonce, &nonce_args, NULL), STATUS_OK);
+	nonce_free(&nonce);
+	EXPECT_EQ(calls, 3);
+
+	// Requests only fail fast once every endpoint is open, the request opening the circuit reports its own failure
+	ASSERT_EQ(trust_authority_connector_set_endpoints(api, urls, 1), STATUS_OK);
+	EXPECT_EQ(get_nonce(api, &nonce, &nonce_args, NULL), STATUS_GET_NONCE_ERROR);
+	EXPECT_EQ(calls, 4);
+	ASSERT_EQ(trust_authority_connector_get_circuit_state(api, &state), STATUS_OK);
+	EXPECT_EQ(state, CIRCUIT_OPEN);
+	EXPECT_EQ(get_nonce(api, &nonce, &nonce_args, NULL), STATUS_CIRCUIT_OPEN_ERROR);
+	EXPECT_EQ(calls, 4);
+
+	connector_free(api);
+}
+
+TEST(TANewTest, Warmup)
+{
+	trust_authority_connector *api = NULL;
+	int calls = 0;
+	transport_adapter transport = {&calls, nonce_transport};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:1", 0, 0), STATUS_OK);
+	EXPECT_EQ(trust_authority_connector_warmup(nullptr, 0, 0), STATUS_NULL_CONNECTOR);
+	EXPECT_EQ(trust_authority_connector_warmup(api, DEFAULT_HTTP_POOL_SIZE + 1, 0), STATUS_INVALID_PARAMETER);
+	EXPECT_EQ(trust_authority_connector_warmup(api, 0, -1), STATUS_INVALID_PARAMETER);
+
+	// Nothing listens on port 1
+	EXPECT_EQ(trust_authority_connector_warmup(api, 2, 2000), STATUS_WARMUP_ERROR);
+
+	// Custom transports have no connections to open
+	ASSERT_EQ(trust_authority_connector_set_transport(api, &transport), STATUS_OK);
+	EXPECT_EQ(trust_authority_connector_warmup(api, 0, 0), STATUS_OK);
+	EXPECT_EQ(calls, 0);
+
+	connector_free(api);
+}
+
+// Preconnects are off until enabled, and the connector can be freed while they run
+TEST(TANewTest, Preconnect)
+{
+	trust_authority_connector *api = NULL;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:1", 0, 0), STATUS_OK);
+	EXPECT_EQ(trust_authority_connector_set_preconnect(nullptr, 1), STATUS_NULL_CONNECTOR);
+	EXPECT_EQ(connector_preconnect(api, 0), 0);
+
+	ASSERT_EQ(trust_authority_connector_set_preconnect(api, 1), STATUS_OK);
+	EXPECT_EQ(connector_preconnect(api, 0), 1);
+	EXPECT_EQ(connector_preconnect(api, 0), 1);
+
+	connector_free(api);
+}
+
+TEST(TANewTest, SetHedging)
+{
+	trust_authority_connector *api = nullptr;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://example.com", 2, 2), STATUS_OK);
+
+	// Hedging is off until enabled
+	EXPECT_EQ(api->hedging.delay_ms, 0);
+
+	ASSERT_EQ(trust_authority_connector_set_hedging(api, 200, "https://secondary.example.com"), STATUS_OK);
+	EXPECT_EQ(api->hedging.delay_ms, 200);
+	EXPECT_STREQ(api->hedging.api_url, "https://secondary.example.com");
+
+	ASSERT_EQ(trust_authority_connector_set_hedging(api, 100, NULL), STATUS_OK);
+	EXPECT_STREQ(api->hedging.api_url, "");
+
+	EXPECT_EQ(trust_authority_connector_set_hedging(api, -1, NULL), STATUS_INVALID_PARAMETER);
+	EXPECT_EQ(trust_authority_connector_set_hedging(api, 100, "123456"), STATUS_INVALID_API_URL);
+	EXPECT_EQ(trust_authority_connector_set_hedging(nullptr, 100, NULL), STATUS_NULL_CONNECTOR);
+
+	connector_free(api);
+}
+
+TEST(TANewTest, CircuitBreaker)
+{
+	trust_authority_connector *api = nullptr;
+	circuit_breaker_config config = {0};
+	circuit_state state = CIRCUIT_OPEN;
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://circuit.example.com", 2, 2), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_get_circuit_state(api, &state), STATUS_OK);
+	EXPECT_EQ(state, CIRCUIT_CLOSED);
+
+	config.failure_threshold = 3;
+	ASSERT_EQ(trust_authority_connector_set_circuit_breaker(api, &config), STATUS_OK);
+
+	config.error_rate_percent = 101;
+	EXPECT_EQ(trust_authority_connector_set_circuit_breaker(api, &config), STATUS_INVALID_PARAMETER);
+	EXPECT_EQ(trust_authority_connector_set_circuit_breaker(api, nullptr), STATUS_INVALID_PARAMETER);
+	EXPECT_EQ(trust_authority_connector_get_circuit_state(api, nullptr), STATUS_INVALID_PARAMETER);
+	EXPECT_EQ(trust_authority_connector_get_circuit_state(nullptr, &state), STATUS_NULL_CONNECTOR);
+
+	connector_free(api);
+}
+
+// Requests failing to resolve the host are failures of the endpoint and trip the breaker
+TEST(TANewTest, CircuitBreakerTripsOnResolveFailure)
+{
+	trust_authority_connector *api = nullptr;
+	circuit_breaker_config config = {0};
+	circuit_state state = CIRCUIT_CLOSED;
+	get_nonce_args nonce_args = {0};
+	nonce nonceObj = {0};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://unresolvable.invalid", 0, 0), STATUS_OK);
+	config.failure_threshold = 2;
+	ASSERT_EQ(trust_authority_connector_set_circuit_breaker(api, &config), STATUS_OK);
+
+	// Requests which were sent report their own failure, the one opening the circuit too
+	EXPECT_EQ(get_nonce(api, &nonceObj, &nonce_args, NULL), STATUS_GET_NONCE_ERROR);
+	ASSERT_EQ(trust_authority_connector_get_circuit_state(api, &state), STATUS_OK);
+	EXPECT_EQ(state, CIRCUIT_CLOSED);
+	EXPECT_EQ(get_nonce(api, &nonceObj, &nonce_args, NULL), STATUS_GET_NONCE_ERROR);
+	ASSERT_EQ(trust_authority_connector_get_circuit_state(api, &state), STATUS_OK);
+	EXPECT_EQ(state, CIRCUIT_OPEN);
+	EXPECT_EQ(get_nonce(api, &nonceObj, &nonce_args, NULL), STATUS_CIRCUIT_OPEN_ERROR);
+
+	// The breaker is shared with the other connectors of the url, new settings do not close it
+	config.failure_threshold = 3;
+	ASSERT_EQ(trust_authority_connector_set_circuit_breaker(api, &config), STATUS_OK);
+	ASSERT_EQ(trust_authority_connector_get_circuit_state(api, &state), STATUS_OK);
+	EXPECT_EQ(state, CIRCUIT_OPEN);
+
+	connector_free(api);
+}
+
+TEST(DeadlineTest, Deadline)
+{
+	long long deadline = trust_authority_deadline(60000);
+
+	EXPECT_EQ(trust_authority_deadline(0), 0);
+	EXPECT_NE(deadline, 0);
+	EXPECT_FALSE(trust_authority_deadline_expired(deadline));
+	EXPECT_FALSE(trust_authority_deadline_expired(0));
+	EXPECT_TRUE(trust_authority_deadline_expired(deadline - 60001));
+}
+
+// A request whose budget is spent fails without going to the network
+TEST(ApiTest, GetNonceDeadlineExceeded)
+{
+	trust_authority_connector api = { 0 };
+	retry_config retries = { 0 };
+	nonce nonce = { 0 };
+	get_nonce_args nonce_args = { 0 };
+
+	api.retries = &retries;
+	strncpy(api.api_url, "http://localhost:8080", API_URL_MAX_LEN);
+	strncpy(api.api_key, "your_api_key", API_KEY_MAX_LEN);
+	nonce_args.request_id = "1234";
+	nonce_args.deadline = trust_authority_deadline(1) - 1000;
+
+	ASSERT_EQ(get_nonce(&api, &nonce, &nonce_args, NULL), STATUS_DEADLINE_EXCEEDED_ERROR);
+	ASSERT_EQ(nonce.val, nullptr);
+}
+
 TEST(URLTest, ValidURL)
 {
 	const char *url = "https://test.com";
@@ -189,6 +664,105 @@ TEST(URLTest, InvalidURL)
 	ASSERT_EQ(result, 1);
 }
 
+TEST(URLTest, LocalHttpURL)
+{
+	// Plain http is only accepted for local hops
+	ASSERT_EQ(is_valid_url("http://localhost:8080/appraisal"), 0);
+	ASSERT_EQ(is_valid_url("http://127.0.0.1"), 0);
+	ASSERT_EQ(is_valid_url("http://[::1]:8080"), 0);
+	ASSERT_NE(is_valid_url("http://test.com"), 0);
+	ASSERT_NE(is_valid_url("http://localhost.test.com"), 0);
+}
+
+TEST(URLTest, MalformedURL)
+{
+	ASSERT_EQ(is_valid_url("https://test.com:8443/appraisal/v1/attest"), 0);
+	ASSERT_NE(is_valid_url("https://"), 0);
+	ASSERT_NE(is_valid_url("https://test.com:"), 0);
+	ASSERT_NE(is_valid_url("https://test.com/a b"), 0);
+	ASSERT_NE(is_valid_url("https://test.com/%2e"), 0);
+	ASSERT_NE(is_valid_url("ftp://test.com"), 0);
+	ASSERT_NE(is_valid_url("http://127."), 0);
+	ASSERT_NE(is_valid_url(NULL), 0);
+}
+
+TEST(ApiKeyTest, Base64Format)
+{
+	ASSERT_EQ(is_valid_api_key("SGVsbG8sIFdvcmxkIW=="), STATUS_OK);
+	ASSERT_EQ(is_valid_api_key("a-b_c+d/"), STATUS_OK);
+	ASSERT_EQ(is_valid_api_key("abc"), STATUS_INVALID_API_KEY);
+	ASSERT_EQ(is_valid_api_key("ab=d"), STATUS_INVALID_API_KEY);
+	ASSERT_EQ(is_valid_api_key("a==="), STATUS_INVALID_API_KEY);
+	ASSERT_EQ(is_valid_api_key("ab*d"), STATUS_INVALID_API_KEY);
+}
+
+// The regex based validators the scanners replaced, compiling their pattern on every call
+static int regex_match(const char *pattern, const char *input)
+{
+	regex_t regex;
+	int ret = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
+	if (0 == ret)
+	{
+		ret = regexec(&regex, input, 0, NULL, 0);
+		regfree(&regex);
+	}
+	return ret;
+}
+
+TEST(UUIDTest, MatchesRegex)
+{
+	const char *pattern = "^[0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{12}$";
+	const char *uuids[] = {
+		"2f546239-b43f-4196-98d2-e8d52733dbbc",
+		"2F546239-B43F-4196-98D2-E8D52733DBBC",
+		"2f546239-b43f-4196-98d2-e8d52733dbb",
+		"2f546239-b43f-4196-98d2-e8d52733dbbcc",
+		"2f546239b43f-4196-98d2-e8d52733dbbc-",
+		"2f546239-b43f-4196-98d2-e8d52733dbbg",
+		"00000000000000000000000000000000",
+		"",
+	};
+
+	for (const char *uuid : uuids)
+	{
+		EXPECT_EQ(0 == is_valid_uuid(uuid), 0 == regex_match(pattern, uuid)) << uuid;
+	}
+}
+
+template <typename F>
+static double ns_per_call(int calls, F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < calls; i++)
+	{
+		f();
+	}
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+// Per call cost of the scanners against the regexes they replaced, run with --gtest_also_run_disabled_tests
+TEST(DISABLED_ValidatorBenchmark, PerCallCost)
+{
+	const char *url = "https://api.trustauthority.intel.com/appraisal/v1/attest";
+	const char *uuid = "2f546239-b43f-4196-98d2-e8d52733dbbc";
+	const int calls = 5000;
+	volatile int sink = 0;
+
+	double url_scan = ns_per_call(calls, [&] { sink += is_valid_url(url); });
+	double url_regex = ns_per_call(calls, [&] {
+		sink += regex_match("^(https://[a-zA-Z0-9.-]+|http://(localhost|127\\.[0-9.]+|\\[::1\\]))(:[0-9]+)?(/[^\\s%]*)*$", url);
+	});
+	double uuid_scan = ns_per_call(calls, [&] { sink += is_valid_uuid(uuid); });
+	double uuid_regex = ns_per_call(calls, [&] {
+		sink += regex_match("^[0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{12}$", uuid);
+	});
+
+	printf("is_valid_url:  %8.1f ns/call, regex %10.1f ns/call\n", url_scan, url_regex);
+	printf("is_valid_uuid: %8.1f ns/call, regex %10.1f ns/call\n", uuid_scan, uuid_regex);
+	EXPECT_LT(url_scan, url_regex);
+	EXPECT_LT(uuid_scan, uuid_regex);
+}
+
 TEST(UUIDTest, ValidUUID)
 {
 	const char *uuid = "2f546239-b43f-4196-98d2-e8d52733dbbc";
@@ -406,6 +980,124 @@ TEST(TokenTest, RetrieveTokenSuccess)
 	mockServer.stop();
 }
 
+// Large request bodies are gzipped when the connector asks for it
+TEST(TokenTest, GzipRequestBody)
+{
+	MockServer mockServer("");
+	mockServer.start();
+	trust_authority_connector *api = nullptr;
+	token tokenObj = { 0 };
+	get_token_args token_args = {0};
+	response_headers resp_headers = { 0 };
+	evidence evidenceObj = { 0 };
+	nonce nonceObj = { 0 };
+	policies policiesObj = { 0 };
+	uint8_t quote[4096];
+	uint8_t user_data[] = "data1";
+	uint8_t val[] = "nonce1";
+	uint8_t iat[] = "iatda";
+	uint8_t signature[] = "sign1";
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:8080", 0, 0), STATUS_OK);
+	strncpy(api->api_url, "http://localhost:8080", API_URL_MAX_LEN);
+	ASSERT_EQ(trust_authority_connector_set_compression(NULL, 0), STATUS_NULL_CONNECTOR);
+	ASSERT_EQ(trust_authority_connector_set_compression(api, 0x80), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(trust_authority_connector_set_compression(api, COMPRESSION_GZIP_REQUEST | COMPRESSION_ACCEPT_ENCODING), STATUS_OK);
+
+	memset(quote, 'A', sizeof(quote));
+	evidenceObj.evidence = quote;
+	evidenceObj.evidence_len = sizeof(quote);
+	evidenceObj.user_data = user_data;
+	evidenceObj.user_data_len = 5;
+	nonceObj.val = val;
+	nonceObj.val_len = 6;
+	nonceObj.iat = iat;
+	nonceObj.iat_len = 5;
+	nonceObj.signature = signature;
+	nonceObj.signature_len = 5;
+	token_args.policies = &policiesObj;
+	token_args.nonce = &nonceObj;
+	token_args.evidence = &evidenceObj;
+
+	ASSERT_EQ(get_token(api, &resp_headers, &tokenObj, &token_args, (char *)"/appraisal/v1/attest"), STATUS_OK);
+
+	// The mock saw a gzip body that inflates back to the JSON request
+	ASSERT_EQ(mockServer.lastContentEncoding(), "gzip");
+	vector<unsigned char> body = mockServer.lastBody();
+	ASSERT_LT(body.size(), sizeof(quote));
+	std::string inflated(2 * sizeof(quote), '\0');
+	z_stream stream = {0};
+	ASSERT_EQ(inflateInit2(&stream, MAX_WBITS + 16), Z_OK);
+	stream.next_in = body.data();
+	stream.avail_in = body.size();
+	stream.next_out = (Bytef *)&inflated[0];
+	stream.avail_out = inflated.size();
+	EXPECT_EQ(inflate(&stream, Z_FINISH), Z_STREAM_END);
+	inflateEnd(&stream);
+	EXPECT_EQ(inflated[0], '{');
+
+	token_free(&tokenObj);
+	response_headers_free(&resp_headers);
+	connector_free(api);
+	mockServer.stop();
+}
+
+TEST(TokenTest, StreamedRequestBody)
+{
+	MockServer mockServer("");
+	mockServer.start();
+	trust_authority_connector *api = nullptr;
+	token tokenObj = { 0 };
+	get_token_args token_args = {0};
+	evidence evidenceObj = { 0 };
+	nonce nonceObj = { 0 };
+	policies policiesObj = { 0 };
+	uint8_t quote[4096];
+	uint8_t event_log[] = "event log";
+	uint8_t val[] = "nonce1";
+	uint8_t iat[] = "iatda";
+	uint8_t signature[] = "sign1";
+	char encoded[sizeof(quote) * 2] = {0};
+
+	ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "http://localhost:8080", 0, 0), STATUS_OK);
+
+	for (size_t i = 0; i < sizeof(quote); i++)
+	{
+		quote[i] = (uint8_t)i;
+	}
+	evidenceObj.evidence = quote;
+	evidenceObj.evidence_len = sizeof(quote) - 1;
+	evidenceObj.event_log = event_log;
+	evidenceObj.event_log_len = 9;
+	nonceObj.val = val;
+	nonceObj.val_len = 6;
+	nonceObj.iat = iat;
+	nonceObj.iat_len = 5;
+	nonceObj.signature = signature;
+	nonceObj.signature_len = 5;
+	token_args.policies = &policiesObj;
+	token_args.nonce = &nonceObj;
+	token_args.evidence = &evidenceObj;
+
+	ASSERT_EQ(get_token(api, NULL, &tokenObj, &token_args, (char *)"/appraisal/v1/attest"), STATUS_OK);
+
+	// The evidence was encoded while uploading into the same JSON as a marshalled request
+	ASSERT_EQ(mockServer.lastContentEncoding(), "");
+	vector<unsigned char> body = mockServer.lastBody();
+	json_t *request = json_loadb((const char *)body.data(), body.size(), 0, NULL);
+	ASSERT_NE(request, nullptr);
+	ASSERT_EQ(base64_encode(quote, sizeof(quote) - 1, encoded, sizeof(encoded), false), 0);
+	EXPECT_STREQ(json_string_value(json_object_get(request, "quote")), encoded);
+	EXPECT_STREQ(json_string_value(json_object_get(request, "event_log")), "ZXZlbnQgbG9n");
+	EXPECT_NE(json_object_get(request, "verifier_nonce"), nullptr);
+	EXPECT_NE(json_object_get(request, "policy_ids"), nullptr);
+	json_decref(request);
+
+	token_free(&tokenObj);
+	connector_free(api);
+	mockServer.stop();
+}
+
 // Test case for failure to retrieve token signing certificate
 TEST(GetJwksTest, RetrieveCertificateFailure)
 {
@@ -489,13 +1181,100 @@ TEST(TokenFree, SuccessCase)
 TEST(EvidenceFree, SuccessCase)
 {
 	evidence *ta_evidence;
-	ta_evidence = (evidence *) malloc(sizeof(evidence));
+	ta_evidence = (evidence *) calloc(1, sizeof(evidence));
 	ta_evidence->evidence = (uint8_t *) malloc(10);
 	ta_evidence->user_data = (uint8_t *) malloc(20);
 	ta_evidence->event_log = (uint8_t *) malloc(20);
 
 	TRUST_AUTHORITY_STATUS result = evidence_free(ta_evidence);
+	free(ta_evidence);
 
 	// Result should be status_ok
 	ASSERT_EQ(result, STATUS_OK);
 }
+
+static void release_quote(void *ctx, uint8_t *data)
+{
+	(*(int *)ctx)++;
+	delete[] data;
+}
+
+// A quote handed over by an adapter is freed with its release callback
+TEST(EvidenceFree, ReleasesHandedOverQuote)
+{
+	evidence evidenceObj = { 0 };
+	int released = 0;
+
+	evidenceObj.evidence = new uint8_t[10];
+	evidenceObj.evidence_len = 10;
+	evidenceObj.runtime_data = (uint8_t *) malloc(5);
+	evidenceObj.runtime_data_len = 5;
+	evidenceObj.release = release_quote;
+	evidenceObj.release_ctx = &released;
+
+	ASSERT_EQ(evidence_free(&evidenceObj), STATUS_OK);
+	EXPECT_EQ(released, 1);
+	EXPECT_EQ(evidenceObj.evidence, nullptr);
+	EXPECT_EQ(evidenceObj.runtime_data, nullptr);
+	EXPECT_EQ(evidenceObj.release, nullptr);
+
+	ASSERT_EQ(evidence_free(&evidenceObj), STATUS_OK);
+	EXPECT_EQ(released, 1);
+}
+
+// The request body with the evidence encoded in place matches the marshalled appraisal request
+TEST(TokenTest, MarshalEncodesEvidenceInPlace)
+{
+	get_token_args token_args = {0};
+	policies policiesObj = { 0 };
+	char *policy_ids[] = { (char *) "policy1" };
+	evidence evidenceObj = { 0 };
+	nonce nonceObj = { 0 };
+	appraisal_request request = { 0 };
+	uint8_t quote[] = "quote bytes";
+	uint8_t event_log[] = "event log";
+	uint8_t user_data[] = "data1";
+	char *body = nullptr;
+	char *expected = nullptr;
+
+	policiesObj.ids = policy_ids;
+	policiesObj.count = 1;
+	evidenceObj.evidence = quote;
+	evidenceObj.evidence_len = sizeof(quote) - 1;
+	evidenceObj.event_log = event_log;
+	evidenceObj.event_log_len = sizeof(event_log) - 1;
+	evidenceObj.user_data = user_data;
+	evidenceObj.user_data_len = sizeof(user_data) - 1;
+	nonceObj.val = (uint8_t *) "nonce1";
+	nonceObj.val_len = 6;
+	nonceObj.iat = (uint8_t *) "iatda";
+	nonceObj.iat_len = 5;
+	nonceObj.signature = (uint8_t *) "sign1";
+	nonceObj.signature_len = 5;
+	token_args.policies = &policiesObj;
+	token_args.nonce = &nonceObj;
+	token_args.evidence = &evidenceObj;
+
+	ASSERT_EQ(marshal_token_request(&token_args, &body), STATUS_OK);
+
+	request.quote = quote;
+	request.quote_len = evidenceObj.evidence_len;
+	request.verifier_nonce = &nonceObj;
+	request.user_data = user_data;
+	request.user_data_len = evidenceObj.user_data_len;
+	request.policy_ids = &policiesObj;
+	request.event_log = event_log;
+	request.event_log_len = evidenceObj.event_log_len;
+	ASSERT_EQ(json_marshal_appraisal_request(&request, &expected), STATUS_OK);
+
+	json_t *body_json = json_loads(body, 0, NULL);
+	json_t *expected_json = json_loads(expected, 0, NULL);
+	ASSERT_NE(body_json, nullptr);
+	ASSERT_NE(expected_json, nullptr);
+	EXPECT_TRUE(json_equal(body_json, expected_json));
+
+	json_decref(body_json);
+	json_decref(expected_json);
+	free(body);
+	free(expected);
+}
@@ -325,6 +325,35 @@ TEST(JsonAppraisalRequestMarshalTest, NullJsonPointerTest)
 	ASSERT_EQ(json, nullptr);
 }
 
+// Requests without policies are marshalled with an empty policy_ids array
+TEST(JsonAppraisalRequestMarshalTest, NullPolicies)
+{
+	appraisal_request request = {0};
+	nonce nonceObj = {0};
+	uint8_t quote[] = "quote";
+	char *json = nullptr;
+
+	nonceObj.val = (uint8_t *)"nonce1";
+	nonceObj.val_len = 6;
+	nonceObj.iat = (uint8_t *)"iatda";
+	nonceObj.iat_len = 5;
+	nonceObj.signature = (uint8_t *)"sign1";
+	nonceObj.signature_len = 5;
+	request.quote = quote;
+	request.quote_len = 5;
+	request.verifier_nonce = &nonceObj;
+
+	ASSERT_EQ(json_marshal_appraisal_request(&request, &json), STATUS_OK);
+	json_t *parsed = json_loads(json, 0, NULL);
+	ASSERT_NE(parsed, nullptr);
+	json_t *ids = json_object_get(parsed, "policy_ids");
+	ASSERT_TRUE(json_is_array(ids));
+	EXPECT_EQ(json_array_size(ids), 0);
+
+	json_decref(parsed);
+	free(json);
+}
+
 // Positive test case
 TEST(JsonUnmarshalTokenTest, ValidInput)
 {
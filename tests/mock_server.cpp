@@ -60,9 +60,27 @@ void MockServer::handleGetRequest(http_request request,
 	request.reply(status_codes::OK, response, "text/plain");
 }
 
+string MockServer::lastContentEncoding()
+{
+	std::lock_guard < std::mutex > lock(requestMutex);
+	return contentEncoding;
+}
+
+vector<unsigned char> MockServer::lastBody()
+{
+	std::lock_guard < std::mutex > lock(requestMutex);
+	return body;
+}
+
 void MockServer::handlePostRequest(http_request request,
 		const string & responseJson)
 {
+	{
+		std::lock_guard < std::mutex > lock(requestMutex);
+		contentEncoding = request.headers().has("Content-Encoding") ?
+			request.headers()["Content-Encoding"] : "";
+		body = request.extract_vector().get();
+	}
 	string response = generateResponse(request, "POST", responseJson);
 	request.reply(status_codes::OK, response, "text/plain");
 }
@@ -19,6 +19,9 @@ public:
     MockServer(const string &responseJson);
     void start();
     void stop();
+    // Content-Encoding and raw body of the last POST request
+    string lastContentEncoding();
+    vector<unsigned char> lastBody();
 
 private:
     void handleGetRequest(http_request request, const string &responseJson);
@@ -30,6 +33,9 @@ private:
     http_listener listener;
     std::condition_variable cv;
     std::mutex mutex_;
+    std::mutex requestMutex;
+    string contentEncoding;
+    vector<unsigned char> body;
 };
 
 #endif
\ No newline at end of file
@@ -3,8 +3,16 @@
  */
 #include <gtest/gtest.h>
 #include <cstring>
+#include <string>
+#include <unistd.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <connector.h>
 #include <log.h>
 #include <rest.h>
+#include <base64.h>
 
 extern "C" {
 	struct curl_slist *build_headers(struct curl_slist *headers,
@@ -14,18 +22,26 @@ extern "C" {
 			const char *content_type);
 	size_t write_response(void *ptr, size_t size, size_t nmemb,
 			void *stream);
+	size_t write_response_headers(char *ptr, size_t size, size_t nmemb,
+			void *userdata);
 	CURLcode make_http_request(const char *url, const char *api_key,
 			const char *accept,
 			const char *request_id,
 			const char *content_type,
-			const char *body, char **response);
+			const char *body,
+			const http_body_stream *stream,
+			char **response,
+			response_headers *resp_headers,
+			retry_config *retries,
+			http_pool *pool,
+			long long deadline,
+			const http_hedge *hedge);
 }
 // Test case for the write_response function
 TEST(WriteResponseTest, BufferSizeCheck)
 {
 	// Prepare test data
-	write_result result;
-	result.pos = 0;
+	write_result result = {0};
 	char response[10] = "Hello";
 
 	// Perform the write operation
@@ -35,6 +51,39 @@ TEST(WriteResponseTest, BufferSizeCheck)
 	EXPECT_EQ(written, sizeof(response));
 	EXPECT_STREQ(result.data, response);
 	EXPECT_EQ(result.pos, sizeof(response));
+	free(result.data);
+}
+
+// Test case for responses larger than the initial buffer
+TEST(WriteResponseTest, BufferGrows)
+{
+	write_result result = {0};
+	std::string chunk(1000, 'a');
+
+	for (int i = 0; i < 64; i++)
+	{
+		ASSERT_EQ(write_response((void *)chunk.data(), sizeof(char), chunk.size(), &result), chunk.size());
+	}
+
+	// 64000 bytes do not fit the fixed 16KB buffer used earlier
+	EXPECT_EQ(result.pos, 64 * chunk.size());
+	EXPECT_GT(result.size, result.pos);
+	EXPECT_EQ(strlen(result.data), result.pos);
+	free(result.data);
+}
+
+// Test case for the hard cap on the response size
+TEST(WriteResponseTest, MaxSizeExceeded)
+{
+	write_result result = {0};
+	char response[64] = "Hello";
+
+	result.max = 32;
+
+	// Writes beyond the cap are rejected which aborts the transfer
+	EXPECT_EQ(write_response(response, sizeof(char), sizeof(response), &result), 0);
+	EXPECT_EQ(result.pos, 0);
+	free(result.data);
 }
 
 // Test case for build_headers
@@ -86,8 +135,588 @@ TEST(BuildHeadersTest, NullAccept)
 TEST(MakeHttpRequestTest, NullUrl)
 {
 	CURLcode status =
-		make_http_request(NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+		make_http_request(NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL);
 
 	// Assert
 	EXPECT_EQ(status, CURLE_URL_MALFORMAT);
 }
+
+TEST(HttpPoolTest, ReleasedHandleIsReused)
+{
+	http_pool *pool = NULL;
+
+	ASSERT_EQ(http_global_init(), CURLE_OK);
+	ASSERT_EQ(http_pool_new(&pool, 1, NULL), CURLE_OK);
+	ASSERT_NE(pool, nullptr);
+
+	CURL *first = http_pool_acquire(pool);
+	ASSERT_NE(first, nullptr);
+	http_pool_release(pool, first);
+	EXPECT_EQ(pool->count, 1);
+
+	// The idle handle is handed out again instead of creating a new one
+	CURL *second = http_pool_acquire(pool);
+	EXPECT_EQ(second, first);
+	EXPECT_EQ(pool->count, 0);
+
+	// Handles beyond capacity are cleaned up on release
+	CURL *third = http_pool_acquire(pool);
+	ASSERT_NE(third, nullptr);
+	http_pool_release(pool, second);
+	http_pool_release(pool, third);
+	EXPECT_EQ(pool->count, 1);
+
+	http_pool_free(pool);
+	http_global_cleanup();
+}
+
+TEST(HttpPoolTest, ReleasedMultiIsReused)
+{
+	http_pool *pool = NULL;
+
+	ASSERT_EQ(http_pool_new(&pool, 1, NULL), CURLE_OK);
+
+	CURLM *first = http_pool_acquire_multi(pool);
+	ASSERT_NE(first, nullptr);
+	http_pool_release_multi(pool, first);
+	EXPECT_EQ(pool->multi_count, 1);
+
+	// Hedged requests keep the connections of the multi handle they ran on
+	EXPECT_EQ(http_pool_acquire_multi(pool), first);
+	EXPECT_EQ(pool->multi_count, 0);
+	http_pool_release_multi(pool, first);
+
+	http_pool_free(pool);
+}
+
+// Headers are parsed as they arrive and indexed by name on hand over
+TEST(WriteHeadersTest, IndexedLookup)
+{
+	const char *lines[] = {
+		"HTTP/1.1 100 Continue\r\n",
+		"Stale: dropped\r\n",
+		"\r\n",
+		"HTTP/1.1 200 OK\r\n",
+		"Content-Type: application/json\r\n",
+		"Request-Id:  1234 \r\n",
+		"Set-Cookie: a=1\r\n",
+		"Set-Cookie: b=2\r\n",
+		"\r\n",
+	};
+	write_result result = {0};
+	write_headers headers = {0};
+	response_headers resp_headers = {0};
+	char *response = NULL;
+
+	for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+	{
+		ASSERT_EQ(write_response_headers((char *)lines[i], 1, strlen(lines[i]), &headers), strlen(lines[i]));
+	}
+	ASSERT_EQ(http_response_take(&result, &headers, &response, &resp_headers), CURLE_OK);
+
+	ASSERT_EQ(resp_headers.count, 4);
+	EXPECT_STREQ(resp_headers.entries[0].name, "content-type");
+	EXPECT_STREQ(response_headers_get(&resp_headers, "request-id"), "1234");
+	EXPECT_STREQ(response_headers_get(&resp_headers, "CONTENT-TYPE"), "application/json");
+	EXPECT_STREQ(response_headers_get(&resp_headers, "set-cookie"), "a=1");
+	EXPECT_EQ(response_headers_get(&resp_headers, "stale"), nullptr);
+	EXPECT_EQ(response_headers_get(&resp_headers, "missing"), nullptr);
+
+	free(response);
+	response_headers_free(&resp_headers);
+	http_response_free(&result, &headers);
+}
+
+// Headers not selected, or not wanted at all, are not stored
+TEST(WriteHeadersTest, DroppedHeaders)
+{
+	const char *line = "X-Trace: abc\r\n";
+	http_pool *pool = NULL;
+	write_headers headers = {0};
+
+	ASSERT_EQ(http_pool_new(&pool, 1, NULL), CURLE_OK);
+	strcpy(pool->keep_headers[0], "request-id");
+	pool->keep_count = 1;
+	headers.pool = pool;
+	ASSERT_EQ(write_response_headers((char *)line, 1, strlen(line), &headers), strlen(line));
+	EXPECT_EQ(headers.count, 0);
+	EXPECT_EQ(headers.headers, nullptr);
+
+	headers.pool = NULL;
+	headers.discard = 1;
+	ASSERT_EQ(write_response_headers((char *)line, 1, strlen(line), &headers), strlen(line));
+	EXPECT_EQ(headers.count, 0);
+	EXPECT_EQ(headers.headers, nullptr);
+
+	http_pool_free(pool);
+}
+
+TEST(RateLimiterTest, SharedPerKey)
+{
+	http_limiter *first = NULL;
+	http_limiter *second = NULL;
+	http_limiter *other = NULL;
+
+	ASSERT_EQ(http_limiter_acquire(&first, "key"), CURLE_OK);
+	ASSERT_EQ(http_limiter_acquire(&second, "key"), CURLE_OK);
+	ASSERT_EQ(http_limiter_acquire(&other, "other key"), CURLE_OK);
+	EXPECT_EQ(first, second);
+	EXPECT_NE(first, other);
+
+	http_limiter_release(first);
+	http_limiter_release(second);
+	http_limiter_release(other);
+}
+
+TEST(RateLimiterTest, PacesRequests)
+{
+	http_limiter *limiter = NULL;
+	rate_limit_config config = {0};
+	rate_limit_stats stats = {0};
+
+	ASSERT_EQ(http_limiter_acquire(&limiter, "pace key"), CURLE_OK);
+	config.requests_per_second = 10;
+	config.burst = 2;
+	http_limiter_configure(limiter, &config);
+
+	// The burst goes out right away, the next request waits for a token
+	EXPECT_EQ(http_limiter_reserve(limiter, 0), 0);
+	EXPECT_EQ(http_limiter_reserve(limiter, 0), 0);
+	long wait = http_limiter_reserve(limiter, 0);
+	EXPECT_GT(wait, 50);
+	EXPECT_LE(wait, 101);
+	http_limiter_get_stats(limiter, &stats);
+	EXPECT_EQ(stats.queue_depth, 1);
+	http_limiter_dequeue(limiter, wait);
+
+	// A request which would wait past its limit is not queued
+	EXPECT_EQ(http_limiter_reserve(limiter, http_now_ms() + 10), -1);
+	http_limiter_get_stats(limiter, &stats);
+	EXPECT_EQ(stats.queue_depth, 0);
+	EXPECT_EQ(stats.requests, 3);
+	EXPECT_EQ(stats.waited, 1);
+
+	http_limiter_release(limiter);
+}
+
+TEST(RateLimiterTest, AdaptsToServer)
+{
+	http_limiter *limiter = NULL;
+	rate_limit_config config = {0};
+	rate_limit_stats stats = {0};
+	write_headers headers = {0};
+	const char *remaining = "X-RateLimit-Remaining: 0\r\n";
+	const char *reset = "RateLimit-Reset: 2\r\n";
+
+	ASSERT_EQ(http_limiter_acquire(&limiter, "adapt key"), CURLE_OK);
+	config.requests_per_second = 8;
+	http_limiter_configure(limiter, &config);
+
+	// 429 pauses all requests for Retry-After and halves the pace
+	headers.ratelimit_remaining = -1;
+	http_limiter_record(limiter, HTTP_TOO_MANY_REQUESTS, 500, &headers);
+	http_limiter_get_stats(limiter, &stats);
+	EXPECT_EQ(stats.throttled, 1);
+	EXPECT_DOUBLE_EQ(stats.requests_per_second, 4);
+	long wait = http_limiter_reserve(limiter, 0);
+	EXPECT_GT(wait, 400);
+	http_limiter_dequeue(limiter, 0);
+
+	// Successful responses recover the pace
+	http_limiter_record(limiter, 200, 0, &headers);
+	http_limiter_get_stats(limiter, &stats);
+	EXPECT_GT(stats.requests_per_second, 4);
+
+	// An exhausted quota pauses until it resets, headers are read even when they are not kept
+	headers.discard = 1;
+	ASSERT_EQ(write_response_headers((char *)remaining, 1, strlen(remaining), &headers), strlen(remaining));
+	ASSERT_EQ(write_response_headers((char *)reset, 1, strlen(reset), &headers), strlen(reset));
+	EXPECT_EQ(headers.ratelimit_remaining, 0);
+	EXPECT_EQ(headers.ratelimit_reset_ms, 2000);
+	EXPECT_EQ(headers.headers, nullptr);
+	http_limiter_record(limiter, 200, 0, &headers);
+	EXPECT_GT(http_limiter_reserve(limiter, 0), 1500);
+
+	http_limiter_release(limiter);
+}
+
+struct loopback
+{
+	int calls;
+	int failures; /* 503 answers before a 200 */
+	std::string method;
+	std::string url;
+};
+
+// In-process transport answering without any network
+static int loopback_perform(void *ctx, const transport_request *request, transport_response *response)
+{
+	loopback *lb = (loopback *)ctx;
+	const char *headers = "Content-Type: application/json\r\nRequest-Id: loop\r\n";
+
+	lb->calls++;
+	lb->method = request->method;
+	lb->url = request->url;
+	response->status_code = (lb->calls <= lb->failures) ? 503 : 200;
+	response->body = strdup("{\"ok\":true}");
+	response->body_len = strlen(response->body);
+	response->headers = strdup(headers);
+	response->headers_len = strlen(headers);
+
+	return 0;
+}
+
+TEST(TransportTest, LoopbackRequest)
+{
+	http_pool *pool = NULL;
+	loopback lb = {0, 1};
+	transport_adapter transport = {&lb, loopback_perform};
+	retry_config retries = {0};
+	response_headers headers = {0};
+	char *response = NULL;
+
+	ASSERT_EQ(http_pool_new(&pool, 1, NULL), CURLE_OK);
+	pool->transport = &transport;
+	retries.retry_max = 1;
+	retries.retry_base_delay_ms = 1;
+
+	// Retries apply around the transport
+	ASSERT_EQ(post_request("http://loopback/appraisal/v1/attest", "key", NULL, NULL, NULL, "{}", &response, &headers,
+				&retries, pool, 0, NULL), CURLE_OK);
+	ASSERT_NE(response, nullptr);
+	EXPECT_STREQ(response, "{\"ok\":true}");
+	EXPECT_EQ(lb.calls, 2);
+	EXPECT_EQ(lb.method, "POST");
+	EXPECT_EQ(lb.url, "http://loopback/appraisal/v1/attest");
+	EXPECT_STREQ(response_headers_get(&headers, "request-id"), "loop");
+	EXPECT_EQ(pool->count, 0);
+
+	free(response);
+	response_headers_free(&headers);
+	http_pool_free(pool);
+}
+
+TEST(GzipTest, CompressesLargeBodies)
+{
+	http_pool *pool = NULL;
+	char *gzip_body = NULL;
+	size_t gzip_len = 0;
+	std::string body = "{\"quote\":\"" + std::string(4096, 'A') + "\"}";
+
+	ASSERT_EQ(http_pool_new(&pool, 1, NULL), CURLE_OK);
+
+	// Request bodies are sent as they are unless asked for
+	ASSERT_EQ(http_gzip_body(pool, body.c_str(), &gzip_body, &gzip_len), CURLE_OK);
+	EXPECT_EQ(gzip_body, nullptr);
+
+	pool->compression = COMPRESSION_GZIP_REQUEST;
+	ASSERT_EQ(http_gzip_body(pool, "{}", &gzip_body, &gzip_len), CURLE_OK);
+	EXPECT_EQ(gzip_body, nullptr);
+
+	ASSERT_EQ(http_gzip_body(pool, body.c_str(), &gzip_body, &gzip_len), CURLE_OK);
+	ASSERT_NE(gzip_body, nullptr);
+	EXPECT_LT(gzip_len, body.size());
+
+	std::string inflated(body.size(), '\0');
+	z_stream stream = {0};
+	ASSERT_EQ(inflateInit2(&stream, MAX_WBITS + 16), Z_OK);
+	stream.next_in = (Bytef *)gzip_body;
+	stream.avail_in = gzip_len;
+	stream.next_out = (Bytef *)&inflated[0];
+	stream.avail_out = inflated.size();
+	EXPECT_EQ(inflate(&stream, Z_FINISH), Z_STREAM_END);
+	inflateEnd(&stream);
+	EXPECT_EQ(inflated, body);
+	free(gzip_body);
+
+	// A server refusing gzip turns it off for the pool
+	http_pool_gzip_rejected(pool);
+	ASSERT_EQ(http_gzip_body(pool, body.c_str(), &gzip_body, &gzip_len), CURLE_OK);
+	EXPECT_EQ(gzip_body, nullptr);
+
+	http_pool_free(pool);
+}
+
+TEST(BodyStreamTest, ReadsInAnyChunkSize)
+{
+	http_body_stream stream = {0};
+	http_body_reader reader;
+	const unsigned char data[] = {0x00, 0xff, 0x10, 0x80, 0x7f, 0x01, 0x02, 0xfe, 0x55, 0xaa, 0x33};
+	char encoded[sizeof(data) * 2] = {0};
+	std::string expected;
+
+	ASSERT_EQ(http_body_stream_add(&stream, "{\"quote\":\"", 10, 0), CURLE_OK);
+	ASSERT_EQ(http_body_stream_add(&stream, data, sizeof(data), 1), CURLE_OK);
+	ASSERT_EQ(http_body_stream_add(&stream, "\"}", 2, 0), CURLE_OK);
+	ASSERT_EQ(base64_encode(data, sizeof(data), encoded, sizeof(encoded), false), 0);
+	expected = std::string("{\"quote\":\"") + encoded + "\"}";
+	EXPECT_EQ(http_body_stream_length(&stream), expected.size());
+
+	// Groups split across reads come out the same as a single encode
+	for (size_t chunk = 1; chunk <= expected.size(); chunk++)
+	{
+		std::string body;
+		char buffer[64];
+		size_t n = 0;
+
+		http_body_reader_init(&reader, &stream);
+		while (0 != (n = http_body_read(buffer, 1, chunk, &reader)))
+		{
+			body.append(buffer, n);
+		}
+		EXPECT_EQ(body, expected) << "chunk " << chunk;
+	}
+
+	char *dump = http_body_stream_dump(&stream);
+	ASSERT_NE(dump, nullptr);
+	EXPECT_EQ(expected, dump);
+	free(dump);
+}
+
+TEST(HttpShareTest, SameUrlSharesCache)
+{
+	http_pool *first = NULL;
+	http_pool *second = NULL;
+	http_pool *other = NULL;
+
+	ASSERT_EQ(http_pool_new(&first, 1, "https://localhost:8080"), CURLE_OK);
+	ASSERT_EQ(http_pool_new(&second, 1, "https://localhost:8080"), CURLE_OK);
+	ASSERT_EQ(http_pool_new(&other, 1, "https://localhost:8081"), CURLE_OK);
+
+	// Pools for the same url use one share object, other urls get their own
+	ASSERT_NE(first->share, nullptr);
+	EXPECT_EQ(first->share, second->share);
+	EXPECT_EQ(first->share->refs, 2);
+	EXPECT_NE(first->share, other->share);
+
+	http_pool_free(second);
+	EXPECT_EQ(first->share->refs, 1);
+
+	http_pool_free(first);
+	http_pool_free(other);
+}
+
+TEST(RetryTest, RetryableResults)
+{
+	EXPECT_TRUE(http_is_retryable(CURLE_OK, 503));
+	EXPECT_TRUE(http_is_retryable(CURLE_OK, 429));
+	EXPECT_FALSE(http_is_retryable(CURLE_OK, 200));
+	EXPECT_FALSE(http_is_retryable(CURLE_OK, 401));
+	EXPECT_TRUE(http_is_retryable(CURLE_COULDNT_CONNECT, 0));
+	EXPECT_TRUE(http_is_retryable(CURLE_RECV_ERROR, 0));
+	EXPECT_FALSE(http_is_retryable(CURLE_URL_MALFORMAT, 0));
+	EXPECT_FALSE(http_is_retryable(CURLE_WRITE_ERROR, 0));
+}
+
+TEST(RetryTest, BackoffGrowsUpToCap)
+{
+	retry_config retries = {0};
+	retries.retry_base_delay_ms = 100;
+	retries.retry_max_delay_ms = 1000;
+
+	EXPECT_EQ(http_retry_delay_ms(&retries, 0, 0), 100);
+	EXPECT_EQ(http_retry_delay_ms(&retries, 1, 0), 200);
+	EXPECT_EQ(http_retry_delay_ms(&retries, 3, 0), 800);
+	EXPECT_EQ(http_retry_delay_ms(&retries, 4, 0), 1000);
+	EXPECT_EQ(http_retry_delay_ms(&retries, 100, 0), 1000);
+
+	// Without a millisecond delay the wait time in seconds is used
+	retries.retry_base_delay_ms = 0;
+	retries.retry_wait_time = 2;
+	retries.retry_max_delay_ms = 0;
+	EXPECT_EQ(http_retry_delay_ms(&retries, 0, 0), 2000);
+	EXPECT_EQ(http_retry_delay_ms(&retries, 10, 0), DEFAULT_RETRY_MAX_DELAY_MS);
+}
+
+TEST(RetryTest, FullJitterStaysInRange)
+{
+	retry_config retries = {0};
+	retries.retry_base_delay_ms = 100;
+	retries.retry_jitter = 1;
+
+	for (int i = 0; i < 100; i++)
+	{
+		long delay = http_retry_delay_ms(&retries, 2, 0);
+		EXPECT_GE(delay, 0);
+		EXPECT_LE(delay, 400);
+	}
+}
+
+TEST(RetryTest, RetryAfterExtendsDelay)
+{
+	retry_config retries = {0};
+	retries.retry_base_delay_ms = 100;
+	retries.retry_max_delay_ms = 5000;
+
+	// Ignored unless enabled
+	EXPECT_EQ(http_retry_delay_ms(&retries, 0, 3000), 100);
+
+	retries.retry_after = 1;
+	EXPECT_EQ(http_retry_delay_ms(&retries, 0, 3000), 3000);
+	// Longer than the backoff cap, retrying earlier would be refused again
+	EXPECT_EQ(http_retry_delay_ms(&retries, 0, 60000), 60000);
+	EXPECT_EQ(http_retry_delay_ms(&retries, 0, 0), 100);
+}
+
+TEST(CircuitBreakerTest, OpensAndRecovers)
+{
+	http_pool *pool = NULL;
+	circuit_breaker_config config = {0};
+
+	ASSERT_EQ(http_pool_new(&pool, 1, "https://breaker.example.com"), CURLE_OK);
+	http_breaker *breaker = http_pool_breaker(pool);
+	ASSERT_NE(breaker, nullptr);
+
+	// Disabled until configured
+	http_breaker_record(breaker, 1);
+	http_breaker_record(breaker, 1);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_CLOSED);
+
+	config.failure_threshold = 2;
+	config.open_ms = 50;
+	http_breaker_configure(breaker, &config);
+
+	http_breaker_record(breaker, 1);
+	http_breaker_record(breaker, 0);
+	http_breaker_record(breaker, 1);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_CLOSED);
+	http_breaker_record(breaker, 1);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_OPEN);
+	EXPECT_FALSE(http_breaker_allow(breaker));
+
+	// A single probe is let through once the open time passed
+	usleep(60 * 1000);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_HALF_OPEN);
+	EXPECT_TRUE(http_breaker_allow(breaker));
+	EXPECT_FALSE(http_breaker_allow(breaker));
+	http_breaker_record(breaker, 0);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_CLOSED);
+	EXPECT_TRUE(http_breaker_allow(breaker));
+
+	http_pool_free(pool);
+}
+
+// Transport errors count whether or not they are retried, throttling does not count at all
+TEST(CircuitBreakerTest, ClassifiesOutcomes)
+{
+	http_pool *pool = NULL;
+	circuit_breaker_config config = {0};
+
+	EXPECT_EQ(http_breaker_outcome(CURLE_COULDNT_RESOLVE_HOST, 0), 1);
+	EXPECT_EQ(http_breaker_outcome(CURLE_PEER_FAILED_VERIFICATION, 0), 1);
+	EXPECT_EQ(http_breaker_outcome(CURLE_WRITE_ERROR, 0), 1);
+	EXPECT_EQ(http_breaker_outcome(CURLE_OK, 500), 1);
+	EXPECT_EQ(http_breaker_outcome(CURLE_OK, 501), 1);
+	EXPECT_EQ(http_breaker_outcome(CURLE_OK, 200), 0);
+	EXPECT_EQ(http_breaker_outcome(CURLE_OK, 404), 0);
+	EXPECT_EQ(http_breaker_outcome(CURLE_OK, 429), -1);
+
+	ASSERT_EQ(http_pool_new(&pool, 1, "https://breaker-outcome.example.com"), CURLE_OK);
+	http_breaker *breaker = http_pool_breaker(pool);
+	config.failure_threshold = 2;
+	config.open_ms = 50;
+	http_breaker_configure(breaker, &config);
+
+	// Throttled attempts neither reset nor add to the consecutive failures
+	http_breaker_record(breaker, 1);
+	http_breaker_record(breaker, -1);
+	http_breaker_record(breaker, 1);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_OPEN);
+
+	// A throttled probe hands its slot back
+	usleep(60 * 1000);
+	EXPECT_TRUE(http_breaker_allow(breaker));
+	http_breaker_record(breaker, -1);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_HALF_OPEN);
+	EXPECT_TRUE(http_breaker_allow(breaker));
+
+	http_pool_free(pool);
+}
+
+TEST(CircuitBreakerTest, OpensOnErrorRate)
+{
+	http_pool *pool = NULL;
+	circuit_breaker_config config = {0};
+
+	ASSERT_EQ(http_pool_new(&pool, 1, "https://breaker-rate.example.com"), CURLE_OK);
+	http_breaker *breaker = http_pool_breaker(pool);
+
+	config.error_rate_percent = 50;
+	config.min_requests = 4;
+	http_breaker_configure(breaker, &config);
+
+	http_breaker_record(breaker, 1);
+	http_breaker_record(breaker, 0);
+	http_breaker_record(breaker, 1);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_CLOSED);
+	http_breaker_record(breaker, 0);
+	EXPECT_EQ(http_breaker_state(breaker), CIRCUIT_OPEN);
+
+	http_pool_free(pool);
+}
+
+// A listening socket which never answers, requests to it only end with their deadline
+static int silent_server(char *url, size_t len)
+{
+	struct sockaddr_in addr = {0};
+	socklen_t addr_len = sizeof(addr);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || 0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || 0 != listen(fd, 8) ||
+			0 != getsockname(fd, (struct sockaddr *)&addr, &addr_len))
+	{
+		return -1;
+	}
+	snprintf(url, len, "http://127.0.0.1:%d", ntohs(addr.sin_port));
+
+	return fd;
+}
+
+// The duplicate of a hedged request is recorded against its own endpoint, and not sent while its circuit is open
+TEST(HedgeTest, RecordsEachEndpoint)
+{
+	http_pool *pool = NULL;
+	char primary[64];
+	char nonce_url[96];
+	const char *urls[2];
+	http_hedge hedge = {"http://127.0.0.1:1/appraisal/v1/nonce", 20};
+	circuit_breaker_config config = {0};
+	endpoint_stats stats[MAX_ENDPOINTS];
+	char *response = NULL;
+	int fd = silent_server(primary, sizeof(primary));
+
+	ASSERT_GE(fd, 0);
+	snprintf(nonce_url, sizeof(nonce_url), "%s/appraisal/v1/nonce", primary);
+	urls[0] = primary;
+	urls[1] = "http://127.0.0.1:1";
+	ASSERT_EQ(http_global_init(), CURLE_OK);
+	ASSERT_EQ(http_pool_new(&pool, 2, NULL), CURLE_OK);
+	http_endpoints_set(&pool->endpoints, urls, 2);
+	config.failure_threshold = 1;
+	config.open_ms = 60000;
+	http_pool_configure_breakers(pool, &config);
+
+	// The duplicate is refused at once, the primary times out
+	EXPECT_EQ(make_http_request(nonce_url, "key", "application/json", NULL, NULL, NULL, NULL, &response, NULL, NULL, pool,
+				http_now_ms() + 200, &hedge), CURLE_OPERATION_TIMEDOUT);
+	ASSERT_EQ(http_endpoints_get_stats(&pool->endpoints, stats), 2);
+	EXPECT_EQ(stats[0].failures, 1);
+	EXPECT_EQ(stats[1].failures, 1);
+	EXPECT_EQ(http_breaker_state(http_pool_url_breaker(pool, hedge.url)), CIRCUIT_OPEN);
+
+	// With its circuit open the hedge endpoint is left alone
+	EXPECT_EQ(http_breaker_state(http_pool_url_breaker(pool, nonce_url)), CIRCUIT_OPEN);
+	config.failure_threshold = 0;
+	http_breaker_configure(http_pool_url_breaker(pool, nonce_url), &config);
+	EXPECT_EQ(make_http_request(nonce_url, "key", "application/json", NULL, NULL, NULL, NULL, &response, NULL, NULL, pool,
+				http_now_ms() + 200, &hedge), CURLE_OPERATION_TIMEDOUT);
+	ASSERT_EQ(http_endpoints_get_stats(&pool->endpoints, stats), 2);
+	EXPECT_EQ(stats[0].requests, 2);
+	EXPECT_EQ(stats[1].requests, 1);
+
+	http_pool_free(pool);
+	http_global_cleanup();
+	close(fd);
+}
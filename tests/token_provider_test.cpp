@@ -3,10 +3,19 @@
  */
 #include <connector.h>
 #include <token_provider.h>
+#include <token_provider_async.h>
+#include <token_scheduler.h>
 #include <gtest/gtest.h>
 #include <log.h>
 #include <stdlib.h>
 #include <types.h>
+#include <base64.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 #include "token_provider_mock_test.h"
 #include "mock_server.h"
 
@@ -87,7 +96,7 @@ int mock_collect_evidence(void *ctx,
 
 TEST(CollectToken, ApiNullParameters)
 {
-	trust_authority_connector api;
+	trust_authority_connector api = {0};
 	token token;
 	policies policies;
 	evidence_adapter *adapter = NULL;
@@ -113,7 +122,7 @@ TEST(CollectToken, ApiNullParameters)
 
 TEST(CollectToken, TokenNullError)
 {
-	trust_authority_connector api;
+	trust_authority_connector api = {0};
 	token token;
 	policies policies;
 	evidence_adapter *adapter = NULL;
@@ -148,7 +157,7 @@ TEST(CollectToken, TokenNullError)
 
 TEST(CollectToken, NullCtxParamater)
 {
-	trust_authority_connector api;
+	trust_authority_connector api = {0};
 	token token;
 	evidence_adapter *adapter = NULL;
 	uint8_t *user_data = NULL;
@@ -200,7 +209,7 @@ TEST(CollectToken, NullCtxParamater)
 
 TEST(CollectToken, NullNonceError)
 {
-	trust_authority_connector api;
+	trust_authority_connector api = {0};
 	token token;
 	evidence_adapter *adapter = NULL;
 	uint8_t *user_data = NULL;
@@ -245,7 +254,7 @@ TEST(CollectToken, NullNonceError)
 
 TEST(CollectToken, ValidData)
 {
-	trust_authority_connector api;
+	trust_authority_connector api = {0};
 	token token;
 	evidence_adapter *adapter = NULL;
 	uint8_t *user_data = NULL;
@@ -295,3 +304,458 @@ TEST(CollectToken, ValidData)
 	delete[] user_data;
 	mockServer.stop();
 }
+
+// Hands out nonces and tokens expiring lifetime seconds after they were issued
+struct token_transport_ctx
+{
+	long lifetime;
+	std::atomic<int> attests;
+};
+
+static int token_transport(void *ctx, const transport_request *request, transport_response *response)
+{
+	token_transport_ctx *tc = (token_transport_ctx *)ctx;
+	std::string body;
+
+	if (0 == strcmp(request->method, "GET"))
+	{
+		body = "{\"val\":\"SGVsbG8sIFdvcmxkIW==\",\"iat\":\"SGVsbG8sIFdvcmxkIW==\",\"signature\":\"SGVsbG8sIFdvcmxkIW==\"}";
+	}
+	else
+	{
+		std::string claims = (tc->lifetime > 0) ? "{\"exp\":" + std::to_string(time(NULL) + tc->lifetime) + "}" : "{}";
+		char payload[128] = {0};
+
+		base64_encode((const unsigned char *)claims.c_str(), claims.size(), payload, sizeof(payload), true);
+		std::string encoded(payload);
+		encoded.erase(encoded.find_last_not_of('=') + 1);
+		body = "{\"token\":\"eyJhbGciOiJub25lIn0." + encoded + ".c2lnbg\"}";
+		tc->attests++;
+	}
+
+	response->status_code = 200;
+	response->body = strdup(body.c_str());
+	response->body_len = body.size();
+
+	return 0;
+}
+
+// A connector answering through token_transport, tokens lasting 300s unless the test changes ctx.lifetime
+class TokenTransportTest : public ::testing::Test
+{
+protected:
+	void SetUp() override
+	{
+		ctx.lifetime = 300;
+		ctx.attests = 0;
+		token_args.policies = &policiesObj;
+		ASSERT_EQ(trust_authority_connector_new(&api, "SGVsbG8sIFdvcmxkIW==", "https://localhost:1", 0, 0), STATUS_OK);
+		ASSERT_EQ(trust_authority_connector_set_transport(api, &transport), STATUS_OK);
+		mock_adapter_new(&adapter, 10, NULL);
+	}
+
+	void TearDown() override
+	{
+		mock_adapter_free(adapter);
+		connector_free(api);
+	}
+
+	trust_authority_connector *api = NULL;
+	evidence_adapter *adapter = NULL;
+	collect_token_args token_args = {0};
+	policies policiesObj = {0};
+	token_transport_ctx ctx;
+	transport_adapter transport = {&ctx, token_transport};
+};
+
+class TokenCacheTest : public TokenTransportTest
+{
+};
+
+// Tokens are reused per policy, algorithm and user data until they expire
+TEST_F(TokenCacheTest, ReusesTokens)
+{
+	token_cache *cache = NULL;
+	token first = {0}, second = {0}, other = {0};
+	token_cache_stats stats = {0};
+	uint8_t user_data[] = "data1";
+	uint8_t other_data[] = "data2";
+
+	ASSERT_EQ(token_cache_new(&cache, NULL), STATUS_OK);
+
+	ASSERT_EQ(collect_token_cached(cache, api, NULL, &first, &token_args, adapter, user_data, 5), STATUS_OK);
+	ASSERT_EQ(collect_token_cached(cache, api, NULL, &second, &token_args, adapter, user_data, 5), STATUS_OK);
+	EXPECT_EQ(ctx.attests, 1);
+	EXPECT_STREQ(first.jwt, second.jwt);
+	EXPECT_NE(first.jwt, second.jwt);
+
+	ASSERT_EQ(collect_token_cached(cache, api, NULL, &other, &token_args, adapter, other_data, 5), STATUS_OK);
+	EXPECT_EQ(ctx.attests, 2);
+
+	ASSERT_EQ(token_cache_get_stats(cache, &stats), STATUS_OK);
+	EXPECT_EQ(stats.entries, 2);
+	EXPECT_EQ(stats.hits, 1);
+	EXPECT_EQ(stats.misses, 2);
+
+	token_free(&first);
+	token_free(&second);
+	token_free(&other);
+	token_cache_free(cache);
+}
+
+// Tokens without an exp claim cannot be checked for expiry and are collected every time
+TEST_F(TokenCacheTest, SkipsTokensWithoutExp)
+{
+	token_cache *cache = NULL;
+	token tokenObj = {0};
+	token_cache_stats stats = {0};
+	token_cache_config invalid = {-1, 0, 0};
+
+	ctx.lifetime = 0;
+	ASSERT_EQ(token_cache_new(&cache, &invalid), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(token_cache_new(&cache, NULL), STATUS_OK);
+	ASSERT_EQ(collect_token_cached(NULL, api, NULL, &tokenObj, &token_args, adapter, NULL, 0), STATUS_INVALID_PARAMETER);
+
+	for (int i = 0; i < 2; i++)
+	{
+		ASSERT_EQ(collect_token_cached(cache, api, NULL, &tokenObj, &token_args, adapter, NULL, 0), STATUS_OK);
+		token_free(&tokenObj);
+	}
+	EXPECT_EQ(ctx.attests, 2);
+	ASSERT_EQ(token_cache_get_stats(cache, &stats), STATUS_OK);
+	EXPECT_EQ(stats.entries, 0);
+
+	token_cache_free(cache);
+}
+
+// A token in use is collected again in the background before it stops being handed out
+TEST_F(TokenCacheTest, RefreshesAhead)
+{
+	token_cache *cache = NULL;
+	token tokenObj = {0};
+	token_cache_stats stats = {0};
+	// Tokens are handed out for 4 to 5s and due for a refresh as soon as they are read
+	token_cache_config config = {1000, 5000, 0};
+
+	ctx.lifetime = 6;
+	ASSERT_EQ(token_cache_new(&cache, &config), STATUS_OK);
+
+	ASSERT_EQ(collect_token_cached(cache, api, NULL, &tokenObj, &token_args, adapter, NULL, 0), STATUS_OK);
+	token_free(&tokenObj);
+	ASSERT_EQ(token_cache_get_stats(cache, &stats), STATUS_OK);
+	EXPECT_EQ(stats.refreshes, 0);
+	ASSERT_EQ(collect_token_cached(cache, api, NULL, &tokenObj, &token_args, adapter, NULL, 0), STATUS_OK);
+	token_free(&tokenObj);
+
+	// Only read tokens are refreshed, once per read
+	for (int i = 0; i < 5000 && 0 == stats.refreshes; i++)
+	{
+		usleep(1000);
+		ASSERT_EQ(token_cache_get_stats(cache, &stats), STATUS_OK);
+	}
+	EXPECT_EQ(stats.refreshes, 1);
+	EXPECT_EQ(ctx.attests, 2);
+
+	// Readers keep being served from the cache
+	ASSERT_EQ(collect_token_cached(cache, api, NULL, &tokenObj, &token_args, adapter, NULL, 0), STATUS_OK);
+	token_free(&tokenObj);
+	ASSERT_EQ(token_cache_get_stats(cache, &stats), STATUS_OK);
+	EXPECT_EQ(stats.misses, 1);
+
+	token_cache_free(cache);
+}
+
+class TokenSchedulerTest : public TokenTransportTest
+{
+};
+
+// Readers always find a current token while it is collected again on the interval
+TEST_F(TokenSchedulerTest, KeepsTokenCurrent)
+{
+	token_scheduler *scheduler = NULL;
+	scheduled_token *handle = NULL;
+	token tokenObj = {0};
+	token_scheduler_stats stats = {0};
+	token_scheduler_config config = {20, 0, 1000, -1};
+	std::atomic<int> reads(0), misses(0);
+	std::atomic<bool> done(false);
+	std::vector<std::thread> readers;
+
+	ASSERT_EQ(token_scheduler_new(&scheduler, &config), STATUS_OK);
+	ASSERT_EQ(token_scheduler_register(scheduler, &handle, api, &token_args, adapter, NULL, 0), STATUS_OK);
+
+	for (int i = 0; i < 5000 && STATUS_OK != scheduled_token_get(handle, &tokenObj); i++)
+	{
+		usleep(1000);
+	}
+	ASSERT_NE(tokenObj.jwt, nullptr);
+	token_free(&tokenObj);
+
+	for (int i = 0; i < 4; i++)
+	{
+		readers.emplace_back([&]() {
+			while (!done)
+			{
+				token t = {0};
+				if (STATUS_OK == scheduled_token_get(handle, &t))
+				{
+					reads++;
+				}
+				else
+				{
+					misses++;
+				}
+				token_free(&t);
+			}
+		});
+	}
+	// Read on while the token is replaced a few times
+	for (int i = 0; i < 5000 && stats.attestations < 4; i++)
+	{
+		usleep(1000);
+		ASSERT_EQ(token_scheduler_get_stats(scheduler, &stats), STATUS_OK);
+	}
+	done = true;
+	for (auto &reader : readers)
+	{
+		reader.join();
+	}
+	EXPECT_GT(reads, 0);
+	EXPECT_EQ(misses, 0);
+
+	ASSERT_EQ(token_scheduler_get_stats(scheduler, &stats), STATUS_OK);
+	EXPECT_EQ(stats.registered, 1);
+	EXPECT_GE(stats.attestations, 4);
+	EXPECT_EQ(stats.failures, 0);
+	// The next attestation may already be under way
+	EXPECT_LE(stats.attestations, ctx.attests);
+
+	ASSERT_EQ(token_scheduler_unregister(scheduler, handle), STATUS_OK);
+	ASSERT_EQ(token_scheduler_get_stats(scheduler, &stats), STATUS_OK);
+	EXPECT_EQ(stats.registered, 0);
+
+	token_scheduler_free(scheduler);
+}
+
+// Tokens without an exp claim are not handed out and collected again after a backoff
+TEST_F(TokenSchedulerTest, NoTokenWithoutExp)
+{
+	token_scheduler *scheduler = NULL;
+	scheduled_token *handle = NULL;
+	token tokenObj = {0};
+	token_scheduler_stats stats = {0};
+	token_scheduler_config invalid = {0, 0, 0, 101};
+
+	ctx.lifetime = 0;
+	ASSERT_EQ(token_scheduler_new(&scheduler, &invalid), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(token_scheduler_new(&scheduler, NULL), STATUS_OK);
+	ASSERT_EQ(token_scheduler_register(scheduler, &handle, NULL, &token_args, adapter, NULL, 0), STATUS_NULL_CONNECTOR);
+	ASSERT_EQ(token_scheduler_register(scheduler, &handle, api, &token_args, adapter, NULL, 0), STATUS_OK);
+
+	// The next attempt is TOKEN_SCHEDULER_MIN_BACKOFF_MS away
+	for (int i = 0; i < 900 && 0 == stats.failures; i++)
+	{
+		usleep(1000);
+		ASSERT_EQ(token_scheduler_get_stats(scheduler, &stats), STATUS_OK);
+	}
+	EXPECT_EQ(stats.failures, 1);
+	EXPECT_EQ(stats.attestations, 0);
+	EXPECT_EQ(scheduled_token_get(handle, &tokenObj), STATUS_NO_TOKEN_ERROR);
+	EXPECT_EQ(tokenObj.jwt, nullptr);
+
+	// Registrations left are freed with the scheduler
+	token_scheduler_free(scheduler);
+}
+
+// Quotes are generated one at a time, like with the quoting enclave. The first token request waits
+// for the next quote, which lasts until the request saw it, so that they overlap on any machine.
+struct slow_quote_ctx
+{
+	std::atomic<int> quoting;
+	std::atomic<int> max_quoting;
+	std::atomic<int> overlapped; /* requests made while a quote was generated */
+	std::atomic<int> attests;
+	std::atomic<bool> met; /* the first token request was made during the second quote */
+	std::atomic<int> nonces;
+	std::atomic<int> quoted;
+	std::atomic<int> max_ahead; /* nonces fetched and not quoted yet */
+	token_transport_ctx *transport;
+};
+
+static int slow_quote_evidence(void *ctx, evidence *evidence, nonce *nonce, uint8_t *user_data, uint32_t user_data_len)
+{
+	slow_quote_ctx *sq = (slow_quote_ctx *)ctx;
+	int quoting = ++sq->quoting;
+
+	if (quoting > sq->max_quoting)
+	{
+		sq->max_quoting = quoting;
+	}
+	for (int i = 0; i < 5000 && 1 == sq->quoted && !sq->met; i++)
+	{
+		usleep(1000);
+	}
+	sq->quoted++;
+	sq->quoting--;
+
+	return mock_collect_evidence(ctx, evidence, nonce, user_data, user_data_len);
+}
+
+static int slow_quote_transport(void *ctx, const transport_request *request, transport_response *response)
+{
+	slow_quote_ctx *sq = (slow_quote_ctx *)ctx;
+
+	if (0 != strcmp(request->method, "GET") && 1 == ++sq->attests)
+	{
+		for (int i = 0; i < 5000 && 0 == sq->quoting; i++)
+		{
+			usleep(1000);
+		}
+		sq->met = (sq->quoting > 0);
+	}
+	if (sq->quoting > 0)
+	{
+		sq->overlapped++;
+	}
+	if (0 == strcmp(request->method, "GET"))
+	{
+		int ahead = ++sq->nonces - sq->quoted;
+
+		if (ahead > sq->max_ahead)
+		{
+			sq->max_ahead = ahead;
+		}
+	}
+	return token_transport(sq->transport, request, response);
+}
+
+static void count_completion(TRUST_AUTHORITY_STATUS status, void *user_data)
+{
+	if (STATUS_OK == status)
+	{
+		(*(std::atomic<int> *)user_data)++;
+	}
+}
+
+class TokenProviderPoolTest : public TokenTransportTest
+{
+};
+
+// Jobs complete through their handles and callbacks, quotes are generated while other jobs make requests
+TEST_F(TokenProviderPoolTest, CollectsTokens)
+{
+	const int jobs = 6;
+	token_provider_pool *pool = NULL;
+	collect_token_job *handles[jobs] = {0};
+	token tokens[jobs + 1] = {0};
+	evidence_adapter slow_adapter = {0};
+	slow_quote_ctx sq;
+	transport_adapter slow_transport = {&sq, slow_quote_transport};
+	token_provider_pool_config config = {3, 0};
+	token_provider_pool_config invalid = {-1, 0};
+	std::atomic<int> completed(0);
+	TRUST_AUTHORITY_STATUS status = STATUS_UNKNOWN_ERROR;
+	attestation_result result;
+
+	sq.quoting = 0;
+	sq.max_quoting = 0;
+	sq.overlapped = 0;
+	sq.attests = 0;
+	sq.met = false;
+	sq.nonces = 0;
+	sq.quoted = 0;
+	sq.max_ahead = 0;
+	sq.transport = &ctx;
+	slow_adapter.ctx = &sq;
+	slow_adapter.collect_evidence = slow_quote_evidence;
+	ASSERT_EQ(trust_authority_connector_set_transport(api, &slow_transport), STATUS_OK);
+	ASSERT_EQ(token_provider_pool_new(&pool, &invalid), STATUS_INVALID_PARAMETER);
+	ASSERT_EQ(token_provider_pool_new(&pool, &config), STATUS_OK);
+	EXPECT_EQ(collect_token_submit(pool, NULL, NULL, NULL, &tokens[0], &token_args, &slow_adapter, NULL, 0, NULL, NULL), STATUS_NULL_CONNECTOR);
+	EXPECT_EQ(collect_token_submit(pool, NULL, api, NULL, NULL, &token_args, &slow_adapter, NULL, 0, NULL, NULL), STATUS_NULL_TOKEN);
+
+	for (int i = 0; i < jobs; i++)
+	{
+		ASSERT_EQ(collect_token_submit(pool, &handles[i], api, NULL, &tokens[i], &token_args, &slow_adapter, NULL, 0,
+					count_completion, &completed), STATUS_OK);
+	}
+	// Fire and forget, only the callback tells
+	ASSERT_EQ(collect_token_submit(pool, NULL, api, NULL, &tokens[jobs], &token_args, &slow_adapter, NULL, 0,
+				count_completion, &completed), STATUS_OK);
+
+	for (int i = 0; i < jobs; i++)
+	{
+		ASSERT_EQ(collect_token_job_wait(handles[i], 5000, &status), STATUS_OK);
+		EXPECT_EQ(status, STATUS_OK);
+		EXPECT_EQ(collect_token_job_poll(handles[i], &status), 1);
+		EXPECT_NE(tokens[i].jwt, nullptr);
+		ASSERT_EQ(collect_token_job_result(handles[i], &result), STATUS_OK);
+		EXPECT_EQ(result.failed_stage, -1);
+		EXPECT_GE(result.stages[ATTESTATION_STAGE_ATTEST].start_us, result.stages[ATTESTATION_STAGE_EVIDENCE].end_us);
+		collect_token_job_free(handles[i]);
+	}
+
+	// Freeing the pool completes the jobs left
+	token_provider_pool_free(pool);
+	EXPECT_EQ(completed, jobs + 1);
+	EXPECT_EQ(ctx.attests, jobs + 1);
+	EXPECT_EQ(sq.max_quoting, 1);
+	EXPECT_TRUE(sq.met);
+	EXPECT_GT(sq.overlapped, 0);
+	// With 3 network workers but one evidence worker, at most one nonce waits behind the quote being generated
+	EXPECT_LE(sq.max_ahead, 2);
+
+	for (int i = 0; i <= jobs; i++)
+	{
+		token_free(&tokens[i]);
+	}
+}
+
+class CollectTokenPipeline : public TokenTransportTest
+{
+};
+
+static int reject_token(void *ctx, token *token)
+{
+	(*(int *)ctx)++;
+	return (NULL != token->jwt) ? STATUS_TOKEN_INVALID_ERROR : STATUS_NULL_TOKEN;
+}
+
+// Every stage which ran records when it started and ended, the failing one is reported
+TEST_F(CollectTokenPipeline, RecordsStageTimings)
+{
+	token tokenObj = {0};
+	attestation_pipeline pipeline = {0};
+	attestation_result result;
+	int verified = 0;
+
+	EXPECT_EQ(collect_token_pipeline(api, NULL, &tokenObj, &token_args, &pipeline, NULL, 0, &result), STATUS_INVALID_PARAMETER);
+
+	pipeline.collect_evidence = adapter->collect_evidence;
+	pipeline.ctx = adapter->ctx;
+	ASSERT_EQ(collect_token_pipeline(api, NULL, &tokenObj, &token_args, &pipeline, NULL, 0, &result), STATUS_OK);
+	EXPECT_EQ(result.failed_stage, -1);
+	for (int stage = ATTESTATION_STAGE_NONCE; stage <= ATTESTATION_STAGE_ATTEST; stage++)
+	{
+		EXPECT_GT(result.stages[stage].start_us, 0) << attestation_stage_name((attestation_stage)stage);
+		EXPECT_GE(result.stages[stage].end_us, result.stages[stage].start_us);
+		if (stage > ATTESTATION_STAGE_NONCE)
+		{
+			EXPECT_GE(result.stages[stage].start_us, result.stages[stage - 1].end_us);
+		}
+	}
+	// Skipped without a verify callback
+	EXPECT_EQ(result.stages[ATTESTATION_STAGE_VERIFY].start_us, 0);
+	token_free(&tokenObj);
+
+	pipeline.verify = reject_token;
+	pipeline.verify_ctx = &verified;
+	EXPECT_EQ(collect_token_pipeline(api, NULL, &tokenObj, &token_args, &pipeline, NULL, 0, &result), STATUS_TOKEN_INVALID_ERROR);
+	EXPECT_EQ(result.failed_stage, ATTESTATION_STAGE_VERIFY);
+	EXPECT_GT(result.stages[ATTESTATION_STAGE_VERIFY].start_us, 0);
+	EXPECT_EQ(verified, 1);
+	EXPECT_EQ(ctx.attests, 2);
+	EXPECT_STREQ(attestation_stage_name(ATTESTATION_STAGE_VERIFY), "verify");
+
+	token_free(&tokenObj);
+}